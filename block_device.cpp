@@ -0,0 +1,165 @@
+#include "block_device.h"
+#include "sd_card.h"
+
+// Constructor
+SDBlockRegion::SDBlockRegion() : SDBlockRegion(&sd_card) {
+}
+
+SDBlockRegion::SDBlockRegion(SDCard* card) {
+    this->card = card;
+    first_sector = 0;
+    count = 0;
+}
+
+void SDBlockRegion::setRegion(uint32_t first_sector, uint32_t count) {
+    this->first_sector = first_sector;
+    this->count = count;
+}
+
+bool SDBlockRegion::read_block(uint32_t index, uint8_t* data) {
+    if (index >= count) {
+        return false;
+    }
+    return card->read_block(first_sector + index, data);
+}
+
+bool SDBlockRegion::read_blocks(uint32_t index, uint8_t* data, uint32_t count) {
+    if (index + count > this->count) {
+        return false;
+    }
+    if (count == 1) {
+        return card->read_block(first_sector + index, data);
+    }
+    return card->read_blocks(first_sector + index, data, count);
+}
+
+bool SDBlockRegion::write_blocks(uint32_t index, const uint8_t* data, uint32_t count) {
+    if (index + count > this->count) {
+        return false;
+    }
+    if (count == 1) {
+        return card->write_block(first_sector + index, data);
+    }
+    return card->write_blocks(first_sector + index, data, count);
+}
+
+bool SDBlockRegion::write_blocks_deferred(uint32_t index, const uint8_t* data, uint32_t count) {
+    if (index + count > this->count) {
+        return false;
+    }
+    if (count == 1) {
+        return card->write_block(first_sector + index, data, false);
+    }
+    return card->write_blocks(first_sector + index, data, count, false);
+}
+
+bool SDBlockRegion::sync() {
+    return card->sync();
+}
+
+// Constructor
+StripedBlockDevice::StripedBlockDevice() {
+    for (uint32_t i = 0; i < STRIPE_MAX_DEVICES; i++) {
+        devices[i] = NULL;
+    }
+    device_count = 0;
+    stripe_blocks = 0;
+    count = 0;
+}
+
+bool StripedBlockDevice::setDevices(BlockDevice* const* devices, uint32_t device_count, uint32_t stripe_blocks) {
+    count = 0;
+    this->device_count = 0;
+    if (device_count == 0 || device_count > STRIPE_MAX_DEVICES || stripe_blocks == 0) {
+        return false;
+    }
+
+    uint32_t smallest = devices[0]->block_count();
+    for (uint32_t i = 0; i < device_count; i++) {
+        this->devices[i] = devices[i];
+        if (devices[i]->block_count() < smallest) {
+            smallest = devices[i]->block_count();
+        }
+    }
+    this->device_count = device_count;
+    this->stripe_blocks = stripe_blocks;
+    count = smallest / stripe_blocks * stripe_blocks * device_count;
+    return count > 0;
+}
+
+BlockDevice* StripedBlockDevice::locate(uint32_t index, uint32_t* device_index, uint32_t* run) const {
+    uint32_t chunk = index / stripe_blocks;
+    uint32_t offset = index % stripe_blocks;
+    *device_index = chunk / device_count * stripe_blocks + offset;
+    *run = stripe_blocks - offset;
+    return devices[chunk % device_count];
+}
+
+bool StripedBlockDevice::read_block(uint32_t index, uint8_t* data) {
+    if (index >= count) {
+        return false;
+    }
+    uint32_t device_index, run;
+    BlockDevice* device = locate(index, &device_index, &run);
+    return device->read_block(device_index, data);
+}
+
+bool StripedBlockDevice::read_blocks(uint32_t index, uint8_t* data, uint32_t count) {
+    if (index + count > this->count) {
+        return false;
+    }
+    while (count > 0) {
+        uint32_t device_index, run;
+        BlockDevice* device = locate(index, &device_index, &run);
+        if (run > count) {
+            run = count;
+        }
+        if (!device->read_blocks(device_index, data, run)) {
+            return false;
+        }
+        index += run;
+        data += run * BLOCK_SIZE;
+        count -= run;
+    }
+    return true;
+}
+
+// Every chunk as a deferred write, each device only waits for its own
+// previous chunk
+bool StripedBlockDevice::write_chunks(uint32_t index, const uint8_t* data, uint32_t count) {
+    if (index + count > this->count) {
+        return false;
+    }
+    bool success = true;
+    while (count > 0 && success) {
+        uint32_t device_index, run;
+        BlockDevice* device = locate(index, &device_index, &run);
+        if (run > count) {
+            run = count;
+        }
+        success = device->write_blocks_deferred(device_index, data, run);
+        index += run;
+        data += run * BLOCK_SIZE;
+        count -= run;
+    }
+    return success;
+}
+
+bool StripedBlockDevice::write_blocks(uint32_t index, const uint8_t* data, uint32_t count) {
+    bool success = write_chunks(index, data, count);
+    return sync() && success;
+}
+
+bool StripedBlockDevice::write_blocks_deferred(uint32_t index, const uint8_t* data, uint32_t count) {
+    return write_chunks(index, data, count);
+}
+
+bool StripedBlockDevice::sync() {
+    bool success = true;
+    for (uint32_t i = 0; i < device_count; i++) {
+        if (!devices[i]->sync()) {
+            success = false;
+        }
+    }
+    return success;
+}
@@ -0,0 +1,102 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// 512-byte block storage, so on-card formats can be exercised on a PC
+// against a RAM image
+class BlockDevice {
+public:
+    static const uint32_t BLOCK_SIZE = 512;
+
+    virtual ~BlockDevice() {}
+    virtual uint32_t block_count() const = 0;
+    virtual bool read_block(uint32_t index, uint8_t* data) = 0;
+    virtual bool write_blocks(uint32_t index, const uint8_t* data, uint32_t count) = 0;
+
+    // One block at a time unless the device can stream them
+    virtual bool read_blocks(uint32_t index, uint8_t* data, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!read_block(index + i, data + i * BLOCK_SIZE)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A write that may return while the device is still programming it, so
+    // the caller can move on to another device meanwhile. The next access
+    // or sync() waits for it to finish.
+    virtual bool write_blocks_deferred(uint32_t index, const uint8_t* data, uint32_t count) {
+        return write_blocks(index, data, count);
+    }
+    virtual bool sync() { return true; }
+};
+
+class SDCard;
+
+// A run of consecutive SD card sectors, such as a preallocated file
+class SDBlockRegion : public BlockDevice {
+private:
+    SDCard* card;
+    uint32_t first_sector;
+    uint32_t count;
+
+public:
+    // Constructor
+    SDBlockRegion();                    // On sd_card
+    explicit SDBlockRegion(SDCard* card);
+
+    // Public interface
+    void setRegion(uint32_t first_sector, uint32_t count);
+    uint32_t block_count() const override { return count; }
+    bool read_block(uint32_t index, uint8_t* data) override;
+    bool read_blocks(uint32_t index, uint8_t* data, uint32_t count) override;
+    bool write_blocks(uint32_t index, const uint8_t* data, uint32_t count) override;
+    bool write_blocks_deferred(uint32_t index, const uint8_t* data, uint32_t count) override;
+    bool sync() override;
+};
+
+// RAID-0 over up to STRIPE_MAX_DEVICES devices
+//
+// Chunks of stripe_blocks consecutive blocks go to each device in turn. A
+// write spanning several chunks hands each device its part with a deferred
+// write before waiting for any of them, so the devices program at the same
+// time and a write of one chunk per device takes about as long as one chunk
+// on a single device. The size is a whole number of chunks on the smallest
+// device times the device count. There is no redundancy: losing one device
+// loses every chunk on it.
+#define STRIPE_MAX_DEVICES 4
+
+class StripedBlockDevice : public BlockDevice {
+private:
+    BlockDevice* devices[STRIPE_MAX_DEVICES];
+    uint32_t device_count;
+    uint32_t stripe_blocks;
+    uint32_t count;
+
+    // Device, block on it and blocks left in the chunk for a block of the stripe
+    BlockDevice* locate(uint32_t index, uint32_t* device_index, uint32_t* run) const;
+    bool write_chunks(uint32_t index, const uint8_t* data, uint32_t count);
+
+public:
+    // Constructor
+    StripedBlockDevice();
+
+    // Public interface
+    bool setDevices(BlockDevice* const* devices, uint32_t device_count, uint32_t stripe_blocks);
+    uint32_t block_count() const override { return count; }
+    bool read_block(uint32_t index, uint8_t* data) override;
+    bool read_blocks(uint32_t index, uint8_t* data, uint32_t count) override;
+    bool write_blocks(uint32_t index, const uint8_t* data, uint32_t count) override;
+    bool write_blocks_deferred(uint32_t index, const uint8_t* data, uint32_t count) override;
+    bool sync() override;
+
+    // Getter methods
+    uint32_t getDeviceCount() const { return device_count; }
+    uint32_t getStripeBlocks() const { return stripe_blocks; }
+};
+
+#endif // BLOCK_DEVICE_H
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "boot.h"
+#include "trace.h"
+
+// Global instance
+BootSequencer boot;
+
+BootSequencer::BootSequencer() {
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        phase_time_us[i] = 0;
+        reached[i] = false;
+    }
+    task_count = 0;
+    tasks_pending = 0;
+}
+
+void BootSequencer::mark(boot_phase_t phase) {
+    if (phase >= BOOT_PHASE_COUNT || reached[phase]) {
+        return;
+    }
+
+    // Microseconds since reset, the timer starts counting when the chip comes out of it
+    phase_time_us[phase] = time_us_64();
+    reached[phase] = true;
+}
+
+bool BootSequencer::add_task(const char* name, boot_step_t step) {
+    if (task_count >= BOOT_MAX_TASKS) {
+        printf("Boot: no room for task %s\n", name);
+        return false;
+    }
+
+    tasks[task_count].name = name;
+    tasks[task_count].step = step;
+    tasks[task_count].done = false;
+    task_count++;
+    tasks_pending++;
+    return true;
+}
+
+void BootSequencer::poll() {
+    if (tasks_pending == 0) {
+        return;
+    }
+
+    for (int i = 0; i < task_count; i++) {
+        if (tasks[i].done) {
+            continue;
+        }
+
+        TRACE_SCOPE(tasks[i].name);
+        if (tasks[i].step()) {
+            tasks[i].done = true;
+            tasks_pending--;
+        }
+    }
+}
+
+const char* BootSequencer::phase_name(boot_phase_t phase) {
+    switch (phase) {
+        case BOOT_PHASE_USB: return "usb";
+        case BOOT_PHASE_RADIO: return "radio";
+        case BOOT_PHASE_SETTINGS: return "settings";
+        case BOOT_PHASE_PROMPT: return "prompt";
+        case BOOT_PHASE_SD: return "sd";
+        case BOOT_PHASE_AUTORUN: return "autorun";
+        case BOOT_PHASE_FIRST_COMMAND: return "first_command";
+        case BOOT_PHASE_NETWORK: return "network";
+        default: return "unknown";
+    }
+}
+
+void BootSequencer::print() {
+    printf("Boot phases (ms since reset):\n");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        boot_phase_t phase = (boot_phase_t)i;
+        if (reached[i]) {
+            printf("  %-14s %8lu.%03lu\n", phase_name(phase),
+                   (unsigned long)(phase_time_us[i] / 1000),
+                   (unsigned long)(phase_time_us[i] % 1000));
+        } else {
+            printf("  %-14s %12s\n", phase_name(phase), "-");
+        }
+    }
+
+    printf("Boot tasks:");
+    if (task_count == 0) {
+        printf(" none");
+    }
+    for (int i = 0; i < task_count; i++) {
+        printf(" %s (%s)", tasks[i].name, tasks[i].done ? "done" : "running");
+    }
+    printf("\n");
+}
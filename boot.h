@@ -0,0 +1,69 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Boot sequencing
+//
+// main() brings up only what the prompt needs (USB, stdio, the radio and the
+// settings store), shows the prompt, and leaves the slow parts to boot tasks
+// that the main loop steps alongside the CLI: mounting the SD card, running
+// the autorun script once the card is there, and waiting for the WiFi manager
+// to associate. Each phase is timestamped the first time it is reached so
+// 'boot' can show where the time went.
+
+typedef enum {
+    BOOT_PHASE_USB = 0,         // USB device and stdio up
+    BOOT_PHASE_RADIO,           // CYW43 initialised
+    BOOT_PHASE_SETTINGS,        // Flash settings store mounted
+    BOOT_PHASE_PROMPT,          // First prompt shown
+    BOOT_PHASE_SD,              // SD card initialised and FAT32 mounted
+    BOOT_PHASE_AUTORUN,         // Autorun script finished, or none configured
+    BOOT_PHASE_FIRST_COMMAND,   // First command typed at the prompt
+    BOOT_PHASE_NETWORK,         // WiFi associated with an address
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+#define BOOT_MAX_TASKS 4
+
+// A boot task does a bounded amount of work per call and returns true once
+// it has nothing left to do
+typedef bool (*boot_step_t)();
+
+class BootSequencer {
+private:
+    struct Task {
+        const char* name;
+        boot_step_t step;
+        bool done;
+    };
+
+    uint64_t phase_time_us[BOOT_PHASE_COUNT];
+    bool reached[BOOT_PHASE_COUNT];
+    Task tasks[BOOT_MAX_TASKS];
+    int task_count;
+    int tasks_pending;
+
+public:
+    // Constructor
+    BootSequencer();
+
+    // Public interface
+    void mark(boot_phase_t phase);      // Records the time only the first time
+    bool add_task(const char* name, boot_step_t step);
+    void poll();                        // Steps every unfinished task once
+    void print();
+
+    // Getter methods
+    bool isReached(boot_phase_t phase) const { return reached[phase]; }
+    bool isComplete() const { return tasks_pending == 0; }
+    uint64_t getPhaseTime(boot_phase_t phase) const { return phase_time_us[phase]; }
+
+    static const char* phase_name(boot_phase_t phase);
+};
+
+// Global instance
+extern BootSequencer boot;
+
+#endif // BOOT_H
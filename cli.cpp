@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include "cli.h"
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int cli_tokenize(char* line, char* argv[], int max_tokens) {
+    char* in = line;
+    char* out = line;  // Tokens are unquoted in place, so out never passes in
+    int argc = 0;
+
+    while (true) {
+        while (is_space(*in)) {
+            in++;
+        }
+        if (*in == '\0') {
+            return argc;
+        }
+        if (argc == max_tokens) {
+            return -1;
+        }
+
+        argv[argc++] = out;
+        char quote = 0;
+        while (*in != '\0' && (quote != 0 || !is_space(*in))) {
+            char c = *in++;
+            if (quote == 0 && (c == '"' || c == '\'')) {
+                quote = c;
+            } else if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote != '\'' && *in != '\0') {
+                *out++ = *in++;
+            } else {
+                *out++ = c;
+            }
+        }
+        if (quote != 0) {
+            return -1;
+        }
+
+        // Step past the separator before terminating, since out may equal in
+        if (*in != '\0') {
+            in++;
+        }
+        *out++ = '\0';
+    }
+}
+
+const cli_command_t* cli_find(const cli_command_t* table, size_t count, const char* name) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int order = strcmp(name, table[mid].name);
+        if (order == 0) {
+            return &table[mid];
+        }
+        if (order < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static void print_usage(const cli_command_t* command) {
+    printf("Usage: %s%s%s\n", command->name, command->usage[0] ? " " : "", command->usage);
+}
+
+bool cli_dispatch(const cli_command_t* table, size_t count, char* line) {
+    char* argv[CLI_MAX_ARGS + 1];
+    int argc = cli_tokenize(line, argv, CLI_MAX_ARGS);
+    if (argc < 0) {
+        printf("Error: Unterminated quote or too many arguments\n");
+        return false;
+    }
+    if (argc == 0) {
+        return false;
+    }
+
+    const cli_command_t* command = cli_find(table, count, argv[0]);
+    if (command == NULL) {
+        printf("Unknown command. Type 'help' for available commands.\n");
+        return false;
+    }
+
+    int args = argc - 1;
+    if (args < command->min_args || args > command->max_args) {
+        printf("Error: '%s' takes ", command->name);
+        if (command->min_args == command->max_args) {
+            printf("%d argument%s\n", command->min_args, command->min_args == 1 ? "" : "s");
+        } else {
+            printf("%d to %d arguments\n", command->min_args, command->max_args);
+        }
+        print_usage(command);
+        return false;
+    }
+
+    // Pad missing optional arguments with empty strings
+    static char empty[] = "";
+    for (int i = argc; i <= command->max_args; i++) {
+        argv[i] = empty;
+    }
+    argv[command->max_args + 1] = NULL;
+
+    command->handler(argc, argv);
+    return true;
+}
+
+void cli_print_help(const cli_command_t* table, size_t count, const char* name) {
+    if (name != NULL && name[0] != '\0') {
+        const cli_command_t* command = cli_find(table, count, name);
+        if (command == NULL) {
+            printf("Unknown command: %s\n", name);
+            return;
+        }
+        print_usage(command);
+        printf("  %s\n", command->help);
+        return;
+    }
+
+    printf("\nAvailable commands:\n");
+    for (size_t i = 0; i < count; i++) {
+        char synopsis[64];
+        snprintf(synopsis, sizeof(synopsis), "%s%s%s", table[i].name,
+                 table[i].usage[0] ? " " : "", table[i].usage);
+        printf("  %-32s - %s\n", synopsis, table[i].help);
+    }
+    printf("Quote arguments containing spaces, e.g. save \"My Network\" \"pass phrase\"\n");
+}
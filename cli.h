@@ -0,0 +1,63 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum tokens on one command line, including the command name
+#define CLI_MAX_ARGS 8
+
+// Handlers receive argv[0] = command name followed by max_args arguments.
+// Arguments the user left out are passed as empty strings, so handlers can
+// index up to max_args without checking argc.
+typedef void (*cli_handler_t)(int argc, char* argv[]);
+
+typedef struct {
+    const char* name;
+    const char* usage;      // Argument synopsis for help, e.g. "<ssid> <password>"
+    const char* help;
+    uint8_t min_args;
+    uint8_t max_args;
+    cli_handler_t handler;
+} cli_command_t;
+
+// Split a line in place into whitespace separated tokens. Single or double
+// quotes group words ("My Network"), and a backslash escapes the next
+// character outside single quotes. Returns the token count, or -1 for an
+// unterminated quote or more than max_tokens tokens.
+int cli_tokenize(char* line, char* argv[], int max_tokens);
+
+// Binary search of a table sorted by name
+const cli_command_t* cli_find(const cli_command_t* table, size_t count, const char* name);
+
+// Tokenize, validate against the command's argument schema and run it.
+// Returns false if the line could not be dispatched.
+bool cli_dispatch(const cli_command_t* table, size_t count, char* line);
+
+// Print every command, or the usage of a single one
+void cli_print_help(const cli_command_t* table, size_t count, const char* name);
+
+// Compile-time checks for the command table
+constexpr int cli_compare(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+template <size_t N>
+constexpr bool cli_table_valid(const cli_command_t (&table)[N]) {
+    for (size_t i = 0; i < N; i++) {
+        if (table[i].min_args > table[i].max_args || table[i].max_args >= CLI_MAX_ARGS) {
+            return false;
+        }
+        if (i > 0 && cli_compare(table[i - 1].name, table[i].name) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif // CLI_H
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/stdio/driver.h"
+#include "tusb.h"
+#include "console.h"
+#include "usb_device.h"
+#include "perf.h"
+#include "memory.h"
+
+static_assert((CONSOLE_BUFFER_SIZE & (CONSOLE_BUFFER_SIZE - 1)) == 0, "console buffer size must be a power of two");
+
+// Ring buffer, head is written by printers and tail by the drain
+static char buffer[CONSOLE_BUFFER_SIZE];
+static volatile uint32_t head;
+static volatile uint32_t tail;
+static uint32_t dropped;
+static bool draining;
+static MemoryRegion memory_console("console", sizeof(buffer));
+
+// Performance counters
+static PerfCounter perf_bytes("console.bytes");
+static PerfCounter perf_packets("console.packets");
+static PerfCounter perf_stalls("console.stalls");
+
+static bool terminal_attached() {
+    return tud_cdc_connected();
+}
+
+// Push as much as USB has room for, at most one contiguous run per call
+static bool drain_once() {
+    uint32_t pending = head - tail;
+    if (pending == 0 || !terminal_attached()) {
+        return false;
+    }
+    uint32_t room = tud_cdc_write_available();
+    if (room == 0) {
+        return false;
+    }
+
+    uint32_t start = tail & (CONSOLE_BUFFER_SIZE - 1);
+    uint32_t length = CONSOLE_BUFFER_SIZE - start;
+    if (length > pending) {
+        length = pending;
+    }
+    if (length > room) {
+        length = room;
+    }
+
+    // Never blocks, the chunk fits in the CDC FIFO
+    tud_cdc_write(&buffer[start], length);
+    tail = tail + length;
+    perf_packets.increment();
+    return true;
+}
+
+static void console_out_chars(const char* data, int length) {
+    for (int i = 0; i < length; i++) {
+        if (head - tail == CONSOLE_BUFFER_SIZE) {
+            // Full: wait for a terminal to take it, or drop when nobody is listening
+            perf_stalls.increment();
+            if (draining || !console_flush(CONSOLE_BLOCK_TIMEOUT_US) || head - tail == CONSOLE_BUFFER_SIZE) {
+                dropped += length - i;
+                perf_bytes.add(i);
+                return;
+            }
+        }
+        buffer[head & (CONSOLE_BUFFER_SIZE - 1)] = data[i];
+        head = head + 1;
+    }
+    perf_bytes.add(length);
+}
+
+static void console_out_flush() {
+    console_drain();
+}
+
+// Anything waiting on input, such as a confirmation prompt, gets its output sent first
+static int console_in_chars(char* data, int length) {
+    console_drain();
+    if (!tud_cdc_available()) {
+        return PICO_ERROR_NO_DATA;
+    }
+    int count = (int)tud_cdc_read(data, (uint32_t)length);
+    return count > 0 ? count : PICO_ERROR_NO_DATA;
+}
+
+static stdio_driver_t console_driver = {
+    .out_chars = console_out_chars,
+    .out_flush = console_out_flush,
+    .in_chars = console_in_chars,
+#if PICO_STDIO_ENABLE_CRLF_SUPPORT
+    .crlf_enabled = PICO_STDIO_DEFAULT_CRLF
+#endif
+};
+
+void console_init() {
+    head = 0;
+    tail = 0;
+    dropped = 0;
+    stdio_set_driver_enabled(&console_driver, true);
+}
+
+void console_drain() {
+    if (draining) {
+        return;
+    }
+    draining = true;
+    bool wrote = false;
+    while (drain_once()) {
+        wrote = true;
+    }
+    if (wrote) {
+        tud_cdc_write_flush();
+    }
+    draining = false;
+}
+
+bool console_flush(uint32_t timeout_us) {
+    absolute_time_t deadline = make_timeout_time_us(timeout_us);
+    while (head != tail) {
+        if (!terminal_attached() || time_reached(deadline)) {
+            return false;
+        }
+        console_drain();
+        if (head != tail) {
+            // Let USB take what was queued, the timer does not service it while the card is exported
+            usb_device_task();
+            sleep_us(100);
+        }
+    }
+    return true;
+}
+
+size_t console_pending() {
+    return head - tail;
+}
+
+uint32_t console_dropped() {
+    return dropped;
+}
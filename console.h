@@ -0,0 +1,33 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Buffered console output
+//
+// console_init() replaces the USB stdio driver with one that appends to a
+// ring buffer, so printf() returns as soon as the text is queued. The main
+// loop calls console_drain() to hand the buffer to USB CDC in packet-sized
+// chunks, and only as much as the host has room for, so it never waits.
+//
+// When the buffer fills with a terminal attached, writers wait for it to
+// drain (bounded by CONSOLE_BLOCK_TIMEOUT_US). With no terminal attached
+// new output is dropped and counted instead. Input still comes straight
+// from the USB CDC interface, see usb_device.h.
+//
+// Output is produced and drained on core 0.
+
+#define CONSOLE_BUFFER_SIZE 4096            // Power of two
+#define CONSOLE_BLOCK_TIMEOUT_US 500000
+
+void console_init();
+void console_drain();                       // Non-blocking, call from the main loop
+bool console_flush(uint32_t timeout_us);    // Drain everything, e.g. before a reset
+
+// Getter methods
+size_t console_pending();
+uint32_t console_dropped();
+
+#endif // CONSOLE_H
@@ -0,0 +1,649 @@
+#include <stdio.h>
+#include <string.h>
+#include "data_logger.h"
+#include "crc32.h"
+#include "memory.h"
+
+#ifndef LOGGER_HOST
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "sd_card.h"
+#include "sd_file.h"
+#include "flash_kv.h"
+#include "event_log.h"
+#include "perf.h"
+
+#define LOG_ADC_INPUT 0         // ADC0 on GPIO26
+#define LOG_ADC_CLOCK_HZ 48000000
+#define LOG_RUN_KEY "log:run"
+
+static_assert(LOG_ADC_CLOCK_HZ / DataLogger::MIN_SAMPLE_RATE - 1 < 65536, "divider fits at the lowest rate");
+
+static SDBlockRegion log_region;
+static SDFile log_file(&sd_card);
+
+// The same file on the second card, striped with the first when it is there
+static SDBlockRegion log_region2(&sd_card2);
+static SDFile log_file2(&sd_card2);
+static StripedBlockDevice log_stripe;
+
+static PerfHistogram perf_compress_us("log.compress_us");
+
+static_assert(LOG_ADC_CLOCK_HZ % 1000000 == 0, "buffer timing counts ADC clocks per microsecond");
+
+// DMA ping-pong state, only touched on core 1. Each data channel chains to
+// a control channel that writes the other data channel's buffer address
+// into its trigger register, so a channel always starts at the top of its
+// buffer however late the interrupt is. WRITE_ADDR does not reload by itself.
+static int dma_channels[2] = {-1, -1};
+static int dma_control[2] = {-1, -1};
+static uint16_t dma_buffers[2][LOG_SAMPLES_PER_BLOCK] __attribute__((aligned(4)));
+static uint16_t* dma_write_addrs[2] = {dma_buffers[0], dma_buffers[1]};
+static MemoryRegion memory_dma("log.dma", sizeof(dma_buffers));
+
+// Buffer n is filled by channel n % 2, and its first sample is taken
+// n * LOG_SAMPLES_PER_BLOCK ADC periods after arm_time_us
+static uint64_t arm_time_us;
+static uint32_t adc_period;             // In 1/256ths of an ADC clock, the divider's resolution
+static uint32_t buffers_captured;       // Buffers packed or counted as lost
+
+static uint32_t buffers_due(uint64_t now_us) {
+    return (uint32_t)((now_us - arm_time_us) * (LOG_ADC_CLOCK_HZ / 1000000 * 256) /
+                      ((uint64_t)adc_period * LOG_SAMPLES_PER_BLOCK));
+}
+
+static uint32_t buffer_time_us(uint32_t index) {
+    return (uint32_t)(arm_time_us + (uint64_t)index * adc_period * LOG_SAMPLES_PER_BLOCK /
+                      (LOG_ADC_CLOCK_HZ / 1000000 * 256));
+}
+
+static void dma_irq_handler() {
+    data_logger.dma_complete();
+}
+#endif
+
+// Global instance
+DataLogger data_logger;
+static MemoryRegion memory_logger("data_logger", sizeof(DataLogger));
+
+// Delta code the samples and split them into low and high byte planes, which
+// turns slowly changing signals into the repeats LZ4 looks for
+void log_filter_block(log_block_t* block) {
+    uint8_t planes[LOG_SAMPLES_PER_BLOCK * 2];
+    uint16_t previous = 0;
+    for (int i = 0; i < LOG_SAMPLES_PER_BLOCK; i++) {
+        uint16_t delta = block->samples[i] - previous;
+        previous = block->samples[i];
+        planes[i] = delta & 0xFF;
+        planes[LOG_SAMPLES_PER_BLOCK + i] = delta >> 8;
+    }
+    memcpy(block->samples, planes, sizeof(planes));
+}
+
+void log_unfilter_block(log_block_t* block) {
+    uint8_t planes[LOG_SAMPLES_PER_BLOCK * 2];
+    memcpy(planes, block->samples, sizeof(planes));
+    uint16_t previous = 0;
+    for (int i = 0; i < LOG_SAMPLES_PER_BLOCK; i++) {
+        previous += planes[i] | (planes[LOG_SAMPLES_PER_BLOCK + i] << 8);
+        block->samples[i] = previous;
+    }
+}
+
+// Constructor
+DataLogger::DataLogger() {
+    device = NULL;
+    blocks_written = 0;
+    sample_rate = 0;
+    run = 0;
+    active = false;
+    compress = false;
+    compressing = false;
+    discarding = false;
+    capture = false;
+    armed = false;
+    ring = NULL;
+    ring_blocks = 0;
+    head = 0;
+    tail = 0;
+    sequence = 0;
+    frames = NULL;
+    for (int i = 0; i < 2; i++) {
+        frame_blocks[i] = 0;
+        frame_ready[i] = false;
+    }
+    fill_frame = 0;
+    compress_frame = 0;
+    lz4_state = NULL;
+    frame_output = NULL;
+    ring_overruns = 0;
+    dma_overruns = 0;
+    write_errors = 0;
+    high_water = 0;
+    start_time_us = 0;
+    frames_compressed = 0;
+    frames_stored = 0;
+    frame_blocks_in = 0;
+    frame_sectors_out = 0;
+}
+
+// Public interface
+bool DataLogger::init(uint32_t ring_blocks) {
+    if (ring != NULL) {
+        return true;
+    }
+    if (ring_blocks < LOG_WRITE_BATCH || (ring_blocks & (ring_blocks - 1)) != 0) {
+        printf("Log ring must be a power of two of at least %d blocks\n", LOG_WRITE_BATCH);
+        return false;
+    }
+
+    ring = (log_block_t*)memory_arena.allocate("log.ring", ring_blocks * sizeof(log_block_t));
+    if (ring == NULL) {
+        return false;
+    }
+    this->ring_blocks = ring_blocks;
+    return true;
+}
+
+// The staging frames and compressor state are only taken from the arena once asked for
+bool DataLogger::set_compression(bool enabled) {
+    if (enabled && frames == NULL) {
+        frames = (log_block_t (*)[LOG_FRAME_BLOCKS])memory_arena.allocate("log.frames", 2 * sizeof(*frames));
+        lz4_state = (lz4_state_t*)memory_arena.allocate("log.lz4_state", sizeof(lz4_state_t));
+        frame_output = (uint8_t*)memory_arena.allocate("log.frame_output", LOG_FRAME_OUTPUT_SIZE);
+        if (frames == NULL || lz4_state == NULL || frame_output == NULL) {
+            // Whatever was allocated stays, the arena never frees
+            return false;
+        }
+    }
+    compress = enabled;
+    return true;
+}
+
+bool DataLogger::start(BlockDevice* device, uint32_t sample_rate, uint16_t run) {
+    if (ring == NULL || (compress && frame_output == NULL)) {
+        return false;
+    }
+    if (active || device == NULL || device->block_count() == 0 || sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+        return false;
+    }
+
+    this->device = device;
+    this->sample_rate = sample_rate;
+    this->run = run;
+    compressing = compress;
+    blocks_written = 0;
+    discarding = false;
+    head = 0;
+    tail = 0;
+    sequence = 0;
+    for (int i = 0; i < 2; i++) {
+        frame_blocks[i] = 0;
+        frame_ready[i] = false;
+    }
+    fill_frame = 0;
+    compress_frame = 0;
+    ring_overruns = 0;
+    dma_overruns = 0;
+    write_errors = 0;
+    high_water = 0;
+    frames_compressed = 0;
+    frames_stored = 0;
+    frame_blocks_in = 0;
+    frame_sectors_out = 0;
+    active = true;
+#ifdef LOGGER_HOST
+    start_time_us = 0;
+    armed = true;
+#else
+    start_time_us = time_us_64();
+#endif
+    capture = true;
+#ifndef LOGGER_HOST
+    __sev();  // Core 1 sleeps until an interrupt or this
+#endif
+    return true;
+}
+
+void DataLogger::stop() {
+    capture = false;
+#ifdef LOGGER_HOST
+    flush_frame();
+    compress_frames();
+    armed = false;
+#else
+    __sev();
+#endif
+}
+
+// Pack one block of samples into the ring, or into the staging frame when
+// compressing. Runs in the DMA interrupt on core 1 on the device.
+bool DataLogger::feed(const uint16_t* samples, uint16_t count, uint32_t timestamp_us) {
+    if (count > LOG_SAMPLES_PER_BLOCK) {
+        count = LOG_SAMPLES_PER_BLOCK;
+    }
+
+    // The sequence advances even for dropped blocks so the gap shows in the file
+    uint32_t block_sequence = sequence++;
+    log_block_t* block;
+    if (compressing) {
+        // Both frames still waiting for the compressor
+        if (frame_ready[fill_frame]) {
+            ring_overruns = ring_overruns + 1;
+            return false;
+        }
+        block = &frames[fill_frame][frame_blocks[fill_frame]];
+    } else {
+        if (head - tail >= ring_blocks) {
+            ring_overruns = ring_overruns + 1;
+            return false;
+        }
+        block = &ring[head % ring_blocks];
+    }
+
+    block->header.magic = LOG_BLOCK_MAGIC;
+    block->header.sequence = block_sequence;
+    block->header.timestamp_us = timestamp_us;
+    block->header.sample_count = count;
+    block->header.run = run;
+    memcpy(block->samples, samples, count * sizeof(uint16_t));
+    if (count < LOG_SAMPLES_PER_BLOCK) {
+        memset(&block->samples[count], 0, (LOG_SAMPLES_PER_BLOCK - count) * sizeof(uint16_t));
+    }
+
+    if (compressing) {
+        if (++frame_blocks[fill_frame] == LOG_FRAME_BLOCKS) {
+            flush_frame();
+        }
+        return true;
+    }
+
+    // Publish the block only once its contents are visible to the other core
+    __sync_synchronize();
+    head = head + 1;
+
+    uint32_t fill = head - tail;
+    if (fill > high_water) {
+        high_water = fill;
+    }
+    return true;
+}
+
+// Hand the frame being filled to the compressor. Packer side.
+void DataLogger::flush_frame() {
+    if (frame_blocks[fill_frame] == 0) {
+        return;
+    }
+    __sync_synchronize();
+    frame_ready[fill_frame] = true;
+    fill_frame ^= 1;
+}
+
+// Compress staged frames into the ring in the order they were filled. Runs
+// on core 1 outside the interrupt, so the packer keeps up meanwhile.
+void DataLogger::compress_frames() {
+    while (frame_ready[compress_frame]) {
+        emit_frame(frames[compress_frame], frame_blocks[compress_frame]);
+        frame_blocks[compress_frame] = 0;
+        __sync_synchronize();
+        frame_ready[compress_frame] = false;
+        compress_frame ^= 1;
+    }
+}
+
+// Queue one frame as a compressed frame, or as its plain blocks if
+// compressing does not save a sector
+void DataLogger::emit_frame(log_block_t* blocks, uint32_t count) {
+#ifndef LOGGER_HOST
+    PerfTimer timer(perf_compress_us);
+#endif
+    for (uint32_t i = 0; i < count; i++) {
+        log_filter_block(&blocks[i]);
+    }
+
+    log_frame_header_t* header = (log_frame_header_t*)frame_output;
+    size_t payload = lz4_compress((const uint8_t*)blocks, count * LOG_BLOCK_SIZE, frame_output + sizeof(*header),
+                                  LOG_FRAME_OUTPUT_SIZE - sizeof(*header), lz4_state);
+    uint32_t sectors = (sizeof(*header) + payload + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+    const uint8_t* source = frame_output;
+
+    if (payload == 0 || sectors >= count) {
+        for (uint32_t i = 0; i < count; i++) {
+            log_unfilter_block(&blocks[i]);
+        }
+        source = (const uint8_t*)blocks;
+        sectors = count;
+        frames_stored++;
+    } else {
+        header->magic = LOG_FRAME_MAGIC;
+        header->first_sequence = blocks[0].header.sequence;
+        header->block_count = count;
+        header->sector_count = sectors;
+        header->payload_length = payload;
+        header->crc = crc32(frame_output + sizeof(*header), payload);
+        memset(frame_output + sizeof(*header) + payload, 0, sectors * LOG_BLOCK_SIZE - sizeof(*header) - payload);
+        frames_compressed++;
+    }
+
+    if (ring_blocks - (head - tail) < sectors) {
+        ring_overruns = ring_overruns + count;
+        return;
+    }
+    for (uint32_t i = 0; i < sectors; i++) {
+        memcpy(&ring[(head + i) % ring_blocks], source + i * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE);
+    }
+    frame_blocks_in += count;
+    frame_sectors_out += sectors;
+
+    __sync_synchronize();
+    head = head + sectors;
+
+    uint32_t fill = head - tail;
+    if (fill > high_water) {
+        high_water = fill;
+    }
+}
+
+// Write full blocks out in batches. Runs on core 0 from the main loop.
+void DataLogger::poll() {
+    if (!active) {
+        return;
+    }
+
+    // After the file filled or a write failed, whatever core 1 delivers
+    // before it disarms is dropped. Once it has disarmed head no longer
+    // moves, so the run finishes exactly once.
+    if (discarding) {
+        bool disarmed = !armed;
+        __sync_synchronize();
+        tail = head;
+        if (disarmed) {
+            finish();
+        }
+        return;
+    }
+
+    // Only write what was queued on entry, so a fast producer cannot hold the main loop
+    uint32_t budget = head - tail;
+    while (budget > 0 && (budget >= LOG_WRITE_BATCH || !armed)) {
+        uint32_t index = tail % ring_blocks;
+        uint32_t count = budget;
+        if (count > LOG_WRITE_BATCH) {
+            count = LOG_WRITE_BATCH;
+        }
+        if (count > ring_blocks - index) {
+            count = ring_blocks - index;  // Stop at the wrap, the rest goes next pass
+        }
+        if (count > device->block_count() - blocks_written) {
+            count = device->block_count() - blocks_written;
+        }
+
+        if (count == 0) {
+            printf("Log file full after %lu blocks, stopping capture\n", (unsigned long)blocks_written);
+            stop();
+            discarding = true;
+            tail = head;
+            break;
+        }
+
+        __sync_synchronize();
+        if (!device->write_blocks(blocks_written, (const uint8_t*)&ring[index], count)) {
+            write_errors++;
+            printf("Log write failed at block %lu, stopping capture\n", (unsigned long)blocks_written);
+            stop();
+            discarding = true;
+            tail = head;
+            break;
+        }
+        blocks_written += count;
+        tail = tail + count;
+        budget -= count;
+    }
+
+    // Stopped, disarmed and drained
+    if (!capture && !armed && head == tail) {
+        finish();
+    }
+}
+
+void DataLogger::finish() {
+    active = false;
+#ifndef LOGGER_HOST
+    event_log.record(EVENT_LOG_STOPPED, blocks_written, ring_overruns);
+#endif
+    if (compressing) {
+        printf("Logging finished: %lu sectors written holding %lu blocks (%lu samples), %lu dropped in ring, %lu lost to a late interrupt\n",
+               (unsigned long)blocks_written, (unsigned long)frame_blocks_in,
+               (unsigned long)(frame_blocks_in * LOG_SAMPLES_PER_BLOCK), (unsigned long)ring_overruns,
+               (unsigned long)dma_overruns);
+        return;
+    }
+    printf("Logging finished: %lu blocks (%lu samples) written, %lu dropped in ring, %lu lost to a late interrupt\n",
+           (unsigned long)blocks_written, (unsigned long)(blocks_written * LOG_SAMPLES_PER_BLOCK),
+           (unsigned long)ring_overruns, (unsigned long)dma_overruns);
+}
+
+void DataLogger::print_status() {
+    const char* state = capture ? "capturing" : (active ? "draining" : "idle");
+    printf("Data logger: %s\n", state);
+    if (sample_rate == 0) {
+        return;
+    }
+    printf("  Run %u at %lu samples/s\n", run, (unsigned long)sample_rate);
+    printf("  Written: %lu of %lu blocks (%lu KB)\n", (unsigned long)blocks_written,
+           (unsigned long)device->block_count(), (unsigned long)(blocks_written / 2));
+    printf("  Ring: %lu of %lu blocks queued, high water %lu\n", (unsigned long)(head - tail),
+           (unsigned long)ring_blocks, (unsigned long)high_water);
+    printf("  Dropped: %lu blocks (ring full), %lu lost to a late interrupt, %lu write errors\n",
+           (unsigned long)ring_overruns, (unsigned long)dma_overruns, (unsigned long)write_errors);
+    if (compressing && frame_sectors_out > 0) {
+        uint32_t ratio = frame_blocks_in * 100 / frame_sectors_out;
+        printf("  Compression: %lu.%02lu:1, %lu frames compressed, %lu stored plain\n", (unsigned long)(ratio / 100),
+               (unsigned long)(ratio % 100), (unsigned long)frames_compressed, (unsigned long)frames_stored);
+    }
+#ifndef LOGGER_HOST
+    if (active) {
+        printf("  Elapsed: %llu ms\n", (unsigned long long)((time_us_64() - start_time_us) / 1000));
+    }
+#endif
+}
+
+#ifndef LOGGER_HOST
+// Preallocate the file on the card and start capturing into it
+bool DataLogger::start_file(const char* filename, uint32_t length, uint32_t sample_rate) {
+    if (active) {
+        printf("Logger already running, use 'log stop' first\n");
+        return false;
+    }
+    if (ring == NULL) {
+        printf("Logger has no ring buffer, it did not fit in RAM at boot\n");
+        return false;
+    }
+    if (!sd_card.isInitialized()) {
+        printf("SD card not initialized. Use 'sd_init' first.\n");
+        return false;
+    }
+    if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+        printf("Sample rate must be %lu to %lu samples/s\n", (unsigned long)MIN_SAMPLE_RATE, (unsigned long)MAX_SAMPLE_RATE);
+        return false;
+    }
+
+    printf("Preallocating %lu KB for %s...\n", (unsigned long)(length / 1024), filename);
+    if (!log_file.preallocate(filename, length)) {
+        printf("Could not preallocate %s (card full, or an existing file is too small or fragmented)\n", filename);
+        return false;
+    }
+    uint32_t capacity = log_file.getSize() / LOG_BLOCK_SIZE;
+    log_region.setRegion(log_file.getFirstSector(), capacity);
+    log_file.close();
+    BlockDevice* device = &log_region;
+
+    if (sd_card2.isInitialized()) {
+        if (!log_file2.preallocate(filename, length)) {
+            printf("Could not preallocate %s on the second card\n", filename);
+            return false;
+        }
+        log_region2.setRegion(log_file2.getFirstSector(), log_file2.getSize() / LOG_BLOCK_SIZE);
+        log_file2.close();
+        BlockDevice* halves[2] = {&log_region, &log_region2};
+        if (!log_stripe.setDevices(halves, 2, LOG_STRIPE_BLOCKS)) {
+            printf("%s is too small to stripe\n", filename);
+            return false;
+        }
+        device = &log_stripe;
+        capacity = log_stripe.block_count();
+    }
+
+    // Persistent run number, so blocks left over from an earlier run can be told apart
+    uint16_t next_run = 0;
+    flash_kv.read(LOG_RUN_KEY, &next_run, sizeof(next_run));
+    next_run++;
+    flash_kv.put(LOG_RUN_KEY, &next_run, sizeof(next_run));
+
+    if (!start(device, sample_rate, next_run)) {
+        return false;
+    }
+    printf("Logging ADC%d at %lu samples/s to %s (run %u, room for %lu blocks%s%s)\n", LOG_ADC_INPUT,
+           (unsigned long)sample_rate, filename, next_run, (unsigned long)capacity, compressing ? ", compressed" : "",
+           device == &log_stripe ? ", striped over two cards" : "");
+    event_log.record(EVENT_LOG_STARTED, sample_rate);
+    return true;
+}
+
+void DataLogger::arm() {
+    // The clock divider has 8 fractional bits, so the rate it gives is known exactly
+    adc_period = (uint32_t)(((uint64_t)LOG_ADC_CLOCK_HZ * 256 + sample_rate / 2) / sample_rate);
+
+    adc_init();
+    adc_gpio_init(26 + LOG_ADC_INPUT);
+    adc_select_input(LOG_ADC_INPUT);
+    adc_fifo_setup(true, true, 1, true, false);  // FIFO on, DREQ at one sample, error bit, 16-bit samples
+    adc_set_clkdiv((float)(adc_period - 256) / 256);
+    adc_fifo_drain();
+
+    if (dma_channels[0] < 0) {
+        for (int i = 0; i < 2; i++) {
+            dma_channels[i] = dma_claim_unused_channel(true);
+            dma_control[i] = dma_claim_unused_channel(true);
+        }
+        irq_set_exclusive_handler(DMA_IRQ_1, dma_irq_handler);
+    }
+
+    // Each data channel fills its own buffer and then has its control
+    // channel restart the other one at the top of its buffer
+    for (int i = 0; i < 2; i++) {
+        dma_channel_config config = dma_channel_get_default_config(dma_channels[i]);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, true);
+        channel_config_set_dreq(&config, DREQ_ADC);
+        channel_config_set_chain_to(&config, dma_control[i]);
+        dma_channel_configure(dma_channels[i], &config, dma_buffers[i], &adc_hw->fifo, LOG_SAMPLES_PER_BLOCK, false);
+        dma_channel_acknowledge_irq1(dma_channels[i]);
+        dma_channel_set_irq1_enabled(dma_channels[i], true);
+
+        dma_channel_config control = dma_channel_get_default_config(dma_control[i]);
+        channel_config_set_transfer_data_size(&control, DMA_SIZE_32);
+        channel_config_set_read_increment(&control, false);
+        channel_config_set_write_increment(&control, false);
+        dma_channel_configure(dma_control[i], &control, &dma_hw->ch[dma_channels[i ^ 1]].al2_write_addr_trig,
+                              &dma_write_addrs[i ^ 1], 1, false);
+    }
+    buffers_captured = 0;
+
+    // Enabled from core 1, so the interrupt is taken here and not on the CLI core
+    irq_set_enabled(DMA_IRQ_1, true);
+    dma_channel_start(dma_channels[0]);
+    arm_time_us = time_us_64();
+    adc_run(true);
+    armed = true;
+}
+
+void DataLogger::disarm() {
+    adc_run(false);
+    irq_set_enabled(DMA_IRQ_1, false);
+    for (int i = 0; i < 2; i++) {
+        // Unchain before aborting, an abort can otherwise trigger the control channel
+        dma_channel_config config = dma_get_channel_config(dma_channels[i]);
+        channel_config_set_chain_to(&config, dma_channels[i]);
+        dma_channel_set_config(dma_channels[i], &config, false);
+        dma_channel_set_irq1_enabled(dma_channels[i], false);
+    }
+    // Control channels first, so neither can restart a data channel already stopped
+    for (int i = 0; i < 2; i++) {
+        dma_channel_abort(dma_control[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        dma_channel_abort(dma_channels[i]);
+        dma_channel_acknowledge_irq1(dma_channels[i]);
+    }
+    adc_fifo_drain();
+
+    // The last partial frame goes out before the writer sees the capture end
+    flush_frame();
+    compress_frames();
+    armed = false;
+}
+
+void DataLogger::core1_poll() {
+    if (capture && !armed) {
+        arm();
+    } else if (!capture && armed) {
+        disarm();
+    }
+
+    if (armed && compressing) {
+        compress_frames();
+    }
+}
+
+// Packs buffers here rather than in core1_poll(), so a frame being compressed
+// cannot hold a buffer past the time the DMA comes back around to it
+void DataLogger::dma_complete() {
+    bool done[2];
+    for (int i = 0; i < 2; i++) {
+        done[i] = dma_channel_get_irq1_status(dma_channels[i]);
+        if (done[i]) {
+            dma_channel_acknowledge_irq1(dma_channels[i]);
+        }
+    }
+
+    if (done[0] && done[1]) {
+        // Late by a buffer or more, with core 1 held off by a flash write for
+        // instance. The channel running now is refilling the buffer it wrote
+        // before, so only the other one is whole, and the time that passed
+        // tells how many buffers went by unpacked.
+        uint32_t due = buffers_due(time_us_64());
+        uint32_t buffer;
+        if (dma_channel_is_busy(dma_channels[0])) {
+            buffer = 1;
+        } else if (dma_channel_is_busy(dma_channels[1])) {
+            buffer = 0;
+        } else {
+            buffer = (due + 1) % 2;  // Between a completion and the restart of the other channel
+        }
+
+        // Newest buffer in it: past the one expected, and no further than the time allows
+        uint32_t index = buffers_captured + 1;
+        if (index % 2 != buffer) {
+            index++;
+        }
+        if (due > index + 1) {
+            index += (due - 1 - index) & ~1u;
+        }
+
+        // The sequence skips the lost buffers so the gap shows in the file
+        uint32_t lost = index - buffers_captured;
+        dma_overruns = dma_overruns + lost;
+        sequence += lost;
+        feed(dma_buffers[buffer], LOG_SAMPLES_PER_BLOCK, buffer_time_us(index));
+        buffers_captured = index + 1;
+    } else if (done[0] || done[1]) {
+        feed(dma_buffers[done[0] ? 0 : 1], LOG_SAMPLES_PER_BLOCK, buffer_time_us(buffers_captured));
+        buffers_captured++;
+    }
+}
+#endif
@@ -0,0 +1,172 @@
+#ifndef DATA_LOGGER_H
+#define DATA_LOGGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "block_device.h"
+#include "lz4.h"
+
+// Continuous ADC capture to the SD card
+//
+//   ADC FIFO -> DMA ping-pong (two data channels, one block of samples each,
+//               restarted at the top of their buffers by two control channels)
+//            -> DMA interrupt on core 1 timestamps and packs 512-byte blocks
+//               into the ring, or into a staging frame when compressing
+//           [-> core 1 compresses full frames of blocks into the ring]
+//            -> core 0 writes runs of full blocks with multi-block writes
+//               into a preallocated, contiguous file
+//
+// Blocks that find the ring full are dropped and counted, and their sequence
+// numbers are skipped so gaps are visible in the file. The ring is taken from
+// the memory arena by init() at boot, and the compression buffers the first
+// time compression is turned on, so RAM is only spent on what is used and
+// 'mem' shows it. Building with
+// LOGGER_HOST leaves out the ADC, DMA and SD parts so synthetic samples can
+// be replayed through feed(), compress_frames() and poll() into a RAM
+// BlockDevice on a PC.
+//
+// With the second card initialized, start_file() preallocates the file on
+// both cards and stripes the run across them in chunks of LOG_STRIPE_BLOCKS,
+// so each batch is programmed by both cards at once. Chunk k of the run is
+// chunk k / 2 of the file on card k % 2; readers interleave the two files
+// back before looking at blocks or frames.
+
+#define LOG_BLOCK_SIZE 512
+#define LOG_SAMPLES_PER_BLOCK 248
+#define LOG_RING_BLOCKS 128         // Default ring size, 64 KB, about 65 ms at 500 kS/s
+#define LOG_WRITE_BATCH 16          // Blocks per multi-block write
+#define LOG_STRIPE_BLOCKS (LOG_WRITE_BATCH / 2)     // Chunk per card when striping, so each batch spans both
+#define LOG_BLOCK_MAGIC 0x314C4441  // "ADL1"
+#define LOG_FRAME_BLOCKS 8          // Blocks compressed together, 4 KB
+#define LOG_FRAME_MAGIC 0x315A4441  // "ADZ1"
+#define LOG_FRAME_OUTPUT_SIZE ((LOG_FRAME_BLOCKS - 1) * LOG_BLOCK_SIZE)  // Anything larger is not worth writing
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;          // Block number within the run, gaps mean dropped blocks
+    uint32_t timestamp_us;      // Time of the first sample
+    uint16_t sample_count;
+    uint16_t run;               // Changes with every start, separates runs in a reused file
+} log_block_header_t;
+
+typedef struct {
+    log_block_header_t header;
+    uint16_t samples[LOG_SAMPLES_PER_BLOCK];    // Raw 12-bit ADC results, bit 15 flags a conversion error
+} log_block_t;
+
+static_assert(sizeof(log_block_t) == LOG_BLOCK_SIZE, "log blocks must fill one SD sector");
+
+// With compression on, each frame of blocks starts on a sector boundary with
+// this header, followed by the LZ4 block and zero padding up to the next
+// sector. The compressed blocks have their samples delta coded and split into
+// low and high byte planes, see log_unfilter_block(). A frame that would not
+// save at least one sector is written as its plain blocks instead, so readers
+// tell the two apart by the magic at the start of each sector and can seek to
+// any frame without decoding the ones before it.
+typedef struct {
+    uint32_t magic;
+    uint32_t first_sequence;    // Sequence of the first block in the frame
+    uint16_t block_count;       // Blocks in the frame, up to LOG_FRAME_BLOCKS
+    uint16_t sector_count;      // Sectors the frame occupies, header included
+    uint32_t payload_length;    // LZ4 bytes after the header
+    uint32_t crc;               // CRC32 of the payload
+} log_frame_header_t;
+
+// Delta code a block's samples and split them into byte planes, in place
+void log_filter_block(log_block_t* block);
+
+// Undo the sample filter on a block decompressed from a frame
+void log_unfilter_block(log_block_t* block);
+
+class DataLogger {
+public:
+    static const uint32_t MIN_SAMPLE_RATE = 733;       // Slower needs more than the ADC divider's 16 integer bits
+    static const uint32_t MAX_SAMPLE_RATE = 500000;
+    static const uint32_t DEFAULT_SAMPLE_RATE = 100000;
+
+private:
+    BlockDevice* device;
+    uint32_t blocks_written;
+    uint32_t sample_rate;
+    uint16_t run;
+    bool active;                // Started and not yet fully written out
+    bool compress;              // Compression setting for the next start
+    bool compressing;           // Compression setting of the current run
+    bool discarding;            // Stopped by a full file or a write error, the rest is dropped
+
+    // Capture is requested by core 0 and armed by core 1
+    volatile bool capture;
+    volatile bool armed;
+
+    // Block ring, head is advanced by the packer and tail by the writer
+    log_block_t* ring;
+    uint32_t ring_blocks;       // Power of two, so indexes stay continuous when head wraps
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t sequence;
+
+    // Staging frames, filled by the packer and handed to the compressor in turn
+    log_block_t (*frames)[LOG_FRAME_BLOCKS];
+    uint32_t frame_blocks[2];
+    volatile bool frame_ready[2];
+    uint32_t fill_frame;
+    uint32_t compress_frame;
+    lz4_state_t* lz4_state;
+    uint8_t* frame_output;      // LOG_FRAME_OUTPUT_SIZE bytes
+
+    // Statistics
+    volatile uint32_t ring_overruns;
+    volatile uint32_t dma_overruns;     // Buffers refilled before the interrupt packed them
+    uint32_t write_errors;
+    uint32_t high_water;
+    uint64_t start_time_us;
+    uint32_t frames_compressed;
+    uint32_t frames_stored;     // Written as plain blocks because they did not compress
+    uint32_t frame_blocks_in;
+    uint32_t frame_sectors_out;
+
+    void flush_frame();
+    void emit_frame(log_block_t* blocks, uint32_t count);
+    void finish();
+#ifndef LOGGER_HOST
+    void arm();
+    void disarm();
+#endif
+
+public:
+    // Constructor
+    DataLogger();
+
+    // Public interface
+    bool init(uint32_t ring_blocks);
+    bool start(BlockDevice* device, uint32_t sample_rate, uint16_t run);
+    void stop();
+    bool feed(const uint16_t* samples, uint16_t count, uint32_t timestamp_us);  // Packer side
+    void compress_frames();     // Core 1, compresses staged frames into the ring
+    void poll();                // Core 0, writes out full blocks
+    bool set_compression(bool enabled);
+#ifndef LOGGER_HOST
+    bool start_file(const char* filename, uint32_t length, uint32_t sample_rate);
+    void core1_poll();          // Core 1, arms the ADC and compresses frames
+    void dma_complete();        // DMA interrupt on core 1
+#endif
+    void print_status();
+
+    // Getter methods
+    bool isActive() const { return active; }
+    bool isCompressionEnabled() const { return compress; }
+    uint32_t getRingBlocks() const { return ring_blocks; }
+    uint32_t getBlocksWritten() const { return blocks_written; }
+    uint32_t getRingOverruns() const { return ring_overruns; }
+    uint32_t getDmaOverruns() const { return dma_overruns; }
+    uint32_t getWriteErrors() const { return write_errors; }
+    uint32_t getHighWater() const { return high_water; }
+    uint32_t getFramesCompressed() const { return frames_compressed; }
+    uint32_t getFramesStored() const { return frames_stored; }
+};
+
+// Global instance
+extern DataLogger data_logger;
+
+#endif // DATA_LOGGER_H
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <string.h>
+#include "event_log.h"
+#include "crc32.h"
+#include "memory.h"
+
+static_assert(sizeof(event_page_header_t) == 16, "page header layout");
+static_assert(sizeof(event_record_t) == 16, "record layout");
+static_assert(FlashDevice::PAGE_SIZE % sizeof(event_record_t) == 0, "records fill the page");
+
+#ifdef EVENT_LOG_HOST
+// Host build: time comes from the caller
+static uint32_t mock_time_ms;
+
+void event_log_set_mock_time(uint32_t time_ms) {
+    mock_time_ms = time_ms;
+}
+
+static uint32_t now_ms() {
+    return mock_time_ms;
+}
+#else
+#include "pico/stdlib.h"
+
+static uint32_t now_ms() {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+// Global instance
+EventLog event_log(&pico_flash, FLASH_EVENT_OFFSET, FLASH_EVENT_SECTORS);
+static MemoryRegion memory_event_log("event_log", sizeof(event_log));
+#endif
+
+// Name and argument format of each event, both arguments are passed as long
+static const struct {
+    const char* name;
+    const char* format;
+} event_types[EVENT_COUNT] = {
+    {"unknown", "%ld %ld"},
+    {"boot", "watchdog %ld"},
+    {"wifi.connected", "after %ld attempts"},
+    {"wifi.join_failed", "status %ld"},
+    {"wifi.link_lost", "status %ld"},
+    {"sd.mounted", "type %ld, %ld sectors per cluster"},
+    {"sd.failed", ""},
+    {"log.started", "%ld Hz"},
+    {"log.stopped", "%ld blocks, %ld dropped"},
+    {"msc.exported", "%ld"},
+    {"ota.received", "%ld bytes"},
+    {"ota.failed", "after %ld bytes"},
+    {"health.stack_low", "core %ld, %ld bytes used"},
+    {"health.heap_low", "%ld bytes free"},
+    {"reboot", "reason %ld"},
+};
+
+// Constructor
+EventLog::EventLog(FlashDevice* device, uint32_t base_offset, uint32_t sector_count) {
+    this->device = device;
+    this->base_offset = base_offset;
+    page_count = sector_count * PAGES_PER_SECTOR;
+    mounted = false;
+    boot = 0;
+    memset(page, 0xFF, sizeof(page));
+    page_index = 0;
+    page_sequence = 1;
+    records = 0;
+    written = 0;
+    page_started = false;
+    oldest_unwritten_ms = 0;
+    events_recorded = 0;
+    page_programs = 0;
+    sector_erases = 0;
+    write_errors = 0;
+}
+
+const event_page_header_t* EventLog::header_at(uint32_t index) const {
+    return (const event_page_header_t*)device->read_ptr(page_offset(index));
+}
+
+bool EventLog::header_valid(const event_page_header_t* header) const {
+    return header->magic == PAGE_MAGIC && header->crc == crc32(header, offsetof(event_page_header_t, crc));
+}
+
+bool EventLog::page_blank(uint32_t index) const {
+    const uint32_t* words = (const uint32_t*)device->read_ptr(page_offset(index));
+    for (uint32_t i = 0; i < FlashDevice::PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint16_t EventLog::record_check(const event_record_t* record) {
+    uint32_t crc = crc32(&record->time_ms, sizeof(record->time_ms));
+    crc = crc32(&record->id, sizeof(record->id), crc);
+    return (uint16_t)crc32(record->args, sizeof(record->args), crc);
+}
+
+bool EventLog::record_valid(const event_record_t* record) {
+    return record->id != 0xFFFF && record->check == record_check(record);
+}
+
+// Slots used in a page, a blank one ends it
+uint32_t EventLog::count_records(const uint8_t* page) {
+    const event_record_t* slots = (const event_record_t*)(page + sizeof(event_page_header_t));
+    uint32_t count = 0;
+    while (count < EVENT_RECORDS_PER_PAGE && (slots[count].id != 0xFFFF || slots[count].check != 0xFFFF)) {
+        count++;
+    }
+    return count;
+}
+
+bool EventLog::mount() {
+    mounted = false;
+
+    // The newest page decides where to continue, and the boot count
+    bool found = false;
+    uint32_t newest = 0;
+    uint32_t newest_sequence = 0;
+    uint16_t last_boot = 0;
+    for (uint32_t i = 0; i < page_count; i++) {
+        const event_page_header_t* header = header_at(i);
+        if (!header_valid(header)) {
+            continue;
+        }
+        if (!found || (int32_t)(header->sequence - newest_sequence) > 0) {
+            found = true;
+            newest = i;
+            newest_sequence = header->sequence;
+            last_boot = header->boot;
+        }
+    }
+
+    // Every boot starts a page of its own, since record times count from boot
+    boot = last_boot + 1;
+    page_index = found ? (newest + 1) % page_count : 0;
+    page_sequence = found ? newest_sequence + 1 : 1;
+    records = 0;
+    written = 0;
+    page_started = false;
+    mounted = true;
+    return true;
+}
+
+bool EventLog::format() {
+    mounted = false;
+    if (!device->erase_range(base_offset, page_count * FlashDevice::PAGE_SIZE)) {
+        write_errors++;
+        return false;
+    }
+    sector_erases += page_count / PAGES_PER_SECTOR;
+    page_index = 0;
+    page_sequence = 1;
+    records = 0;
+    written = 0;
+    page_started = false;
+    mounted = true;
+    return true;
+}
+
+// Start the open page at index, or the first blank page after it in the same sector
+bool EventLog::open_page(uint32_t index) {
+    // A page left half written by a reset can't be programmed again
+    while (index % PAGES_PER_SECTOR != 0 && !page_blank(index)) {
+        index = (index + 1) % page_count;
+    }
+    if (index % PAGES_PER_SECTOR == 0) {
+        if (!device->erase_sector(page_offset(index))) {
+            write_errors++;
+            return false;
+        }
+        sector_erases++;
+    }
+
+    memset(page, 0xFF, sizeof(page));
+    event_page_header_t* header = (event_page_header_t*)page;
+    header->magic = PAGE_MAGIC;
+    header->sequence = page_sequence;
+    header->boot = boot;
+    header->reserved = 0xFFFF;
+    header->crc = crc32(header, offsetof(event_page_header_t, crc));
+
+    page_index = index;
+    records = 0;
+    written = 0;
+    page_started = true;
+    return true;
+}
+
+// Program the open page, then move on once it is full
+bool EventLog::write_page() {
+    page_programs++;
+    if (!device->program_page(page_offset(page_index), page)) {
+        write_errors++;
+        return false;
+    }
+    written = records;
+
+    if (records == EVENT_RECORDS_PER_PAGE) {
+        page_index = (page_index + 1) % page_count;
+        page_sequence++;
+        page_started = false;
+    }
+    return true;
+}
+
+bool EventLog::record(event_id_t id, uint32_t arg0, uint32_t arg1) {
+    if (!mounted) {
+        return false;
+    }
+
+    // Full and not yet written, only when poll() hasn't run since it filled or the write failed
+    if (page_started && records == EVENT_RECORDS_PER_PAGE && !write_page()) {
+        return false;
+    }
+    if (!page_started && !open_page(page_index)) {
+        return false;
+    }
+
+    event_record_t* record = (event_record_t*)(page + sizeof(event_page_header_t)) + records;
+    record->time_ms = now_ms();
+    record->id = (uint16_t)id;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->check = record_check(record);
+
+    if (records == written) {
+        oldest_unwritten_ms = record->time_ms;
+    }
+    records++;
+    events_recorded++;
+    return true;
+}
+
+bool EventLog::flush() {
+    if (!mounted || records == written) {
+        return true;
+    }
+    return write_page();
+}
+
+void EventLog::poll() {
+    if (getFlushDelayMs() == 0) {
+        write_page();
+    }
+}
+
+uint32_t EventLog::getFlushDelayMs() const {
+    if (!mounted || records == written) {
+        return UINT32_MAX;
+    }
+    uint32_t waited = now_ms() - oldest_unwritten_ms;
+    if (records == EVENT_RECORDS_PER_PAGE || waited >= EVENT_LOG_FLUSH_MS) {
+        return 0;
+    }
+    return EVENT_LOG_FLUSH_MS - waited;
+}
+
+// Oldest first. The open page comes from RAM, so events not yet written are included.
+uint32_t EventLog::read_all(void (*callback)(uint16_t boot, const event_record_t* record, void* context), void* context) const {
+    if (!mounted) {
+        return 0;
+    }
+
+    // The ring continues after the open page, or at the page about to be opened
+    uint32_t start = page_started ? page_index + 1 : page_index;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < page_count; i++) {
+        uint32_t index = (start + i) % page_count;
+        const uint8_t* data;
+        if (page_started && index == page_index) {
+            data = page;
+        } else {
+            // Blank and torn pages fail the header check
+            const event_page_header_t* header = header_at(index);
+            if (!header_valid(header) || (int32_t)(header->sequence - page_sequence) >= 0) {
+                continue;
+            }
+            data = (const uint8_t*)header;
+        }
+
+        const event_page_header_t* header = (const event_page_header_t*)data;
+        const event_record_t* slots = (const event_record_t*)(data + sizeof(event_page_header_t));
+        uint32_t used = count_records(data);
+        for (uint32_t slot = 0; slot < used; slot++) {
+            if (record_valid(&slots[slot])) {
+                callback(header->boot, &slots[slot], context);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+const char* EventLog::event_name(uint16_t id) {
+    return id < EVENT_COUNT ? event_types[id].name : event_types[0].name;
+}
+
+static void print_event(uint16_t boot, const event_record_t* record, void* context) {
+    (void)context;
+    uint16_t id = record->id < EVENT_COUNT ? record->id : 0;
+    printf("  %5u %6lu.%03lu  %-18s ", boot, (unsigned long)(record->time_ms / 1000),
+           (unsigned long)(record->time_ms % 1000), event_types[id].name);
+    printf(event_types[id].format, (long)(int32_t)record->args[0], (long)(int32_t)record->args[1]);
+    printf("\n");
+}
+
+void EventLog::dump() const {
+    printf("  %5s %10s  %s\n", "Boot", "Time (s)", "Event");
+    uint32_t count = read_all(print_event, NULL);
+    printf("%lu events\n", (unsigned long)count);
+}
+
+void EventLog::print_stats() const {
+    printf("Event log: %s, boot %u\n", mounted ? "mounted" : "not mounted", boot);
+    printf("  Ring: %lu pages of %u events, open page %lu (sequence %lu), %lu events not yet written\n",
+           (unsigned long)page_count, (unsigned)EVENT_RECORDS_PER_PAGE, (unsigned long)page_index,
+           (unsigned long)page_sequence, (unsigned long)(records - written));
+    printf("  Since boot: %lu events, %lu page programs, %lu sector erases, %lu write errors\n",
+           (unsigned long)events_recorded, (unsigned long)page_programs,
+           (unsigned long)sector_erases, (unsigned long)write_errors);
+}
@@ -0,0 +1,137 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "flash_device.h"
+
+// Structured event log in a ring of flash sectors
+//
+// Diagnostics that survive a reset: each event is an id, the time since
+// boot and two arguments, 16 bytes in all. 'events' decodes them.
+//
+// Events collect in a RAM copy of the open page, and poll() programs the
+// page once it fills or EVENT_LOG_FLUSH_MS after the first unwritten event.
+// A page is programmed again as more events land in it. Earlier records
+// are rewritten with the bits they already hold, and every record carries
+// its own check, so a cut during a program loses at most the records in
+// flight. Each program holds interrupts off for one page, and each erase
+// for one sector. A sector is erased only when the ring comes back around
+// to it, which drops its 16 oldest pages.
+//
+// Page layout: event_page_header_t, then EVENT_RECORDS_PER_PAGE
+// event_record_t slots filled in order. A blank slot ends the page.
+//
+// record() only touches RAM unless the open page is full and unwritten,
+// and must be called from the main loop, like everything else that
+// writes flash.
+
+#define EVENT_LOG_FLUSH_MS 5000     // Longest an event waits in RAM
+
+typedef enum {
+    EVENT_BOOT = 1,                 // arg0: 1 after a watchdog reset
+    EVENT_WIFI_CONNECTED,           // arg0: attempts
+    EVENT_WIFI_JOIN_FAILED,         // arg0: link status
+    EVENT_WIFI_LINK_LOST,           // arg0: link status
+    EVENT_SD_MOUNTED,               // arg0: card type, arg1: sectors per cluster
+    EVENT_SD_FAILED,
+    EVENT_LOG_STARTED,              // arg0: sample rate
+    EVENT_LOG_STOPPED,              // arg0: blocks written, arg1: blocks dropped
+    EVENT_MSC_EXPORTED,             // arg0: 1 exported, 0 taken back
+    EVENT_OTA_RECEIVED,             // arg0: image length
+    EVENT_OTA_FAILED,               // arg0: bytes received
+    EVENT_STACK_LOW,                // arg0: core, arg1: bytes used
+    EVENT_HEAP_LOW,                 // arg0: bytes free
+    EVENT_REBOOT,                   // arg0: 0 bootloader, 1 firmware update
+    EVENT_COUNT
+} event_id_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;              // Consecutive over the life of the log
+    uint16_t boot;                  // Boot the page was started in
+    uint16_t reserved;
+    uint32_t crc;                   // CRC32 of the header up to here
+} event_page_header_t;
+
+typedef struct {
+    uint32_t time_ms;               // Since boot
+    uint16_t id;
+    uint16_t check;                 // Low half of the CRC32 of the rest of the record
+    uint32_t args[2];
+} event_record_t;
+
+#define EVENT_RECORDS_PER_PAGE ((FlashDevice::PAGE_SIZE - sizeof(event_page_header_t)) / sizeof(event_record_t))
+
+class EventLog {
+private:
+    static const uint32_t PAGE_MAGIC = 0x314C5645;  // "EVL1"
+    static const uint32_t PAGES_PER_SECTOR = FlashDevice::SECTOR_SIZE / FlashDevice::PAGE_SIZE;
+
+    FlashDevice* device;
+    uint32_t base_offset;
+    uint32_t page_count;
+
+    bool mounted;
+    uint16_t boot;
+
+    // Open page, a RAM copy of what is in flash plus the events not yet written
+    uint8_t page[FlashDevice::PAGE_SIZE];
+    uint32_t page_index;
+    uint32_t page_sequence;
+    uint32_t records;               // Slots used in the open page
+    uint32_t written;               // Slots already in flash
+    bool page_started;              // A page is open, and its sector erased if it needed to be
+    uint32_t oldest_unwritten_ms;
+
+    // Statistics
+    uint32_t events_recorded;
+    uint32_t page_programs;
+    uint32_t sector_erases;
+    uint32_t write_errors;
+
+    uint32_t page_offset(uint32_t index) const { return base_offset + index * FlashDevice::PAGE_SIZE; }
+    const event_page_header_t* header_at(uint32_t index) const;
+    bool header_valid(const event_page_header_t* header) const;
+    bool page_blank(uint32_t index) const;
+    static uint16_t record_check(const event_record_t* record);
+    static bool record_valid(const event_record_t* record);
+    static uint32_t count_records(const uint8_t* page);
+    bool open_page(uint32_t index);
+    bool write_page();
+
+public:
+    // Constructor
+    EventLog(FlashDevice* device, uint32_t base_offset, uint32_t sector_count);
+
+    // Public interface
+    bool mount();
+    bool format();
+    bool record(event_id_t id, uint32_t arg0 = 0, uint32_t arg1 = 0);
+    bool flush();
+    void poll();
+    uint32_t read_all(void (*callback)(uint16_t boot, const event_record_t* record, void* context), void* context) const;
+    void dump() const;
+    void print_stats() const;
+
+    static const char* event_name(uint16_t id);
+
+    // Getter methods
+    bool isMounted() const { return mounted; }
+    uint16_t getBoot() const { return boot; }
+    uint32_t getEventsRecorded() const { return events_recorded; }
+    uint32_t getPagePrograms() const { return page_programs; }
+    uint32_t getSectorErases() const { return sector_erases; }
+    uint32_t getUnwritten() const { return records - written; }
+    uint32_t getFlushDelayMs() const;   // Until poll() writes the open page, UINT32_MAX when nothing waits
+};
+
+#ifdef EVENT_LOG_HOST
+void event_log_set_mock_time(uint32_t time_ms);
+#else
+// Global instance
+extern EventLog event_log;
+#endif
+
+#endif // EVENT_LOG_H
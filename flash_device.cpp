@@ -0,0 +1,74 @@
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "flash_device.h"
+#include "flash_kv.h"
+#include "trace.h"
+#include "perf.h"
+
+static_assert(FlashDevice::PAGE_SIZE == FLASH_PAGE_SIZE, "flash page size mismatch");
+static_assert(FlashDevice::SECTOR_SIZE == FLASH_SECTOR_SIZE, "flash sector size mismatch");
+
+// Global instances
+PicoFlashDevice pico_flash;
+FlashKV flash_kv(&pico_flash, FLASH_KV_OFFSET, FLASH_KV_SECTORS);
+
+// Performance counters
+static PerfCounter perf_erases("flash.erases");
+static PerfCounter perf_programs("flash.programs");
+static PerfHistogram perf_blocked_us("flash.blocked_us");
+
+// Parameters for the operations run inside flash_safe_execute()
+typedef struct {
+    uint32_t offset;
+    const uint8_t* data;
+} flash_operation_t;
+
+static void erase_operation(void* param) {
+    flash_operation_t* operation = (flash_operation_t*)param;
+    flash_range_erase(operation->offset, FLASH_SECTOR_SIZE);
+}
+
+static void program_operation(void* param) {
+    flash_operation_t* operation = (flash_operation_t*)param;
+    flash_range_program(operation->offset, operation->data, FLASH_PAGE_SIZE);
+}
+
+// Constructor
+PicoFlashDevice::PicoFlashDevice() {
+    max_blocked_us = 0;
+    failures = 0;
+}
+
+bool PicoFlashDevice::run(void (*operation)(void*), void* param) {
+    TRACE_SCOPE("flash_op");
+    uint64_t start = time_us_64();
+    int result = flash_safe_execute(operation, param, SAFE_TIMEOUT_MS);
+    uint32_t elapsed = (uint32_t)(time_us_64() - start);
+
+    if (result != PICO_OK) {
+        failures++;
+        return false;
+    }
+    if (elapsed > max_blocked_us) {
+        max_blocked_us = elapsed;
+    }
+    perf_blocked_us.record(elapsed);
+    return true;
+}
+
+const uint8_t* PicoFlashDevice::read_ptr(uint32_t offset) {
+    return (const uint8_t*)(XIP_BASE + offset);
+}
+
+bool PicoFlashDevice::erase_sector(uint32_t offset) {
+    flash_operation_t operation = {offset, NULL};
+    perf_erases.increment();
+    return run(erase_operation, &operation);
+}
+
+bool PicoFlashDevice::program_page(uint32_t offset, const uint8_t* data) {
+    flash_operation_t operation = {offset, data};
+    perf_programs.increment();
+    return run(program_operation, &operation);
+}
@@ -0,0 +1,81 @@
+#ifndef FLASH_DEVICE_H
+#define FLASH_DEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// NOR flash access used by the storage layers. Offsets are relative to the
+// start of flash. Erase works on whole sectors and sets every bit to 1,
+// program works on whole pages and can only clear bits.
+class FlashDevice {
+public:
+    static const uint32_t PAGE_SIZE = 256;
+    static const uint32_t SECTOR_SIZE = 4096;
+
+    virtual ~FlashDevice() {}
+
+    // Memory-mapped view of the flash, reads need no driver call
+    virtual const uint8_t* read_ptr(uint32_t offset) = 0;
+    virtual bool erase_sector(uint32_t offset) = 0;
+    virtual bool program_page(uint32_t offset, const uint8_t* data) = 0;
+
+    // Erase sector by sector so nothing is held off for the whole range
+    virtual bool erase_range(uint32_t offset, uint32_t length) {
+        for (uint32_t done = 0; done < length; done += SECTOR_SIZE) {
+            if (!erase_sector(offset + done)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// On-chip QSPI flash, read through XIP.
+// Every erase or program runs through flash_safe_execute(), which parks the
+// other core in RAM (multicore lockout) and disables interrupts on this one
+// for that single operation only. If the other core can't be parked in time
+// the write fails instead of hanging the system.
+class PicoFlashDevice : public FlashDevice {
+private:
+    static const uint32_t SAFE_TIMEOUT_MS = 100;
+
+    uint32_t max_blocked_us;    // Longest single erase/program
+    uint32_t failures;          // Writes refused because the other core didn't park
+
+    bool run(void (*operation)(void*), void* param);
+
+public:
+    // Constructor
+    PicoFlashDevice();
+
+    const uint8_t* read_ptr(uint32_t offset) override;
+    bool erase_sector(uint32_t offset) override;
+    bool program_page(uint32_t offset, const uint8_t* data) override;
+
+    // Getter methods
+    uint32_t getMaxBlockedUs() const { return max_blocked_us; }
+    uint32_t getFailures() const { return failures; }
+};
+
+// Flash layout, counted back from the end of flash
+#define FLASH_KV_SECTORS 4
+#define FLASH_KV_OFFSET (PICO_FLASH_SIZE_BYTES - (FLASH_KV_SECTORS + 1) * FlashDevice::SECTOR_SIZE)
+#define FLASH_LEGACY_CREDENTIALS_OFFSET (PICO_FLASH_SIZE_BYTES - FlashDevice::SECTOR_SIZE)
+
+// Event log ring, below the settings store
+#define FLASH_EVENT_SECTORS 4
+#define FLASH_EVENT_OFFSET (FLASH_KV_OFFSET - FLASH_EVENT_SECTORS * FlashDevice::SECTOR_SIZE)
+
+// OTA staging region, from the middle of flash up to the event log.
+// The running firmware has to fit below it.
+#define FLASH_OTA_OFFSET (PICO_FLASH_SIZE_BYTES / 2)
+#define FLASH_OTA_SIZE (FLASH_EVENT_OFFSET - FLASH_OTA_OFFSET)
+
+class FlashKV;
+
+// Global instances
+extern PicoFlashDevice pico_flash;
+extern FlashKV flash_kv;
+
+#endif // FLASH_DEVICE_H
@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <string.h>
+#include "flash_kv.h"
+#include "crc32.h"
+
+static_assert(sizeof(kv_sector_header_t) == 16, "sector header layout");
+static_assert(sizeof(kv_record_header_t) == 12, "record header layout");
+
+// Constructor
+FlashKV::FlashKV(FlashDevice* device, uint32_t base_offset, int sector_count) {
+    this->device = device;
+    this->base_offset = base_offset;
+    this->sector_count = sector_count < MAX_SECTORS ? sector_count : MAX_SECTORS;
+    mounted = false;
+    sequence = 0;
+    active_sector = 0;
+    write_offset = 0;
+    memset(sector_sequence, 0, sizeof(sector_sequence));
+    key_count = 0;
+    erase_count = 0;
+    program_count = 0;
+}
+
+const kv_record_header_t* FlashKV::record_at(uint32_t offset) const {
+    return (const kv_record_header_t*)device->read_ptr(offset);
+}
+
+uint32_t FlashKV::record_size(const kv_record_header_t* header) {
+    return (sizeof(kv_record_header_t) + header->key_len + header->value_len + 3) & ~3u;
+}
+
+uint32_t FlashKV::key_hash(const char* key, size_t key_len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_crc(const kv_record_header_t* header, const void* key, const void* value) {
+    uint32_t crc = crc32(header, offsetof(kv_record_header_t, crc));
+    crc = crc32(key, header->key_len, crc);
+    return crc32(value, header->value_len, crc);
+}
+
+// Index position of a key, or -1
+int FlashKV::find(const char* key, size_t key_len) const {
+    uint32_t hash = key_hash(key, key_len);
+    for (int i = 0; i < key_count; i++) {
+        if (index[i].hash != hash) {
+            continue;
+        }
+        const kv_record_header_t* record = record_at(index[i].offset);
+        if (record->key_len == key_len && memcmp(record + 1, key, key_len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Make the record at offset the live one for its key
+void FlashKV::apply(uint32_t offset) {
+    const kv_record_header_t* record = record_at(offset);
+    const char* key = (const char*)(record + 1);
+    int i = find(key, record->key_len);
+
+    if (record->flags & FLAG_TOMBSTONE) {
+        if (i >= 0) {
+            memmove(&index[i], &index[i + 1], (key_count - i - 1) * sizeof(kv_index_entry_t));
+            key_count--;
+        }
+    } else if (i >= 0) {
+        index[i].offset = offset;
+    } else if (key_count < MAX_KEYS) {
+        index[key_count].hash = key_hash(key, record->key_len);
+        index[key_count].offset = offset;
+        key_count++;
+    }
+}
+
+// Program bytes at any offset, one page at a time. Bytes outside the range
+// are programmed as 0xFF, which leaves whatever is already there untouched.
+bool FlashKV::write_bytes(uint32_t offset, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t page[FlashDevice::PAGE_SIZE];
+
+    while (length > 0) {
+        uint32_t page_offset = offset & ~(FlashDevice::PAGE_SIZE - 1);
+        uint32_t start = offset - page_offset;
+        uint32_t count = FlashDevice::PAGE_SIZE - start;
+        if (count > length) {
+            count = length;
+        }
+
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page + start, bytes, count);
+        if (!device->program_page(page_offset, page)) {
+            return false;
+        }
+        program_count++;
+
+        offset += count;
+        bytes += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool FlashKV::erase(int sector) {
+    if (!device->erase_sector(sector_offset(sector))) {
+        return false;
+    }
+    erase_count++;
+    sector_sequence[sector] = 0;
+    return true;
+}
+
+// Stamp an erased sector as the new active one
+bool FlashKV::start_sector(int sector) {
+    kv_sector_header_t header;
+    header.magic = SECTOR_MAGIC;
+    header.sequence = sequence + 1;
+    header.crc = crc32(&header, offsetof(kv_sector_header_t, crc));
+    header.reserved = 0xFFFFFFFF;
+
+    if (!write_bytes(sector_offset(sector), &header, sizeof(header))) {
+        return false;
+    }
+    sequence++;
+    sector_sequence[sector] = sequence;
+    active_sector = sector;
+    write_offset = sizeof(kv_sector_header_t);
+    return true;
+}
+
+bool FlashKV::sector_erased(int sector) const {
+    const uint32_t* words = (const uint32_t*)device->read_ptr(sector_offset(sector));
+    for (uint32_t i = 0; i < FlashDevice::SECTOR_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int FlashKV::find_spare() const {
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (sector_sequence[sector] == 0 && sector != active_sector) {
+            return sector;
+        }
+    }
+    return -1;
+}
+
+int FlashKV::oldest_sector() const {
+    int oldest = -1;
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (sector_sequence[sector] != 0 && sector != active_sector &&
+            (oldest < 0 || sector_sequence[sector] < sector_sequence[oldest])) {
+            oldest = sector;
+        }
+    }
+    return oldest;
+}
+
+// Garbage collect a sector: copy its live records forward, then erase it.
+// Tombstones and superseded records are simply dropped.
+bool FlashKV::collect(int sector) {
+    uint32_t start = sector_offset(sector);
+    uint32_t end = start + FlashDevice::SECTOR_SIZE;
+
+    for (int i = 0; i < key_count; i++) {
+        if (index[i].offset < start || index[i].offset >= end) {
+            continue;
+        }
+        const kv_record_header_t* record = record_at(index[i].offset);
+        uint32_t size = record_size(record);
+        if (write_offset + size > FlashDevice::SECTOR_SIZE) {
+            return false;  // Live data no longer fits, store is over-full
+        }
+
+        uint32_t offset = sector_offset(active_sector) + write_offset;
+        if (!write_bytes(offset, record, size)) {
+            return false;
+        }
+        index[i].offset = offset;
+        write_offset += size;
+    }
+
+    return erase(sector);
+}
+
+// Make room for a record in the active sector
+bool FlashKV::reserve(uint32_t size) {
+    if (write_offset + size <= FlashDevice::SECTOR_SIZE) {
+        return true;
+    }
+
+    int spare = find_spare();
+    if (spare < 0 || !start_sector(spare)) {
+        return false;
+    }
+
+    // Always keep one erased sector for the next roll-over
+    if (find_spare() < 0) {
+        int oldest = oldest_sector();
+        if (oldest < 0 || !collect(oldest)) {
+            return false;
+        }
+    }
+
+    return write_offset + size <= FlashDevice::SECTOR_SIZE;
+}
+
+bool FlashKV::append(const kv_record_header_t* header, const void* key, const void* value) {
+    uint32_t size = record_size(header);
+    if (!reserve(size)) {
+        return false;
+    }
+
+    // Stream header, key and value through one page buffer so the record
+    // goes out in as few page programs as possible
+    const uint8_t* parts[3] = {(const uint8_t*)header, (const uint8_t*)key, (const uint8_t*)value};
+    const size_t lengths[3] = {sizeof(kv_record_header_t), header->key_len, header->value_len};
+    uint32_t offset = sector_offset(active_sector) + write_offset;
+    uint32_t page_offset = offset & ~(FlashDevice::PAGE_SIZE - 1);
+    uint32_t position = offset - page_offset;
+    uint8_t page[FlashDevice::PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+
+    for (int part = 0; part < 3; part++) {
+        for (size_t i = 0; i < lengths[part]; i++) {
+            page[position++] = parts[part][i];
+            if (position == FlashDevice::PAGE_SIZE) {
+                if (!device->program_page(page_offset, page)) {
+                    return false;
+                }
+                program_count++;
+                page_offset += FlashDevice::PAGE_SIZE;
+                position = 0;
+                memset(page, 0xFF, sizeof(page));
+            }
+        }
+    }
+    if (position > 0) {
+        if (!device->program_page(page_offset, page)) {
+            return false;
+        }
+        program_count++;
+    }
+    write_offset += size;
+    apply(offset);
+    return true;
+}
+
+// Replay one sector's records into the index, the active sector's log end
+// becomes write_offset. Returns false if the log ends in a torn record.
+bool FlashKV::scan_sector(int sector) {
+    uint32_t start = sector_offset(sector);
+    uint32_t end = start + FlashDevice::SECTOR_SIZE;
+    uint32_t offset = start + sizeof(kv_sector_header_t);
+    bool intact = true;
+
+    while (offset + sizeof(kv_record_header_t) <= end) {
+        const kv_record_header_t* record = record_at(offset);
+        if (record->magic == 0xFF) {
+            break;  // Erased, end of log
+        }
+
+        uint32_t size = record_size(record);
+        const uint8_t* key = (const uint8_t*)(record + 1);
+        if (record->magic != RECORD_MAGIC || record->key_len > MAX_KEY_LEN ||
+            size > end - offset || record->crc != record_crc(record, key, key + record->key_len)) {
+            // Torn write: nothing after this point can be trusted or programmed
+            offset = end;
+            intact = false;
+            break;
+        }
+
+        apply(offset);
+        offset += size;
+    }
+
+    if (sector == active_sector) {
+        write_offset = offset - start;
+    }
+    return intact;
+}
+
+// Find the sectors, rebuild the index and finish any interrupted collection
+bool FlashKV::mount() {
+    mounted = false;
+    key_count = 0;
+    sequence = 0;
+    active_sector = -1;
+
+    for (int sector = 0; sector < sector_count; sector++) {
+        const kv_sector_header_t* header = (const kv_sector_header_t*)device->read_ptr(sector_offset(sector));
+        sector_sequence[sector] = 0;
+
+        if (header->magic == SECTOR_MAGIC && header->sequence != 0 &&
+            header->crc == crc32(header, offsetof(kv_sector_header_t, crc))) {
+            sector_sequence[sector] = header->sequence;
+            if (header->sequence > sequence) {
+                sequence = header->sequence;
+                active_sector = sector;
+            }
+        } else if (!sector_erased(sector)) {
+            // Interrupted erase or header write
+            if (!erase(sector)) {
+                return false;
+            }
+        }
+    }
+
+    if (active_sector < 0) {
+        return format();
+    }
+
+    // Replay oldest to newest so later records win
+    uint32_t last = 0;
+    bool active_intact = true;
+    for (;;) {
+        int next = -1;
+        for (int sector = 0; sector < sector_count; sector++) {
+            if (sector_sequence[sector] > last &&
+                (next < 0 || sector_sequence[sector] < sector_sequence[next])) {
+                next = sector;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        if (!scan_sector(next) && next == active_sector) {
+            active_intact = false;
+        }
+        last = sector_sequence[next];
+    }
+
+    // Power lost between starting a sector and erasing the collected one
+    if (find_spare() < 0) {
+        // Cut partway through copying a record: the new sector is marked
+        // full and cannot take the rest, but it holds nothing the collected
+        // sector doesn't, so drop it and let the next roll-over collect again
+        if (!active_intact) {
+            if (!erase(active_sector)) {
+                return false;
+            }
+            return mount();
+        }
+        int oldest = oldest_sector();
+        if (oldest < 0 || !collect(oldest)) {
+            return false;
+        }
+    }
+
+    mounted = true;
+    return true;
+}
+
+bool FlashKV::format() {
+    mounted = false;
+    key_count = 0;
+    sequence = 0;
+
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (!sector_erased(sector) && !erase(sector)) {
+            return false;
+        }
+        sector_sequence[sector] = 0;
+    }
+
+    active_sector = 0;
+    if (!start_sector(0)) {
+        return false;
+    }
+    mounted = true;
+    return true;
+}
+
+// Pointer to the value in flash (not aligned), or NULL if the key is missing
+const void* FlashKV::get(const char* key, size_t* length) const {
+    int i = find(key, strlen(key));
+    if (i < 0) {
+        return NULL;
+    }
+    const kv_record_header_t* record = record_at(index[i].offset);
+    *length = record->value_len;
+    return (const uint8_t*)(record + 1) + record->key_len;
+}
+
+// Copy a fixed-size value out, fails if missing or the size differs
+bool FlashKV::read(const char* key, void* buffer, size_t length) const {
+    size_t stored_length;
+    const void* value = get(key, &stored_length);
+    if (value == NULL || stored_length != length) {
+        return false;
+    }
+    memcpy(buffer, value, length);
+    return true;
+}
+
+bool FlashKV::put(const char* key, const void* value, size_t length) {
+    size_t key_len = strlen(key);
+    if (!mounted || key_len == 0 || key_len > MAX_KEY_LEN || length > MAX_VALUE_LEN) {
+        return false;
+    }
+
+    // Rewriting an identical value would only wear the flash
+    size_t stored_length;
+    const void* stored = get(key, &stored_length);
+    if (stored != NULL && stored_length == length && memcmp(stored, value, length) == 0) {
+        return true;
+    }
+    if (stored == NULL && key_count >= MAX_KEYS) {
+        return false;
+    }
+
+    kv_record_header_t header;
+    header.magic = RECORD_MAGIC;
+    header.flags = 0;
+    header.key_len = (uint8_t)key_len;
+    header.reserved = 0xFF;
+    header.value_len = (uint16_t)length;
+    header.reserved2 = 0xFFFF;
+    header.crc = record_crc(&header, key, value);
+    return append(&header, key, value);
+}
+
+bool FlashKV::remove(const char* key) {
+    size_t key_len = strlen(key);
+    if (!mounted || find(key, key_len) < 0) {
+        return false;
+    }
+
+    kv_record_header_t header;
+    header.magic = RECORD_MAGIC;
+    header.flags = FLAG_TOMBSTONE;
+    header.key_len = (uint8_t)key_len;
+    header.reserved = 0xFF;
+    header.value_len = 0;
+    header.reserved2 = 0xFFFF;
+    header.crc = record_crc(&header, key, NULL);
+    return append(&header, key, NULL);
+}
+
+// Copy out the key at an index position, for iteration
+bool FlashKV::key_at(int position, char* key, size_t size) const {
+    if (position < 0 || position >= key_count || size == 0) {
+        return false;
+    }
+    const kv_record_header_t* record = record_at(index[position].offset);
+    size_t key_len = record->key_len < size - 1 ? record->key_len : size - 1;
+    memcpy(key, record + 1, key_len);
+    key[key_len] = '\0';
+    return true;
+}
+
+uint32_t FlashKV::getFreeBytes() const {
+    // One sector is always kept spare for collection
+    uint32_t capacity = (sector_count - 1) * (FlashDevice::SECTOR_SIZE - sizeof(kv_sector_header_t));
+    uint32_t live = 0;
+    for (int i = 0; i < key_count; i++) {
+        live += record_size(record_at(index[i].offset));
+    }
+    return live < capacity ? capacity - live : 0;
+}
+
+void FlashKV::print_stats() const {
+    printf("Flash KV store: %s\n", mounted ? "Mounted" : "Not mounted");
+    printf("  Sectors: %d at 0x%08lx, active %d (sequence %lu, %lu bytes used)\n",
+           sector_count, (unsigned long)base_offset, active_sector,
+           (unsigned long)sequence, (unsigned long)write_offset);
+    printf("  Keys: %d of %d, %lu bytes free\n", key_count, MAX_KEYS, (unsigned long)getFreeBytes());
+    printf("  Since boot: %lu sector erases, %lu page programs\n",
+           (unsigned long)erase_count, (unsigned long)program_count);
+}
@@ -0,0 +1,113 @@
+#ifndef FLASH_KV_H
+#define FLASH_KV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "flash_device.h"
+
+// Log-structured key/value store spread over a few flash sectors.
+//
+// Records are only ever appended, so a put costs one or two page programs
+// and a sector is erased only once it has filled up and its live records
+// have been copied forward. The newest record for a key wins; deletes
+// append a tombstone. A RAM index of live records is rebuilt by scanning
+// the log at mount, and values are read in place through the flash
+// device's memory map.
+//
+// Sector layout: kv_sector_header_t, then records back to back, each a
+// kv_record_header_t followed by the key and the value, padded to 4 bytes.
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;      // Increases every time a sector is started
+    uint32_t crc;           // CRC32 of magic and sequence
+    uint32_t reserved;
+} kv_sector_header_t;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t flags;
+    uint8_t key_len;
+    uint8_t reserved;
+    uint16_t value_len;
+    uint16_t reserved2;
+    uint32_t crc;           // CRC32 of the header up to here, the key and the value
+} kv_record_header_t;
+
+class FlashKV {
+private:
+    static const uint32_t SECTOR_MAGIC = 0x4B565331;  // "KVS1"
+    static const uint8_t RECORD_MAGIC = 0xA5;
+    static const uint8_t FLAG_TOMBSTONE = 0x01;
+    static const int MAX_SECTORS = 8;
+
+public:
+    static const int MAX_KEYS = 32;
+    static const int MAX_KEY_LEN = 47;
+    static const size_t MAX_VALUE_LEN = 1024;
+
+private:
+    // Live record for each key
+    typedef struct {
+        uint32_t hash;
+        uint32_t offset;
+    } kv_index_entry_t;
+
+    FlashDevice* device;
+    uint32_t base_offset;
+    int sector_count;
+
+    bool mounted;
+    uint32_t sequence;          // Sequence of the active sector
+    int active_sector;
+    uint32_t write_offset;      // Next free byte in the active sector
+    uint32_t sector_sequence[MAX_SECTORS];  // 0 = erased
+
+    kv_index_entry_t index[MAX_KEYS];
+    int key_count;
+
+    uint32_t erase_count;       // Sectors erased since boot
+    uint32_t program_count;     // Pages programmed since boot
+
+    uint32_t sector_offset(int sector) const { return base_offset + sector * FlashDevice::SECTOR_SIZE; }
+    const kv_record_header_t* record_at(uint32_t offset) const;
+    static uint32_t record_size(const kv_record_header_t* header);
+    static uint32_t key_hash(const char* key, size_t key_len);
+
+    int find(const char* key, size_t key_len) const;
+    void apply(uint32_t offset);
+    bool write_bytes(uint32_t offset, const void* data, size_t length);
+    bool erase(int sector);
+    bool start_sector(int sector);
+    bool scan_sector(int sector);
+    bool sector_erased(int sector) const;
+    int find_spare() const;
+    int oldest_sector() const;
+    bool collect(int sector);
+    bool reserve(uint32_t size);
+    bool append(const kv_record_header_t* header, const void* key, const void* value);
+
+public:
+    // Constructor
+    FlashKV(FlashDevice* device, uint32_t base_offset, int sector_count);
+
+    // Public interface
+    bool mount();
+    bool format();
+    const void* get(const char* key, size_t* length) const;
+    bool read(const char* key, void* buffer, size_t length) const;
+    bool put(const char* key, const void* value, size_t length);
+    bool remove(const char* key);
+    bool key_at(int position, char* key, size_t size) const;
+    void print_stats() const;
+
+    // Getter methods
+    bool isMounted() const { return mounted; }
+    int getKeyCount() const { return key_count; }
+    uint32_t getEraseCount() const { return erase_count; }
+    uint32_t getProgramCount() const { return program_count; }
+    uint32_t getFreeBytes() const;
+};
+
+#endif // FLASH_KV_H
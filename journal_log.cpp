@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h>
+#include "journal_log.h"
+#include "crc32.h"
+#include "memory.h"
+
+#ifdef JOURNAL_HOST
+// Host build: time comes from the caller
+static uint32_t mock_time_ms;
+
+void journal_set_mock_time(uint32_t time_ms) {
+    mock_time_ms = time_ms;
+}
+
+static uint32_t now_ms() {
+    return mock_time_ms;
+}
+#else
+#include "pico/stdlib.h"
+#include "sd_card.h"
+#include "sd_file.h"
+
+static uint32_t now_ms() {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static SDBlockRegion journal_region;
+static SDFile journal_file(&sd_card);
+#endif
+
+static_assert(sizeof(journal_page_header_t) == 20, "journal page header layout");
+static_assert(sizeof(journal_record_header_t) == 12, "journal record header layout");
+
+// Global instance
+JournalLog journal;
+static MemoryRegion memory_journal("journal", sizeof(JournalLog));
+
+static uint32_t align4(uint32_t length) {
+    return (length + 3) & ~3u;
+}
+
+// Constructor
+JournalLog::JournalLog() {
+    device = NULL;
+    unmount();
+    commits = 0;
+    pages_written = 0;
+    recovered_pages = 0;
+    write_errors = 0;
+}
+
+bool JournalLog::read_checkpoint(uint32_t slot, journal_checkpoint_t* checkpoint) {
+    if (!device->read_block(slot, scratch)) {
+        return false;
+    }
+    memcpy(checkpoint, scratch, sizeof(journal_checkpoint_t));
+    return checkpoint->magic == CHECKPOINT_MAGIC &&
+           checkpoint->crc == crc32(checkpoint, offsetof(journal_checkpoint_t, crc));
+}
+
+// Alternate between the two slots so a torn write leaves the previous one intact
+bool JournalLog::write_checkpoint() {
+    generation++;
+    journal_checkpoint_t checkpoint;
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    checkpoint.generation = generation;
+    checkpoint.epoch = epoch;
+    checkpoint.tail_page = tail_page;
+    checkpoint.page_sequence = next_page_sequence;
+    checkpoint.record_sequence = next_record_sequence;
+    checkpoint.crc = crc32(&checkpoint, offsetof(journal_checkpoint_t, crc));
+
+    memset(scratch, 0, PAGE_SIZE);
+    memcpy(scratch, &checkpoint, sizeof(checkpoint));
+    return device->write_blocks(generation % 2, scratch, 1);
+}
+
+bool JournalLog::page_valid(const uint8_t* page) const {
+    journal_page_header_t header;
+    memcpy(&header, page, sizeof(header));
+    if (header.magic != PAGE_MAGIC || header.record_count == 0) {
+        return false;
+    }
+    uint32_t crc = crc32(page, offsetof(journal_page_header_t, crc));
+    crc = crc32("\0\0\0\0", 4, crc);
+    crc = crc32(page + sizeof(header), PAGE_SIZE - sizeof(header), crc);
+    return crc == header.crc;
+}
+
+// Sequence following the last record in a page, checking each record on the way
+uint32_t JournalLog::last_record_sequence(const uint8_t* page) const {
+    const journal_page_header_t* header = (const journal_page_header_t*)page;
+    uint32_t offset = sizeof(journal_page_header_t);
+    uint32_t sequence = 0;
+    for (uint16_t i = 0; i < header->record_count; i++) {
+        const journal_record_header_t* record = (const journal_record_header_t*)(page + offset);
+        if (offset + sizeof(journal_record_header_t) + record->length > PAGE_SIZE) {
+            break;
+        }
+        uint32_t crc = crc32(record, offsetof(journal_record_header_t, crc));
+        if (crc32(record + 1, record->length, crc) != record->crc) {
+            break;
+        }
+        sequence = record->sequence + 1;
+        offset += align4(sizeof(journal_record_header_t) + record->length);
+    }
+    return sequence;
+}
+
+// Close the open page and move on to the next one in the batch
+void JournalLog::seal_page() {
+    uint8_t* page = batch[batch_pages];
+    memset(page + page_used, 0, PAGE_SIZE - page_used);
+
+    journal_page_header_t header;
+    header.magic = PAGE_MAGIC;
+    header.page_sequence = next_page_sequence++;
+    header.epoch = epoch;
+    header.record_count = page_records;
+    header.reserved = 0;
+    header.crc = 0;
+    memcpy(page, &header, sizeof(header));
+    header.crc = crc32(page, PAGE_SIZE);
+    memcpy(page, &header, sizeof(header));
+
+    batch_pages++;
+    page_used = sizeof(journal_page_header_t);
+    page_records = 0;
+}
+
+// Public interface
+bool JournalLog::format(BlockDevice* device) {
+    unmount();
+    if (device->block_count() <= DATA_START + JOURNAL_CHECKPOINT_PAGES + JOURNAL_BATCH_PAGES) {
+        return false;
+    }
+    this->device = device;
+    page_count = device->block_count() - DATA_START;
+
+    // Continue on from an earlier journal, skipping its sequence numbers so
+    // none of its pages can be mistaken for ours
+    journal_checkpoint_t old_checkpoint;
+    epoch = 1;
+    generation = 0;
+    next_page_sequence = 1;
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        if (read_checkpoint(slot, &old_checkpoint)) {
+            if (old_checkpoint.epoch >= epoch) {
+                epoch = old_checkpoint.epoch + 1;
+            }
+            if (old_checkpoint.generation > generation) {
+                generation = old_checkpoint.generation;
+            }
+            if (old_checkpoint.page_sequence + page_count + JOURNAL_BATCH_PAGES > next_page_sequence) {
+                next_page_sequence = old_checkpoint.page_sequence + page_count + JOURNAL_BATCH_PAGES;
+            }
+        }
+    }
+    tail_page = 0;
+    next_record_sequence = 1;
+
+    // Both slots, so an older checkpoint cannot win at the next mount
+    if (!write_checkpoint() || !write_checkpoint()) {
+        return false;
+    }
+    return mount(device);
+}
+
+bool JournalLog::mount(BlockDevice* device) {
+    unmount();
+    if (device->block_count() <= DATA_START + JOURNAL_CHECKPOINT_PAGES + JOURNAL_BATCH_PAGES) {
+        return false;
+    }
+    this->device = device;
+    page_count = device->block_count() - DATA_START;
+
+    journal_checkpoint_t checkpoints[2];
+    bool valid[2];
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        valid[slot] = read_checkpoint(slot, &checkpoints[slot]);
+    }
+    if (!valid[0] && !valid[1]) {
+        return false;
+    }
+    const journal_checkpoint_t* checkpoint = &checkpoints[1];
+    if (valid[0] && (!valid[1] || checkpoints[0].generation > checkpoints[1].generation)) {
+        checkpoint = &checkpoints[0];
+    }
+    epoch = checkpoint->epoch;
+    generation = checkpoint->generation;
+    tail_page = checkpoint->tail_page % page_count;
+    next_page_sequence = checkpoint->page_sequence;
+    next_record_sequence = checkpoint->record_sequence;
+
+    // Roll forward over batches committed since the checkpoint
+    recovered_pages = 0;
+    while (recovered_pages < JOURNAL_CHECKPOINT_PAGES + JOURNAL_BATCH_PAGES) {
+        if (!device->read_block(DATA_START + tail_page, scratch)) {
+            return false;
+        }
+        const journal_page_header_t* header = (const journal_page_header_t*)scratch;
+        if (!page_valid(scratch) || header->epoch != epoch || header->page_sequence != next_page_sequence) {
+            break;
+        }
+        uint32_t sequence = last_record_sequence(scratch);
+        if (sequence <= next_record_sequence) {
+            break;
+        }
+        next_record_sequence = sequence;
+        next_page_sequence++;
+        tail_page = (tail_page + 1) % page_count;
+        recovered_pages++;
+    }
+    committed_sequence = next_record_sequence;
+
+    // New epoch, so pages beyond the tail from a torn batch are never accepted
+    epoch++;
+    pages_since_checkpoint = 0;
+    if (!write_checkpoint()) {
+        return false;
+    }
+    mounted = true;
+    return true;
+}
+
+void JournalLog::unmount() {
+    mounted = false;
+    page_count = 0;
+    epoch = 0;
+    generation = 0;
+    tail_page = 0;
+    next_page_sequence = 0;
+    next_record_sequence = 0;
+    committed_sequence = 0;
+    pages_since_checkpoint = 0;
+    batch_pages = 0;
+    page_used = sizeof(journal_page_header_t);
+    page_records = 0;
+    pending_records = 0;
+    oldest_pending_ms = 0;
+    commit_records = JOURNAL_COMMIT_RECORDS;
+    commit_interval_ms = JOURNAL_COMMIT_INTERVAL_MS;
+}
+
+bool JournalLog::append(const void* data, size_t length, uint32_t* sequence) {
+    if (!mounted || length > MAX_RECORD_LEN) {
+        return false;
+    }
+
+    uint32_t needed = align4(sizeof(journal_record_header_t) + length);
+    if (page_used + needed > PAGE_SIZE) {
+        seal_page();
+    }
+    if (batch_pages == JOURNAL_BATCH_PAGES && !flush()) {
+        return false;
+    }
+
+    journal_record_header_t header;
+    header.sequence = next_record_sequence;
+    header.length = (uint16_t)length;
+    header.reserved = 0;
+    header.crc = crc32(data, length, crc32(&header, offsetof(journal_record_header_t, crc)));
+
+    uint8_t* page = batch[batch_pages];
+    memcpy(page + page_used, &header, sizeof(header));
+    memcpy(page + page_used + sizeof(header), data, length);
+    memset(page + page_used + sizeof(header) + length, 0, needed - sizeof(header) - length);
+    page_used += needed;
+    page_records++;
+
+    if (sequence != NULL) {
+        *sequence = next_record_sequence;
+    }
+    next_record_sequence++;
+    if (pending_records++ == 0) {
+        oldest_pending_ms = now_ms();
+    }
+
+    // A failed commit is retried by the next append, poll or flush
+    if (pending_records >= commit_records) {
+        flush();
+    }
+    return true;
+}
+
+// Write the batch, including a partly filled page, in one multi-block write
+bool JournalLog::flush() {
+    if (!mounted) {
+        return false;
+    }
+    if (page_records > 0) {
+        seal_page();
+    }
+    if (batch_pages == 0) {
+        return true;
+    }
+
+    uint32_t first = page_count - tail_page;
+    if (first > batch_pages) {
+        first = batch_pages;
+    }
+    bool success = device->write_blocks(DATA_START + tail_page, batch[0], first);
+    if (success && first < batch_pages) {
+        success = device->write_blocks(DATA_START, batch[first], batch_pages - first);
+    }
+    if (!success) {
+        write_errors++;
+        return false;
+    }
+
+    tail_page = (tail_page + batch_pages) % page_count;
+    pages_written += batch_pages;
+    pages_since_checkpoint += batch_pages;
+    commits++;
+    batch_pages = 0;
+    pending_records = 0;
+    committed_sequence = next_record_sequence;
+
+    // Keeps the roll forward at mount short
+    if (pages_since_checkpoint >= JOURNAL_CHECKPOINT_PAGES) {
+        if (!write_checkpoint()) {
+            write_errors++;
+            return false;
+        }
+        pages_since_checkpoint = 0;
+    }
+    return true;
+}
+
+void JournalLog::poll() {
+    if (mounted && pending_records > 0 && now_ms() - oldest_pending_ms >= commit_interval_ms) {
+        flush();
+    }
+}
+
+uint32_t JournalLog::getCommitDelayMs() const {
+    if (!mounted || pending_records == 0) {
+        return UINT32_MAX;
+    }
+    uint32_t waited = now_ms() - oldest_pending_ms;
+    return waited >= commit_interval_ms ? 0 : commit_interval_ms - waited;
+}
+
+void JournalLog::set_commit_policy(uint32_t records, uint32_t interval_ms) {
+    commit_records = records > 0 ? records : 1;
+    commit_interval_ms = interval_ms;
+}
+
+// Walk committed records oldest first, returns how many were found
+uint32_t JournalLog::read_all(void (*callback)(uint32_t sequence, const uint8_t* data, size_t length, void* context), void* context) {
+    if (!mounted) {
+        return 0;
+    }
+
+    uint32_t found = 0;
+    uint32_t last_sequence = 0;
+    for (uint32_t i = 0; i < page_count; i++) {
+        uint32_t index = (tail_page + i) % page_count;
+        if (!device->read_block(DATA_START + index, scratch) || !page_valid(scratch)) {
+            continue;
+        }
+
+        // Only pages from the current lap of the ring
+        const journal_page_header_t* header = (const journal_page_header_t*)scratch;
+        if (next_page_sequence - 1 - header->page_sequence >= page_count) {
+            continue;
+        }
+
+        uint32_t offset = sizeof(journal_page_header_t);
+        for (uint16_t r = 0; r < header->record_count; r++) {
+            const journal_record_header_t* record = (const journal_record_header_t*)(scratch + offset);
+            if (offset + sizeof(journal_record_header_t) + record->length > PAGE_SIZE) {
+                break;
+            }
+            uint32_t crc = crc32(record, offsetof(journal_record_header_t, crc));
+            if (crc32(record + 1, record->length, crc) != record->crc) {
+                break;
+            }
+            if (found == 0 || record->sequence > last_sequence) {
+                callback(record->sequence, (const uint8_t*)(record + 1), record->length, context);
+                last_sequence = record->sequence;
+                found++;
+            }
+            offset += align4(sizeof(journal_record_header_t) + record->length);
+        }
+    }
+    return found;
+}
+
+void JournalLog::print_stats() {
+    if (!mounted) {
+        printf("Journal: not mounted\n");
+        return;
+    }
+    printf("Journal: %lu pages, tail at page %lu, epoch %lu\n",
+           (unsigned long)page_count, (unsigned long)tail_page, (unsigned long)epoch);
+    printf("  Records: next %lu, committed below %lu, %lu pending\n",
+           (unsigned long)next_record_sequence, (unsigned long)committed_sequence, (unsigned long)pending_records);
+    printf("  Group commit: every %lu records or %lu ms, %lu commits, %lu pages written\n",
+           (unsigned long)commit_records, (unsigned long)commit_interval_ms,
+           (unsigned long)commits, (unsigned long)pages_written);
+    printf("  Recovery rolled forward %lu pages, %lu write errors\n",
+           (unsigned long)recovered_pages, (unsigned long)write_errors);
+}
+
+#ifndef JOURNAL_HOST
+// Mount the journal kept in a preallocated file, formatting it if asked or
+// if the file holds no journal yet
+bool JournalLog::open_file(const char* filename, uint32_t length, bool reformat) {
+    if (mounted) {
+        flush();
+        unmount();
+    }
+    if (!sd_card.isInitialized()) {
+        printf("SD card not initialized. Use 'sd_init' first.\n");
+        return false;
+    }
+    if (!journal_file.preallocate(filename, length)) {
+        printf("Could not preallocate %s (card full, or an existing file is too small or fragmented)\n", filename);
+        return false;
+    }
+    journal_region.setRegion(journal_file.getFirstSector(), journal_file.getSize() / PAGE_SIZE);
+    journal_file.close();
+
+    if (!reformat && mount(&journal_region)) {
+        printf("Journal mounted, %lu pages rolled forward, next record %lu\n",
+               (unsigned long)recovered_pages, (unsigned long)next_record_sequence);
+        return true;
+    }
+    if (format(&journal_region)) {
+        printf("Journal formatted in %s\n", filename);
+        return true;
+    }
+    printf("Failed to format journal\n");
+    return false;
+}
+#endif
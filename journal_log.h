@@ -0,0 +1,146 @@
+#ifndef JOURNAL_LOG_H
+#define JOURNAL_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "block_device.h"
+
+// Crash-safe append-only record log on a block device
+//
+// The device is a preallocated region, so appending never touches the FAT
+// or a directory entry. Blocks 0 and 1 hold checkpoints written alternately;
+// the rest is a ring of 512-byte pages. Records are packed into pages in
+// RAM and written a batch at a time (group commit) once enough records are
+// pending, enough time has passed, or the batch is full. A sealed page is
+// never rewritten until the ring wraps, so a power cut can only lose the
+// batch being written.
+//
+// Mounting reads the newer checkpoint and scans forward from its tail only
+// while pages carry the next sequence number and the checkpoint's epoch, so
+// recovery reads at most JOURNAL_CHECKPOINT_PAGES + JOURNAL_BATCH_PAGES
+// pages whatever the log size. Each mount starts a new epoch, which keeps
+// pages left over from a torn batch from being picked up later.
+//
+// Page layout: journal_page_header_t, then records back to back, each a
+// journal_record_header_t followed by the data, padded to 4 bytes.
+//
+// Building with JOURNAL_HOST replaces the clock with journal_set_mock_time()
+// so the format can be tested on a PC against a RAM device.
+
+#define JOURNAL_BATCH_PAGES 8           // Pages per group commit write
+#define JOURNAL_CHECKPOINT_PAGES 64     // Pages between checkpoints, bounds recovery
+#define JOURNAL_COMMIT_RECORDS 32       // Default group commit size
+#define JOURNAL_COMMIT_INTERVAL_MS 100  // Default longest time a record waits for commit
+#define JOURNAL_FILE_SIZE (1024u * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t page_sequence;     // Consecutive over the life of the log
+    uint32_t epoch;             // Mount count when the page was written
+    uint16_t record_count;
+    uint16_t reserved;
+    uint32_t crc;               // CRC32 of the whole page with this field zeroed
+} journal_page_header_t;
+
+typedef struct {
+    uint32_t sequence;          // Consecutive over the life of the log
+    uint16_t length;
+    uint16_t reserved;
+    uint32_t crc;               // CRC32 of sequence, length and the data
+} journal_record_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;        // The newer of the two valid checkpoints wins
+    uint32_t epoch;
+    uint32_t tail_page;         // Next page to write
+    uint32_t page_sequence;     // Sequence of that page
+    uint32_t record_sequence;   // Next record sequence
+    uint32_t crc;
+} journal_checkpoint_t;
+
+class JournalLog {
+public:
+    static const uint32_t PAGE_SIZE = BlockDevice::BLOCK_SIZE;
+    static const uint32_t MAX_RECORD_LEN = PAGE_SIZE - sizeof(journal_page_header_t) - sizeof(journal_record_header_t);
+
+private:
+    static const uint32_t PAGE_MAGIC = 0x314C4E4A;        // "JNL1"
+    static const uint32_t CHECKPOINT_MAGIC = 0x504B434A;  // "JCKP"
+    static const uint32_t DATA_START = 2;                 // After the checkpoint blocks
+
+    BlockDevice* device;
+    bool mounted;
+    uint32_t page_count;
+
+    // Position, from the last checkpoint plus recovery
+    uint32_t epoch;
+    uint32_t generation;
+    uint32_t tail_page;
+    uint32_t next_page_sequence;
+    uint32_t next_record_sequence;
+    uint32_t committed_sequence;        // Records below this are on the card
+    uint32_t pages_since_checkpoint;
+
+    // Group commit batch, pages [0, batch_pages) are sealed
+    uint8_t batch[JOURNAL_BATCH_PAGES][PAGE_SIZE];
+    uint32_t batch_pages;
+    uint32_t page_used;                 // Bytes used in the open page
+    uint16_t page_records;
+    uint32_t pending_records;
+    uint32_t oldest_pending_ms;
+    uint32_t commit_records;
+    uint32_t commit_interval_ms;
+
+    // Scratch page for mount and reads
+    uint8_t scratch[PAGE_SIZE];
+
+    // Statistics
+    uint32_t commits;
+    uint32_t pages_written;
+    uint32_t recovered_pages;
+    uint32_t write_errors;
+
+    bool read_checkpoint(uint32_t slot, journal_checkpoint_t* checkpoint);
+    bool write_checkpoint();
+    bool page_valid(const uint8_t* page) const;
+    uint32_t last_record_sequence(const uint8_t* page) const;
+    void seal_page();
+
+public:
+    // Constructor
+    JournalLog();
+
+    // Public interface
+    bool format(BlockDevice* device);
+    bool mount(BlockDevice* device);
+    void unmount();
+    bool append(const void* data, size_t length, uint32_t* sequence = NULL);
+    bool flush();
+    void poll();
+    void set_commit_policy(uint32_t records, uint32_t interval_ms);
+    uint32_t read_all(void (*callback)(uint32_t sequence, const uint8_t* data, size_t length, void* context), void* context);
+    void print_stats();
+#ifndef JOURNAL_HOST
+    bool open_file(const char* filename, uint32_t length, bool reformat);
+#endif
+
+    // Getter methods
+    bool isMounted() const { return mounted; }
+    uint32_t getNextSequence() const { return next_record_sequence; }
+    uint32_t getCommittedSequence() const { return committed_sequence; }
+    uint32_t getPendingRecords() const { return pending_records; }
+    uint32_t getRecoveredPages() const { return recovered_pages; }
+    uint32_t getCommits() const { return commits; }
+    uint32_t getCommitDelayMs() const;      // Until poll() commits the pending records, UINT32_MAX when none
+};
+
+#ifdef JOURNAL_HOST
+void journal_set_mock_time(uint32_t time_ms);
+#endif
+
+// Global instance
+extern JournalLog journal;
+
+#endif // JOURNAL_LOG_H
@@ -0,0 +1,181 @@
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     // The block must end with at least this many literals
+#define MATCH_LIMIT 12      // No match may start closer than this to the end
+#define SKIP_TRIGGER 5      // Probe further apart after 2^n misses in a row
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Length fields above 15 continue in 255-valued bytes
+static uint8_t* write_length(uint8_t* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// One sequence: token, literals, then a match unless this is the last sequence
+static uint8_t* write_sequence(uint8_t* out, const uint8_t* out_end, const uint8_t* literals,
+                               size_t literal_length, size_t offset, size_t match_length) {
+    // Token, extra length bytes, literals, offset and extra match length bytes
+    size_t needed = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+    if ((size_t)(out_end - out) < needed) {
+        return NULL;
+    }
+
+    uint8_t* token = out++;
+    *token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15) {
+        out = write_length(out, literal_length - 15);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length == 0) {
+        return out;
+    }
+    *out++ = offset & 0xFF;
+    *out++ = (offset >> 8) & 0xFF;
+    size_t extra = match_length - MIN_MATCH;
+    *token |= extra >= 15 ? 15 : extra;
+    if (extra >= 15) {
+        out = write_length(out, extra - 15);
+    }
+    return out;
+}
+
+size_t lz4_compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity, lz4_state_t* state) {
+    if (length > LZ4_MAX_INPUT) {
+        return 0;
+    }
+
+    const uint8_t* end = src + length;
+    const uint8_t* anchor = src;
+    uint8_t* out = dst;
+    const uint8_t* out_end = dst + capacity;
+
+    if (length > MATCH_LIMIT) {
+        const uint8_t* match_limit = end - MATCH_LIMIT;
+        memset(state->table, 0, sizeof(state->table));
+        const uint8_t* ip = src;
+        uint32_t misses = 0;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash(sequence);
+            const uint8_t* ref = src + state->table[h];
+            state->table[h] = (uint16_t)(ip - src);
+
+            if (ref >= ip || read32(ref) != sequence) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // Extend backwards over literals, then forwards up to the last literals
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* match_end = ip + MIN_MATCH;
+            const uint8_t* ref_end = ref + MIN_MATCH;
+            while (match_end < end - LAST_LITERALS && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            out = write_sequence(out, out_end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (out == NULL) {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+
+            // Seed the table inside the match so the next search has something to find
+            if (ip - 2 > src) {
+                state->table[hash(read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    out = write_sequence(out, out_end, anchor, end - anchor, 0, 0);
+    return out == NULL ? 0 : (size_t)(out - dst);
+}
+
+int lz4_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + length;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + capacity;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= end) {
+                    return -1;
+                }
+                byte = *ip++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if ((size_t)(end - ip) < literal_length || (size_t)(op_end - op) < literal_length) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // The last sequence has no match
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_length = (token & 0x0F) + MIN_MATCH;
+        if ((token & 0x0F) == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= end) {
+                    return -1;
+                }
+                byte = *ip++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        if ((size_t)(op_end - op) < match_length) {
+            return -1;
+        }
+
+        // Byte by byte, matches may overlap their own output
+        const uint8_t* match = op - offset;
+        for (size_t i = 0; i < match_length; i++) {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return (int)(op - dst);
+}
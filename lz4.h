@@ -0,0 +1,30 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// LZ4 block format compressor and decompressor, compatible with the
+// reference LZ4_decompress_safe() so files can be read with stock tools.
+//
+// Greedy single-probe matching through a 4096-entry hash table of 16-bit
+// positions held in caller-supplied state, so there is no heap use and
+// inputs are limited to 64 KB, which is also the match window.
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MAX_INPUT 65535
+
+typedef struct {
+    uint16_t table[1 << LZ4_HASH_BITS];
+} lz4_state_t;
+
+// Worst case output size for an incompressible input
+#define LZ4_COMPRESS_BOUND(length) ((length) + (length) / 255 + 16)
+
+// Returns the compressed size, or 0 if the input is too long or the output does not fit
+size_t lz4_compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity, lz4_state_t* state);
+
+// Returns the decompressed size, or -1 if the input is malformed or the output does not fit
+int lz4_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+
+#endif // LZ4_H
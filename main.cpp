@@ -3,30 +3,35 @@
 #include "pico/cyw43_arch.h"
 #include "pico/bootrom.h"
 #include <string.h>
+#include <stdlib.h>
 #include "lwip/netif.h"
 #include "lwip/ip4_addr.h"
 #include "cyw43.h"
 #include "lwip/init.h"
 #include "pico/multicore.h"
-#include <map>
-#include <string>
-#include "hardware/flash.h"
-#include "hardware/sync.h"
+#include "pico/flash.h"
+#include "hardware/watchdog.h"
 #include "sd_card.h"
-
-// Flash storage configuration
-#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
-#define FLASH_CREDENTIALS_MAGIC 0x57494649  // "WIFI" in hex
-#define MAX_SSID_LEN 32
-#define MAX_PASSWORD_LEN 64
-
-// WiFi credentials structure
-typedef struct {
-    uint32_t magic;
-    char ssid[MAX_SSID_LEN];
-    char password[MAX_PASSWORD_LEN];
-    uint32_t checksum;
-} wifi_credentials_t;
+#include "sd_file.h"
+#include "wifi_credentials.h"
+#include "wifi_manager.h"
+#include "wifi_scan.h"
+#include "flash_device.h"
+#include "flash_kv.h"
+#include "trace.h"
+#include "perf.h"
+#include "cli.h"
+#include "console.h"
+#include "data_logger.h"
+#include "journal_log.h"
+#include "usb_device.h"
+#include "usb_msc.h"
+#include "boot.h"
+#include "ota.h"
+#include "memory.h"
+#include "power.h"
+#include "scheduler.h"
+#include "event_log.h"
 
 // Global variables
 // Command buffer
@@ -34,147 +39,99 @@ typedef struct {
 char cmd_buffer[MAX_CMD_LEN];
 int cmd_pos = 0;
 
-// LED control
-volatile bool led_blinking = false;
-volatile uint32_t led_interval_ms = 500;  // Default 500ms interval
+// Main loop iteration time
+static PerfHistogram perf_loop_us("main.loop_us");
+
+// lwIP keeps its own heap for pbufs and control blocks
+static MemoryRegion memory_lwip("lwip.heap", MEM_SIZE);
+
+// Size of the file preallocated by 'log start'
+#define LOG_FILE_SIZE (64u * 1024 * 1024)
 
-// WiFi state
-bool wifi_initialized = false;
+// Logger ring size in blocks, read at boot
+#define LOG_RING_KEY "log:ring"
+
+// LED control, blinking is a periodic task
+#define LED_BLINK_INTERVAL_MS 500
+static bool led_on = true;
+static int led_task = -1;
+
+// Health check, warns once when a stack or the heap runs low
+#define HEALTH_INTERVAL_MS 5000
+#define HEALTH_STACK_MARGIN 256     // Bytes never touched at the bottom of a stack
+#define HEALTH_HEAP_MARGIN 4096     // Bytes sbrk can still hand out
+static int health_task = -1;
 
 // SD Card state - now using the class instance
 extern SDCard sd_card;
 
-// Flash storage functions
-uint32_t calculate_checksum(const wifi_credentials_t* creds) {
-    uint32_t checksum = 0;
-    const uint8_t* data = (const uint8_t*)creds;
-    for (size_t i = 0; i < sizeof(wifi_credentials_t) - sizeof(uint32_t); i++) {
-        checksum += data[i];
-    }
-    return checksum;
-}
-
-bool save_wifi_credentials(const char* ssid, const char* password) {
-    wifi_credentials_t creds;
-    creds.magic = FLASH_CREDENTIALS_MAGIC;
-    strncpy(creds.ssid, ssid, MAX_SSID_LEN - 1);
-    creds.ssid[MAX_SSID_LEN - 1] = '\0';
-    strncpy(creds.password, password, MAX_PASSWORD_LEN - 1);
-    creds.password[MAX_PASSWORD_LEN - 1] = '\0';
-    creds.checksum = calculate_checksum(&creds);
-    
-    // Disable interrupts during flash write
-    uint32_t ints = save_and_disable_interrupts();
-    
-    // Erase the flash sector
-    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
-    
-    // Write the credentials
-    flash_range_program(FLASH_TARGET_OFFSET, (const uint8_t*)&creds, sizeof(wifi_credentials_t));
-    
-    // Restore interrupts
-    restore_interrupts(ints);
+// Core 1 entry point
+void core1_entry() {
+    // Let flash writes on core 0 park this core in RAM while XIP is unavailable
+    flash_safe_execute_core_init();
     
-    // Verify the write
-    const wifi_credentials_t* stored = (const wifi_credentials_t*)(XIP_BASE + FLASH_TARGET_OFFSET);
-    if (stored->magic == FLASH_CREDENTIALS_MAGIC && 
-        stored->checksum == calculate_checksum(stored)) {
-        return true;
+    // Core 1 runs the data logger front end: arming the ADC, packing DMA buffers in
+    // its interrupt and compressing frames when enabled. It sleeps in between, the
+    // DMA interrupt or an SEV from start() and stop() on core 0 wakes it.
+    while (true) {
+        data_logger.core1_poll();
+        __wfe();
     }
-    
-    return false;
 }
 
-bool load_wifi_credentials(char* ssid, char* password) {
-    const wifi_credentials_t* stored = (const wifi_credentials_t*)(XIP_BASE + FLASH_TARGET_OFFSET);
-    
-    // Check magic number and checksum
-    if (stored->magic != FLASH_CREDENTIALS_MAGIC) {
-        return false;
-    }
-    
-    if (stored->checksum != calculate_checksum(stored)) {
-        return false;
-    }
-    
-    // Copy credentials
-    strncpy(ssid, stored->ssid, MAX_SSID_LEN);
-    strncpy(password, stored->password, MAX_PASSWORD_LEN);
-    
-    return true;
+// Command handlers
+void handle_help(const char* command);
+void handle_run(const char* filename);
+void handle_autorun(const char* filename);
+
+static void set_led(bool on) {
+    led_on = on;
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, on);
 }
 
-bool clear_wifi_credentials() {
-    // Disable interrupts during flash write
-    uint32_t ints = save_and_disable_interrupts();
-    
-    // Erase the flash sector
-    flash_range_erase(FLASH_TARGET_OFFSET, FLASH_SECTOR_SIZE);
-    
-    // Restore interrupts
-    restore_interrupts(ints);
-    
-    return true;
+static void led_blink_task(void*) {
+    set_led(!led_on);
 }
 
-// Core 1 entry point
-void core1_entry() {
-    while (true) {
-        if (led_blinking) {
-            //cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, !cyw43_arch_gpio_get(CYW43_WL_GPIO_LED_PIN));
+static void health_check_task(void*) {
+    static bool stack_warned[2];
+    static bool heap_warned;
+
+    for (int core = 0; core < 2; core++) {
+        if (!stack_warned[core] && memory_stack_size(core) - memory_stack_used(core) < HEALTH_STACK_MARGIN) {
+            printf("\nHealth: core %d stack nearly full, %lu of %lu bytes used\n", core,
+                   (unsigned long)memory_stack_used(core), (unsigned long)memory_stack_size(core));
+            event_log.record(EVENT_STACK_LOW, core, memory_stack_used(core));
+            stack_warned[core] = true;
         }
-        sleep_ms(led_interval_ms);
+    }
+    if (!heap_warned && memory_heap_free() < HEALTH_HEAP_MARGIN) {
+        printf("\nHealth: heap nearly exhausted, %lu bytes left\n", (unsigned long)memory_heap_free());
+        event_log.record(EVENT_HEAP_LOW, memory_heap_free());
+        heap_warned = true;
     }
 }
 
-// Command handlers
-void handle_help() {
-    printf("\nAvailable commands:\n");
-    printf("  help    - Show this help message\n");
-    printf("  led on  - Turn LED on\n");
-    printf("  led off - Turn LED off\n");
-    printf("  led blink - Start LED blinking (500ms interval)\n");
-    printf("  led blink <interval_ms> - Start LED blinking with custom interval\n");
-    printf("  status  - Show system status\n");
-    printf("  clear   - Clear screen\n");
-    printf("  exit    - Enter bootloader mode for programming\n");
-    printf("  ssid    - Scan for WiFi networks\n");
-    printf("  wifi    - Connect using saved WiFi credentials\n");
-    printf("  wifi <ssid> <password> - Connect with provided credentials\n");
-    printf("  save <ssid> <password> - Save WiFi credentials to flash\n");
-    printf("  load    - Load and connect using saved credentials\n");
-    printf("  clear_creds - Clear saved WiFi credentials\n");
-    printf("  sd_init - Initialize SD card and mount FAT32 filesystem\n");
-    printf("  sd_ls   - List files and directories on SD card\n");
-    printf("  sd_cat <file> - Display file contents from SD card\n");
-    printf("  sd_write <file> <content> - Write text to file on SD card\n");
-    printf("  sd_test - Test SPI communication with SD card\n");
-    printf("  sd_format - Format SD card with FAT32 filesystem\n");
-}
-
-void handle_led(const char* state) {
+void handle_led(const char* state, const char* interval_ms) {
     if (strcmp(state, "on") == 0) {
-        led_blinking = false;
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
+        scheduler.stop(led_task);
+        set_led(true);
         printf("LED turned ON\n");
     } else if (strcmp(state, "off") == 0) {
-        led_blinking = false;
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
+        scheduler.stop(led_task);
+        set_led(false);
         printf("LED turned OFF\n");
-    } else if (strcmp(state, "blink") == 0) {
-        led_blinking = true;
+    } else if (strcmp(state, "blink") == 0 && strlen(interval_ms) == 0) {
+        scheduler.start(led_task, LED_BLINK_INTERVAL_MS);
         printf("LED blinking started\n");
-    } else if (strncmp(state, "blink", 5) == 0) {
-        // Parse interval if provided (e.g., "blink 1000")
-        int interval = 500;  // default 500ms
-        sscanf(state + 5, "%d", &interval);
+    } else if (strcmp(state, "blink") == 0) {
+        int interval = atoi(interval_ms);
         if (interval > 0) {
-            led_interval_ms = interval;
-            led_blinking = true;
+            scheduler.start(led_task, interval);
             printf("LED blinking started with %dms interval\n", interval);
         } else {
-            printf("Invalid interval. Using default 500ms\n");
-            led_blinking = true;
+            printf("Invalid interval. Using default %dms\n", LED_BLINK_INTERVAL_MS);
+            scheduler.start(led_task, LED_BLINK_INTERVAL_MS);
         }
     } else {
         printf("Invalid LED state. Use 'on', 'off', 'blink', or 'blink <interval_ms>'\n");
@@ -183,7 +140,11 @@ void handle_led(const char* state) {
 
 void handle_status() {
     printf("\nSystem Status:\n");
-    printf("  LED State: %s\n", cyw43_arch_gpio_get(CYW43_WL_GPIO_LED_PIN) ? "ON" : "OFF");
+    if (scheduler.isRunning(led_task)) {
+        printf("  LED State: blinking every %lu ms\n", (unsigned long)scheduler.getInterval(led_task));
+    } else {
+        printf("  LED State: %s\n", led_on ? "ON" : "OFF");
+    }
     
     // WiFi status
     int wifi_status = cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA);
@@ -212,6 +173,13 @@ void handle_status() {
             break;
     }
     printf("  WiFi Status: %s (code: %d)\n", status_str, wifi_status);
+    printf("  WiFi Manager: %s for %llu ms",
+           WiFiManager::state_name(wifi_manager.getState()),
+           (unsigned long long)(wifi_manager.getStateTime() / 1000));
+    if (wifi_manager.getAttempts() > 0) {
+        printf(" (attempt %lu)", (unsigned long)wifi_manager.getAttempts());
+    }
+    printf("\n");
     
     if (wifi_status == CYW43_LINK_UP || wifi_status == CYW43_LINK_JOIN) {
         // Get IP address
@@ -248,125 +216,103 @@ void handle_status() {
         printf("  FAT32 Filesystem: Mounted\n");
         printf("  Sectors per cluster: %d\n", sd_card.getSectorsPerCluster());
     }
+    if (sd_card2.isInitialized()) {
+        printf("  Second SD Card: %lu MB, log runs are striped across both\n", (unsigned long)(sd_card2.getSize() / 2048));
+    }
+    
+    // Main loop latency, excluding the idle sleep
+    perf_histogram_snapshot_t loop;
+    perf_loop_us.snapshot(&loop);
+    printf("  Main Loop: p50 %lu us, p99 %lu us, max %lu us (see 'perf')\n",
+           (unsigned long)perf_histogram_percentile(&loop, 50),
+           (unsigned long)perf_histogram_percentile(&loop, 99),
+           (unsigned long)loop.max);
+    printf("  Console: %u bytes queued, %lu dropped\n",
+           (unsigned)console_pending(), (unsigned long)console_dropped());
+    printf("  USB Mass Storage: %s\n", usb_msc.isExported() ? "SD card exported" : "Off");
+    printf("  RAM: %lu bytes free, stacks %lu/%lu and %lu/%lu bytes (see 'mem')\n",
+           (unsigned long)memory_heap_free(),
+           (unsigned long)memory_stack_used(0), (unsigned long)memory_stack_size(0),
+           (unsigned long)memory_stack_used(1), (unsigned long)memory_stack_size(1));
+    printf("  OTA: %s\n", OtaReceiver::state_name(ota.getState()));
+    printf("  Power: %lu%% idle, radio power save %s (see 'power')\n",
+           (unsigned long)power.getIdlePercent(), PowerManager::policy_name(power.getPolicy()));
+    printf("  Boot: prompt at %lu ms, %s (see 'boot')\n",
+           (unsigned long)(boot.getPhaseTime(BOOT_PHASE_PROMPT) / 1000),
+           boot.isComplete() ? "complete" : "tasks running");
 }
 
 void handle_clear() {
     printf("\033[2J\033[H");  // ANSI escape sequence to clear screen
 }
 
+void handle_events(const char* action) {
+    if (strcmp(action, "stats") == 0) {
+        event_log.print_stats();
+    } else if (strcmp(action, "clear") == 0) {
+        if (event_log.format()) {
+            printf("Event log cleared\n");
+        } else {
+            printf("Failed to clear event log\n");
+        }
+    } else {
+        event_log.dump();
+    }
+}
+
 void handle_exit() {
     printf("\nEntering bootloader mode...\n");
     printf("Device will now appear as a USB mass storage device.\n");
     printf("You can now program it using picotool or drag-and-drop UF2 files.\n");
+    console_flush(CONSOLE_BLOCK_TIMEOUT_US);
+    event_log.record(EVENT_REBOOT, 0);
+    event_log.flush();
     sleep_ms(1000);  // Give time for the message to be sent
     reset_usb_boot(0, 0);  // Enter bootloader mode
 }
 
 // WiFi configuration
 
+static bool check_credential_lengths(const char* ssid, const char* password) {
+    if (strlen(ssid) >= MAX_SSID_LEN) {
+        printf("Error: SSID longer than %d characters\n", MAX_SSID_LEN - 1);
+        return false;
+    }
+    if (strlen(password) >= MAX_PASSWORD_LEN) {
+        printf("Error: Password longer than %d characters\n", MAX_PASSWORD_LEN - 1);
+        return false;
+    }
+    return true;
+}
+
 void handle_wifi(const char* ssid, const char* password) {
-    char actual_ssid[MAX_SSID_LEN];
-    char actual_password[MAX_PASSWORD_LEN];
-    bool using_saved_creds = false;
-    
-    // If no arguments provided, try to load saved credentials
+    // If no arguments provided, pick the best saved network
     if (strlen(ssid) == 0 || strlen(password) == 0) {
-        if (load_wifi_credentials(actual_ssid, actual_password)) {
-            printf("Using saved WiFi credentials for network: %s\n", actual_ssid);
-            using_saved_creds = true;
-        } else {
+        if (count_wifi_credentials() == 0) {
             printf("Error: No saved WiFi credentials found and no credentials provided\n");
             printf("Usage: wifi <ssid> <password> - Connect with provided credentials\n");
-            printf("       wifi - Connect using saved credentials\n");
+            printf("       wifi - Connect to the strongest saved network\n");
             printf("Use 'save <ssid> <password>' to store credentials first.\n");
             return;
         }
-    } else {
-        // Use provided credentials
-        strncpy(actual_ssid, ssid, MAX_SSID_LEN - 1);
-        actual_ssid[MAX_SSID_LEN - 1] = '\0';
-        strncpy(actual_password, password, MAX_PASSWORD_LEN - 1);
-        actual_password[MAX_PASSWORD_LEN - 1] = '\0';
-    }
-    
-    printf("Connecting to WiFi network '%s'...\n", actual_ssid);
-    
-    // Disable power management
-    //cyw43_wifi_pm(&cyw43_state, CYW43_NO_POWERSAVE_MODE);
-    //printf("Power management disabled\n");
-    
-    // Enable station mode
-    cyw43_arch_enable_sta_mode();
-    printf("Station mode enabled\n");
-    
-    // Try to connect with retries
-    const int max_retries = 3;
-    int retry_count = 0;
-    int result = 0;
-    
-    while (retry_count < max_retries) {
-        printf("Connection attempt %d of %d...\n", retry_count + 1, max_retries);
-        
-        // Try to connect
-        result = cyw43_arch_wifi_connect_timeout_ms(actual_ssid, actual_password, CYW43_AUTH_WPA3_WPA2_AES_PSK, 30000);
-        if (result == 0) {
-            break;  // Connection successful
-        }
-        
-        printf("Connection attempt failed (error: %d), retrying...\n", result);
-        retry_count++;
-        if (retry_count < max_retries) {
-            sleep_ms(2000);  // Wait before retry
-        }
+        printf("Connecting to the strongest of %d saved networks in the background...\n",
+               count_wifi_credentials());
+        printf("Use 'status' or 'wifi_log' to follow progress.\n");
+        wifi_manager.connect_auto();
+        return;
     }
     
-    if (result != 0) {
-        printf("Failed to connect after %d attempts\n", max_retries);
+    if (!check_credential_lengths(ssid, password)) {
         return;
     }
     
-    // Wait for connection to stabilize
-    printf("Waiting for connection to stabilize...\n");
-    sleep_ms(2000);
-    
-    // Verify connection
-    int wifi_status = cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA);
-    printf("WiFi status code: %d\n", wifi_status);
-    
-    if (wifi_status == CYW43_LINK_UP) {
-        printf("Successfully connected to WiFi\n");
-        
-        // Get and display IP address
-        struct netif *netif = netif_default;
-        if (netif != NULL) {
-            printf("IP Address: %s\n", ip4addr_ntoa(&netif->ip_addr));
-        } else {
-            printf("Warning: Network interface not available\n");
-        }
-    } else {
-        const char* status_str;
-        switch (wifi_status) {
-            case CYW43_LINK_JOIN:
-                status_str = "Joined";
-                break;
-            case CYW43_LINK_DOWN:
-                status_str = "Link Down";
-                break;
-            case CYW43_LINK_FAIL:
-                status_str = "Link Failed";
-                break;
-            case CYW43_LINK_NONET:
-                status_str = "No Network";
-                break;
-            case CYW43_LINK_BADAUTH:
-                status_str = "Authentication Failed";
-                break;
-            default:
-                status_str = "Unknown";
-                break;
-        }
-        printf("Connection failed - WiFi status: %s (%d)\n", status_str, wifi_status);
-    }
+    printf("Connecting to WiFi network '%s' in the background...\n", ssid);
+    printf("Use 'status' or 'wifi_log' to follow progress.\n");
+    wifi_manager.connect(ssid, password);
+}
+
+void handle_wifi_log() {
+    wifi_manager.print_history();
 }
 
 void handle_save(const char* ssid, const char* password) {
@@ -376,27 +322,274 @@ void handle_save(const char* ssid, const char* password) {
         return;
     }
     
+    if (!check_credential_lengths(ssid, password)) {
+        return;
+    }
+    
     printf("Saving WiFi credentials to flash...\n");
     if (save_wifi_credentials(ssid, password)) {
         printf("WiFi credentials saved successfully!\n");
         printf("Credentials will be used automatically on next boot.\n");
     } else {
-        printf("Failed to save WiFi credentials to flash.\n");
+        printf("Failed to save WiFi credentials to flash (%d networks max).\n", WIFI_MAX_NETWORKS);
     }
 }
 
 void handle_load() {
+    printf("Loading saved WiFi credentials...\n");
+    handle_wifi("", "");
+}
+
+void handle_networks() {
     char ssid[MAX_SSID_LEN];
     char password[MAX_PASSWORD_LEN];
     
-    printf("Loading saved WiFi credentials...\n");
-    if (load_wifi_credentials(ssid, password)) {
-        printf("Found saved credentials for network: %s\n", ssid);
-        printf("Attempting to connect...\n");
-        handle_wifi(ssid, password);
+    printf("Saved networks (%d of %d):\n", count_wifi_credentials(), WIFI_MAX_NETWORKS);
+    for (int i = 0; load_wifi_credentials(i, ssid, password); i++) {
+        wifi_lease_t lease;
+        if (load_wifi_lease(ssid, &lease)) {
+            ip4_addr_t ip;
+            ip4_addr_set_u32(&ip, lease.ip_addr);
+            printf("  %-32s last AP %02x:%02x:%02x:%02x:%02x:%02x chan %d ip %s\n", ssid,
+                   lease.bssid[0], lease.bssid[1], lease.bssid[2], lease.bssid[3], lease.bssid[4], lease.bssid[5],
+                   lease.channel, ip4addr_ntoa(&ip));
+        } else {
+            printf("  %s\n", ssid);
+        }
+    }
+}
+
+void handle_forget(const char* ssid) {
+    if (strlen(ssid) == 0) {
+        printf("Error: SSID required\n");
+        printf("Usage: forget <ssid>\n");
+        return;
+    }
+    
+    if (forget_wifi_credentials(ssid)) {
+        printf("Forgot network: %s\n", ssid);
     } else {
-        printf("No saved WiFi credentials found.\n");
-        printf("Use 'save <ssid> <password>' to store credentials.\n");
+        printf("Network not saved: %s\n", ssid);
+    }
+}
+
+void handle_kv() {
+    flash_kv.print_stats();
+    printf("  Longest flash operation: %lu us, %lu refused\n",
+           (unsigned long)pico_flash.getMaxBlockedUs(), (unsigned long)pico_flash.getFailures());
+    
+    char key[FlashKV::MAX_KEY_LEN + 1];
+    for (int i = 0; flash_kv.key_at(i, key, sizeof(key)); i++) {
+        size_t length;
+        flash_kv.get(key, &length);
+        printf("  %-40s %u bytes\n", key, (unsigned)length);
+    }
+}
+
+void handle_trace(const char* action) {
+    if (strcmp(action, "dump") == 0) {
+        trace_dump();
+    } else if (strcmp(action, "clear") == 0) {
+        trace_clear();
+        printf("Trace buffers cleared\n");
+    } else if (strcmp(action, "on") == 0) {
+        trace_set_recording(true);
+        trace_print_status();
+    } else if (strcmp(action, "off") == 0) {
+        trace_set_recording(false);
+        trace_print_status();
+    } else {
+        trace_print_status();
+    }
+}
+
+void handle_perf(const char* action) {
+    if (strcmp(action, "reset") == 0) {
+        perf_reset();
+        printf("Performance counters reset\n");
+    } else if (strcmp(action, "export") == 0) {
+        perf_export_hex();
+    } else {
+        perf_print();
+    }
+}
+
+// Radio power save policy, a power_pm_policy_t
+#define POWER_PM_KEY "power:pm"
+
+void handle_power(const char* action, const char* mode) {
+    if (strcmp(action, "pm") != 0) {
+        power.print_status();
+        return;
+    }
+
+    for (int i = 0; i < POWER_PM_COUNT; i++) {
+        power_pm_policy_t policy = (power_pm_policy_t)i;
+        if (strcmp(mode, PowerManager::policy_name(policy)) == 0) {
+            power.set_policy(policy);
+            uint8_t value = (uint8_t)policy;
+            if (!flash_kv.put(POWER_PM_KEY, &value, sizeof(value))) {
+                printf("Failed to save power setting\n");
+            }
+            printf("Radio power save: %s\n", PowerManager::policy_name(policy));
+            return;
+        }
+    }
+    printf("Usage: power pm auto|off|performance|aggressive\n");
+}
+
+// Set while the device should accept updates over the network, so 'ota on' survives a reboot
+#define OTA_KEY "ota:listen"
+
+void handle_ota(const char* action) {
+    if (strcmp(action, "on") == 0) {
+        if (!ota.listen()) {
+            return;
+        }
+        if (!flash_kv.put(OTA_KEY, "1", 1)) {
+            printf("Failed to save OTA setting\n");
+        }
+        printf("Accepting firmware updates on TCP port %d\n", OTA_PORT);
+    } else if (strcmp(action, "off") == 0) {
+        ota.stop();
+        flash_kv.remove(OTA_KEY);
+        printf("OTA updates disabled\n");
+    } else {
+        ota.print_status();
+    }
+}
+
+// Whole card, handed to the USB host by 'msc on'
+static SDBlockRegion msc_region;
+
+// The host owns the file system while the card is exported
+static bool sd_card_exported() {
+    if (usb_msc.isExported()) {
+        printf("SD card is exported over USB. Eject it on the host or use 'msc off' first.\n");
+        return true;
+    }
+    return false;
+}
+
+void handle_msc(const char* action) {
+    if (strcmp(action, "on") == 0) {
+        if (usb_msc.isExported()) {
+            printf("SD card already exported\n");
+            return;
+        }
+        if (!sd_card.isInitialized() || sd_card.getSize() == 0) {
+            printf("SD card not initialized. Use 'sd_init' first.\n");
+            return;
+        }
+        if (data_logger.isActive()) {
+            printf("Logger is running, use 'log stop' first\n");
+            return;
+        }
+        if (journal.isMounted()) {
+            journal.flush();
+            journal.unmount();
+            printf("Journal unmounted\n");
+        }
+        msc_region.setRegion(0, sd_card.getSize());
+        usb_msc.export_device(&msc_region);
+        event_log.record(EVENT_MSC_EXPORTED, 1);
+        printf("SD card exported over USB (%lu MB)\n", (unsigned long)(sd_card.getSize() / 2048));
+    } else if (strcmp(action, "off") == 0) {
+        if (!usb_msc.isExported()) {
+            printf("SD card is not exported\n");
+            return;
+        }
+        usb_msc.eject();
+        sd_card.parse_boot_sector();
+        event_log.record(EVENT_MSC_EXPORTED, 0);
+        printf("SD card returned to the firmware\n");
+    } else {
+        usb_msc.print_status();
+    }
+}
+
+void handle_log(const char* action, const char* rate, const char* filename) {
+    if (strcmp(action, "start") == 0) {
+        if (sd_card_exported()) {
+            return;
+        }
+        uint32_t sample_rate = strlen(rate) > 0 ? (uint32_t)strtoul(rate, NULL, 10) : DataLogger::DEFAULT_SAMPLE_RATE;
+        data_logger.start_file(strlen(filename) > 0 ? filename : "LOG.BIN", LOG_FILE_SIZE, sample_rate);
+    } else if (strcmp(action, "compress") == 0) {
+        if (strcmp(rate, "on") == 0 || strcmp(rate, "off") == 0) {
+            if (!data_logger.set_compression(strcmp(rate, "on") == 0)) {
+                printf("Not enough RAM for the compression buffers\n");
+            }
+        } else if (strlen(rate) > 0) {
+            printf("Usage: log compress [on|off]\n");
+            return;
+        }
+        printf("Compression %s for the next run\n", data_logger.isCompressionEnabled() ? "on" : "off");
+    } else if (strcmp(action, "ring") == 0) {
+        if (strlen(rate) > 0) {
+            uint32_t blocks = (uint32_t)strtoul(rate, NULL, 10);
+            if (blocks < LOG_WRITE_BATCH || (blocks & (blocks - 1)) != 0) {
+                printf("Ring size must be a power of two of at least %d blocks\n", LOG_WRITE_BATCH);
+                return;
+            }
+            if (!flash_kv.put(LOG_RING_KEY, &blocks, sizeof(blocks))) {
+                printf("Failed to save ring size\n");
+                return;
+            }
+            printf("Ring of %lu blocks (%lu KB) from the next boot\n", (unsigned long)blocks, (unsigned long)(blocks / 2));
+        } else {
+            printf("Ring: %lu blocks (%lu KB)\n", (unsigned long)data_logger.getRingBlocks(),
+                   (unsigned long)(data_logger.getRingBlocks() / 2));
+        }
+    } else if (strcmp(action, "stop") == 0) {
+        if (!data_logger.isActive()) {
+            printf("Logger is not running\n");
+            return;
+        }
+        data_logger.stop();
+        printf("Stopping capture, queued blocks are still being written\n");
+    } else {
+        data_logger.print_status();
+    }
+}
+
+static void print_journal_record(uint32_t sequence, const uint8_t* data, size_t length, void* context) {
+    (void)context;
+    printf("  %6lu  %.*s\n", (unsigned long)sequence, (int)length, (const char*)data);
+}
+
+void handle_journal(const char* action, const char* text) {
+    if (strcmp(action, "mount") == 0 || strcmp(action, "format") == 0) {
+        if (sd_card_exported()) {
+            return;
+        }
+        journal.open_file("JOURNAL.LOG", JOURNAL_FILE_SIZE, strcmp(action, "format") == 0);
+        return;
+    }
+    if (strlen(action) == 0) {
+        journal.print_stats();
+        return;
+    }
+    if (!journal.isMounted()) {
+        printf("Journal not mounted. Use 'journal mount' first.\n");
+        return;
+    }
+    
+    if (strcmp(action, "append") == 0) {
+        uint32_t sequence;
+        if (journal.append(text, strlen(text), &sequence)) {
+            printf("Appended record %lu (committed with the next group)\n", (unsigned long)sequence);
+        } else {
+            printf("Failed to append record\n");
+        }
+    } else if (strcmp(action, "flush") == 0) {
+        printf(journal.flush() ? "Journal flushed\n" : "Journal flush failed\n");
+    } else if (strcmp(action, "dump") == 0) {
+        journal.flush();
+        uint32_t count = journal.read_all(print_journal_record, NULL);
+        printf("%lu records\n", (unsigned long)count);
+    } else {
+        printf("Usage: journal [mount|format|append <text>|flush|dump]\n");
     }
 }
 
@@ -417,9 +610,53 @@ void handle_sd_init() {
     
     if (sd_card.init() && sd_card.parse_boot_sector()) {
         printf("SD card and FAT32 filesystem ready\n");
+        event_log.record(EVENT_SD_MOUNTED, sd_card.getType(), sd_card.getSectorsPerCluster());
     } else {
         printf("Failed to initialize SD card\n");
+        event_log.record(EVENT_SD_FAILED);
+    }
+}
+
+// Second card on spi0, only used to stripe log runs with the first
+void handle_sd2_init() {
+    if (sd_card2.isInitialized()) {
+        printf("Second SD card already initialized\n");
+        return;
+    }
+    if (data_logger.isActive()) {
+        printf("Logger is running, use 'log stop' first\n");
+        return;
+    }
+
+    if (sd_card2.init() && sd_card2.parse_boot_sector()) {
+        printf("Second SD card ready, log runs will be striped across both cards\n");
+    } else {
+        sd_card2.deinit();      // Not striped across without a filesystem
+        printf("Failed to initialize second SD card\n");
+    }
+}
+
+// "BOOT    TXT" in a directory entry -> "BOOT.TXT"
+static void format_entry_name(const uint8_t* entry, char name[13]) {
+    int name_pos = 0;
+    
+    // Copy main part of filename
+    for (int j = 0; j < 8; j++) {
+        if (entry[j] != ' ') {
+            name[name_pos++] = entry[j];
+        }
+    }
+    
+    // Add extension if present
+    if (entry[8] != ' ') {
+        name[name_pos++] = '.';
+        for (int j = 8; j < 11; j++) {
+            if (entry[j] != ' ') {
+                name[name_pos++] = entry[j];
+            }
+        }
     }
+    name[name_pos] = '\0';
 }
 
 void handle_sd_ls() {
@@ -448,99 +685,79 @@ void handle_sd_ls() {
         if (entry[0] == 0xE5) {
             continue;  // Deleted file
         }
-        if ((entry[11] & 0x10) == 0x10) {
-            // Directory
-            printf("DIR  ");
-        } else {
-            // File
-            printf("FILE ");
-        }
-        
-        // Print filename (8 characters)
-        for (int j = 0; j < 8; j++) {
-            if (entry[j] != ' ') {
-                printf("%c", entry[j]);
-            }
-        }
-        
-        // Print extension (3 characters)
-        if (entry[8] != ' ') {
-            printf(".");
-            for (int j = 8; j < 11; j++) {
-                if (entry[j] != ' ') {
-                    printf("%c", entry[j]);
-                }
-            }
-        }
         
-        // Print file size
+        // One write per entry rather than one per character
+        char entry_name[13];
+        format_entry_name(entry, entry_name);
         uint32_t file_size = (entry[31] << 24) | (entry[30] << 16) | (entry[29] << 8) | entry[28];
-        printf("  %d bytes\n", file_size);
+        printf("%s %s  %lu bytes\n", (entry[11] & 0x10) ? "DIR " : "FILE", entry_name, (unsigned long)file_size);
     }
 }
 
+// Read-ahead window for 'sd_cat', the buffers are taken from the arena on first use
+#define SD_CAT_AHEAD_BLOCKS 8
+
 void handle_sd_cat(const char* filename) {
     if (!sd_card.isInitialized()) {
         printf("SD card not initialized. Use 'sd_init' first.\n");
         return;
     }
-    
-    if (strlen(filename) == 0) {
-        printf("Error: Filename required\n");
-        printf("Usage: sd_cat <filename>\n");
+    if (sd_card_exported()) {
         return;
     }
     
-    printf("Reading file: %s\n", filename);
-    
-    // For now, just read the first sector of the root directory
-    // In a full implementation, you'd need to parse the FAT chain
-    uint8_t buffer[512];
-    if (!sd_card.read_block(sd_card.getFat32RootDirSector(), buffer)) {
-        printf("Failed to read directory\n");
+    static SDFile file(&sd_card);
+    static uint8_t* ahead_buffers;
+    if (ahead_buffers == NULL) {
+        ahead_buffers = (uint8_t*)memory_arena.allocate("sd_cat.ahead", 2 * SD_CAT_AHEAD_BLOCKS * 512);
+        file.enable_read_ahead(ahead_buffers, SD_CAT_AHEAD_BLOCKS);
+    }
+    if (!file.open_file(filename)) {
+        printf("File not found: %s\n", filename);
         return;
     }
     
-    // Simple file search (this is a basic implementation)
-    bool found = false;
-    for (int i = 0; i < 512; i += 32) {
-        uint8_t* entry = &buffer[i];
-        
-        if (entry[0] == 0x00) break;
-        if (entry[0] == 0xE5) continue;
-        
-        // Extract filename
-        char entry_name[13];
-        int name_pos = 0;
-        
-        // Copy main part of filename
-        for (int j = 0; j < 8; j++) {
-            if (entry[j] != ' ') {
-                entry_name[name_pos++] = entry[j];
-            }
-        }
-        
-        // Add extension if present
-        if (entry[8] != ' ') {
-            entry_name[name_pos++] = '.';
-            for (int j = 8; j < 11; j++) {
-                if (entry[j] != ' ') {
-                    entry_name[name_pos++] = entry[j];
-                }
-            }
-        }
-        entry_name[name_pos] = '\0';
-        
-        if (strcmp(entry_name, filename) == 0) {
-            found = true;
-            printf("File found! (Basic implementation - would need FAT parsing for full content)\n");
-            break;
-        }
+    // Read the next window from the card while USB sends the chunk just queued
+    char chunk[256];
+    int length;
+    while ((length = file.read(chunk, sizeof(chunk))) > 0) {
+        fwrite(chunk, 1, length, stdout);
+        file.prefetch();
+        console_drain();
+    }
+    fflush(stdout);
+    if (length < 0) {
+        printf("\nRead error at byte %lu\n", (unsigned long)file.getPosition());
+    }
+    printf("\n");
+    file.print_read_ahead();
+    file.close();
+}
+
+void handle_sd_rm(const char* filename) {
+    if (!sd_card.isInitialized()) {
+        printf("SD card not initialized. Use 'sd_init' first.\n");
+        return;
+    }
+    if (sd_card_exported()) {
+        return;
+    }
+    // Both write straight into the sectors of their preallocated files
+    if (data_logger.isActive()) {
+        printf("Logger is running, use 'log stop' first\n");
+        return;
+    }
+    if (journal.isMounted()) {
+        printf("Journal is mounted, it may be using the file\n");
+        return;
     }
     
-    if (!found) {
-        printf("File not found: %s\n", filename);
+    static SDFile file(&sd_card);
+    if (!file.remove(filename)) {
+        printf("Could not remove %s\n", filename);
+        return;
     }
+    printf("Removed %s\n", filename);
 }
 
 void handle_sd_write(const char* filename, const char* content) {
@@ -561,6 +778,20 @@ void handle_sd_write(const char* filename, const char* content) {
 }
 
 void handle_sd_format() {
+    if (sd_card_exported()) {
+        return;
+    }
+    // A run writes straight into the sectors of its file, on both cards when
+    // striped, and the journal into its own. Either would scribble over the
+    // new filesystem. The journal's file is going anyway, so just drop it.
+    if (data_logger.isActive()) {
+        printf("Logger is running, use 'log stop' first\n");
+        return;
+    }
+    if (journal.isMounted()) {
+        journal.unmount();
+        printf("Journal unmounted\n");
+    }
     if (sd_card.format()) {
         printf("SD card formatted successfully!\n");
         printf("You can now use 'sd_ls' to verify the filesystem.\n");
@@ -569,118 +800,300 @@ void handle_sd_format() {
     }
 }
 
-// WiFi scan callback for ssid command
-static int ssid_scan_callback(void *env, const cyw43_ev_scan_result_t *result) {
-    if (result) {
-        std::map<std::string, int> & ssid_map = *(std::map<std::string, int> *)env;   
-        std::string ssid((char *)result->ssid, (int)result->ssid_len);
+void handle_ssid() {
+    printf("Scanning for WiFi networks...\n");
 
-        if (ssid_map.find(ssid) == ssid_map.end()) {
-            ssid_map.insert(std::pair<std::string, int>(ssid, result->rssi));
+    int err = wifi_scan.start();
+    if (err != 0) {
+        printf("error: cyw43_wifi_scan failed with code %d\n", err);
+        return;
+    }
 
-            const char *auth_mode_str;
-            switch (result->auth_mode) {
-                case CYW43_AUTH_OPEN: auth_mode_str = "Open"; break;
-                case CYW43_AUTH_WPA_TKIP_PSK: auth_mode_str = "WPA"; break;
-                case CYW43_AUTH_WPA2_AES_PSK: auth_mode_str = "WPA2"; break;
-                case CYW43_AUTH_WPA2_MIXED_PSK: auth_mode_str = "WPA2 Mixed"; break;
-                case CYW43_AUTH_WPA3_SAE_AES_PSK: auth_mode_str = "WPA3"; break;
-                case CYW43_AUTH_WPA3_WPA2_AES_PSK: auth_mode_str = "WPA2/WPA3"; break;
-                default: auth_mode_str = "Unknown"; break;
-            }
+    // Keep the connection state machine running while the radio scans. The
+    // manager may be the one to see the scan end, when it started or joined
+    // it, so wait for the scan to be over rather than for our own poll() to say so.
+    while (wifi_scan.isActive()) {
+        wifi_scan.poll();
+        wifi_manager.poll();
+        sleep_ms(10);
+    }
 
-            printf("ssid: %-32s rssi: %4d chan: %3d mac: %02x:%02x:%02x:%02x:%02x:%02x sec: %s (%u)\n",
-                ssid.c_str(), result->rssi, result->channel,
-                result->bssid[0], result->bssid[1], result->bssid[2], result->bssid[3], result->bssid[4], result->bssid[5],
-                auth_mode_str, result->auth_mode);
-        }
-    } 
-    return 0;
+    for (int i = 0; i < wifi_scan.getCount(); i++) {
+        const wifi_scan_entry_t* entry = wifi_scan.getEntry(i);
+        printf("ssid: %-32s rssi: %4d chan: %3d mac: %02x:%02x:%02x:%02x:%02x:%02x sec: %s (%u)\n",
+            entry->ssid, entry->rssi, entry->channel,
+            entry->bssid[0], entry->bssid[1], entry->bssid[2], entry->bssid[3], entry->bssid[4], entry->bssid[5],
+            WiFiScan::auth_name(entry->auth_mode), entry->auth_mode);
+    }
+    printf("%d networks found", wifi_scan.getCount());
+    if (wifi_scan.getDropped() > 0) {
+        printf(" (%lu results dropped, table full)", (unsigned long)wifi_scan.getDropped());
+    }
+    printf("\n");
 }
 
+// Command table, sorted by name for binary search
+static constexpr cli_command_t commands[] = {
+    {"autorun", "[file|off]", "Show, set or disable the script run at boot", 0, 1,
+        [](int, char* argv[]) { handle_autorun(argv[1]); }},
+    {"boot", "", "Show boot phase timestamps and boot task state", 0, 0,
+        [](int, char*[]) { boot.print(); }},
+    {"clear", "", "Clear screen", 0, 0,
+        [](int, char*[]) { handle_clear(); }},
+    {"clear_creds", "", "Clear all saved WiFi credentials", 0, 0,
+        [](int, char*[]) { handle_clear_creds(); }},
+    {"events", "[stats|clear]", "Show the event log kept in flash across resets", 0, 1,
+        [](int, char* argv[]) { handle_events(argv[1]); }},
+    {"exit", "", "Enter bootloader mode for programming", 0, 0,
+        [](int, char*[]) { handle_exit(); }},
+    {"forget", "<ssid>", "Remove a saved WiFi network", 1, 1,
+        [](int, char* argv[]) { handle_forget(argv[1]); }},
+    {"help", "[command]", "Show this help message, or usage of one command", 0, 1,
+        [](int, char* argv[]) { handle_help(argv[1]); }},
+    {"journal", "[mount|format|append <text>|flush|dump]", "Crash-safe record journal on the SD card", 0, 2,
+        [](int, char* argv[]) { handle_journal(argv[1], argv[2]); }},
+    {"kv", "", "Show flash settings store usage and keys", 0, 0,
+        [](int, char*[]) { handle_kv(); }},
+    {"led", "<on|off|blink> [interval_ms]", "Control the LED", 1, 2,
+        [](int, char* argv[]) { handle_led(argv[1], argv[2]); }},
+    {"load", "", "Load and connect using saved credentials", 0, 0,
+        [](int, char*[]) { handle_load(); }},
+    {"log", "[start [rate] [file]|stop|compress [on|off]|ring [blocks]]", "ADC data logger status, start (733 to 500000 samples/s), stop, compression or ring size", 0, 3,
+        [](int, char* argv[]) { handle_log(argv[1], argv[2], argv[3]); }},
+    {"mem", "", "Show RAM use by module, arena buffers, heap and stack watermarks", 0, 0,
+        [](int, char*[]) { memory_print(); }},
+    {"msc", "[on|off]", "Export the SD card as a USB drive, or take it back", 0, 1,
+        [](int, char* argv[]) { handle_msc(argv[1]); }},
+    {"networks", "", "List saved WiFi networks", 0, 0,
+        [](int, char*[]) { handle_networks(); }},
+    {"ota", "[on|off]", "Accept firmware updates over WiFi, see ota_send.py", 0, 1,
+        [](int, char* argv[]) { handle_ota(argv[1]); }},
+    {"perf", "[reset|export]", "Show performance counters, or export them as hex", 0, 1,
+        [](int, char* argv[]) { handle_perf(argv[1]); }},
+    {"power", "[pm auto|off|performance|aggressive]", "Idle and radio power save status, or set the radio policy", 0, 2,
+        [](int, char* argv[]) { handle_power(argv[1], argv[2]); }},
+    {"run", "<file>", "Run the commands in a script file on the SD card", 1, 1,
+        [](int, char* argv[]) { handle_run(argv[1]); }},
+    {"save", "<ssid> <password>", "Add or update saved WiFi network", 2, 2,
+        [](int, char* argv[]) { handle_save(argv[1], argv[2]); }},
+    {"sd2_init", "", "Initialize a second SD card on spi0 to stripe log runs across", 0, 0,
+        [](int, char*[]) { handle_sd2_init(); }},
+    {"sd_cat", "<file>", "Display file contents from SD card", 1, 1,
+        [](int, char* argv[]) { handle_sd_cat(argv[1]); }},
+    {"sd_format", "", "Format SD card with FAT32 filesystem", 0, 0,
+        [](int, char*[]) { handle_sd_format(); }},
+    {"sd_init", "", "Initialize SD card and mount FAT32 filesystem", 0, 0,
+        [](int, char*[]) { handle_sd_init(); }},
+    {"sd_ls", "", "List files and directories on SD card", 0, 0,
+        [](int, char*[]) { handle_sd_ls(); }},
+    {"sd_rm", "<file>", "Delete a file and let the card erase its clusters", 1, 1,
+        [](int, char* argv[]) { handle_sd_rm(argv[1]); }},
+    {"sd_test", "", "Test SPI communication with SD card", 0, 0,
+        [](int, char*[]) { sd_card.spi_test(); }},
+    {"sd_write", "<file> <content>", "Write text to file on SD card", 2, 2,
+        [](int, char* argv[]) { handle_sd_write(argv[1], argv[2]); }},
+    {"ssid", "", "Scan for WiFi networks", 0, 0,
+        [](int, char*[]) { handle_ssid(); }},
+    {"status", "", "Show system status", 0, 0,
+        [](int, char*[]) { handle_status(); }},
+    {"tasks", "", "Show periodic tasks with their jitter and overruns", 0, 0,
+        [](int, char*[]) { scheduler.print_status(); }},
+    {"trace", "[on|off|clear|dump]", "Trace status, or dump as Chrome trace JSON", 0, 1,
+        [](int, char* argv[]) { handle_trace(argv[1]); }},
+    {"wifi", "[<ssid> <password>]", "Connect, or pick the strongest saved network", 0, 2,
+        [](int, char* argv[]) { handle_wifi(argv[1], argv[2]); }},
+    {"wifi_log", "", "Show WiFi connection state transitions", 0, 0,
+        [](int, char*[]) { handle_wifi_log(); }},
+};
 
-void handle_ssid() {
-    printf("Scanning for WiFi networks...\n");
+static const size_t COMMAND_COUNT = sizeof(commands) / sizeof(commands[0]);
+static_assert(cli_table_valid(commands), "command table must be sorted by name with valid argument counts");
 
-    printf("scan started\n");
+void handle_help(const char* command) {
+    cli_print_help(commands, COMMAND_COUNT, command);
+}
 
-    absolute_time_t scan_time = make_timeout_time_ms(10000);
+// Command scripts
+// One command per line, blank lines and lines starting with '#' are skipped.
+// Lines go straight to the dispatcher without echo, and the script stops at
+// the first line that fails to parse or names an unknown command.
+#define AUTORUN_KEY "cli:autorun"
+#define MAX_SCRIPT_NAME_LEN 12  // 8.3
 
-    bool scanning = false;
+static bool script_running = false;
 
-    std::map<std::string, int> ssid_map;
+bool run_script(const char* filename) {
+    // Kept off the stack, scripts cannot nest so one instance is enough
+    static SDFile script(&sd_card);
+    
+    if (script_running) {
+        printf("Error: 'run' cannot be used inside a script\n");
+        return false;
+    }
+    if (!sd_card.isInitialized()) {
+        printf("SD card not initialized. Use 'sd_init' first.\n");
+        return false;
+    }
+    if (!script.open_file(filename)) {
+        printf("Script not found: %s\n", filename);
+        return false;
+    }
+    
+    script_running = true;
+    char line[MAX_CMD_LEN];
+    int line_number = 0;
+    bool success = true;
+    while (script.read_line(line, sizeof(line))) {
+        line_number++;
+        const char* start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        
+        if (!cli_dispatch(commands, COMMAND_COUNT, line)) {
+            printf("%s:%d: script stopped\n", filename, line_number);
+            success = false;
+            break;
+        }
+        
+        // Keep the connection state machine running between commands
+        wifi_manager.poll();
+    }
+    script.close();
+    script_running = false;
+    return success;
+}
 
-    // scan for 10 seconds
-    while (!time_reached(scan_time)) {
-        if (!scanning) {
-            cyw43_wifi_scan_options_t scan_options = {0};
-            int err = cyw43_wifi_scan(&cyw43_state, &scan_options, &ssid_map, ssid_scan_callback);
-            if (err != 0) {
-                printf("error: cyw43_wifi_scan failed with code %d\n", err);
-                return;
-            }
+void handle_run(const char* filename) {
+    uint32_t start = time_us_32();
+    if (run_script(filename)) {
+        printf("Script %s finished in %lu ms\n", filename, (unsigned long)((time_us_32() - start) / 1000));
+    }
+}
+
+void handle_autorun(const char* filename) {
+    if (strcmp(filename, "off") == 0) {
+        flash_kv.remove(AUTORUN_KEY);
+        printf("Autorun disabled\n");
+    } else if (strlen(filename) > 0) {
+        if (strlen(filename) > MAX_SCRIPT_NAME_LEN) {
+            printf("Error: Script names are 8.3, at most %d characters\n", MAX_SCRIPT_NAME_LEN);
+        } else if (flash_kv.put(AUTORUN_KEY, filename, strlen(filename))) {
+            printf("Will run %s from the SD card at boot\n", filename);
+        } else {
+            printf("Failed to save autorun setting\n");
         }
-        else if (!cyw43_wifi_scan_active(&cyw43_state)) {
-            scanning = false;
+    } else {
+        size_t length;
+        const char* value = (const char*)flash_kv.get(AUTORUN_KEY, &length);
+        if (value != NULL) {
+            printf("Autorun: %.*s\n", (int)length, value);
+        } else {
+            printf("Autorun: off\n");
         }
-        sleep_ms(100);
     }
 }
 
+// Run the configured boot script, if any
+void autorun_script() {
+    size_t length;
+    const char* value = (const char*)flash_kv.get(AUTORUN_KEY, &length);
+    if (value == NULL || length == 0 || length > MAX_SCRIPT_NAME_LEN) {
+        return;
+    }
+    
+    char filename[MAX_SCRIPT_NAME_LEN + 1];
+    memcpy(filename, value, length);
+    filename[length] = '\0';
+    
+    if (!sd_card.isInitialized()) {
+        printf("Boot script %s skipped, SD card not mounted\n", filename);
+        return;
+    }
+    
+    printf("Running boot script %s...\n", filename);
+    handle_run(filename);
+}
+
+// Reprint the prompt and any partly typed command after output from the background
+static void show_prompt() {
+    printf("\n> %.*s", cmd_pos, cmd_buffer);
+}
+
+// Boot task: mount the SD card quietly, it may take a second or be missing altogether
+static bool boot_mount_sd() {
+    if (sd_card.isInitialized() || (sd_card.init(false) && sd_card.parse_boot_sector(false))) {
+        boot.mark(BOOT_PHASE_SD);
+        event_log.record(EVENT_SD_MOUNTED, sd_card.getType(), sd_card.getSectorsPerCluster());
+    } else {
+        event_log.record(EVENT_SD_FAILED);
+    }
+    return true;
+}
+
+// Boot task: run the boot script, the SD card task ahead of it has finished by now
+static bool boot_autorun() {
+    size_t length;
+    if (flash_kv.get(AUTORUN_KEY, &length) != NULL) {
+        printf("\n");
+        autorun_script();
+        show_prompt();
+    }
+    boot.mark(BOOT_PHASE_AUTORUN);
+    return true;
+}
+
+// Boot task: wait for the WiFi manager to associate, it is driven from the main loop
+static bool boot_network() {
+    switch (wifi_manager.getState()) {
+        case WIFI_STATE_CONNECTED:
+            boot.mark(BOOT_PHASE_NETWORK);
+            return true;
+        case WIFI_STATE_IDLE:
+            return true;  // Nothing to connect to, or given up
+        default:
+            return false;
+    }
+}
+
+// Earliest time the main loop has work that no interrupt will announce
+static absolute_time_t next_wake_time() {
+    // The data logger's blocks arrive from core 1 without waking this core
+    if (data_logger.isActive()) {
+        return make_timeout_time_ms(1);
+    }
+
+    // lwIP and driver timers
+    absolute_time_t wake = cyw43_arch_async_context()->next_time;
+    wake = power_earliest(wake, wifi_manager.getWakeTime());
+    wake = power_earliest(wake, ota.getWakeTime());
+    wake = power_earliest(wake, power.getWakeTime());
+    wake = power_earliest(wake, scheduler.getWakeTime());
+    uint32_t commit_ms = journal.getCommitDelayMs();
+    if (commit_ms != UINT32_MAX) {
+        wake = power_earliest(wake, make_timeout_time_ms(commit_ms));
+    }
+    uint32_t flush_ms = event_log.getFlushDelayMs();
+    if (flush_ms != UINT32_MAX) {
+        wake = power_earliest(wake, make_timeout_time_ms(flush_ms));
+    }
+    return wake;
+}
+
 // Process a complete command
 void process_command() {
     if (cmd_pos == 0) return;  // Empty command
     
+    TRACE_SCOPE("cli_dispatch");
+    
     cmd_buffer[cmd_pos] = '\0';  // Null terminate the command
     printf("\n");  // New line after command
+    boot.mark(BOOT_PHASE_FIRST_COMMAND);
     
-    // Parse command
-    char cmd[32] = {0};
-    char arg[32] = {0};
-    char subarg[64] = {0};
-    
-    if (strncmp(cmd_buffer, "wifi", 4) == 0 || strncmp(cmd_buffer, "save", 4) == 0 || strncmp(cmd_buffer, "sd_write", 8) == 0) {
-        sscanf(cmd_buffer, "%31s %31s %63s", cmd, arg, subarg);
-    } else {
-        sscanf(cmd_buffer, "%31s %31s", cmd, arg);
-    }
-    
-    // Execute command
-    if (strcmp(cmd, "help") == 0) {
-        handle_help();
-    } else if (strcmp(cmd, "led") == 0) {
-        handle_led(arg);
-    } else if (strcmp(cmd, "status") == 0) {
-        handle_status();
-    } else if (strcmp(cmd, "clear") == 0) {
-        handle_clear();
-    } else if (strcmp(cmd, "exit") == 0) {
-        handle_exit();
-    } else if (strcmp(cmd, "wifi") == 0) {
-        handle_wifi(arg, subarg);
-    } else if (strcmp(cmd, "ssid") == 0) {
-        handle_ssid();
-    } else if (strcmp(cmd, "save") == 0) {
-        handle_save(arg, subarg);
-    } else if (strcmp(cmd, "load") == 0) {
-        handle_load();
-    } else if (strcmp(cmd, "clear_creds") == 0) {
-        handle_clear_creds();
-    } else if (strcmp(cmd, "sd_init") == 0) {
-        handle_sd_init();
-    } else if (strcmp(cmd, "sd_ls") == 0) {
-        handle_sd_ls();
-    } else if (strcmp(cmd, "sd_cat") == 0) {
-        handle_sd_cat(arg);
-    } else if (strcmp(cmd, "sd_write") == 0) {
-        handle_sd_write(arg, subarg);
-    } else if (strcmp(cmd, "sd_format") == 0) {
-        handle_sd_format();
-    } else if (strcmp(cmd, "sd_test") == 0) {
-        sd_card.spi_test();
-    } else {
-        printf("Unknown command. Type 'help' for available commands.\n");
-    }
+    cli_dispatch(commands, COMMAND_COUNT, cmd_buffer);
     
     // Reset command buffer
     cmd_pos = 0;
@@ -688,8 +1101,17 @@ void process_command() {
 }
 
 int main() {
-    // Initialize stdio
+    // Before core 1 starts, so both stacks get their watermark pattern
+    memory_paint_stacks();
+    
+    // Initialize USB (console and mass storage) and stdio
+    usb_device_init();
     stdio_init_all();
+    console_init();
+    boot.mark(BOOT_PHASE_USB);
+    
+    // Core 1 services the data logger
+    multicore_launch_core1(core1_entry);
     
     
     // Initialize WiFi
@@ -698,71 +1120,68 @@ int main() {
         printf("Failed to initialize CYW43\n");
         return -1;
     }
+    boot.mark(BOOT_PHASE_RADIO);
 
-    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
+    // LED on shows the board is up
+    set_led(true);
+    led_task = scheduler.add("led", led_blink_task, NULL);
+    health_task = scheduler.add("health", health_check_task, NULL);
+    scheduler.start(health_task, HEALTH_INTERVAL_MS);
     
-    // Enable LED
-    for (int i = 0; i < 20; i++) {
-        // Toggle the LED
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, !cyw43_arch_gpio_get(CYW43_WL_GPIO_LED_PIN));
-        sleep_ms(250);
+    // Mount the flash settings store
+    if (!wifi_credentials_init()) {
+        printf("Failed to mount flash settings store\n");
     }
+    boot.mark(BOOT_PHASE_SETTINGS);
     
-    // Disable power management
-    cyw43_wifi_pm(&cyw43_state, CYW43_NO_POWERSAVE_MODE);
+    // Events from earlier boots are kept, this one continues on a new page
+    event_log.mount();
+    event_log.record(EVENT_BOOT, watchdog_caused_reboot());
     
-    // Enable station mode
-    cyw43_arch_enable_sta_mode();
+    // Radio power saving, auto unless set otherwise
+    uint8_t pm_policy = POWER_PM_AUTO;
+    flash_kv.read(POWER_PM_KEY, &pm_policy, sizeof(pm_policy));
+    power.set_policy((power_pm_policy_t)pm_policy);
     
-    // Try to connect using saved credentials
-    char saved_ssid[MAX_SSID_LEN];
-    char saved_password[MAX_PASSWORD_LEN];
-    if (load_wifi_credentials(saved_ssid, saved_password)) {
-        printf("Found saved WiFi credentials. Attempting to connect...\n");
-        printf("Connecting to: %s\n", saved_ssid);
-        
-        // Try to connect with retries
-        const int max_retries = 3;
-        int retry_count = 0;
-        int result = 0;
-        
-        while (retry_count < max_retries) {
-            printf("Connection attempt %d of %d...\n", retry_count + 1, max_retries);
-            
-            result = cyw43_arch_wifi_connect_timeout_ms(saved_ssid, saved_password, CYW43_AUTH_WPA3_WPA2_AES_PSK, 30000);
-            if (result == 0) {
-                break;  // Connection successful
-            }
-            
-            printf("Connection attempt failed (error: %d), retrying...\n", result);
-            retry_count++;
-            if (retry_count < max_retries) {
-                sleep_ms(2000);  // Wait before retry
-            }
-        }
-        
-        if (result == 0) {
-            printf("Successfully connected to saved WiFi network!\n");
-            struct netif *netif = netif_default;
-            if (netif != NULL) {
-                printf("IP Address: %s\n", ip4addr_ntoa(&netif->ip_addr));
-            }
-        } else {
-            printf("Failed to connect to saved WiFi network after %d attempts\n", max_retries);
-        }
+    // Long-lived buffers, sized from the settings
+    uint32_t ring_blocks = LOG_RING_BLOCKS;
+    flash_kv.read(LOG_RING_KEY, &ring_blocks, sizeof(ring_blocks));
+    if (!data_logger.init(ring_blocks) && ring_blocks != LOG_RING_BLOCKS) {
+        printf("Falling back to a %d block log ring\n", LOG_RING_BLOCKS);
+        data_logger.init(LOG_RING_BLOCKS);
+    }
+    
+    // Listen for updates if enabled, lwIP accepts the connection once the link is up
+    size_t ota_setting_length;
+    if (flash_kv.get(OTA_KEY, &ota_setting_length) != NULL) {
+        ota.listen();
+    }
+    
+    // Start connecting to the best saved network, the main loop drives the connection
+    if (count_wifi_credentials() > 0) {
+        printf("Found %d saved WiFi networks, connecting...\n", count_wifi_credentials());
+        wifi_manager.connect_auto();
     } else {
         printf("No saved WiFi credentials found.\n");
     }
     
+    // The SD card, boot script and network come up behind the prompt, in this order
+    boot.add_task("boot.sd", boot_mount_sd);
+    boot.add_task("boot.autorun", boot_autorun);
+    boot.add_task("boot.network", boot_network);
+    
     printf("\nPico W WiFi CLI\n");
     printf("Type 'help' for available commands\n\n");
     printf("> ");  // Show prompt
+    boot.mark(BOOT_PHASE_PROMPT);
     
     // Main loop
     while (true) {
-        // Check for incoming characters
-        int c = getchar_timeout_us(0);
-        if (c != PICO_ERROR_TIMEOUT) {
+        uint32_t loop_start = time_us_32();
+        
+        // Drain all pending input, so pasted commands are not limited to one character per tick
+        int c;
+        while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
             // Handle backspace
             if (c == '\b' || c == 127) {
                 if (cmd_pos > 0) {
@@ -781,7 +1200,37 @@ int main() {
             }
         }
         
-        // Small delay to prevent busy waiting
-        sleep_ms(10);
+        // Service the WiFi driver and connection state machine
+        wifi_manager.poll();
+        
+        // Step the boot tasks still running behind the prompt
+        boot.poll();
+        
+        // Drop stalled update senders, and install an image once it has been verified
+        ota.poll();
+        
+        // Write captured data blocks to the SD card, and commit journal records and events that have waited long enough
+        data_logger.poll();
+        journal.poll();
+        event_log.poll();
+        
+        // Service USB, then read ahead or write behind for the mass storage host
+        usb_device_task();
+        usb_msc.poll();
+        
+        // Hand queued output to USB
+        console_drain();
+        
+        // LED pattern, health check and other periodic tasks that are due
+        scheduler.poll();
+        
+        // Radio power save follows the traffic
+        power.poll();
+        perf_loop_us.record(time_us_32() - loop_start);
+        
+        // Sleep until the next deadline or interrupt, skipped while the USB host is transferring
+        if (!usb_msc.isBusy()) {
+            power.idle(next_wake_time());
+        }
     }
 } 
\ No newline at end of file
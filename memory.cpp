@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+#ifndef MEMORY_HOST
+#include <malloc.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+#endif
+
+// Global instance
+MemoryArena memory_arena;
+
+// Registry head, zero before any constructor runs
+static MemoryRegion* region_list;
+
+MemoryRegion::MemoryRegion(const char* name, size_t size) {
+    this->name = name;
+    this->size = size;
+    next = region_list;
+    region_list = this;
+}
+
+MemoryRegion* MemoryRegion::first() {
+    return region_list;
+}
+
+// Constructor
+MemoryArena::MemoryArena() {
+    allocation_count = 0;
+    used = 0;
+    failures = 0;
+}
+
+void* MemoryArena::allocate(const char* name, size_t size) {
+    if (allocation_count >= MAX_ALLOCATIONS) {
+        printf("Memory: no room to record %s\n", name);
+        failures++;
+        return NULL;
+    }
+
+    void* memory = calloc(1, size);
+    if (memory == NULL) {
+        printf("Memory: out of RAM for %s (%u bytes)\n", name, (unsigned)size);
+        failures++;
+        return NULL;
+    }
+
+    allocations[allocation_count].name = name;
+    allocations[allocation_count].size = size;
+    allocation_count++;
+    used += size;
+    return memory;
+}
+
+void MemoryArena::print() {
+    printf("  Arena: %u bytes in %d buffers", (unsigned)used, allocation_count);
+    if (failures > 0) {
+        printf(", %lu refused", (unsigned long)failures);
+    }
+    printf("\n");
+    for (int i = 0; i < allocation_count; i++) {
+        printf("    %-20s %8u\n", allocations[i].name, (unsigned)allocations[i].size);
+    }
+}
+
+#ifndef MEMORY_HOST
+
+// From the linker script
+extern char __end__;            // End of static RAM, start of the heap
+extern char __HeapLimit;
+extern char __StackBottom;      // Core 0 stack, in scratch Y
+extern char __StackTop;
+extern char __StackOneBottom;   // Core 1 stack, in scratch X
+extern char __StackOneTop;
+
+#define STACK_PAINT 0xDEADBEEFu
+
+static void paint(uint32_t* start, uint32_t* end) {
+    while (start < end) {
+        *start++ = STACK_PAINT;
+    }
+}
+
+void memory_paint_stacks() {
+    // Core 0 is running on its stack, so stop well short of this frame
+    uint32_t* current = (uint32_t*)((uintptr_t)__builtin_frame_address(0) & ~3u) - 64;
+    paint((uint32_t*)&__StackBottom, current);
+    paint((uint32_t*)&__StackOneBottom, (uint32_t*)&__StackOneTop);
+}
+
+uint32_t memory_stack_size(int core) {
+    return core == 0 ? (uint32_t)(&__StackTop - &__StackBottom) : (uint32_t)(&__StackOneTop - &__StackOneBottom);
+}
+
+uint32_t memory_stack_used(int core) {
+    const uint32_t* bottom = (const uint32_t*)(core == 0 ? &__StackBottom : &__StackOneBottom);
+    const uint32_t* top = (const uint32_t*)(core == 0 ? &__StackTop : &__StackOneTop);
+    const uint32_t* word = bottom;
+    while (word < top && *word == STACK_PAINT) {
+        word++;
+    }
+    return (uint32_t)((top - word) * sizeof(uint32_t));
+}
+
+uint32_t memory_heap_free() {
+    return (uint32_t)(&__HeapLimit - (char*)sbrk(0));
+}
+
+void memory_print() {
+    uint32_t static_size = (uint32_t)((uintptr_t)&__end__ - SRAM_BASE);
+    uint32_t heap_size = (uint32_t)(&__HeapLimit - &__end__);
+
+    // Static RAM, the part no module claims is the SDK, lwIP, the WiFi driver and TinyUSB
+    printf("Memory:\n");
+    printf("  Static: %lu bytes\n", (unsigned long)static_size);
+    uint32_t claimed = 0;
+    for (MemoryRegion* region = MemoryRegion::first(); region != NULL; region = region->getNext()) {
+        printf("    %-20s %8u\n", region->getName(), (unsigned)region->getSize());
+        claimed += region->getSize();
+    }
+    printf("    %-20s %8lu\n", "other", (unsigned long)(static_size > claimed ? static_size - claimed : 0));
+
+    memory_arena.print();
+
+    // Heap, free chunks inside the part already taken from sbrk are fragmentation
+    struct mallinfo info = mallinfo();
+    printf("  Heap: %lu bytes, %lu taken, %lu in use, %lu free in %lu chunks\n",
+           (unsigned long)heap_size, (unsigned long)info.arena, (unsigned long)info.uordblks,
+           (unsigned long)info.fordblks, (unsigned long)info.ordblks);
+
+    for (int core = 0; core < 2; core++) {
+        printf("  Stack core %d: %lu of %lu bytes used at most\n", core,
+               (unsigned long)memory_stack_used(core), (unsigned long)memory_stack_size(core));
+    }
+    printf("  Free: %lu bytes never handed out\n", (unsigned long)memory_heap_free());
+}
+
+#endif // MEMORY_HOST
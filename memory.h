@@ -0,0 +1,81 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// RAM accounting
+//
+// Static RAM: each module declares a MemoryRegion for its global instance
+// next to the instance itself, the way perf counters are declared:
+//     static MemoryRegion memory_logger("data_logger", sizeof(data_logger));
+//
+// Long-lived buffers: carved out once with memory_arena.allocate(), usually
+// at boot. They come off the heap and are never freed, so they can't
+// fragment it, and each one is named so 'mem' shows who holds what.
+//
+// Stacks: memory_paint_stacks() fills the unused part of both stacks with a
+// pattern before core 1 starts, and the watermark is the deepest word that
+// no longer holds it.
+//
+// Building with MEMORY_HOST leaves out the parts that need the linker
+// script and newlib, so modules using the arena still build on a PC.
+
+class MemoryRegion {
+private:
+    const char* name;
+    size_t size;
+    MemoryRegion* next;
+
+public:
+    MemoryRegion(const char* name, size_t size);
+
+    const char* getName() const { return name; }
+    size_t getSize() const { return size; }
+    MemoryRegion* getNext() const { return next; }
+
+    static MemoryRegion* first();
+};
+
+class MemoryArena {
+public:
+    static const int MAX_ALLOCATIONS = 16;
+
+private:
+    struct Allocation {
+        const char* name;
+        size_t size;
+    };
+
+    Allocation allocations[MAX_ALLOCATIONS];
+    int allocation_count;
+    size_t used;
+    uint32_t failures;
+
+public:
+    // Constructor
+    MemoryArena();
+
+    // Public interface
+    void* allocate(const char* name, size_t size);  // Zeroed, NULL when RAM or the table runs out
+    void print();
+
+    // Getter methods
+    size_t getUsed() const { return used; }
+    int getAllocationCount() const { return allocation_count; }
+    uint32_t getFailures() const { return failures; }
+};
+
+#ifndef MEMORY_HOST
+void memory_paint_stacks();             // Call early in main(), before core 1 is launched
+uint32_t memory_stack_size(int core);
+uint32_t memory_stack_used(int core);   // Deepest use since boot
+uint32_t memory_heap_free();            // Never handed out by sbrk yet
+void memory_print();
+#endif
+
+// Global instance
+extern MemoryArena memory_arena;
+
+#endif // MEMORY_H
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <string.h>
+#include "ota.h"
+
+#ifndef OTA_HOST
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "hardware/structs/psm.h"
+#include "hardware/structs/watchdog.h"
+#include "lwip/tcp.h"
+#include "console.h"
+#include "trace.h"
+#include "perf.h"
+#include "memory.h"
+#include "event_log.h"
+#endif
+
+// Where images run from, and the RAM their stack pointer has to be in
+#define IMAGE_BASE 0x10000000u
+#define IMAGE_VECTOR_OFFSET 0x100u  // Vector table follows the 256-byte boot2
+#define IMAGE_RAM_START 0x20000000u
+#define IMAGE_RAM_END 0x20042000u
+
+// Constructor
+OtaStagingWriter::OtaStagingWriter(FlashDevice* flash, uint32_t base_offset, uint32_t size) {
+    this->flash = flash;
+    this->base_offset = base_offset;
+    this->size = size;
+    open = false;
+    staged = false;
+    image_length = 0;
+    received = 0;
+    page_used = 0;
+    pages_written = 0;
+    error = NULL;
+}
+
+bool OtaStagingWriter::fail(const char* reason) {
+    error = reason;
+    open = false;
+    return false;
+}
+
+bool OtaStagingWriter::begin(const ota_header_t* header) {
+    open = false;
+    staged = false;
+    error = NULL;
+
+    if (header->magic != OTA_MAGIC) {
+        return fail("bad header");
+    }
+    if (header->image_length <= IMAGE_VECTOR_OFFSET + 8 || header->image_length > size) {
+        return fail("image size");
+    }
+
+    image_length = header->image_length;
+    memcpy(expected_sha256, header->sha256, SHA256_DIGEST_SIZE);
+    received = 0;
+    page_used = 0;
+    pages_written = 0;
+    sha256_init(&sha);
+    open = true;
+    return true;
+}
+
+// Program the buffered page, erasing its sector first when the page starts one
+bool OtaStagingWriter::program_page() {
+    uint32_t offset = base_offset + pages_written * FlashDevice::PAGE_SIZE;
+    if (offset % FlashDevice::SECTOR_SIZE == 0 && !flash->erase_sector(offset)) {
+        return fail("flash erase");
+    }
+    if (!flash->program_page(offset, page)) {
+        return fail("flash program");
+    }
+    if (memcmp(flash->read_ptr(offset), page, FlashDevice::PAGE_SIZE) != 0) {
+        return fail("flash verify");
+    }
+
+    pages_written++;
+    page_used = 0;
+    return true;
+}
+
+bool OtaStagingWriter::write(const uint8_t* data, size_t length) {
+    if (!open) {
+        return false;
+    }
+    if (length > image_length - received) {
+        return fail("image longer than header");
+    }
+
+    sha256_update(&sha, data, length);
+    received += length;
+
+    while (length > 0) {
+        size_t take = FlashDevice::PAGE_SIZE - page_used;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(page + page_used, data, take);
+        page_used += take;
+        data += take;
+        length -= take;
+
+        if (page_used == FlashDevice::PAGE_SIZE && !program_page()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool OtaStagingWriter::finish() {
+    if (!open) {
+        return false;
+    }
+    if (received != image_length) {
+        return fail("image shorter than header");
+    }
+
+    // Pad the last page as erased flash
+    if (page_used > 0) {
+        memset(page + page_used, 0xFF, FlashDevice::PAGE_SIZE - page_used);
+        if (!program_page()) {
+            return false;
+        }
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_final(&sha, digest);
+    if (memcmp(digest, expected_sha256, SHA256_DIGEST_SIZE) != 0) {
+        return fail("sha256 mismatch");
+    }
+
+    const char* reason;
+    if (!image_bootable(flash->read_ptr(base_offset), image_length, &reason)) {
+        return fail(reason);
+    }
+
+    open = false;
+    staged = true;
+    return true;
+}
+
+void OtaStagingWriter::abort() {
+    open = false;
+}
+
+// Boot2 checksum as the bootrom computes it: CRC-32/MPEG-2, MSB first, no final inversion
+static uint32_t boot2_crc(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool OtaStagingWriter::image_bootable(const uint8_t* image, uint32_t length, const char** reason) {
+    // The bootrom refuses to run boot2 when its checksum is wrong, leaving only BOOTSEL
+    if (length < IMAGE_VECTOR_OFFSET + 8 || boot2_crc(image, 252) != read_le32(image + 252)) {
+        *reason = "boot2 checksum";
+        return false;
+    }
+
+    // Initial stack pointer in RAM, reset handler a Thumb address inside the image
+    uint32_t stack = read_le32(image + IMAGE_VECTOR_OFFSET);
+    uint32_t reset = read_le32(image + IMAGE_VECTOR_OFFSET + 4);
+    if (stack < IMAGE_RAM_START || stack > IMAGE_RAM_END ||
+        !(reset & 1) || reset < IMAGE_BASE || reset >= IMAGE_BASE + length) {
+        *reason = "vector table";
+        return false;
+    }
+    return true;
+}
+
+#ifndef OTA_HOST
+
+// Global instance
+OtaReceiver ota;
+static MemoryRegion memory_ota("ota", sizeof(OtaReceiver));
+
+// Performance counters
+static PerfCounter perf_ota_bytes("ota.bytes");
+static PerfHistogram perf_ota_segment_us("ota.segment_us");
+
+// End of the running firmware in flash, from the linker script
+extern char __flash_binary_end;
+
+static uint32_t firmware_size() {
+    return (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE);
+}
+
+// Constructor
+OtaReceiver::OtaReceiver() : writer(&pico_flash, FLASH_OTA_OFFSET, FLASH_OTA_SIZE) {
+    state = OTA_STATE_IDLE;
+    listener = NULL;
+    client = NULL;
+    client_aborted = false;
+    header_used = 0;
+    last_activity_us = 0;
+    staged_time_us = 0;
+    updates_received = 0;
+    updates_failed = 0;
+    last_error = NULL;
+}
+
+bool OtaReceiver::listen() {
+    if (listener != NULL) {
+        return true;
+    }
+
+    // Installing copies the staging region down from the middle of flash, the firmware can't reach into it
+    if (firmware_size() > FLASH_OTA_OFFSET) {
+        printf("OTA: firmware is %lu bytes, overlaps the staging region at %lu\n",
+               (unsigned long)firmware_size(), (unsigned long)FLASH_OTA_OFFSET);
+        return false;
+    }
+
+    struct tcp_pcb* pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+    if (pcb == NULL) {
+        printf("OTA: out of TCP control blocks\n");
+        return false;
+    }
+    if (tcp_bind(pcb, IP_ANY_TYPE, OTA_PORT) != ERR_OK) {
+        printf("OTA: port %d in use\n", OTA_PORT);
+        tcp_close(pcb);
+        return false;
+    }
+
+    // Listening swaps in a smaller control block
+    listener = tcp_listen_with_backlog(pcb, 1);
+    if (listener == NULL) {
+        printf("OTA: listen failed\n");
+        tcp_close(pcb);
+        return false;
+    }
+    tcp_arg(listener, this);
+    tcp_accept(listener, on_accept);
+    state = OTA_STATE_LISTENING;
+    return true;
+}
+
+void OtaReceiver::stop() {
+    if (client != NULL) {
+        tcp_arg(client, NULL);
+        tcp_recv(client, NULL);
+        tcp_err(client, NULL);
+        tcp_abort(client);
+        client = NULL;
+        writer.abort();
+    }
+    if (listener != NULL) {
+        tcp_close(listener);
+        listener = NULL;
+    }
+    if (state != OTA_STATE_INSTALLING) {
+        state = OTA_STATE_IDLE;
+    }
+}
+
+err_t OtaReceiver::on_accept(void* arg, struct tcp_pcb* pcb, err_t err) {
+    OtaReceiver* self = (OtaReceiver*)arg;
+    if (err != ERR_OK || pcb == NULL) {
+        return ERR_VAL;
+    }
+
+    // One update at a time
+    if (self->client != NULL || self->state != OTA_STATE_LISTENING) {
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    self->client = pcb;
+    self->header_used = 0;
+    self->last_activity_us = time_us_64();
+    self->state = OTA_STATE_RECEIVING;
+    tcp_arg(pcb, self);
+    tcp_recv(pcb, on_recv);
+    tcp_err(pcb, on_error);
+    return ERR_OK;
+}
+
+err_t OtaReceiver::on_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* p, err_t err) {
+    OtaReceiver* self = (OtaReceiver*)arg;
+
+    // The sender closed its side
+    self->client_aborted = false;
+    if (p == NULL) {
+        if (self->client == pcb) {
+            self->writer.abort();
+            self->updates_failed++;
+            event_log.record(EVENT_OTA_FAILED, self->writer.getReceived());
+            self->last_error = "connection closed early";
+            self->drop_client();
+            self->state = self->listener != NULL ? OTA_STATE_LISTENING : OTA_STATE_IDLE;
+        }
+        return self->client_aborted ? ERR_ABRT : ERR_OK;
+    }
+
+    if (self->client != pcb) {
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    TRACE_SCOPE("ota_segment");
+    PerfTimer timer(perf_ota_segment_us);
+    self->last_activity_us = time_us_64();
+
+    // Each segment goes to flash before the window is opened again, which paces the sender
+    uint16_t total = p->tot_len;
+    for (struct pbuf* q = p; q != NULL && self->client != NULL; q = q->next) {
+        self->consume((const uint8_t*)q->payload, q->len);
+    }
+    if (self->client != NULL) {
+        tcp_recved(pcb, total);
+    }
+    pbuf_free(p);
+    perf_ota_bytes.add(total);
+    return self->client_aborted ? ERR_ABRT : ERR_OK;
+}
+
+void OtaReceiver::on_error(void* arg, err_t err) {
+    OtaReceiver* self = (OtaReceiver*)arg;
+    if (self == NULL) {
+        return;
+    }
+
+    // The control block is already gone
+    self->client = NULL;
+    if (self->state == OTA_STATE_RECEIVING) {
+        self->writer.abort();
+        self->updates_failed++;
+        event_log.record(EVENT_OTA_FAILED, self->writer.getReceived());
+        self->last_error = "connection reset";
+        self->state = self->listener != NULL ? OTA_STATE_LISTENING : OTA_STATE_IDLE;
+    }
+}
+
+void OtaReceiver::consume(const uint8_t* data, size_t length) {
+    if (header_used < sizeof(header)) {
+        size_t take = sizeof(header) - header_used;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(header + header_used, data, take);
+        header_used += take;
+        data += take;
+        length -= take;
+        if (header_used < sizeof(header)) {
+            return;
+        }
+
+        ota_header_t parsed;
+        memcpy(&parsed, header, sizeof(parsed));
+        if (!writer.begin(&parsed)) {
+            reply("ERR", writer.getError());
+            return;
+        }
+        printf("\nOTA: receiving %lu byte image\n", (unsigned long)parsed.image_length);
+    }
+
+    if (length > 0 && !writer.write(data, length)) {
+        reply("ERR", writer.getError());
+        return;
+    }
+
+    if (writer.isComplete()) {
+        if (writer.finish()) {
+            reply("OK", NULL);
+        } else {
+            reply("ERR", writer.getError());
+        }
+    }
+}
+
+// Send the one-line answer and close, lwIP sends the queued line before the FIN
+void OtaReceiver::reply(const char* message, const char* reason) {
+    char line[64];
+    int length = snprintf(line, sizeof(line), reason != NULL ? "%s %s\n" : "%s\n", message, reason);
+    tcp_write(client, line, (uint16_t)length, TCP_WRITE_FLAG_COPY);
+    tcp_output(client);
+    drop_client();
+
+    if (writer.isStaged()) {
+        updates_received++;
+        event_log.record(EVENT_OTA_RECEIVED, writer.getImageLength());
+        last_error = NULL;
+        staged_time_us = time_us_64();
+        state = OTA_STATE_INSTALLING;
+        printf("OTA: image verified, installing\n");
+    } else {
+        updates_failed++;
+        event_log.record(EVENT_OTA_FAILED, writer.getReceived());
+        last_error = reason;
+        state = listener != NULL ? OTA_STATE_LISTENING : OTA_STATE_IDLE;
+        printf("OTA: update failed (%s)\n", reason);
+    }
+}
+
+void OtaReceiver::drop_client() {
+    tcp_arg(client, NULL);
+    tcp_recv(client, NULL);
+    tcp_err(client, NULL);
+    if (tcp_close(client) != ERR_OK) {
+        tcp_abort(client);
+        client_aborted = true;
+    }
+    client = NULL;
+}
+
+void OtaReceiver::poll() {
+    uint64_t now = time_us_64();
+
+    if (state == OTA_STATE_RECEIVING && client != NULL &&
+        now - last_activity_us > (uint64_t)OTA_TIMEOUT_MS * 1000) {
+        printf("\nOTA: sender stalled, giving up\n");
+        writer.abort();
+        tcp_arg(client, NULL);
+        tcp_recv(client, NULL);
+        tcp_err(client, NULL);
+        tcp_abort(client);
+        client = NULL;
+        updates_failed++;
+        event_log.record(EVENT_OTA_FAILED, writer.getReceived());
+        last_error = "timeout";
+        state = listener != NULL ? OTA_STATE_LISTENING : OTA_STATE_IDLE;
+    }
+
+    if (state == OTA_STATE_INSTALLING && now - staged_time_us > (uint64_t)OTA_INSTALL_DELAY_MS * 1000) {
+        install();
+    }
+}
+
+absolute_time_t OtaReceiver::getWakeTime() const {
+    if (state == OTA_STATE_RECEIVING && client != NULL) {
+        return from_us_since_boot(last_activity_us + (uint64_t)OTA_TIMEOUT_MS * 1000 + 1);
+    }
+    if (state == OTA_STATE_INSTALLING) {
+        return from_us_since_boot(staged_time_us + (uint64_t)OTA_INSTALL_DELAY_MS * 1000 + 1);
+    }
+    return at_the_end_of_time;
+}
+
+// Copy the staged image over the running firmware a sector at a time, then reset.
+// Runs from RAM with interrupts off and the other core parked, because the
+// code it would otherwise execute is what it is overwriting.
+static uint8_t install_buffer[FLASH_SECTOR_SIZE];
+static MemoryRegion memory_install("ota.install", sizeof(install_buffer));
+
+static void __no_inline_not_in_flash_func(install_image)(uint32_t length) {
+    for (uint32_t offset = 0; offset < length; offset += FLASH_SECTOR_SIZE) {
+        // XIP is off while the flash is written, so the source goes through RAM
+        const volatile uint32_t* source = (const volatile uint32_t*)(XIP_BASE + FLASH_OTA_OFFSET + offset);
+        uint32_t* destination = (uint32_t*)install_buffer;
+        for (uint32_t i = 0; i < FLASH_SECTOR_SIZE / 4; i++) {
+            destination[i] = source[i];
+        }
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        flash_range_program(offset, install_buffer, FLASH_SECTOR_SIZE);
+    }
+
+    // Same reset as watchdog_reboot(), which lives in the flash just rewritten
+    watchdog_hw->ctrl = WATCHDOG_CTRL_TRIGGER_BITS;
+    while (true) {
+        tight_loop_contents();
+    }
+}
+
+void OtaReceiver::install() {
+    if (!writer.isStaged()) {
+        printf("OTA: no verified image staged\n");
+        return;
+    }
+
+    printf("OTA: installing %lu bytes and restarting...\n", (unsigned long)writer.getImageLength());
+    console_flush(CONSOLE_BLOCK_TIMEOUT_US);
+    stop();
+    event_log.record(EVENT_REBOOT, 1);
+    event_log.flush();
+
+    // Reset everything but the oscillators when the watchdog fires, as watchdog_reboot() does
+    hw_set_bits(&psm_hw->wdsel, PSM_WDSEL_BITS & ~(PSM_WDSEL_ROSC_BITS | PSM_WDSEL_XOSC_BITS));
+
+    multicore_lockout_start_blocking();
+    save_and_disable_interrupts();
+    install_image(writer.getImageLength());
+}
+
+const char* OtaReceiver::state_name(ota_state_t state) {
+    switch (state) {
+        case OTA_STATE_IDLE: return "idle";
+        case OTA_STATE_LISTENING: return "listening";
+        case OTA_STATE_RECEIVING: return "receiving";
+        case OTA_STATE_INSTALLING: return "installing";
+        default: return "unknown";
+    }
+}
+
+void OtaReceiver::print_status() {
+    printf("OTA: %s", state_name(state));
+    if (state != OTA_STATE_IDLE) {
+        printf(" on port %d", OTA_PORT);
+    }
+    printf("\n");
+    if (state == OTA_STATE_RECEIVING) {
+        printf("  Received: %lu of %lu bytes\n",
+               (unsigned long)writer.getReceived(), (unsigned long)writer.getImageLength());
+    }
+    printf("  Firmware: %lu bytes, staging region %lu bytes at 0x%06lx\n",
+           (unsigned long)firmware_size(),
+           (unsigned long)writer.getSize(), (unsigned long)FLASH_OTA_OFFSET);
+    printf("  Updates: %lu received, %lu failed", (unsigned long)updates_received, (unsigned long)updates_failed);
+    if (last_error != NULL) {
+        printf(" (last: %s)", last_error);
+    }
+    printf("\n");
+}
+
+#endif // OTA_HOST
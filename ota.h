@@ -0,0 +1,154 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "flash_device.h"
+#include "sha256.h"
+
+// Over-the-air firmware update
+//
+// The sender connects to OTA_PORT and writes an ota_header_t followed by the
+// image, which is the .bin that build.sh makes (the flash contents from
+// offset 0, boot2 included). The device answers with one line, "OK" or
+// "ERR <reason>", and closes the connection. ota_send.py does the sending.
+//
+// The image streams straight into the staging region in the upper half of
+// flash a page at a time as segments arrive: a sector is erased when the
+// write reaches it, each page is read back after programming, and SHA-256
+// runs over the data as it goes, so nothing larger than one page is held in
+// RAM. Once the digest matches and the image looks bootable, a routine
+// running from RAM copies the staging region over the running firmware and
+// resets. The RP2040 always boots from the start of flash, so this copy is
+// the bank switch; until it starts, a failed or abandoned update leaves the
+// running firmware untouched. Losing power during the copy needs a BOOTSEL
+// reload.
+//
+// Building with OTA_HOST leaves out the network and install parts so the
+// streaming writer can be tested on a PC against a simulated FlashDevice.
+
+#define OTA_PORT 4242
+#define OTA_MAGIC 0x3141544F        // "OTA1"
+#define OTA_TIMEOUT_MS 10000        // Longest gap between segments before giving up
+#define OTA_INSTALL_DELAY_MS 500    // Time for the reply to reach the sender
+
+typedef struct {
+    uint32_t magic;
+    uint32_t image_length;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+} ota_header_t;
+
+// Streams an image into a staging region of flash
+class OtaStagingWriter {
+private:
+    FlashDevice* flash;
+    uint32_t base_offset;
+    uint32_t size;
+
+    bool open;
+    bool staged;                // The last image written completely and verified
+    uint32_t image_length;
+    uint8_t expected_sha256[SHA256_DIGEST_SIZE];
+    uint32_t received;
+    sha256_state_t sha;
+    uint8_t page[FlashDevice::PAGE_SIZE];
+    uint32_t page_used;
+    uint32_t pages_written;
+    const char* error;
+
+    bool program_page();
+    bool fail(const char* reason);
+
+public:
+    // Constructor
+    OtaStagingWriter(FlashDevice* flash, uint32_t base_offset, uint32_t size);
+
+    // Public interface
+    bool begin(const ota_header_t* header);
+    bool write(const uint8_t* data, size_t length);
+    bool finish();              // Flushes the last page and verifies the image
+    void abort();
+
+    // Checks the boot2 checksum and vector table of an image linked to run from flash
+    static bool image_bootable(const uint8_t* image, uint32_t length, const char** reason);
+
+    // Getter methods
+    bool isOpen() const { return open; }
+    bool isStaged() const { return staged; }
+    bool isComplete() const { return open && received == image_length; }
+    uint32_t getReceived() const { return received; }
+    uint32_t getImageLength() const { return image_length; }
+    uint32_t getSize() const { return size; }
+    const char* getError() const { return error; }
+};
+
+#ifndef OTA_HOST
+
+#include "pico/stdlib.h"
+
+typedef enum {
+    OTA_STATE_IDLE = 0,         // Not listening
+    OTA_STATE_LISTENING,        // Waiting for a sender
+    OTA_STATE_RECEIVING,        // Streaming an image into staging
+    OTA_STATE_INSTALLING        // Verified, about to copy and reset
+} ota_state_t;
+
+struct tcp_pcb;
+struct pbuf;
+
+// Accepts updates over TCP, one connection at a time
+class OtaReceiver {
+private:
+    OtaStagingWriter writer;
+    ota_state_t state;
+    struct tcp_pcb* listener;
+    struct tcp_pcb* client;
+    bool client_aborted;        // Closing failed inside a callback, lwIP must be told
+
+    // The header is gathered first, it can be split across segments
+    uint8_t header[sizeof(ota_header_t)];
+    uint32_t header_used;
+
+    uint64_t last_activity_us;
+    uint64_t staged_time_us;
+
+    // Statistics
+    uint32_t updates_received;
+    uint32_t updates_failed;
+    const char* last_error;
+
+    void consume(const uint8_t* data, size_t length);
+    void reply(const char* message, const char* reason);
+    void drop_client();
+
+    static int8_t on_accept(void* arg, struct tcp_pcb* pcb, int8_t err);
+    static int8_t on_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* p, int8_t err);
+    static void on_error(void* arg, int8_t err);
+
+public:
+    // Constructor
+    OtaReceiver();
+
+    // Public interface
+    bool listen();
+    void stop();
+    void poll();                // Times out stalled senders and installs a verified image
+    void install();             // Does not return
+    void print_status();
+
+    // Getter methods
+    ota_state_t getState() const { return state; }
+    uint32_t getUpdatesReceived() const { return updates_received; }
+    uint32_t getUpdatesFailed() const { return updates_failed; }
+    absolute_time_t getWakeTime() const;    // When poll() next has work without a packet arriving
+
+    static const char* state_name(ota_state_t state);
+};
+
+// Global instance
+extern OtaReceiver ota;
+
+#endif // OTA_HOST
+
+#endif // OTA_H
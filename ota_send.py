@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""Send a firmware image to one or more Pico W boards running 'ota on'.
+
+Usage: ota_send.py build/picowbase.bin <host> [<host> ...]
+
+Each board gets the header (magic, length, SHA-256) and the image over
+TCP, answers OK or ERR <reason>, then installs the image and restarts.
+"""
+
+import hashlib
+import socket
+import struct
+import sys
+
+OTA_PORT = 4242
+OTA_MAGIC = 0x3141544F  # "OTA1"
+
+
+def send(host, image, header):
+    with socket.create_connection((host, OTA_PORT), timeout=30) as sock:
+        sock.sendall(header)
+        sock.sendall(image)
+        reply = sock.makefile().readline().strip()
+    return reply or "ERR no reply"
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(__doc__.strip())
+        return 2
+
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+    header = struct.pack("<II", OTA_MAGIC, len(image)) + hashlib.sha256(image).digest()
+
+    failures = 0
+    for host in sys.argv[2:]:
+        try:
+            reply = send(host, image, header)
+        except OSError as e:
+            reply = "ERR %s" % e
+        print("%s: %s" % (host, reply))
+        if reply != "OK":
+            failures += 1
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <string.h>
+#include "perf.h"
+
+// Registry heads, zero-initialised before any constructor runs
+static PerfCounter* perf_counters;
+static PerfHistogram* perf_histograms;
+
+// Binary export format, little endian:
+//   perf_export_header_t
+//   per counter:   uint8_t name_len, name, uint32_t value
+//   per histogram: uint8_t name_len, name, count, max, sum (uint64_t), 33 buckets
+#define PERF_EXPORT_MAGIC 0x46524550  // "PERF" in hex
+#define PERF_EXPORT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t counter_count;
+    uint16_t histogram_count;
+    uint16_t reserved;
+    uint64_t time_us;
+} perf_export_header_t;
+
+PerfCounter::PerfCounter(const char* name) {
+    this->name = name;
+    value[0] = 0;
+    value[1] = 0;
+    next = perf_counters;
+    perf_counters = this;
+}
+
+void PerfCounter::reset() {
+    uint32_t state = save_and_disable_interrupts();
+    value[0] = 0;
+    value[1] = 0;
+    restore_interrupts(state);
+}
+
+PerfCounter* PerfCounter::first() {
+    return perf_counters;
+}
+
+PerfHistogram::PerfHistogram(const char* name) {
+    this->name = name;
+    memset(buckets, 0, sizeof(buckets));
+    max[0] = 0;
+    max[1] = 0;
+    sum[0] = 0;
+    sum[1] = 0;
+    next = perf_histograms;
+    perf_histograms = this;
+}
+
+void PerfHistogram::snapshot(perf_histogram_snapshot_t* snapshot) const {
+    memset(snapshot, 0, sizeof(*snapshot));
+    uint32_t state = save_and_disable_interrupts();
+    for (int core = 0; core < 2; core++) {
+        for (int i = 0; i < BUCKETS; i++) {
+            snapshot->buckets[i] += buckets[core][i];
+            snapshot->count += buckets[core][i];
+        }
+        snapshot->sum += sum[core];
+        if (max[core] > snapshot->max) {
+            snapshot->max = max[core];
+        }
+    }
+    restore_interrupts(state);
+}
+
+void PerfHistogram::reset() {
+    uint32_t state = save_and_disable_interrupts();
+    memset(buckets, 0, sizeof(buckets));
+    max[0] = 0;
+    max[1] = 0;
+    sum[0] = 0;
+    sum[1] = 0;
+    restore_interrupts(state);
+}
+
+PerfHistogram* PerfHistogram::first() {
+    return perf_histograms;
+}
+
+// Upper bound of the bucket holding the given percentile
+uint32_t perf_histogram_percentile(const perf_histogram_snapshot_t* snapshot, uint32_t percent) {
+    if (snapshot->count == 0) {
+        return 0;
+    }
+    uint64_t target = ((uint64_t)snapshot->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < PerfHistogram::BUCKETS; i++) {
+        seen += snapshot->buckets[i];
+        if (seen >= target) {
+            uint32_t bound = i == 0 ? 0 : (i == 32 ? 0xFFFFFFFF : (1u << i) - 1);
+            return bound < snapshot->max ? bound : snapshot->max;
+        }
+    }
+    return snapshot->max;
+}
+
+void perf_print() {
+    printf("Counters:\n");
+    for (PerfCounter* counter = PerfCounter::first(); counter; counter = counter->getNext()) {
+        printf("  %-24s %lu\n", counter->getName(), (unsigned long)counter->get());
+    }
+
+    printf("Histograms:                  count      avg      p50      p99      max\n");
+    for (PerfHistogram* histogram = PerfHistogram::first(); histogram; histogram = histogram->getNext()) {
+        perf_histogram_snapshot_t snapshot;
+        histogram->snapshot(&snapshot);
+        printf("  %-24s %8lu %8lu %8lu %8lu %8lu\n", histogram->getName(),
+               (unsigned long)snapshot.count,
+               (unsigned long)(snapshot.count ? snapshot.sum / snapshot.count : 0),
+               (unsigned long)perf_histogram_percentile(&snapshot, 50),
+               (unsigned long)perf_histogram_percentile(&snapshot, 99),
+               (unsigned long)snapshot.max);
+    }
+}
+
+void perf_reset() {
+    for (PerfCounter* counter = PerfCounter::first(); counter; counter = counter->getNext()) {
+        counter->reset();
+    }
+    for (PerfHistogram* histogram = PerfHistogram::first(); histogram; histogram = histogram->getNext()) {
+        histogram->reset();
+    }
+}
+
+static void export_name(const char* name, void (*write)(const void*, size_t, void*), void* context) {
+    uint8_t length = (uint8_t)strnlen(name, 255);
+    write(&length, 1, context);
+    write(name, length, context);
+}
+
+// Stream a snapshot of every counter and histogram in the binary format
+void perf_export(void (*write)(const void* data, size_t length, void* context), void* context) {
+    perf_export_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PERF_EXPORT_MAGIC;
+    header.version = PERF_EXPORT_VERSION;
+    for (PerfCounter* counter = PerfCounter::first(); counter; counter = counter->getNext()) {
+        header.counter_count++;
+    }
+    for (PerfHistogram* histogram = PerfHistogram::first(); histogram; histogram = histogram->getNext()) {
+        header.histogram_count++;
+    }
+    header.time_us = time_us_64();
+    write(&header, sizeof(header), context);
+
+    for (PerfCounter* counter = PerfCounter::first(); counter; counter = counter->getNext()) {
+        uint32_t value = counter->get();
+        export_name(counter->getName(), write, context);
+        write(&value, sizeof(value), context);
+    }
+
+    for (PerfHistogram* histogram = PerfHistogram::first(); histogram; histogram = histogram->getNext()) {
+        perf_histogram_snapshot_t snapshot;
+        histogram->snapshot(&snapshot);
+        export_name(histogram->getName(), write, context);
+        write(&snapshot.count, sizeof(snapshot.count), context);
+        write(&snapshot.max, sizeof(snapshot.max), context);
+        write(&snapshot.sum, sizeof(snapshot.sum), context);
+        write(snapshot.buckets, sizeof(snapshot.buckets), context);
+    }
+}
+
+// Hex lines for the serial console, 32 bytes per line
+typedef struct {
+    uint32_t column;
+} hex_writer_t;
+
+static void write_hex(const void* data, size_t length, void* context) {
+    hex_writer_t* writer = (hex_writer_t*)context;
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        if (writer->column == 0) {
+            printf("PERF:");
+        }
+        printf("%02x", bytes[i]);
+        if (++writer->column == 32) {
+            printf("\n");
+            writer->column = 0;
+        }
+    }
+}
+
+void perf_export_hex() {
+    hex_writer_t writer = {0};
+    perf_export(write_hex, &writer);
+    if (writer.column != 0) {
+        printf("\n");
+    }
+    printf("PERF:END\n");
+}
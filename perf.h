@@ -0,0 +1,105 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+// Performance counters and latency histograms.
+//
+// Declare one as a global in the module that owns it:
+//     static PerfCounter perf_spi_bytes("spi.bytes");
+// The constructor links it into a registry during static initialisation,
+// so nothing needs to be called at runtime and 'perf' finds every one.
+//
+// Each core updates its own slot with interrupts masked for the
+// read-modify-write, so updates from both cores and from interrupt
+// handlers are never lost. Readers sum the slots.
+
+class PerfCounter {
+private:
+    const char* name;
+    PerfCounter* next;
+    uint32_t value[2];              // One slot per core
+
+public:
+    explicit PerfCounter(const char* name);
+
+    void add(uint32_t amount) {
+        uint32_t state = save_and_disable_interrupts();
+        value[get_core_num()] += amount;
+        restore_interrupts(state);
+    }
+    void increment() { add(1); }
+
+    uint32_t get() const { return value[0] + value[1]; }
+    const char* getName() const { return name; }
+    PerfCounter* getNext() const { return next; }
+    void reset();
+
+    static PerfCounter* first();
+};
+
+// Snapshot of a histogram, summed over both cores
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[33];           // Bucket n holds values in [2^(n-1), 2^n), bucket 0 holds 0
+} perf_histogram_snapshot_t;
+
+class PerfHistogram {
+public:
+    static const int BUCKETS = 33;
+
+private:
+    const char* name;
+    PerfHistogram* next;
+    uint32_t buckets[2][BUCKETS];
+    uint32_t max[2];
+    uint64_t sum[2];
+
+public:
+    explicit PerfHistogram(const char* name);
+
+    void record(uint32_t sample) {
+        int bucket = sample ? 32 - __builtin_clz(sample) : 0;
+        uint core = get_core_num();
+        uint32_t state = save_and_disable_interrupts();
+        buckets[core][bucket]++;
+        sum[core] += sample;
+        if (sample > max[core]) {
+            max[core] = sample;
+        }
+        restore_interrupts(state);
+    }
+
+    const char* getName() const { return name; }
+    PerfHistogram* getNext() const { return next; }
+    void snapshot(perf_histogram_snapshot_t* snapshot) const;
+    void reset();
+
+    static PerfHistogram* first();
+};
+
+// Records the time spent in a scope into a histogram, in microseconds
+class PerfTimer {
+private:
+    PerfHistogram& histogram;
+    uint32_t start;
+
+public:
+    explicit PerfTimer(PerfHistogram& histogram) : histogram(histogram), start(time_us_32()) {}
+    ~PerfTimer() { histogram.record(time_us_32() - start); }
+};
+
+// Registry-wide operations
+void perf_print();
+void perf_reset();
+void perf_export(void (*write)(const void* data, size_t length, void* context), void* context);
+void perf_export_hex();
+uint32_t perf_histogram_percentile(const perf_histogram_snapshot_t* snapshot, uint32_t percent);
+
+#endif // PERF_H
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+#include "power.h"
+#include "perf.h"
+#include "memory.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/netif.h"
+#include "hardware/sync.h"
+
+// Global instance
+PowerManager power;
+static MemoryRegion memory_power("power", sizeof(power));
+
+static PerfHistogram perf_sleep_us("power.sleep_us");
+static PerfHistogram perf_event_wake_us("power.event_wake_us");    // Interrupt to the main loop running again
+static PerfHistogram perf_timer_late_us("power.timer_late_us");    // Deadline to the main loop running again
+
+static const char* const policy_names[POWER_PM_COUNT] = {"auto", "off", "performance", "aggressive"};
+
+// Driver functions the netif hooks pass packets on to
+static netif_input_fn driver_input;
+static netif_linkoutput_fn driver_linkoutput;
+
+static err_t counting_input(struct pbuf* p, struct netif* netif) {
+    power.note_traffic(true);
+    return driver_input(p, netif);
+}
+
+static err_t counting_linkoutput(struct netif* netif, struct pbuf* p) {
+    power.note_traffic(false);
+    return driver_linkoutput(netif, p);
+}
+
+// Constructor
+PowerManager::PowerManager() {
+    policy = POWER_PM_AUTO;
+    radio_pm = 0;
+    radio_pm_set = false;
+    packets_in = 0;
+    packets_out = 0;
+    last_traffic_us = 0;
+    event_us = 0;
+    stats_start_us = 0;
+    asleep_us = 0;
+    sleeps = 0;
+    timer_wakes = 0;
+    event_wakes = 0;
+    pm_switches = 0;
+}
+
+void PowerManager::idle(absolute_time_t until) {
+    until = power_earliest(until, make_timeout_time_ms(POWER_MAX_SLEEP_MS));
+    uint64_t start = time_us_64();
+    if (to_us_since_boot(until) <= start) {
+        return;
+    }
+
+    // WFE returns at once if an event arrived since the last one, which
+    // only costs an extra pass of the main loop
+    event_us = 0;
+    bool timed_out = best_effort_wfe_or_timeout(until);
+    uint64_t woke = time_us_64();
+    uint32_t noted = event_us;
+
+    uint32_t slept = (uint32_t)(woke - start);
+    asleep_us += slept;
+    sleeps++;
+    perf_sleep_us.record(slept);
+    if (timed_out) {
+        timer_wakes++;
+        perf_timer_late_us.record((uint32_t)(woke - to_us_since_boot(until)));
+    } else {
+        event_wakes++;
+        if (noted != 0) {
+            perf_event_wake_us.record((uint32_t)woke - noted);
+        }
+    }
+}
+
+void PowerManager::note_event() {
+    if (event_us == 0) {
+        event_us = time_us_32() | 1;
+    }
+}
+
+void PowerManager::note_traffic(bool received) {
+    if (received) {
+        packets_in++;
+    } else {
+        packets_out++;
+    }
+    last_traffic_us = time_us_64();
+}
+
+void PowerManager::hook_netif() {
+    // The driver sets the functions up again whenever the interface is brought up
+    struct netif* netif = &cyw43_state.netif[CYW43_ITF_STA];
+    if (netif->input != NULL && netif->input != counting_input) {
+        driver_input = netif->input;
+        netif->input = counting_input;
+    }
+    if (netif->linkoutput != NULL && netif->linkoutput != counting_linkoutput) {
+        driver_linkoutput = netif->linkoutput;
+        netif->linkoutput = counting_linkoutput;
+    }
+}
+
+void PowerManager::set_radio_pm(uint32_t mode) {
+    if (radio_pm_set && radio_pm == mode) {
+        return;
+    }
+    if (cyw43_wifi_pm(&cyw43_state, mode) != 0) {
+        return;  // Radio not up yet, try again on the next poll
+    }
+    if (radio_pm_set) {
+        pm_switches++;
+    }
+    radio_pm = mode;
+    radio_pm_set = true;
+}
+
+void PowerManager::poll() {
+    if (stats_start_us == 0) {
+        stats_start_us = time_us_64();
+        last_traffic_us = stats_start_us;
+    }
+    hook_netif();
+
+    switch (policy) {
+        case POWER_PM_OFF: set_radio_pm(CYW43_NO_POWERSAVE_MODE); break;
+        case POWER_PM_PERFORMANCE: set_radio_pm(CYW43_PERFORMANCE_PM); break;
+        case POWER_PM_AGGRESSIVE: set_radio_pm(CYW43_AGGRESSIVE_PM); break;
+        default:
+            if (time_us_64() - last_traffic_us < (uint64_t)POWER_QUIET_MS * 1000) {
+                set_radio_pm(CYW43_NO_POWERSAVE_MODE);
+            } else {
+                set_radio_pm(CYW43_AGGRESSIVE_PM);
+            }
+            break;
+    }
+}
+
+void PowerManager::set_policy(power_pm_policy_t policy) {
+    if (policy >= POWER_PM_COUNT) {
+        return;
+    }
+    this->policy = policy;
+
+    // Treat the change as traffic, so auto starts out responsive
+    last_traffic_us = time_us_64();
+    poll();
+}
+
+uint32_t PowerManager::getIdlePercent() const {
+    uint64_t elapsed = time_us_64() - stats_start_us;
+    if (stats_start_us == 0 || elapsed == 0) {
+        return 0;
+    }
+    return (uint32_t)(asleep_us * 100 / elapsed);
+}
+
+absolute_time_t PowerManager::getWakeTime() const {
+    if (policy != POWER_PM_AUTO || !radio_pm_set || radio_pm != CYW43_NO_POWERSAVE_MODE) {
+        return at_the_end_of_time;
+    }
+    return from_us_since_boot(last_traffic_us + (uint64_t)POWER_QUIET_MS * 1000);
+}
+
+const char* PowerManager::policy_name(power_pm_policy_t policy) {
+    return policy < POWER_PM_COUNT ? policy_names[policy] : "unknown";
+}
+
+static const char* radio_pm_name(uint32_t mode) {
+    if (mode == CYW43_NO_POWERSAVE_MODE) return "off";
+    if (mode == CYW43_PERFORMANCE_PM) return "performance";
+    if (mode == CYW43_AGGRESSIVE_PM) return "aggressive";
+    return "custom";
+}
+
+void PowerManager::print_status() {
+    printf("Power:\n");
+    printf("  Radio power save: %s, now %s, %lu switches\n", policy_name(policy),
+           radio_pm_set ? radio_pm_name(radio_pm) : "not set", (unsigned long)pm_switches);
+    printf("  Traffic: %lu packets in, %lu out, last %lu ms ago\n",
+           (unsigned long)packets_in, (unsigned long)packets_out,
+           (unsigned long)((time_us_64() - last_traffic_us) / 1000));
+    printf("  Idle: %lu%% asleep, %lu sleeps, %lu ended by a deadline, %lu by an event\n",
+           (unsigned long)getIdlePercent(), (unsigned long)sleeps,
+           (unsigned long)timer_wakes, (unsigned long)event_wakes);
+
+    perf_histogram_snapshot_t snapshot;
+    perf_event_wake_us.snapshot(&snapshot);
+    printf("  Event wake: p50 %lu us, p99 %lu us, max %lu us\n",
+           (unsigned long)perf_histogram_percentile(&snapshot, 50),
+           (unsigned long)perf_histogram_percentile(&snapshot, 99),
+           (unsigned long)snapshot.max);
+    perf_timer_late_us.snapshot(&snapshot);
+    printf("  Deadline wake: p50 %lu us, p99 %lu us, max %lu us late\n",
+           (unsigned long)perf_histogram_percentile(&snapshot, 50),
+           (unsigned long)perf_histogram_percentile(&snapshot, 99),
+           (unsigned long)snapshot.max);
+}
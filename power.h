@@ -0,0 +1,90 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+
+// Idle sleep and radio power saving
+//
+// The main loop has no tick: once a pass finds nothing to do, idle() sleeps
+// with WFE until the earliest deadline any module reported, or until an
+// interrupt (USB, timer, GPIO, the radio's host wake line) or an SEV from
+// core 1 ends it early. Core 1 does the same between DMA interrupts. Each
+// wake is timed: timer wakes by how late they ran after the deadline, event
+// wakes from the interrupt that noted itself with note_event().
+//
+// Dormant mode is not used, it stops the clocks USB and the radio's SPI bus
+// run on, and the console has to stay attached.
+//
+// With the auto policy the radio runs without power saving while packets
+// are flowing and drops to aggressive power save after POWER_QUIET_MS
+// without any, so a battery unit only pays for low latency while it is
+// being talked to. Packets are counted by hooking the station netif.
+
+#define POWER_QUIET_MS 5000         // No packets for this long before aggressive power save
+#define POWER_MAX_SLEEP_MS 1000     // Longest single sleep, bounds anything polled without a deadline
+
+typedef enum {
+    POWER_PM_AUTO = 0,              // Switch on traffic
+    POWER_PM_OFF,                   // Always CYW43_NO_POWERSAVE_MODE
+    POWER_PM_PERFORMANCE,           // Always CYW43_PERFORMANCE_PM
+    POWER_PM_AGGRESSIVE,            // Always CYW43_AGGRESSIVE_PM
+    POWER_PM_COUNT
+} power_pm_policy_t;
+
+class PowerManager {
+private:
+    power_pm_policy_t policy;
+    uint32_t radio_pm;              // Last mode given to the driver
+    bool radio_pm_set;
+
+    // Traffic, counted from the netif hooks
+    uint32_t packets_in;
+    uint32_t packets_out;
+    uint64_t last_traffic_us;
+
+    // Set by the first interrupt that notes itself during a sleep
+    volatile uint32_t event_us;
+
+    // Statistics
+    uint64_t stats_start_us;
+    uint64_t asleep_us;
+    uint32_t sleeps;
+    uint32_t timer_wakes;
+    uint32_t event_wakes;
+    uint32_t pm_switches;
+
+    void hook_netif();
+    void set_radio_pm(uint32_t mode);
+
+public:
+    // Constructor
+    PowerManager();
+
+    // Public interface
+    void idle(absolute_time_t until);
+    void note_event();              // Interrupt handlers, for wake latency
+    void note_traffic(bool received);
+    void poll();                    // Hooks the netif and applies the power save policy
+    void set_policy(power_pm_policy_t policy);
+    void print_status();
+
+    // Getter methods
+    power_pm_policy_t getPolicy() const { return policy; }
+    uint32_t getSleeps() const { return sleeps; }
+    uint32_t getIdlePercent() const;
+    absolute_time_t getWakeTime() const;    // When auto drops the radio into power save
+
+    static const char* policy_name(power_pm_policy_t policy);
+};
+
+// Earlier of two deadlines
+static inline absolute_time_t power_earliest(absolute_time_t a, absolute_time_t b) {
+    return absolute_time_diff_us(a, b) < 0 ? b : a;
+}
+
+// Global instance
+extern PowerManager power;
+
+#endif // POWER_H
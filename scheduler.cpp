@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include "scheduler.h"
+#include "perf.h"
+#include "memory.h"
+#include "trace.h"
+
+// Global instance
+PeriodicScheduler scheduler;
+static MemoryRegion memory_scheduler("scheduler", sizeof(scheduler));
+
+static PerfHistogram perf_late_us("sched.late_us");
+
+// Constructor
+PeriodicScheduler::PeriodicScheduler() {
+    memset(tasks, 0, sizeof(tasks));
+    task_count = 0;
+}
+
+int PeriodicScheduler::add(const char* name, scheduler_task_fn function, void* context, uint32_t budget_us) {
+    if (task_count >= SCHEDULER_MAX_TASKS) {
+        printf("Scheduler: no room for %s\n", name);
+        return -1;
+    }
+    Task* task = &tasks[task_count];
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->function = function;
+    task->context = context;
+    task->budget_us = budget_us;
+    return task_count++;
+}
+
+void PeriodicScheduler::start(int id, uint32_t interval_ms) {
+    if (id < 0 || id >= task_count || interval_ms == 0) {
+        return;
+    }
+    Task* task = &tasks[id];
+    task->interval_us = interval_ms * 1000;
+    task->due_us = time_us_64() + task->interval_us;
+    task->running = true;
+}
+
+void PeriodicScheduler::stop(int id) {
+    if (id >= 0 && id < task_count) {
+        tasks[id].running = false;
+    }
+}
+
+// Running task due soonest, or -1
+int PeriodicScheduler::next_due() const {
+    int next = -1;
+    for (int i = 0; i < task_count; i++) {
+        if (tasks[i].running && (next < 0 || tasks[i].due_us < tasks[next].due_us)) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+void PeriodicScheduler::poll() {
+    // Earliest first, and each task at most once per pass
+    for (int pass = 0; pass < task_count; pass++) {
+        int id = next_due();
+        uint64_t now = time_us_64();
+        if (id < 0 || tasks[id].due_us > now) {
+            return;
+        }
+        Task* task = &tasks[id];
+
+        uint32_t late = (uint32_t)(now - task->due_us);
+        perf_late_us.record(late);
+        if (late > task->max_late_us) {
+            task->max_late_us = late;
+        }
+        if (late > task->budget_us) {
+            task->overruns++;
+        }
+
+        // Next due on the original grid, skipping the runs that were missed entirely
+        uint32_t missed = late / task->interval_us;
+        task->skipped += missed;
+        task->due_us += (uint64_t)(missed + 1) * task->interval_us;
+
+        TRACE_BEGIN(task->name);
+        task->function(task->context);
+        TRACE_END(task->name);
+        task->runs++;
+
+        uint32_t run = (uint32_t)(time_us_64() - now);
+        if (run > task->max_run_us) {
+            task->max_run_us = run;
+        }
+    }
+}
+
+bool PeriodicScheduler::isRunning(int id) const {
+    return id >= 0 && id < task_count && tasks[id].running;
+}
+
+uint32_t PeriodicScheduler::getInterval(int id) const {
+    return id >= 0 && id < task_count ? tasks[id].interval_us / 1000 : 0;
+}
+
+uint32_t PeriodicScheduler::getOverruns() const {
+    uint32_t overruns = 0;
+    for (int i = 0; i < task_count; i++) {
+        overruns += tasks[i].overruns;
+    }
+    return overruns;
+}
+
+absolute_time_t PeriodicScheduler::getWakeTime() const {
+    int id = next_due();
+    return id < 0 ? at_the_end_of_time : from_us_since_boot(tasks[id].due_us);
+}
+
+void PeriodicScheduler::print_status() {
+    printf("Periodic tasks:\n");
+    printf("  %-12s %8s %8s %8s %8s %8s %9s %9s\n",
+           "Name", "Every", "Runs", "Budget", "Overrun", "Skipped", "Max late", "Max run");
+    for (int i = 0; i < task_count; i++) {
+        const Task* task = &tasks[i];
+        char interval[12];
+        if (task->running) {
+            snprintf(interval, sizeof(interval), "%lums", (unsigned long)(task->interval_us / 1000));
+        } else {
+            snprintf(interval, sizeof(interval), "stopped");
+        }
+        printf("  %-12s %8s %8lu %6luus %8lu %8lu %7luus %7luus\n", task->name, interval,
+               (unsigned long)task->runs, (unsigned long)task->budget_us, (unsigned long)task->overruns,
+               (unsigned long)task->skipped, (unsigned long)task->max_late_us, (unsigned long)task->max_run_us);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+
+// Periodic tasks run from the core 0 main loop
+//
+// Each task has an interval and a jitter budget. The next run is due one
+// interval after the previous due time rather than after the previous run,
+// so a late run does not push the ones after it back. A run later than the
+// budget counts as an overrun, and a task that fell a whole interval behind
+// skips the runs it missed instead of catching up in a burst.
+//
+// getWakeTime() feeds the earliest due time into the main loop's idle
+// sleep, whose timer alarm wakes the core for it, so a waiting task costs
+// no polling. Tasks run where cyw43 calls are allowed, which is why the LED
+// is driven from here rather than from core 1 or a timer interrupt.
+
+#define SCHEDULER_MAX_TASKS 8
+#define SCHEDULER_JITTER_BUDGET_US 2000     // Default lateness allowed before a run counts as an overrun
+
+typedef void (*scheduler_task_fn)(void* context);
+
+class PeriodicScheduler {
+private:
+    struct Task {
+        const char* name;
+        scheduler_task_fn function;
+        void* context;
+        uint32_t interval_us;
+        uint32_t budget_us;
+        uint64_t due_us;
+        bool running;
+
+        // Statistics
+        uint32_t runs;
+        uint32_t overruns;
+        uint32_t skipped;
+        uint32_t max_late_us;
+        uint32_t max_run_us;
+    };
+
+    Task tasks[SCHEDULER_MAX_TASKS];
+    int task_count;
+
+    int next_due() const;
+
+public:
+    // Constructor
+    PeriodicScheduler();
+
+    // Public interface
+    int add(const char* name, scheduler_task_fn function, void* context,
+            uint32_t budget_us = SCHEDULER_JITTER_BUDGET_US);  // Task id, or -1 when full
+    void start(int id, uint32_t interval_ms);   // First run one interval from now
+    void stop(int id);
+    void poll();
+    void print_status();
+
+    // Getter methods
+    bool isRunning(int id) const;
+    uint32_t getInterval(int id) const;         // Milliseconds
+    int getTaskCount() const { return task_count; }
+    uint32_t getOverruns() const;
+    absolute_time_t getWakeTime() const;
+};
+
+// Global instance
+extern PeriodicScheduler scheduler;
+
+#endif // SCHEDULER_H
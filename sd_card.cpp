@@ -5,18 +5,75 @@
 #include "hardware/gpio.h"
 #include "hardware/dma.h"
 #include "sd_card.h"
+#include "trace.h"
+#include "perf.h"
+#include "memory.h"
 
-// Static member definition
-spi_inst_t* SDCard::SD_SPI_PORT = spi1;
+// Progress and diagnostics from init() and parse_boot_sector(), left out for the
+// quiet mount at boot
+#define INIT_LOG(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
 
-// Global instance
-SDCard sd_card;
+// Performance counters
+static PerfCounter perf_spi_bytes("spi.bytes");
+static PerfCounter perf_cmd_read("sd.cmd.read");
+static PerfCounter perf_cmd_write("sd.cmd.write");
+static PerfCounter perf_cmd_other("sd.cmd.other");
+static PerfCounter perf_cmd_errors("sd.cmd.errors");
+static PerfCounter perf_init_retries("sd.init.retries");
+static PerfCounter perf_token_spins("sd.token.spins");
+static PerfCounter perf_busy_spins("sd.busy.spins");
+static PerfHistogram perf_read_us("sd.read_us");
+static PerfHistogram perf_write_us("sd.write_us");
+static PerfHistogram perf_write_multi_us("sd.write_multi_us");
+static PerfHistogram perf_read_multi_us("sd.read_multi_us");
+static PerfCounter perf_erase_blocks("sd.erase.blocks");
+static PerfHistogram perf_erase_us("sd.erase_us");
+
+// Transfer paths for each addressing mode
+const SDCard::Transfers SDCard::block_transfers = {
+    &SDCard::read_block_as<SD_ADDRESS_BLOCK>,
+    &SDCard::read_blocks_as<SD_ADDRESS_BLOCK>,
+    &SDCard::write_block_as<SD_ADDRESS_BLOCK>,
+    &SDCard::write_blocks_as<SD_ADDRESS_BLOCK>,
+    &SDCard::erase_as<SD_ADDRESS_BLOCK>,
+};
+const SDCard::Transfers SDCard::byte_transfers = {
+    &SDCard::read_block_as<SD_ADDRESS_BYTE>,
+    &SDCard::read_blocks_as<SD_ADDRESS_BYTE>,
+    &SDCard::write_block_as<SD_ADDRESS_BYTE>,
+    &SDCard::write_blocks_as<SD_ADDRESS_BYTE>,
+    &SDCard::erase_as<SD_ADDRESS_BYTE>,
+};
+
+// Global instances
+SDCard sd_card(spi1, 11, 12, 13, 14);
+SDCard sd_card2(spi0, 19, 16, 18, 17);
+static MemoryRegion memory_sd("sd_card", sizeof(SDCard));
+static MemoryRegion memory_sd2("sd_card2", sizeof(SDCard));
 
 // Constructor
-SDCard::SDCard() {
+SDCard::SDCard(spi_inst_t* spi_port, int mosi_pin, int miso_pin, int sck_pin, int cs_pin) {
+    this->spi_port = spi_port;
+    this->mosi_pin = mosi_pin;
+    this->miso_pin = miso_pin;
+    this->sck_pin = sck_pin;
+    this->cs_pin = cs_pin;
+    deinit();
+}
+
+// Forget the card and its filesystem, as before init(). The SPI pins stay
+// set up, so init() can be retried at any time.
+void SDCard::deinit() {
+    programming = false;
     initialized = false;
     card_type = SD_TYPE_UNKNOWN;
     card_size = 0;
+    au_blocks = SD_DEFAULT_AU_BLOCKS;
+    erase_size = 0;
+    erase_timeout_s = 0;
+    erase_offset_s = 0;
+    transfers = &block_transfers;
+    memset(&boot_sector, 0, sizeof(boot_sector));
     first_fat_sector = 0;
     root_dir_sector = 0;
     data_sector = 0;
@@ -26,36 +83,54 @@ SDCard::SDCard() {
 
 // Private SPI functions
 void SDCard::spi_init() {
-    ::spi_init(SD_SPI_PORT, 400000);  // Start at 400kHz for initialization
-    gpio_set_function(SD_MOSI_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SD_MISO_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SD_SCK_PIN, GPIO_FUNC_SPI);
-    gpio_init(SD_CS_PIN);
-    gpio_set_dir(SD_CS_PIN, GPIO_OUT);
-    gpio_put(SD_CS_PIN, 1);  // CS high (inactive)
+    ::spi_init(spi_port, 400000);  // Start at 400kHz for initialization
+    gpio_set_function(mosi_pin, GPIO_FUNC_SPI);
+    gpio_set_function(miso_pin, GPIO_FUNC_SPI);
+    gpio_set_function(sck_pin, GPIO_FUNC_SPI);
+    gpio_init(cs_pin);
+    gpio_set_dir(cs_pin, GPIO_OUT);
+    gpio_put(cs_pin, 1);  // CS high (inactive)
 }
 
 void SDCard::cs_low() {
-    gpio_put(SD_CS_PIN, 0);
+    gpio_put(cs_pin, 0);
     sleep_us(1);
 }
 
 void SDCard::cs_high() {
     sleep_us(1);
-    gpio_put(SD_CS_PIN, 1);
+    gpio_put(cs_pin, 1);
 }
 
 uint8_t SDCard::spi_transfer(uint8_t data) {
     uint8_t received = 0;
-    ::spi_write_read_blocking(SD_SPI_PORT, &data, &received, 1);
+    ::spi_write_read_blocking(spi_port, &data, &received, 1);
+    perf_spi_bytes.increment();
     return received;
 }
 
 void SDCard::spi_transfer_multiple(const uint8_t* data_out, uint8_t* data_in, size_t length) {
-    ::spi_write_read_blocking(SD_SPI_PORT, data_out, data_in, length);
+    TRACE_SCOPE("spi_block");
+    ::spi_write_read_blocking(spi_port, data_out, data_in, length);
+    perf_spi_bytes.add(length);
 }
 
-uint8_t SDCard::send_command(uint8_t cmd, uint32_t arg) {
+// With hold_cs the card stays selected for a data phase, and the caller
+// must cs_high() once it is done
+uint8_t SDCard::send_command(uint8_t cmd, uint32_t arg, bool hold_cs) {
+    TRACE_SCOPE("sd_cmd");
+    TRACE_INSTANT("sd_cmd_index", cmd);
+    if (programming && !sync()) {
+        perf_cmd_errors.increment();
+        return 0xFF;
+    }
+    if (cmd == CMD17 || cmd == CMD18) {
+        perf_cmd_read.increment();
+    } else if (cmd == CMD24 || cmd == CMD25) {
+        perf_cmd_write.increment();
+    } else {
+        perf_cmd_other.increment();
+    }
     uint8_t command[6];
     command[0] = 0x40 | cmd;  // Command byte
     command[1] = (arg >> 24) & 0xFF;  // Argument (big endian)
@@ -71,6 +146,11 @@ uint8_t SDCard::send_command(uint8_t cmd, uint32_t arg) {
         spi_transfer(command[i]);
     }
     
+    // STOP_TRANSMISSION is followed by a stuff byte before the response
+    if (cmd == CMD12) {
+        spi_transfer(0xFF);
+    }
+    
     // Wait for response (up to 8 bytes)
     uint8_t response = 0xFF;
     for (int i = 0; i < 8; i++) {
@@ -78,41 +158,177 @@ uint8_t SDCard::send_command(uint8_t cmd, uint32_t arg) {
         if ((response & 0x80) == 0) break;
     }
     
-    cs_high();
+    if (!hold_cs) {
+        cs_high();
+    }
+    if (response & 0x80) {
+        perf_cmd_errors.increment();
+    }
     return response;
 }
 
-// Public interface
-bool SDCard::read_block(uint32_t block_addr, uint8_t* buffer) {
-    uint8_t response = send_command(CMD17, block_addr);
-    if (response != 0) {
-        return false;
+// Wait for the card to release the busy signal (MISO held low)
+bool SDCard::wait_ready(uint32_t timeout_us) {
+    uint32_t start = time_us_32();
+    while (spi_transfer(0xFF) != 0xFF) {
+        perf_busy_spins.increment();
+        if (time_us_32() - start > timeout_us) {
+            return false;
+        }
     }
-    
-    // Wait for data token
+    return true;
+}
+
+// Wait for a write left programming by wait = false
+bool SDCard::sync() {
+    if (!programming) {
+        return true;
+    }
+    programming = false;
+    cs_low();
+    bool ready = wait_ready(WRITE_TIMEOUT_US);
+    cs_high();
+    return ready;
+}
+
+// Receive one data block: wait for the start token, then data and CRC (ignored)
+bool SDCard::read_data(uint8_t* buffer, size_t length) {
     uint8_t token = 0xFF;
     for (int i = 0; i < 1000; i++) {
         token = spi_transfer(0xFF);
         if (token == 0xFE) break;
+        perf_token_spins.increment();
     }
-    
     if (token != 0xFE) {
         return false;
     }
     
-    // Read 512 bytes of data
-    spi_transfer_multiple(NULL, buffer, 512);
-    
-    // Read CRC (ignore)
+    spi_transfer_multiple(NULL, buffer, length);
     spi_transfer(0xFF);
     spi_transfer(0xFF);
+    return true;
+}
+
+// Card capacity from the CSD register, in 512-byte blocks
+bool SDCard::read_capacity() {
+    uint8_t csd[16];
+    if (send_command(CMD9, 0, true) != 0 || !read_data(csd, sizeof(csd))) {
+        cs_high();
+        return false;
+    }
+    cs_high();
     
+    if ((csd[0] >> 6) == 1) {
+        // CSD version 2.0 (SDHC/SDXC): C_SIZE counts 512 KB units
+        uint32_t c_size = ((uint32_t)(csd[7] & 0x3F) << 16) | (csd[8] << 8) | csd[9];
+        card_size = (c_size + 1) * 1024;
+    } else {
+        // CSD version 1.0: (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks of 2^READ_BL_LEN bytes
+        uint32_t c_size = ((csd[6] & 0x03) << 10) | (csd[7] << 2) | (csd[8] >> 6);
+        uint32_t c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        uint32_t read_bl_len = csd[5] & 0x0F;
+        card_size = (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+    }
     return true;
 }
 
-bool SDCard::write_block(uint32_t block_addr, const uint8_t* buffer) {
-    uint8_t response = send_command(CMD24, block_addr);
+// Erase geometry from the 64-byte SD status. AU_SIZE sits in bits 431:428,
+// ERASE_SIZE in 423:408, ERASE_TIMEOUT in 407:402 and ERASE_OFFSET in 401:400.
+bool SDCard::read_sd_status() {
+    uint8_t status[64];
+    send_command(CMD55, 0);
+    if (send_command(ACMD13, 0, true) != 0) {
+        cs_high();
+        return false;
+    }
+    spi_transfer(0xFF);  // Second byte of the R2 response
+    if (!read_data(status, sizeof(status))) {
+        cs_high();
+        return false;
+    }
+    cs_high();
+
+    // 16 KB doubling up to 4 MB, then the SDXC sizes
+    static const uint32_t large_au_blocks[] = {16384, 24576, 32768, 49152, 65536, 131072};
+    uint8_t au_size = status[10] >> 4;
+    if (au_size >= 1 && au_size <= 9) {
+        au_blocks = 32u << (au_size - 1);
+    } else if (au_size >= 10) {
+        au_blocks = large_au_blocks[au_size - 10];
+    }
+    erase_size = (status[11] << 8) | status[12];
+    erase_timeout_s = status[13] >> 2;
+    erase_offset_s = status[13] & 0x03;
+    return true;
+}
+
+// Busy time allowed for erasing count blocks: the card's own figure per AU
+// when it gives one, otherwise a generous second per AU
+uint32_t SDCard::erase_timeout_us(uint32_t count) const {
+    uint64_t units = (count + au_blocks - 1) / au_blocks;
+    uint64_t timeout;
+    if (erase_size == 0 || erase_timeout_s == 0) {
+        timeout = units * 1000000;
+    } else {
+        timeout = units * (erase_timeout_s * 1000000u / erase_size) + (erase_offset_s + 1) * 1000000u;
+    }
+    return timeout < UINT32_MAX ? (uint32_t)timeout : UINT32_MAX;
+}
+
+// Data transfers, block_addr always counts 512-byte blocks
+template <sd_addressing_t MODE>
+bool SDCard::read_block_as(uint32_t block_addr, uint8_t* buffer) {
+    TRACE_SCOPE("sd_read_block");
+    PerfTimer timer(perf_read_us);
+    uint8_t response = send_command(CMD17, card_address<MODE>(block_addr), true);
+    if (response != 0) {
+        cs_high();
+        return false;
+    }
+    
+    bool success = read_data(buffer, 512);
+    cs_high();
+    return success;
+}
+
+// Read consecutive blocks with one READ_MULTIPLE_BLOCK command, the card
+// streams them back to back until STOP_TRANSMISSION
+template <sd_addressing_t MODE>
+bool SDCard::read_blocks_as(uint32_t block_addr, uint8_t* buffer, uint32_t count) {
+    TRACE_SCOPE("sd_read_blocks");
+    PerfTimer timer(perf_read_multi_us);
+    if (count == 0) {
+        return true;
+    }
+    
+    uint8_t response = send_command(CMD18, card_address<MODE>(block_addr), true);
     if (response != 0) {
+        cs_high();
+        return false;
+    }
+    
+    bool success = true;
+    for (uint32_t i = 0; i < count && success; i++) {
+        success = read_data(buffer + i * 512, 512);
+    }
+    
+    // The card may already be sending the next block, stop it and wait out the busy signal
+    cs_high();
+    response = send_command(CMD12, 0, true);
+    if (response != 0 || !wait_ready(WRITE_TIMEOUT_US)) {
+        success = false;
+    }
+    cs_high();
+    return success;
+}
+
+template <sd_addressing_t MODE>
+bool SDCard::write_block_as(uint32_t block_addr, const uint8_t* buffer, bool wait) {
+    TRACE_SCOPE("sd_write_block");
+    PerfTimer timer(perf_write_us);
+    uint8_t response = send_command(CMD24, card_address<MODE>(block_addr), true);
+    if (response != 0) {
+        cs_high();
         return false;
     }
     
@@ -129,17 +345,116 @@ bool SDCard::write_block(uint32_t block_addr, const uint8_t* buffer) {
     // Read data response
     uint8_t data_response = spi_transfer(0xFF);
     if ((data_response & 0x1F) != 0x05) {
+        cs_high();
         return false;
     }
     
-    // Wait for write completion
-    uint8_t busy = 0xFF;
-    for (int i = 0; i < 1000; i++) {
-        busy = spi_transfer(0xFF);
-        if (busy == 0xFF) break;
+    // Wait for write completion, or leave it to the next command
+    bool ready = true;
+    if (wait) {
+        ready = wait_ready(WRITE_TIMEOUT_US);
+    } else {
+        programming = true;
+    }
+    cs_high();
+    return ready;
+}
+
+// Write consecutive blocks with one WRITE_MULTIPLE_BLOCK command, so the
+// card can program them without the per-command overhead of CMD24
+template <sd_addressing_t MODE>
+bool SDCard::write_blocks_as(uint32_t block_addr, const uint8_t* buffer, uint32_t count, bool wait) {
+    TRACE_SCOPE("sd_write_blocks");
+    PerfTimer timer(perf_write_multi_us);
+    if (count == 0) {
+        return true;
     }
     
-    return (busy == 0xFF);
+    // Tell the card how many blocks are coming so it can pre-erase them
+    send_command(CMD55, 0);
+    send_command(ACMD23, count);
+    
+    uint8_t response = send_command(CMD25, card_address<MODE>(block_addr), true);
+    if (response != 0) {
+        cs_high();
+        return false;
+    }
+    
+    bool success = true;
+    for (uint32_t i = 0; i < count && success; i++) {
+        if (!wait_ready(WRITE_TIMEOUT_US)) {
+            success = false;
+            break;
+        }
+        
+        // Multi-block data token, data and dummy CRC
+        spi_transfer(0xFC);
+        spi_transfer_multiple(buffer + i * 512, NULL, 512);
+        spi_transfer(0xFF);
+        spi_transfer(0xFF);
+        
+        uint8_t data_response = spi_transfer(0xFF);
+        if ((data_response & 0x1F) != 0x05) {
+            success = false;
+        }
+    }
+    
+    // Stop transmission token, then wait for the last block to program
+    wait_ready(WRITE_TIMEOUT_US);
+    spi_transfer(0xFD);
+    spi_transfer(0xFF);
+    if (!wait) {
+        programming = true;
+    } else if (!wait_ready(WRITE_TIMEOUT_US)) {
+        success = false;
+    }
+    cs_high();
+    return success;
+}
+
+// ERASE_WR_BLK_START and _END take the first and last block, both inclusive
+template <sd_addressing_t MODE>
+bool SDCard::erase_as(uint32_t block_addr, uint32_t count) {
+    TRACE_SCOPE("sd_erase");
+    PerfTimer timer(perf_erase_us);
+    if (count == 0) {
+        return true;
+    }
+    if (send_command(CMD32, card_address<MODE>(block_addr)) != 0 ||
+        send_command(CMD33, card_address<MODE>(block_addr + count - 1)) != 0) {
+        return false;
+    }
+
+    // R1b, the card holds MISO low until the erase is done
+    if (send_command(CMD38, 0, true) != 0) {
+        cs_high();
+        return false;
+    }
+    bool ready = wait_ready(erase_timeout_us(count));
+    cs_high();
+    if (ready) {
+        perf_erase_blocks.add(count);
+    }
+    return ready;
+}
+
+// Public interface
+uint32_t SDCard::discard(uint32_t block_addr, uint32_t count) {
+    // In 64 bits: a 512 MB AU times an erase size of hundreds is past 2^32
+    // blocks, and so are the rounded ends of a range at the top of a 2 TB card
+    uint64_t first = ((uint64_t)block_addr + au_blocks - 1) / au_blocks * au_blocks;
+    uint64_t end = ((uint64_t)block_addr + count) / au_blocks * au_blocks;
+    uint64_t batch = (uint64_t)au_blocks * (erase_size > 0 ? erase_size : 1);
+    uint32_t erased = 0;
+    while (first < end) {
+        uint32_t blocks = (uint32_t)(end - first < batch ? end - first : batch);
+        if (!erase(first, blocks)) {
+            break;
+        }
+        first += blocks;
+        erased += blocks;
+    }
+    return erased;
 }
 
 void SDCard::spi_test() {
@@ -177,54 +492,58 @@ void SDCard::spi_test() {
     printf("SPI test completed\n");
 }
 
-bool SDCard::init() {
-    printf("Initializing SD card...\n");
-    printf("SPI Configuration: MOSI=%d, MISO=%d, SCK=%d, CS=%d\n", 
-           SD_MOSI_PIN, SD_MISO_PIN, SD_SCK_PIN, SD_CS_PIN);
+bool SDCard::init(bool verbose) {
+    INIT_LOG("Initializing SD card...\n");
+    INIT_LOG("SPI Configuration: MOSI=%d, MISO=%d, SCK=%d, CS=%d\n", 
+           mosi_pin, miso_pin, sck_pin, cs_pin);
     
+    // A card that was swapped or failed leaves nothing behind from before
+    deinit();
     spi_init();
-    printf("SPI initialized at 400kHz\n");
+    INIT_LOG("SPI initialized at 400kHz\n");
     
     // Send 80 clock pulses with CS high
-    printf("Sending 80 clock pulses...\n");
+    INIT_LOG("Sending 80 clock pulses...\n");
     cs_high();
     for (int i = 0; i < 10; i++) {
         spi_transfer(0xFF);
     }
     
     // Send CMD0 to reset card
-    printf("Sending CMD0 (GO_IDLE_STATE)...\n");
+    INIT_LOG("Sending CMD0 (GO_IDLE_STATE)...\n");
     uint8_t response = send_command(CMD0, 0);
-    printf("CMD0 response: 0x%02X\n", response);
+    INIT_LOG("CMD0 response: 0x%02X\n", response);
     
     if (response != R1_IDLE_STATE) {
-        printf("SD card not responding to CMD0 (response: 0x%02X)\n", response);
-        printf("Expected response: 0x%02X (R1_IDLE_STATE)\n", R1_IDLE_STATE);
-        printf("Possible issues:\n");
-        printf("  1. Check wiring connections\n");
-        printf("  2. Ensure SD card is powered with 3.3V\n");
-        printf("  3. Verify SD card is properly inserted\n");
-        printf("  4. Check for loose connections\n");
+        INIT_LOG("SD card not responding to CMD0 (response: 0x%02X)\n", response);
+        INIT_LOG("Expected response: 0x%02X (R1_IDLE_STATE)\n", R1_IDLE_STATE);
+        INIT_LOG("Possible issues:\n");
+        INIT_LOG("  1. Check wiring connections\n");
+        INIT_LOG("  2. Ensure SD card is powered with 3.3V\n");
+        INIT_LOG("  3. Verify SD card is properly inserted\n");
+        INIT_LOG("  4. Check for loose connections\n");
+        deinit();
         return false;
     }
     
-    printf("CMD0 successful, card is in idle state\n");
+    INIT_LOG("CMD0 successful, card is in idle state\n");
     
     // Send CMD8 to check voltage range
-    printf("Sending CMD8 (SEND_IF_COND)...\n");
+    INIT_LOG("Sending CMD8 (SEND_IF_COND)...\n");
     response = send_command(CMD8, 0x1AA);
-    printf("CMD8 response: 0x%02X\n", response);
+    INIT_LOG("CMD8 response: 0x%02X\n", response);
     
     if (response == R1_IDLE_STATE) {
         // SD v2.0 card
         card_type = SD_TYPE_SD2;
-        printf("SD v2.0 card detected\n");
+        INIT_LOG("SD v2.0 card detected\n");
     } else if (response == (R1_IDLE_STATE | R1_ILLEGAL_COMMAND)) {
         // SD v1.0 card
         card_type = SD_TYPE_SD1;
-        printf("SD v1.0 card detected\n");
+        INIT_LOG("SD v1.0 card detected\n");
     } else {
-        printf("Unknown SD card type (response: 0x%02X)\n", response);
+        INIT_LOG("Unknown SD card type (response: 0x%02X)\n", response);
+        deinit();
         return false;
     }
     
@@ -243,20 +562,21 @@ bool SDCard::init() {
         if (response == 0) {
             break;
         }
+        perf_init_retries.increment();
         sleep_ms(10);
     }
     
     if (response != 0) {
-        printf("SD card initialization failed\n");
+        INIT_LOG("SD card initialization failed\n");
+        deinit();
         return false;
     }
     
     // Check if SDHC
     if (card_type == SD_TYPE_SD2) {
-        response = send_command(CMD58, 0);
+        response = send_command(CMD58, 0, true);
         if (response == 0) {
             uint8_t ocr[4];
-            cs_low();
             for (int i = 0; i < 4; i++) {
                 ocr[i] = spi_transfer(0xFF);
             }
@@ -264,33 +584,51 @@ bool SDCard::init() {
             
             if (ocr[0] & 0x40) {
                 card_type = SD_TYPE_SDHC;
-                printf("SDHC card detected\n");
+                INIT_LOG("SDHC card detected\n");
             }
+        } else {
+            cs_high();
         }
     }
     
-    // Set block size to 512 bytes (not needed for SDHC)
+    // SDHC takes block numbers and fixed 512-byte blocks, the others byte
+    // offsets and a block length that has to be set
+    transfers = card_type == SD_TYPE_SDHC ? &block_transfers : &byte_transfers;
     if (card_type != SD_TYPE_SDHC) {
         response = send_command(CMD16, 512);
         if (response != 0) {
-            printf("Failed to set block size\n");
+            INIT_LOG("Failed to set block size\n");
+            deinit();
             return false;
         }
     }
     
     // Increase SPI speed
-    ::spi_set_baudrate(SD_SPI_PORT, 25000000);  // 25MHz
+    ::spi_set_baudrate(spi_port, 25000000);  // 25MHz
     
-    printf("SD card initialized successfully\n");
+    if (read_capacity()) {
+        INIT_LOG("Card capacity: %lu MB\n", (unsigned long)(card_size / 2048));
+    } else {
+        INIT_LOG("Could not read card capacity\n");
+    }
+
+    if (read_sd_status()) {
+        INIT_LOG("Allocation unit: %lu KB\n", (unsigned long)(au_blocks / 2));
+    } else {
+        INIT_LOG("Could not read SD status, erasing in %lu KB units\n", (unsigned long)(au_blocks / 2));
+    }
+    
+    initialized = true;
+    INIT_LOG("SD card initialized successfully\n");
     return true;
 }
 
-bool SDCard::parse_boot_sector() {
+bool SDCard::parse_boot_sector(bool verbose) {
     uint8_t buffer[512];
     
     // Read boot sector (sector 0)
     if (!read_block(0, buffer)) {
-        printf("Failed to read boot sector\n");
+        INIT_LOG("Failed to read boot sector\n");
         return false;
     }
     
@@ -299,12 +637,12 @@ bool SDCard::parse_boot_sector() {
     
     // Check for FAT32 signature
     if (boot_sector.BPB_BytsPerSec != 512) {
-        printf("Unsupported sector size: %d\n", boot_sector.BPB_BytsPerSec);
+        INIT_LOG("Unsupported sector size: %d\n", boot_sector.BPB_BytsPerSec);
         return false;
     }
     
     if (strncmp((char*)boot_sector.BS_FilSysType, "FAT32", 5) != 0) {
-        printf("Not a FAT32 filesystem\n");
+        INIT_LOG("Not a FAT32 filesystem\n");
         return false;
     }
     
@@ -317,12 +655,12 @@ bool SDCard::parse_boot_sector() {
     data_sector = root_dir_sector + 
                  ((boot_sector.BPB_RootEntCnt * 32) / bytes_per_sector);
     
-    printf("FAT32 filesystem detected\n");
-    printf("  Sectors per cluster: %d\n", sectors_per_cluster);
-    printf("  Bytes per sector: %d\n", bytes_per_sector);
-    printf("  First FAT sector: %d\n", first_fat_sector);
-    printf("  Root directory sector: %d\n", root_dir_sector);
-    printf("  Data sector: %d\n", data_sector);
+    INIT_LOG("FAT32 filesystem detected\n");
+    INIT_LOG("  Sectors per cluster: %d\n", sectors_per_cluster);
+    INIT_LOG("  Bytes per sector: %d\n", bytes_per_sector);
+    INIT_LOG("  First FAT sector: %d\n", first_fat_sector);
+    INIT_LOG("  Root directory sector: %d\n", root_dir_sector);
+    INIT_LOG("  Data sector: %d\n", data_sector);
     
     return true;
 }
@@ -371,6 +709,15 @@ bool SDCard::format() {
         }
     }
     
+    // Everything on the card is being thrown away, so hand it all back to
+    // the card. Erased blocks read as zeros or ones depending on the card,
+    // which is why the FATs and root directory below are written in full.
+    if (card_size > 0) {
+        printf("Erasing card...\n");
+        uint32_t erased = discard(0, card_size);
+        printf("Erased %lu MB\n", (unsigned long)(erased / 2048));
+    }
+    
     printf("Creating FAT32 filesystem...\n");
     
     // Create a basic FAT32 boot sector
@@ -445,7 +792,7 @@ bool SDCard::format() {
     
     printf("Creating FAT tables...\n");
     
-    // Create FAT1 (sector 32)
+    // First FAT sector (sector 32)
     uint8_t fat_buffer[512] = {0};
     fat_buffer[0] = 0xF8; // Media descriptor
     fat_buffer[1] = 0xFF;
@@ -458,24 +805,27 @@ bool SDCard::format() {
     fat_buffer[10] = 0xFF;
     fat_buffer[11] = 0x0F;
     
-    if (!write_block(32, fat_buffer)) {
-        printf("Failed to write FAT1\n");
-        return false;
-    }
-    
-    // Create FAT2 (copy of FAT1)
-    if (!write_block(32 + new_boot_sector.BPB_FATSz32, fat_buffer)) {
-        printf("Failed to write FAT2\n");
-        return false;
+    // Both FATs in full, every cluster after the root directory free
+    uint8_t zero_buffer[512] = {0};
+    for (uint32_t fat = 0; fat < new_boot_sector.BPB_NumFATs; fat++) {
+        uint32_t fat_start = 32 + fat * new_boot_sector.BPB_FATSz32;
+        for (uint32_t i = 0; i < new_boot_sector.BPB_FATSz32; i++) {
+            if (!write_block(fat_start + i, i == 0 ? fat_buffer : zero_buffer)) {
+                printf("Failed to write FAT%lu\n", (unsigned long)(fat + 1));
+                return false;
+            }
+        }
     }
     
     printf("Creating root directory...\n");
     
-    // Create empty root directory (sector 64)
-    uint8_t root_dir_buffer[512] = {0};
-    if (!write_block(64, root_dir_buffer)) {
-        printf("Failed to write root directory\n");
-        return false;
+    // Empty root directory, cluster 2 at the start of the data area
+    uint32_t root_sector = 32 + new_boot_sector.BPB_NumFATs * new_boot_sector.BPB_FATSz32;
+    for (uint32_t i = 0; i < new_boot_sector.BPB_SecPerClus; i++) {
+        if (!write_block(root_sector + i, zero_buffer)) {
+            printf("Failed to write root directory\n");
+            return false;
+        }
     }
     
     printf("Format completed successfully!\n");
@@ -12,6 +12,18 @@
 #define SD_TYPE_SD2     2
 #define SD_TYPE_SDHC    3
 
+// How a card reads the address argument of data commands. SDHC and SDXC
+// cards take a block number, SD v1 and standard capacity v2 cards a byte
+// offset, which limits them to 4 GB (they are at most 2 GB anyway).
+typedef enum {
+    SD_ADDRESS_BLOCK,
+    SD_ADDRESS_BYTE
+} sd_addressing_t;
+
+// Erase granularity when the SD status gives no allocation unit size, the
+// largest AU an SDHC card may have
+#define SD_DEFAULT_AU_BLOCKS 8192
+
 // FAT32 structures
 typedef struct {
     uint8_t BS_jmpBoot[3];
@@ -46,11 +58,12 @@ typedef struct {
 class SDCard {
 private:
     // SD Card configuration
-    static spi_inst_t* SD_SPI_PORT;  // spi1
-    static const int SD_MOSI_PIN = 11;
-    static const int SD_MISO_PIN = 12;
-    static const int SD_SCK_PIN = 13;
-    static const int SD_CS_PIN = 14;
+    spi_inst_t* spi_port;
+    int mosi_pin;
+    int miso_pin;
+    int sck_pin;
+    int cs_pin;
+    static const uint32_t WRITE_TIMEOUT_US = 500000;  // Worst case busy time for SDXC writes
 
     // SD Card commands
     static const uint8_t CMD0 = 0;     // GO_IDLE_STATE
@@ -65,8 +78,13 @@ private:
     static const uint8_t CMD23 = 23;   // SET_BLOCK_COUNT
     static const uint8_t CMD24 = 24;   // WRITE_BLOCK
     static const uint8_t CMD25 = 25;   // WRITE_MULTIPLE_BLOCK
+    static const uint8_t CMD32 = 32;   // ERASE_WR_BLK_START
+    static const uint8_t CMD33 = 33;   // ERASE_WR_BLK_END
+    static const uint8_t CMD38 = 38;   // ERASE
     static const uint8_t CMD41 = 41;   // SEND_OP_COND (ACMD)
     static const uint8_t CMD55 = 55;   // APP_CMD
+    static const uint8_t ACMD13 = 13;  // SD_STATUS (after CMD55)
+    static const uint8_t ACMD23 = 23;  // SET_WR_BLK_ERASE_COUNT (after CMD55)
     static const uint8_t CMD58 = 58;   // READ_OCR
 
     // SD Card response types
@@ -84,13 +102,51 @@ private:
     void cs_high();
     uint8_t spi_transfer(uint8_t data);
     void spi_transfer_multiple(const uint8_t* data_out, uint8_t* data_in, size_t length);
-    uint8_t send_command(uint8_t cmd, uint32_t arg);
+    uint8_t send_command(uint8_t cmd, uint32_t arg, bool hold_cs = false);
+    bool wait_ready(uint32_t timeout_us);
+    bool read_data(uint8_t* buffer, size_t length);
+    bool read_capacity();
+    bool read_sd_status();
+    uint32_t erase_timeout_us(uint32_t count) const;
+
+    // Erase geometry from the SD status register
+    uint32_t au_blocks;             // Allocation unit, what discard() erases whole
+    uint16_t erase_size;            // AUs erase_timeout_s is given for, 0 when not given
+    uint8_t erase_timeout_s;
+    uint8_t erase_offset_s;
+
+    // A write returned without waiting for the card to program it, the
+    // next command or sync() waits instead
+    bool programming;
+
+    // Transfer path, compiled once per addressing mode. init() picks one
+    // after identifying the card, so the per-block calls neither test the
+    // card type nor get the address wrong on byte addressed cards.
+    struct Transfers {
+        bool (SDCard::*read_block)(uint32_t block_addr, uint8_t* buffer);
+        bool (SDCard::*read_blocks)(uint32_t block_addr, uint8_t* buffer, uint32_t count);
+        bool (SDCard::*write_block)(uint32_t block_addr, const uint8_t* buffer, bool wait);
+        bool (SDCard::*write_blocks)(uint32_t block_addr, const uint8_t* buffer, uint32_t count, bool wait);
+        bool (SDCard::*erase)(uint32_t block_addr, uint32_t count);
+    };
+    static const Transfers block_transfers;
+    static const Transfers byte_transfers;
+    const Transfers* transfers;
+
+    template <sd_addressing_t MODE> static uint32_t card_address(uint32_t block_addr) {
+        return MODE == SD_ADDRESS_BLOCK ? block_addr : block_addr << 9;
+    }
+    template <sd_addressing_t MODE> bool read_block_as(uint32_t block_addr, uint8_t* buffer);
+    template <sd_addressing_t MODE> bool read_blocks_as(uint32_t block_addr, uint8_t* buffer, uint32_t count);
+    template <sd_addressing_t MODE> bool write_block_as(uint32_t block_addr, const uint8_t* buffer, bool wait);
+    template <sd_addressing_t MODE> bool write_blocks_as(uint32_t block_addr, const uint8_t* buffer, uint32_t count, bool wait);
+    template <sd_addressing_t MODE> bool erase_as(uint32_t block_addr, uint32_t count);
 
 public:
     // SD Card state
     bool initialized;
     uint8_t card_type;
-    uint32_t card_size;
+    uint32_t card_size;         // In 512-byte blocks, from the CSD
     fat32_boot_sector_t boot_sector;
     uint32_t first_fat_sector;
     uint32_t root_dir_sector;
@@ -99,20 +155,49 @@ public:
     uint32_t bytes_per_sector;
 
     // Constructor
-    SDCard();
+    SDCard(spi_inst_t* spi_port, int mosi_pin, int miso_pin, int sck_pin, int cs_pin);
 
     // Public interface
-    bool init();
-    bool read_block(uint32_t block_addr, uint8_t* buffer);
-    bool write_block(uint32_t block_addr, const uint8_t* buffer);
-    bool parse_boot_sector();
+    bool init(bool verbose = true);
+    void deinit();
+    bool read_block(uint32_t block_addr, uint8_t* buffer) {
+        return (this->*transfers->read_block)(block_addr, buffer);
+    }
+    bool read_blocks(uint32_t block_addr, uint8_t* buffer, uint32_t count) {
+        return (this->*transfers->read_blocks)(block_addr, buffer, count);
+    }
+    // With wait false a write returns once the card has taken the data, so
+    // the caller can feed another card while this one programs it
+    bool write_block(uint32_t block_addr, const uint8_t* buffer, bool wait = true) {
+        return (this->*transfers->write_block)(block_addr, buffer, wait);
+    }
+    bool write_blocks(uint32_t block_addr, const uint8_t* buffer, uint32_t count, bool wait = true) {
+        return (this->*transfers->write_blocks)(block_addr, buffer, count, wait);
+    }
+    bool sync();
+
+    // erase() clears exactly the blocks given. discard() is for blocks whose
+    // contents no longer matter: it erases only the whole allocation units
+    // inside the range, in batches of the size the card quotes a timeout
+    // for, and returns how many blocks that was. Erased blocks write faster
+    // than ones the card has to clear first, and read back as all zeros or
+    // all ones depending on the card.
+    bool erase(uint32_t block_addr, uint32_t count) {
+        return (this->*transfers->erase)(block_addr, count);
+    }
+    uint32_t discard(uint32_t block_addr, uint32_t count);
+
+    bool parse_boot_sector(bool verbose = true);
     bool format();
     void spi_test();
     
     // Getter methods
     bool isInitialized() const { return initialized; }
+    bool isProgramming() const { return programming; }
     uint8_t getType() const { return card_type; }
     uint32_t getSize() const { return card_size; }
+    uint32_t getAuBlocks() const { return au_blocks; }
+    sd_addressing_t getAddressing() const { return transfers == &byte_transfers ? SD_ADDRESS_BYTE : SD_ADDRESS_BLOCK; }
     uint32_t getFirstFatSector() const { return first_fat_sector; }
     uint32_t getFat32RootDirSector() const { return root_dir_sector; }
     uint32_t getDataSector() const { return data_sector; }
@@ -120,7 +205,9 @@ public:
     uint32_t getBytesPerSector() const { return bytes_per_sector; }
 };
 
-// Global instance
+// Global instances: the main card on spi1, and an optional second card on
+// spi0 that log runs are striped across once it is initialized
 extern SDCard sd_card;
+extern SDCard sd_card2;
 
 #endif // SD_CARD_H 
\ No newline at end of file
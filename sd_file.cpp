@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "pico/stdlib.h"
+#include "sd_file.h"
+
+// Constructor
+SDFile::SDFile(SDCard* card) {
+    this->card = card;
+    ahead[0].data = NULL;
+    ahead[1].data = NULL;
+    ahead_max_blocks = 0;
+    close();
+}
+
+uint32_t SDFile::cluster_to_sector(uint32_t cluster_number) const {
+    return card->getDataSector() + (cluster_number - 2) * card->getSectorsPerCluster();
+}
+
+// Follow the FAT chain, returning FAT_END_OF_CHAIN at the end or on error
+uint32_t SDFile::next_cluster(uint32_t cluster_number) {
+    uint32_t fat_offset = cluster_number * 4;
+    if (!load_sector(card->getFirstFatSector() + fat_offset / SECTOR_SIZE)) {
+        return FAT_END_OF_CHAIN;
+    }
+    const uint8_t* entry = &buffer[fat_offset % SECTOR_SIZE];
+    uint32_t next = (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t)entry[3] << 24)) & 0x0FFFFFFF;
+    if (next < 2) {
+        return FAT_END_OF_CHAIN;
+    }
+    return next;
+}
+
+bool SDFile::load_sector(uint32_t sector) {
+    if (buffer_valid && buffered_sector == sector) {
+        return true;
+    }
+    buffer_valid = card->read_block(sector, buffer);
+    buffered_sector = sector;
+    return buffer_valid;
+}
+
+bool SDFile::store_sector() {
+    return buffer_valid && card->write_block(buffered_sector, buffer);
+}
+
+// True if the first cluster_count clusters of the open file follow each other
+bool SDFile::is_contiguous(uint32_t cluster_count) {
+    for (uint32_t i = 0; i + 1 < cluster_count; i++) {
+        if (next_cluster(first_cluster + i) != first_cluster + i + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// First cluster of a run of free clusters, or 0 if there is none
+uint32_t SDFile::find_free_run(uint32_t cluster_count) {
+    uint32_t total_clusters = (card->boot_sector.BPB_TotSec32 - card->getDataSector()) / card->getSectorsPerCluster() + 2;
+    uint32_t run_start = 2;
+    uint32_t run_length = 0;
+    for (uint32_t cluster_number = 2; cluster_number < total_clusters; cluster_number++) {
+        uint32_t fat_offset = cluster_number * 4;
+        if (!load_sector(card->getFirstFatSector() + fat_offset / SECTOR_SIZE)) {
+            return 0;
+        }
+        const uint8_t* entry = &buffer[fat_offset % SECTOR_SIZE];
+        uint32_t value = (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t)entry[3] << 24)) & 0x0FFFFFFF;
+        if (value != 0) {
+            run_length = 0;
+            run_start = cluster_number + 1;
+        } else if (++run_length == cluster_count) {
+            return run_start;
+        }
+    }
+    return 0;
+}
+
+// Link clusters start..start+count-1 into one chain in every FAT copy
+bool SDFile::write_chain(uint32_t start, uint32_t cluster_count) {
+    uint32_t fat_size = card->boot_sector.BPB_FATSz32;
+    for (uint32_t fat = 0; fat < card->boot_sector.BPB_NumFATs; fat++) {
+        uint32_t cluster_number = start;
+        while (cluster_number < start + cluster_count) {
+            uint32_t fat_offset = cluster_number * 4;
+            if (!load_sector(card->getFirstFatSector() + fat * fat_size + fat_offset / SECTOR_SIZE)) {
+                return false;
+            }
+            // Fill every entry of the run that lives in this FAT sector, then write it once
+            do {
+                uint32_t value = (cluster_number == start + cluster_count - 1) ? 0x0FFFFFFF : cluster_number + 1;
+                uint8_t* entry = &buffer[(cluster_number * 4) % SECTOR_SIZE];
+                entry[0] = value & 0xFF;
+                entry[1] = (value >> 8) & 0xFF;
+                entry[2] = (value >> 16) & 0xFF;
+                entry[3] = (entry[3] & 0xF0) | ((value >> 24) & 0x0F);
+                cluster_number++;
+            } while (cluster_number < start + cluster_count && (cluster_number * 4) % SECTOR_SIZE != 0);
+            if (!store_sector()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Use the first free slot of the root directory, the directory is not extended
+bool SDFile::add_directory_entry(const char fat_name[11], uint32_t start, uint32_t length) {
+    uint32_t directory_cluster = card->boot_sector.BPB_RootClus;
+    while (directory_cluster < FAT_END_OF_CHAIN) {
+        for (uint32_t s = 0; s < card->getSectorsPerCluster(); s++) {
+            if (!load_sector(cluster_to_sector(directory_cluster) + s)) {
+                return false;
+            }
+            for (uint32_t i = 0; i < SECTOR_SIZE; i += 32) {
+                uint8_t* entry = &buffer[i];
+                if (entry[0] != 0x00 && entry[0] != 0xE5) {
+                    continue;
+                }
+                memset(entry, 0, 32);
+                memcpy(entry, fat_name, 11);
+                entry[11] = 0x20;  // Archive
+                entry[20] = (start >> 16) & 0xFF;
+                entry[21] = (start >> 24) & 0xFF;
+                entry[26] = start & 0xFF;
+                entry[27] = (start >> 8) & 0xFF;
+                entry[28] = length & 0xFF;
+                entry[29] = (length >> 8) & 0xFF;
+                entry[30] = (length >> 16) & 0xFF;
+                entry[31] = (length >> 24) & 0xFF;
+                return store_sector();
+            }
+        }
+        directory_cluster = next_cluster(directory_cluster);
+    }
+    return false;
+}
+
+// Entry for a file in the root directory, pointing into the sector buffer,
+// or NULL if there is none
+uint8_t* SDFile::find_directory_entry(const char fat_name[11]) {
+    uint32_t directory_cluster = card->boot_sector.BPB_RootClus;
+    while (directory_cluster < FAT_END_OF_CHAIN) {
+        for (uint32_t s = 0; s < card->getSectorsPerCluster(); s++) {
+            if (!load_sector(cluster_to_sector(directory_cluster) + s)) {
+                return NULL;
+            }
+            for (uint32_t i = 0; i < SECTOR_SIZE; i += 32) {
+                uint8_t* entry = &buffer[i];
+                if (entry[0] == 0x00) {
+                    return NULL;  // End of directory
+                }
+                // Skip deleted entries, long name fragments, volume labels and directories
+                if (entry[0] == 0xE5 || (entry[11] & 0x18) != 0) {
+                    continue;
+                }
+                if (memcmp(entry, fat_name, 11) == 0) {
+                    return entry;
+                }
+            }
+        }
+        directory_cluster = next_cluster(directory_cluster);
+    }
+    return NULL;
+}
+
+// Discard the clusters of a run, the card erases the whole AUs among them
+void SDFile::discard_clusters(uint32_t start, uint32_t cluster_count) {
+    if (cluster_count > 0) {
+        card->discard(cluster_to_sector(start), cluster_count * card->getSectorsPerCluster());
+    }
+}
+
+// Mark a chain free in every FAT copy and discard it, one contiguous run at a time
+bool SDFile::free_chain(uint32_t start) {
+    uint32_t fat_size = card->boot_sector.BPB_FATSz32;
+    uint32_t total_clusters = (card->boot_sector.BPB_TotSec32 - card->getDataSector()) / card->getSectorsPerCluster() + 2;
+    uint32_t run_start = start;
+    uint32_t run_length = 0;
+    uint32_t cluster_number = start;
+    uint32_t freed = 0;
+    while (cluster_number >= 2 && cluster_number < total_clusters) {
+        uint32_t sector = card->getFirstFatSector() + cluster_number * 4 / SECTOR_SIZE;
+        if (!load_sector(sector)) {
+            return false;
+        }
+        // Clear every link of the chain that lives in this FAT sector, then write it to each FAT once
+        do {
+            uint8_t* entry = &buffer[(cluster_number * 4) % SECTOR_SIZE];
+            uint32_t next = (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t)entry[3] << 24)) & 0x0FFFFFFF;
+            entry[0] = 0;
+            entry[1] = 0;
+            entry[2] = 0;
+            entry[3] &= 0xF0;
+
+            if (cluster_number == run_start + run_length) {
+                run_length++;
+            } else {
+                discard_clusters(run_start, run_length);
+                run_start = cluster_number;
+                run_length = 1;
+            }
+            // A damaged chain that loops is cut off after it has covered the volume
+            if (++freed >= total_clusters || next < 2 || next >= FAT_END_OF_CHAIN) {
+                cluster_number = 0;
+            } else {
+                cluster_number = next;
+            }
+        } while (cluster_number >= 2 && card->getFirstFatSector() + cluster_number * 4 / SECTOR_SIZE == sector);
+
+        for (uint32_t fat = 0; fat < card->boot_sector.BPB_NumFATs; fat++) {
+            if (!card->write_block(sector + fat * fat_size, buffer)) {
+                return false;
+            }
+        }
+    }
+    discard_clusters(run_start, run_length);
+    return true;
+}
+
+// "boot.txt" -> "BOOT    TXT" as stored in a directory entry
+void SDFile::to_fat_name(const char* name, char fat_name[11]) {
+    memset(fat_name, ' ', 11);
+    int i = 0;
+    while (*name && *name != '.' && i < 8) {
+        fat_name[i++] = toupper((unsigned char)*name++);
+    }
+    while (*name && *name != '.') {
+        name++;
+    }
+    if (*name == '.') {
+        name++;
+        for (i = 8; *name && i < 11; i++) {
+            fat_name[i] = toupper((unsigned char)*name++);
+        }
+    }
+}
+
+// Public interface
+bool SDFile::open_file(const char* name) {
+    close();
+    if (!card->isInitialized() || card->getSectorsPerCluster() == 0) {
+        return false;
+    }
+
+    char fat_name[11];
+    to_fat_name(name, fat_name);
+    const uint8_t* entry = find_directory_entry(fat_name);
+    if (entry == NULL) {
+        return false;
+    }
+    first_cluster = ((uint32_t)(entry[21] << 8 | entry[20]) << 16) | (entry[27] << 8 | entry[26]);
+    size = entry[28] | (entry[29] << 8) | (entry[30] << 16) | ((uint32_t)entry[31] << 24);
+    cluster = first_cluster;
+    open = true;
+    return true;
+}
+
+// Open a file whose clusters are contiguous and hold at least length bytes,
+// creating it if it does not exist. Callers can then write raw sectors from
+// getFirstSector() onwards without touching the FAT again. The FSInfo free
+// cluster hint is not updated, which FAT32 allows.
+bool SDFile::preallocate(const char* name, uint32_t length) {
+    if (!card->isInitialized() || card->getSectorsPerCluster() == 0 || length == 0) {
+        return false;
+    }
+    uint32_t cluster_bytes = card->getSectorsPerCluster() * SECTOR_SIZE;
+    uint32_t cluster_count = (length + cluster_bytes - 1) / cluster_bytes;
+
+    if (open_file(name)) {
+        if (size >= length && first_cluster >= 2 && is_contiguous(cluster_count)) {
+            return true;
+        }
+        close();
+        return false;  // Too small or fragmented, delete it first
+    }
+
+    uint32_t start = find_free_run(cluster_count);
+    if (start == 0) {
+        return false;
+    }
+
+    // Whatever the free clusters held is garbage, erase it ahead of the writes
+    discard_clusters(start, cluster_count);
+
+    char fat_name[11];
+    to_fat_name(name, fat_name);
+    if (!write_chain(start, cluster_count) || !add_directory_entry(fat_name, start, cluster_count * cluster_bytes)) {
+        return false;
+    }
+    return open_file(name);
+}
+
+// Delete a file and free its clusters. The directory entry goes first, so
+// a reset part way through leaves lost clusters rather than a file whose
+// clusters are marked free.
+bool SDFile::remove(const char* name) {
+    close();
+    if (!card->isInitialized() || card->getSectorsPerCluster() == 0) {
+        return false;
+    }
+
+    char fat_name[11];
+    to_fat_name(name, fat_name);
+    uint8_t* entry = find_directory_entry(fat_name);
+    if (entry == NULL) {
+        return false;
+    }
+    uint32_t start = ((uint32_t)(entry[21] << 8 | entry[20]) << 16) | (entry[27] << 8 | entry[26]);
+    entry[0] = 0xE5;
+    if (!store_sector()) {
+        return false;
+    }
+    return start < 2 || free_chain(start);
+}
+
+void SDFile::close() {
+    open = false;
+    first_cluster = 0;
+    size = 0;
+    position = 0;
+    cluster = 0;
+    cluster_index = 0;
+    buffered_sector = 0;
+    buffer_valid = false;
+    ahead[0].start = 0;
+    ahead[0].length = 0;
+    ahead[1].start = 0;
+    ahead[1].length = 0;
+    ahead_front = 0;
+    ahead_window = READ_AHEAD_MIN_BLOCKS;
+    ahead_swap_us = 0;
+    ahead_hits = 0;
+    ahead_misses = 0;
+    ahead_reads = 0;
+}
+
+// Move the cluster cursor to the cluster holding offset. Reads only go
+// forward, so the chain is walked from the start at most once.
+bool SDFile::seek_cluster(uint32_t offset) {
+    uint32_t cluster_bytes = card->getSectorsPerCluster() * SECTOR_SIZE;
+    if (cluster_index > offset / cluster_bytes) {
+        cluster = first_cluster;
+        cluster_index = 0;
+    }
+    while (cluster_index < offset / cluster_bytes) {
+        cluster = next_cluster(cluster);
+        if (cluster >= FAT_END_OF_CHAIN) {
+            return false;
+        }
+        cluster_index++;
+    }
+    return true;
+}
+
+// Read the window starting at the sector aligned file offset start, as far
+// as the clusters from there on are contiguous
+bool SDFile::fill(AheadBuffer* target, uint32_t start) {
+    target->length = 0;
+    if (!seek_cluster(start)) {
+        return false;
+    }
+
+    uint32_t sectors_per_cluster = card->getSectorsPerCluster();
+    uint32_t first = (start / SECTOR_SIZE) % sectors_per_cluster;
+    uint32_t sector = cluster_to_sector(cluster) + first;
+    uint32_t count = sectors_per_cluster - first;
+    uint32_t file_sectors = (size - start + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint32_t wanted = ahead_window < file_sectors ? ahead_window : file_sectors;
+
+    // Carry on into following clusters that sit right after this one
+    uint32_t run_cluster = cluster;
+    while (count < wanted) {
+        uint32_t next = next_cluster(run_cluster);
+        if (next != run_cluster + 1) {
+            break;
+        }
+        run_cluster = next;
+        count += sectors_per_cluster;
+    }
+    if (count > wanted) {
+        count = wanted;
+    }
+
+    ahead_reads++;
+    if (!card->read_blocks(sector, target->data, count)) {
+        return false;
+    }
+    target->start = start;
+    target->length = count * SECTOR_SIZE;
+    return true;
+}
+
+// Window that holds READ_AHEAD_TARGET_US of reading at the rate the last buffer went
+void SDFile::resize_window(uint32_t consumed, uint32_t elapsed_us) {
+    uint64_t bytes = elapsed_us > 0 ? (uint64_t)consumed * READ_AHEAD_TARGET_US / elapsed_us : UINT32_MAX;
+    uint64_t window = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (window < READ_AHEAD_MIN_BLOCKS) {
+        window = READ_AHEAD_MIN_BLOCKS;
+    }
+    if (window > ahead_max_blocks) {
+        window = ahead_max_blocks;
+    }
+    ahead_window = (uint32_t)window;
+}
+
+// Bytes at the current position, and how many follow them in the same buffer
+const uint8_t* SDFile::data_at_position(uint32_t* available) {
+    // Past the first sector a reader is taken to be streaming the file
+    if (ahead_max_blocks > 0 && position >= SECTOR_SIZE) {
+        AheadBuffer* front = &ahead[ahead_front];
+        if (position - front->start >= front->length) {
+            uint32_t now = time_us_32();
+            if (front->length > 0) {
+                resize_window(front->length, now - ahead_swap_us);
+            }
+
+            AheadBuffer* back = &ahead[ahead_front ^ 1];
+            if (back->length > 0 && position - back->start < back->length) {
+                ahead_hits++;
+            } else {
+                // Nothing prefetched, or not this far, so the reader waits for the card
+                ahead_misses++;
+                if (!fill(back, position - position % SECTOR_SIZE)) {
+                    return NULL;
+                }
+            }
+            front->length = 0;
+            ahead_front ^= 1;
+            front = back;
+            ahead_swap_us = now;
+        }
+        *available = front->length - (position - front->start);
+        return front->data + (position - front->start);
+    }
+
+    // Single sectors through the shared buffer
+    uint32_t cluster_bytes = card->getSectorsPerCluster() * SECTOR_SIZE;
+    if (!seek_cluster(position) || !load_sector(cluster_to_sector(cluster) + (position % cluster_bytes) / SECTOR_SIZE)) {
+        return NULL;
+    }
+    *available = SECTOR_SIZE - position % SECTOR_SIZE;
+    return &buffer[position % SECTOR_SIZE];
+}
+
+int SDFile::read(void* data, size_t length) {
+    if (!open) {
+        return -1;
+    }
+
+    uint8_t* out = (uint8_t*)data;
+    size_t total = 0;
+
+    while (total < length && position < size) {
+        uint32_t chunk;
+        const uint8_t* source = data_at_position(&chunk);
+        if (source == NULL) {
+            return -1;
+        }
+        if (chunk > length - total) {
+            chunk = length - total;
+        }
+        if (chunk > size - position) {
+            chunk = size - position;
+        }
+        memcpy(out + total, source, chunk);
+        total += chunk;
+        position += chunk;
+    }
+    return (int)total;
+}
+
+void SDFile::enable_read_ahead(uint8_t* buffers, uint32_t max_blocks) {
+    ahead[0].data = buffers;
+    ahead[1].data = buffers + max_blocks * SECTOR_SIZE;
+    ahead[0].length = 0;
+    ahead[1].length = 0;
+    ahead_max_blocks = buffers != NULL ? max_blocks : 0;
+    ahead_window = READ_AHEAD_MIN_BLOCKS;
+}
+
+void SDFile::prefetch() {
+    if (!open || ahead_max_blocks == 0 || position < SECTOR_SIZE) {
+        return;
+    }
+    const AheadBuffer* front = &ahead[ahead_front];
+    AheadBuffer* back = &ahead[ahead_front ^ 1];
+    uint32_t next = front->start + front->length;
+    if (front->length == 0 || next >= size || (back->length > 0 && back->start == next)) {
+        return;
+    }
+    if (!fill(back, next)) {
+        back->length = 0;  // The reader tries again and reports the error
+    }
+}
+
+void SDFile::print_read_ahead() const {
+    printf("Read-ahead: %lu reads, %lu hits, %lu misses, window %lu of %lu blocks\n",
+           (unsigned long)ahead_reads, (unsigned long)ahead_hits, (unsigned long)ahead_misses,
+           (unsigned long)ahead_window, (unsigned long)ahead_max_blocks);
+}
+
+bool SDFile::read_line(char* line, size_t capacity) {
+    size_t length = 0;
+    bool any = false;
+    char c;
+    while (read(&c, 1) == 1) {
+        any = true;
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && length < capacity - 1) {
+            line[length++] = c;
+        }
+    }
+    line[length] = '\0';
+    return any;
+}
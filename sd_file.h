@@ -0,0 +1,108 @@
+#ifndef SD_FILE_H
+#define SD_FILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sd_card.h"
+
+// Sequential read-only access to a file in the root directory of the
+// FAT32 volume mounted by SDCard::parse_boot_sector(). Names are 8.3
+// and matched case-insensitively; long file names are not supported.
+//
+// remove() and preallocate() tell the card about clusters whose contents
+// no longer matter with SDCard::discard(), so later writes to them land
+// on erased blocks.
+//
+// With enable_read_ahead() a reader that gets past the first sector is
+// taken to be streaming the file. Reads then come from a double buffer
+// filled with multi-block reads, and prefetch() fills the back half with
+// the window after the front one. A consumer that calls prefetch() after
+// handing each chunk on (to USB, the network) has the SPI transfer of the
+// next window run while the previous one is still being sent. The window
+// is resized at every buffer swap to hold READ_AHEAD_TARGET_US of reading
+// at the rate the consumer went through the last one.
+
+#define READ_AHEAD_MIN_BLOCKS 1
+#define READ_AHEAD_TARGET_US 20000
+
+class SDFile {
+private:
+    static const uint32_t SECTOR_SIZE = 512;
+    static const uint32_t FAT_END_OF_CHAIN = 0x0FFFFFF8;
+
+    SDCard* card;
+    bool open;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t position;
+
+    // Cluster holding the current position, and its index in the chain
+    uint32_t cluster;
+    uint32_t cluster_index;
+
+    // One-sector read buffer
+    uint8_t buffer[SECTOR_SIZE];
+    uint32_t buffered_sector;
+    bool buffer_valid;
+
+    // Read-ahead double buffer, from enable_read_ahead()
+    struct AheadBuffer {
+        uint8_t* data;
+        uint32_t start;             // File offset of data[0], sector aligned
+        uint32_t length;            // Bytes held, 0 when empty
+    };
+    AheadBuffer ahead[2];
+    int ahead_front;
+    uint32_t ahead_max_blocks;
+    uint32_t ahead_window;          // Blocks per read
+    uint32_t ahead_swap_us;         // When the front buffer came into use
+
+    // Read-ahead statistics for the open file
+    uint32_t ahead_hits;            // Front buffer used up with the next one ready
+    uint32_t ahead_misses;          // ... and the reader had to wait for the card
+    uint32_t ahead_reads;
+
+    uint32_t cluster_to_sector(uint32_t cluster_number) const;
+    uint32_t next_cluster(uint32_t cluster_number);
+    bool load_sector(uint32_t sector);
+    bool store_sector();
+    bool is_contiguous(uint32_t cluster_count);
+    uint32_t find_free_run(uint32_t cluster_count);
+    bool write_chain(uint32_t start, uint32_t cluster_count);
+    bool add_directory_entry(const char fat_name[11], uint32_t start, uint32_t length);
+    uint8_t* find_directory_entry(const char fat_name[11]);
+    bool free_chain(uint32_t start);
+    void discard_clusters(uint32_t start, uint32_t cluster_count);
+    bool seek_cluster(uint32_t offset);
+    const uint8_t* data_at_position(uint32_t* available);
+    bool fill(AheadBuffer* target, uint32_t start);
+    void resize_window(uint32_t consumed, uint32_t elapsed_us);
+    static void to_fat_name(const char* name, char fat_name[11]);
+
+public:
+    // Constructor
+    explicit SDFile(SDCard* card);
+
+    // Public interface
+    bool open_file(const char* name);
+    bool preallocate(const char* name, uint32_t length);
+    bool remove(const char* name);
+    void close();
+    int read(void* data, size_t length);        // Bytes read, 0 at end of file, -1 on error
+    bool read_line(char* line, size_t capacity);  // Strips the line ending, false at end of file or error
+    void enable_read_ahead(uint8_t* buffers, uint32_t max_blocks);  // Room for 2 * max_blocks sectors
+    void prefetch();                            // Between chunks, reads the next window if it isn't buffered
+    void print_read_ahead() const;
+
+    // Getter methods
+    bool isOpen() const { return open; }
+    uint32_t getSize() const { return size; }
+    uint32_t getPosition() const { return position; }
+    uint32_t getFirstSector() const { return cluster_to_sector(first_cluster); }  // Contiguous after preallocate()
+    uint32_t getReadAheadWindow() const { return ahead_window; }
+    uint32_t getReadAheadHits() const { return ahead_hits; }
+    uint32_t getReadAheadMisses() const { return ahead_misses; }
+};
+
+#endif // SD_FILE_H
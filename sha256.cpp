@@ -0,0 +1,114 @@
+#include <string.h>
+#include "sha256.h"
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotate_right(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void compress_block(uint32_t hash[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3];
+    uint32_t e = hash[4], f = hash[5], g = hash[6], h = hash[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + round_constants[i] + w[i];
+        uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    hash[0] += a; hash[1] += b; hash[2] += c; hash[3] += d;
+    hash[4] += e; hash[5] += f; hash[6] += g; hash[7] += h;
+}
+
+void sha256_init(sha256_state_t* state) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(state->hash, initial, sizeof(initial));
+    state->length = 0;
+    state->block_used = 0;
+}
+
+void sha256_update(sha256_state_t* state, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    state->length += length;
+
+    // Top up a partial block first
+    if (state->block_used > 0) {
+        size_t take = SHA256_BLOCK_SIZE - state->block_used;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(state->block + state->block_used, bytes, take);
+        state->block_used += take;
+        bytes += take;
+        length -= take;
+        if (state->block_used < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        compress_block(state->hash, state->block);
+        state->block_used = 0;
+    }
+
+    // Whole blocks straight from the input
+    while (length >= SHA256_BLOCK_SIZE) {
+        compress_block(state->hash, bytes);
+        bytes += SHA256_BLOCK_SIZE;
+        length -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(state->block, bytes, length);
+    state->block_used = length;
+}
+
+void sha256_final(sha256_state_t* state, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bit_length = state->length * 8;
+
+    // A 1 bit, zeros up to 8 bytes short of a block boundary, then the length
+    uint8_t padding[SHA256_BLOCK_SIZE + 8];
+    size_t pad_length = (state->block_used < 56 ? 56 : 120) - state->block_used;
+    memset(padding, 0, pad_length);
+    padding[0] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        padding[pad_length + i] = (uint8_t)(bit_length >> (56 - i * 8));
+    }
+    sha256_update(state, padding, pad_length + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(state->hash[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state->hash[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state->hash[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state->hash[i];
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SHA-256 (FIPS 180-4), fed in pieces as the data arrives
+//
+//     sha256_state_t state;
+//     sha256_init(&state);
+//     sha256_update(&state, data, length);    // Any number of times
+//     sha256_final(&state, digest);
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t hash[8];
+    uint64_t length;                    // Bytes hashed so far
+    uint8_t block[SHA256_BLOCK_SIZE];   // Partial block waiting for more data
+    uint32_t block_used;
+} sha256_state_t;
+
+void sha256_init(sha256_state_t* state);
+void sha256_update(sha256_state_t* state, const void* data, size_t length);
+void sha256_final(sha256_state_t* state, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif // SHA256_H
@@ -0,0 +1,157 @@
+// Command line tokenizer and dispatcher: quoting and escapes, the token
+// limit, argument counts checked against the table, and the compile-time
+// checks of the table itself
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include "cli.h"
+
+static std::vector<std::string> tokens(const char* text, int max_tokens = CLI_MAX_ARGS) {
+    char line[128];
+    char* argv[CLI_MAX_ARGS];
+    strcpy(line, text);
+    int argc = cli_tokenize(line, argv, max_tokens);
+    if (argc < 0) {
+        return {"<error>"};
+    }
+    return std::vector<std::string>(argv, argv + argc);
+}
+
+typedef std::vector<std::string> Tokens;
+
+static void test_tokenize() {
+    assert(tokens("").empty());
+    assert(tokens(" \t\r\n").empty());
+    assert(tokens("status") == Tokens({"status"}));
+    assert(tokens("  wifi   connect\tnet  ") == Tokens({"wifi", "connect", "net"}));
+    assert(tokens("save \"My Network\" 'pass phrase'") == Tokens({"save", "My Network", "pass phrase"}));
+    assert(tokens("a\"b c\"d") == Tokens({"ab cd"}));
+    assert(tokens("\"\" x") == Tokens({"", "x"}));
+    assert(tokens("\"it's\" 'say \"hi\"'") == Tokens({"it's", "say \"hi\""}));
+
+    // Backslash escapes outside single quotes only
+    assert(tokens("My\\ Network") == Tokens({"My Network"}));
+    assert(tokens("\"a \\\"quoted\\\" word\"") == Tokens({"a \"quoted\" word"}));
+    assert(tokens("'back\\slash'") == Tokens({"back\\slash"}));
+    assert(tokens("\\\\") == Tokens({"\\"}));
+    assert(tokens("trailing\\") == Tokens({"trailing\\"}));
+
+    assert(tokens("save \"My Network") == Tokens({"<error>"}));
+    assert(tokens("save 'open") == Tokens({"<error>"}));
+    assert(tokens("\\\"not a quote") == Tokens({"\"not", "a", "quote"}));
+
+    // The limit counts the command name
+    assert(tokens("1 2 3 4 5 6 7 8").size() == CLI_MAX_ARGS);
+    assert(tokens("1 2 3 4 5 6 7 8 9") == Tokens({"<error>"}));
+    assert(tokens("1 2 3 4 5 6 7 8   ").size() == CLI_MAX_ARGS);
+    assert(tokens("a b", 1) == Tokens({"<error>"}));
+    printf("tokenize: ok\n");
+}
+
+// What the last handler was called with
+static std::string called;
+static Tokens arguments;
+
+static void record(int argc, char* argv[]) {
+    called = argv[0];
+    arguments.clear();
+    for (int i = 1; argv[i] != NULL; i++) {
+        arguments.push_back(argv[i]);
+    }
+    assert(argc >= 1);
+}
+
+static constexpr cli_command_t table[] = {
+    {"copy", "<from> <to>", "Two arguments", 2, 2, record},
+    {"help", "[command]", "Optional argument", 0, 1, record},
+    {"log", "<name> [a] [b] [c]", "One to four", 1, 4, record},
+    {"most", "", "As many as a line holds", 0, CLI_MAX_ARGS - 1, record},
+    {"status", "", "No arguments", 0, 0, record},
+};
+static const size_t COUNT = sizeof(table) / sizeof(table[0]);
+static_assert(cli_table_valid(table), "test table");
+
+static bool dispatch(const char* text) {
+    char line[128];
+    strcpy(line, text);
+    called.clear();
+    arguments.clear();
+    return cli_dispatch(table, COUNT, line);
+}
+
+static void test_dispatch() {
+    assert(dispatch("status") && called == "status" && arguments.empty());
+    assert(!dispatch("status now") && called.empty());
+
+    // Optional arguments the user left out arrive as empty strings
+    assert(dispatch("help") && called == "help" && arguments == Tokens({""}));
+    assert(dispatch("help copy") && arguments == Tokens({"copy"}));
+    assert(!dispatch("help copy log"));
+    assert(dispatch("log boot") && arguments == Tokens({"boot", "", "", ""}));
+    assert(dispatch("log \"cold boot\" 1 2 3") && arguments == Tokens({"cold boot", "1", "2", "3"}));
+    assert(!dispatch("log") && !dispatch("log 1 2 3 4 5"));
+
+    assert(!dispatch("copy a"));
+    assert(dispatch("copy a b") && arguments == Tokens({"a", "b"}));
+    assert(!dispatch("copy a b c"));
+
+    assert(dispatch("most 1 2 3 4 5 6 7") && arguments.size() == CLI_MAX_ARGS - 1);
+    assert(!dispatch("most 1 2 3 4 5 6 7 8") && called.empty());
+
+    // Lines that never reach a handler
+    assert(!dispatch(""));
+    assert(!dispatch("   "));
+    assert(!dispatch("stat"));
+    assert(!dispatch("statuss"));
+    assert(!dispatch("Status"));
+    assert(!dispatch("copy \"a b"));
+    assert(called.empty());
+
+    // Every entry is found by the binary search, and nothing between them
+    for (size_t i = 0; i < COUNT; i++) {
+        assert(cli_find(table, COUNT, table[i].name) == &table[i]);
+    }
+    assert(cli_find(table, COUNT, "a") == NULL && cli_find(table, COUNT, "zzz") == NULL);
+    assert(cli_find(table, COUNT, "d") == NULL && cli_find(table, 0, "copy") == NULL);
+    printf("dispatch: ok\n");
+}
+
+// Tables the compile-time check refuses
+static constexpr cli_command_t unsorted[] = {
+    {"status", "", "", 0, 0, record},
+    {"copy", "", "", 0, 0, record},
+};
+static constexpr cli_command_t duplicate[] = {
+    {"copy", "", "", 0, 0, record},
+    {"copy", "", "", 0, 0, record},
+};
+static constexpr cli_command_t prefix_after[] = {
+    {"logs", "", "", 0, 0, record},
+    {"log", "", "", 0, 0, record},
+};
+static constexpr cli_command_t inverted[] = {
+    {"copy", "", "", 2, 1, record},
+};
+static constexpr cli_command_t too_many[] = {
+    {"copy", "", "", 0, CLI_MAX_ARGS, record},
+};
+static constexpr cli_command_t prefix_before[] = {
+    {"log", "", "", 0, 0, record},
+    {"logs", "", "", 0, 0, record},
+};
+static_assert(!cli_table_valid(unsorted), "unsorted");
+static_assert(!cli_table_valid(duplicate), "duplicate");
+static_assert(!cli_table_valid(prefix_after), "prefix sorts first");
+static_assert(!cli_table_valid(inverted), "min above max");
+static_assert(!cli_table_valid(too_many), "more arguments than a line holds");
+static_assert(cli_table_valid(prefix_before), "prefix sorts first");
+static_assert(cli_compare("a", "b") < 0 && cli_compare("b", "a") > 0 && cli_compare("ab", "ab") == 0, "compare");
+
+int main() {
+    test_tokenize();
+    test_dispatch();
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,225 @@
+// Logger pipeline with LOGGER_HOST: synthetic samples go through feed(),
+// compress_frames() and poll() into a RAM BlockDevice, standing in for the
+// DMA interrupt, core 1 and the SD card
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+#include "data_logger.h"
+#include "crc32.h"
+
+class RamSink : public BlockDevice {
+public:
+    std::vector<uint8_t> data;
+    uint32_t capacity;
+    uint32_t writes = 0;
+    uint32_t largest_write = 0;
+    bool fail = false;
+
+    explicit RamSink(uint32_t capacity) : capacity(capacity) {}
+
+    uint32_t block_count() const override { return capacity; }
+    bool read_block(uint32_t, uint8_t*) override { return false; }
+    bool write_blocks(uint32_t block_addr, const uint8_t* buffer, uint32_t count) override {
+        if (fail) {
+            return false;
+        }
+        assert(block_addr * LOG_BLOCK_SIZE == data.size());  // The log is written in order
+        data.insert(data.end(), buffer, buffer + count * LOG_BLOCK_SIZE);
+        writes++;
+        if (count > largest_write) {
+            largest_write = count;
+        }
+        return true;
+    }
+};
+
+static uint16_t samples[LOG_SAMPLES_PER_BLOCK];
+static uint32_t next_sample;
+
+static void feed_blocks(int count) {
+    for (int b = 0; b < count; b++) {
+        for (int i = 0; i < LOG_SAMPLES_PER_BLOCK; i++) {
+            samples[i] = next_sample++ & 0xFFF;
+        }
+        data_logger.feed(samples, LOG_SAMPLES_PER_BLOCK, 0);
+    }
+}
+
+// Blocks dropped while the writer stalls leave a gap in the sequence
+// numbers, and everything else reaches the file intact
+static void test_stall() {
+    RamSink sink(1000);
+    next_sample = 0;
+    assert(data_logger.start(&sink, 500000, 7));
+    for (int i = 0; i < 60; i++) {
+        feed_blocks(10);
+        data_logger.poll();
+    }
+    feed_blocks(200);               // Writer stalled, the ring overflows
+    data_logger.stop();
+    data_logger.poll();
+    assert(!data_logger.isActive());
+
+    uint32_t written = data_logger.getBlocksWritten();
+    uint32_t dropped = data_logger.getRingOverruns();
+    assert(written + dropped == 800);
+    assert(dropped >= 200 - LOG_RING_BLOCKS && dropped <= 200 - LOG_RING_BLOCKS + LOG_WRITE_BATCH);
+    assert(sink.largest_write <= LOG_WRITE_BATCH);
+
+    uint32_t gaps = 0;
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < written; i++) {
+        const log_block_t* block = (const log_block_t*)&sink.data[i * LOG_BLOCK_SIZE];
+        assert(block->header.magic == LOG_BLOCK_MAGIC && block->header.run == 7);
+        assert(block->header.sample_count == LOG_SAMPLES_PER_BLOCK);
+        if (i > 0) {
+            assert(block->header.sequence > previous);
+            gaps += block->header.sequence - previous - 1;
+        }
+        previous = block->header.sequence;
+        uint32_t first = block->header.sequence * LOG_SAMPLES_PER_BLOCK;
+        for (int k = 0; k < LOG_SAMPLES_PER_BLOCK; k++) {
+            assert(block->samples[k] == ((first + k) & 0xFFF));
+        }
+    }
+    assert(gaps + (799 - previous) == dropped);
+    printf("stall: %lu written, %lu dropped, ok\n", (unsigned long)written, (unsigned long)dropped);
+}
+
+// A full file or a failed write stops the run once, and blocks still
+// arriving before capture ends are dropped, not written
+static void test_stop_on_error() {
+    RamSink small(20);
+    assert(data_logger.start(&small, 1000, 8));
+    feed_blocks(2 * LOG_WRITE_BATCH);
+    data_logger.poll();
+    feed_blocks(LOG_WRITE_BATCH);
+    data_logger.poll();
+    assert(!data_logger.isActive());
+    assert(data_logger.getBlocksWritten() == 20 && small.data.size() == 20 * LOG_BLOCK_SIZE);
+
+    RamSink failing(100);
+    failing.fail = true;
+    assert(data_logger.start(&failing, 1000, 9));
+    feed_blocks(LOG_WRITE_BATCH);
+    data_logger.poll();
+    assert(data_logger.getWriteErrors() == 1);
+    feed_blocks(LOG_WRITE_BATCH);
+    data_logger.poll();
+    data_logger.poll();
+    assert(!data_logger.isActive() && data_logger.getWriteErrors() == 1);
+    printf("stop on error: ok\n");
+}
+
+// Decode a compressed log back into blocks: each sector starts either a
+// plain block or a frame, whose payload decompresses to filtered blocks
+static std::vector<log_block_t> decode(const RamSink& sink) {
+    std::vector<log_block_t> blocks;
+    uint32_t sectors = sink.data.size() / LOG_BLOCK_SIZE;
+    uint32_t i = 0;
+    while (i < sectors) {
+        const uint8_t* sector = &sink.data[i * LOG_BLOCK_SIZE];
+        uint32_t magic;
+        memcpy(&magic, sector, sizeof(magic));
+        if (magic == LOG_BLOCK_MAGIC) {
+            blocks.push_back(*(const log_block_t*)sector);
+            i++;
+            continue;
+        }
+        assert(magic == LOG_FRAME_MAGIC);
+        log_frame_header_t header;
+        memcpy(&header, sector, sizeof(header));
+        assert(header.sector_count > 0 && header.sector_count < header.block_count);
+        assert(crc32(sector + sizeof(header), header.payload_length) == header.crc);
+        log_block_t frame[LOG_FRAME_BLOCKS];
+        int length = lz4_decompress(sector + sizeof(header), header.payload_length, (uint8_t*)frame, sizeof(frame));
+        assert(length == header.block_count * LOG_BLOCK_SIZE);
+        for (int b = 0; b < header.block_count; b++) {
+            log_unfilter_block(&frame[b]);
+            assert(frame[b].header.magic == LOG_BLOCK_MAGIC);
+            assert(frame[b].header.sequence == header.first_sequence + b);
+            blocks.push_back(frame[b]);
+        }
+        i += header.sector_count;
+    }
+    return blocks;
+}
+
+static uint16_t signal(int kind, uint32_t n) {
+    switch (kind) {
+    case 0:
+        return 2048 + (int)(1000 * sin(n / 50.0));                          // Smooth
+    case 1:
+        return rand() & 0xFFF;                                              // Noise, stored plain
+    default:
+        return 2048 + (int)(1000 * sin(n / 50.0)) + rand() % 17 - 8;        // Smooth with noise
+    }
+}
+
+// Compressed runs decode back to the samples fed in, with a partial frame
+// at the end, and frames that do not shrink stored as plain blocks
+static void test_compression() {
+    assert(data_logger.set_compression(true));
+    for (int kind = 0; kind < 3; kind++) {
+        srand(1);
+        std::vector<uint16_t> fed;
+        RamSink sink(100000);
+        assert(data_logger.start(&sink, 500000, 3));
+        int total = 3000 + kind;
+        for (int b = 0; b < total; b++) {
+            for (int i = 0; i < LOG_SAMPLES_PER_BLOCK; i++) {
+                samples[i] = signal(kind, fed.size());
+                fed.push_back(samples[i]);
+            }
+            data_logger.feed(samples, LOG_SAMPLES_PER_BLOCK, b);
+            if (b % 8 == 7) {
+                data_logger.compress_frames();
+            }
+            if (b % 16 == 15) {
+                data_logger.poll();
+            }
+        }
+        data_logger.stop();
+        data_logger.poll();
+        assert(!data_logger.isActive());
+
+        std::vector<log_block_t> blocks = decode(sink);
+        assert(blocks.size() + data_logger.getRingOverruns() == (size_t)total);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            assert(blocks[i].header.run == 3);
+            assert(i == 0 || blocks[i].header.sequence == blocks[i - 1].header.sequence + 1);
+            const uint16_t* expected = &fed[blocks[i].header.sequence * LOG_SAMPLES_PER_BLOCK];
+            assert(memcmp(blocks[i].samples, expected, sizeof(blocks[i].samples)) == 0);
+        }
+        if (kind == 1) {
+            assert(data_logger.getFramesCompressed() == 0);
+        } else {
+            assert(sink.data.size() / LOG_BLOCK_SIZE < blocks.size());
+        }
+        printf("compression, signal %d: %lu blocks in %lu sectors, ok\n", kind,
+               (unsigned long)blocks.size(), (unsigned long)(sink.data.size() / LOG_BLOCK_SIZE));
+    }
+
+    // Without the compressor running, both staging frames fill and the rest is dropped
+    RamSink sink(100000);
+    assert(data_logger.start(&sink, 1000, 4));
+    feed_blocks(100);
+    data_logger.stop();
+    data_logger.poll();
+    assert(decode(sink).size() == 2 * LOG_FRAME_BLOCKS);
+    assert(data_logger.getRingOverruns() == 100 - 2 * LOG_FRAME_BLOCKS);
+    assert(data_logger.set_compression(false));
+    printf("compression, stalled compressor: ok\n");
+}
+
+int main() {
+    assert(data_logger.init(LOG_RING_BLOCKS));
+    test_stall();
+    test_stop_on_error();
+    test_compression();
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Event log with EVENT_LOG_HOST against a RAM FlashDevice of four sectors
+// that can lose power after a set number of erases and programs, a program
+// cut partway through its page
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <utility>
+#include <vector>
+#include "event_log.h"
+
+struct PowerCut {};
+
+class RamFlash : public FlashDevice {
+public:
+    uint8_t memory[4 * SECTOR_SIZE];
+    long operations_left = -1;      // Negative for no cut
+    int erases = 0;
+    int programs = 0;
+
+    RamFlash() { memset(memory, 0xFF, sizeof(memory)); }
+
+    const uint8_t* read_ptr(uint32_t offset) override { return memory + offset; }
+    bool erase_sector(uint32_t offset) override {
+        assert(offset % SECTOR_SIZE == 0);
+        cut_point();
+        memset(memory + offset, 0xFF, SECTOR_SIZE);
+        erases++;
+        return true;
+    }
+    bool program_page(uint32_t offset, const uint8_t* data) override {
+        assert(offset % PAGE_SIZE == 0);
+        cut_point();
+        bool torn = operations_left == 0;
+        uint32_t length = torn ? rand() % PAGE_SIZE : PAGE_SIZE;
+        for (uint32_t i = 0; i < length; i++) {
+            memory[offset + i] &= data[i];
+        }
+        programs++;
+        if (torn) {
+            throw PowerCut();
+        }
+        return true;
+    }
+
+private:
+    void cut_point() {
+        if (operations_left == 0) {
+            throw PowerCut();
+        }
+        if (operations_left > 0) {
+            operations_left--;
+        }
+    }
+};
+
+// Boot and first argument of every event read back
+typedef std::vector<std::pair<uint16_t, uint32_t>> Events;
+
+static void collect(uint16_t boot, const event_record_t* record, void* context) {
+    ((Events*)context)->push_back(std::make_pair(boot, record->args[0]));
+}
+
+static Events read_events(const EventLog& log) {
+    Events events;
+    log.read_all(collect, &events);
+    return events;
+}
+
+// Events survive a reboot, poll() writes them out within EVENT_LOG_FLUSH_MS,
+// and once the ring wraps only the newest are kept, in order
+static void test_ring() {
+    RamFlash flash;
+    EventLog log(&flash, 0, 4);
+    assert(log.mount() && log.getBoot() == 1);
+    uint32_t time_ms = 0;
+    for (uint32_t i = 0; i < 100; i++) {
+        event_log_set_mock_time(time_ms += 100);
+        assert(log.record(EVENT_LOG_STARTED, i));
+        log.poll();
+    }
+    Events events = read_events(log);
+    assert(events.size() == 100);
+    for (uint32_t i = 0; i < 100; i++) {
+        assert(events[i].second == i);
+    }
+    event_log_set_mock_time(time_ms += EVENT_LOG_FLUSH_MS + 1000);
+    log.poll();
+    assert(log.getUnwritten() == 0);
+
+    EventLog rebooted(&flash, 0, 4);
+    assert(rebooted.mount() && rebooted.getBoot() == 2);
+    assert(read_events(rebooted).size() == 100);
+    assert(rebooted.record(EVENT_BOOT, 7));
+    events = read_events(rebooted);
+    assert(events.size() == 101 && events.back() == std::make_pair((uint16_t)2, 7u));
+
+    for (uint32_t i = 0; i < 5000; i++) {
+        event_log_set_mock_time(++time_ms);
+        rebooted.record(EVENT_LOG_STARTED, 1000 + i);
+        rebooted.poll();
+    }
+    rebooted.flush();
+    events = read_events(rebooted);
+    for (size_t i = 1; i < events.size(); i++) {
+        assert(events[i].second == events[i - 1].second + 1);
+    }
+    assert(events.back().second == 5999);
+
+    EventLog again(&flash, 0, 4);
+    assert(again.mount());
+    Events remounted = read_events(again);
+    assert(remounted.size() == events.size() && remounted.back().second == 5999);
+    printf("ring: %lu events kept after wrapping, ok\n", (unsigned long)events.size());
+}
+
+// After a cut at any point the log mounts, reads back in order, keeps
+// everything flushed before the cut, and goes on recording over later boots
+static void test_power_cuts() {
+    int trials = 0;
+    for (long cut = 1; cut < 400; cut += 3) {
+        RamFlash flash;
+        EventLog log(&flash, 0, 4);
+        assert(log.mount());
+        flash.operations_left = cut;
+        uint32_t flushed = 0;
+        try {
+            for (uint32_t n = 1; n < 3000; n++) {
+                event_log_set_mock_time(n);
+                log.record(EVENT_LOG_STARTED, n);
+                if (n % 7 == 0) {
+                    log.flush();
+                    flushed = n;
+                }
+            }
+        } catch (const PowerCut&) {
+        }
+        flash.operations_left = -1;
+
+        for (int boot = 0; boot < 3; boot++) {
+            EventLog rebooted(&flash, 0, 4);
+            assert(rebooted.mount());
+            Events events = read_events(rebooted);
+            for (size_t i = 1; i < events.size(); i++) {
+                assert(events[i].second > events[i - 1].second);
+            }
+            if (boot == 0 && flushed != 0) {
+                assert(!events.empty() && events.back().second >= flushed);
+            }
+            for (uint32_t i = 0; i < 40; i++) {
+                assert(rebooted.record(EVENT_LOG_STARTED, 100000 + boot * 100 + i));
+            }
+            rebooted.flush();
+            assert(read_events(rebooted).back().second == 100000u + boot * 100 + 39);
+        }
+        trials++;
+    }
+    printf("power cuts: %d, ok\n", trials);
+}
+
+int main() {
+    srand(3);
+    test_ring();
+    test_power_cuts();
+    printf("PASS\n");
+    return 0;
+}
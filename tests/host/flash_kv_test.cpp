@@ -0,0 +1,308 @@
+// Key/value store against a RAM FlashDevice that enforces NOR semantics:
+// erase sets a whole sector to 0xFF, a program can only clear bits, and
+// programming a byte that is not erased is a bug in the store. The
+// device can lose power after a set number of erases and programs, leaving
+// the page or sector it was working on partly done.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <map>
+#include <string>
+#include "flash_kv.h"
+
+struct PowerCut {};
+
+class RamFlash : public FlashDevice {
+public:
+    static const int SECTORS = 4;
+    uint8_t memory[SECTORS * SECTOR_SIZE];
+    long operations_left = -1;      // Negative for no cut
+    long operations = 0;
+
+    RamFlash() { memset(memory, 0xFF, sizeof(memory)); }
+
+    const uint8_t* read_ptr(uint32_t offset) override { return memory + offset; }
+    bool erase_sector(uint32_t offset) override {
+        assert(offset % SECTOR_SIZE == 0 && offset < sizeof(memory));
+        uint32_t length = SECTOR_SIZE;
+        bool cut = cut_point();
+        if (cut) {
+            length = rand() % (SECTOR_SIZE / PAGE_SIZE) * PAGE_SIZE;
+        }
+        memset(memory + offset, 0xFF, length);
+        if (cut) {
+            throw PowerCut();
+        }
+        return true;
+    }
+    bool program_page(uint32_t offset, const uint8_t* data) override {
+        assert(offset % PAGE_SIZE == 0 && offset < sizeof(memory));
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            assert(data[i] == 0xFF || memory[offset + i] == 0xFF);     // 0xFF leaves a byte alone
+        }
+        uint32_t length = PAGE_SIZE;
+        bool cut = cut_point();
+        if (cut) {
+            length = rand() % PAGE_SIZE;
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            memory[offset + i] &= data[i];
+        }
+        if (cut) {
+            throw PowerCut();
+        }
+        return true;
+    }
+
+private:
+    // True when this operation is the one the power fails during
+    bool cut_point() {
+        operations++;
+        if (operations_left < 0) {
+            return false;
+        }
+        return operations_left-- == 0;
+    }
+};
+
+// Values follow from the key and a version, so any value read back can be
+// told apart from a torn or stale one
+static std::string value_for(int key, uint32_t version, size_t length) {
+    std::string value(length, ' ');
+    for (size_t i = 0; i < length; i++) {
+        value[i] = (char)('a' + (key * 7 + version * 13 + i) % 26);
+    }
+    return value;
+}
+
+static std::string key_name(int key) {
+    return "key" + std::to_string(key);
+}
+
+static bool holds(const FlashKV& kv, int key, const std::string& expected) {
+    size_t length;
+    const void* value = kv.get(key_name(key).c_str(), &length);
+    return value != NULL && length == expected.size() && memcmp(value, expected.data(), length) == 0;
+}
+
+typedef std::map<int, std::string> Model;
+
+// The store holds exactly the keys and values of the model
+static bool matches(const FlashKV& kv, const Model& model, int keys) {
+    if (kv.getKeyCount() != (int)model.size()) {
+        return false;
+    }
+    for (int key = 0; key < keys; key++) {
+        Model::const_iterator it = model.find(key);
+        size_t length;
+        if (it == model.end() ? kv.get(key_name(key).c_str(), &length) != NULL : !holds(kv, key, it->second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Step of a workload over a handful of keys: removes a key that exists
+// every fifth step, otherwise puts a value of varying length
+static bool step(FlashKV& kv, Model& model, uint32_t n, int keys) {
+    int key = (int)(n * 7 % keys);
+    if (n % 5 == 4 && model.count(key)) {
+        model.erase(key);
+        return kv.remove(key_name(key).c_str());
+    }
+    model[key] = value_for(key, n, n * 37 % 300);
+    return kv.put(key_name(key).c_str(), model[key].data(), model[key].size());
+}
+
+static void test_basic() {
+    RamFlash flash;
+    FlashKV kv(&flash, 0, RamFlash::SECTORS);
+    assert(!kv.isMounted() && kv.mount() && kv.getKeyCount() == 0);
+
+    uint32_t number = 1234;
+    assert(kv.put("number", &number, sizeof(number)));
+    assert(kv.put("name", "picow", 5));
+    assert(kv.put("empty", "", 0));
+    number = 0;
+    assert(kv.read("number", &number, sizeof(number)) && number == 1234);
+    assert(!kv.read("number", &number, 2));
+    size_t length;
+    const void* value = kv.get("name", &length);
+    assert(value != NULL && length == 5 && memcmp(value, "picow", 5) == 0);
+    assert(kv.get("empty", &length) != NULL && length == 0);
+    assert(kv.get("missing", &length) == NULL);
+
+    // Rewriting a value unchanged programs nothing
+    uint32_t programs = kv.getProgramCount();
+    assert(kv.put("name", "picow", 5));
+    assert(kv.getProgramCount() == programs);
+
+    // A tombstone hides every older record, also after a remount
+    assert(kv.put("name", "pico w", 6));
+    assert(kv.remove("name") && kv.get("name", &length) == NULL);
+    assert(!kv.remove("name"));
+    FlashKV rebooted(&flash, 0, RamFlash::SECTORS);
+    assert(rebooted.mount() && rebooted.getKeyCount() == 2);
+    assert(rebooted.get("name", &length) == NULL);
+    assert(rebooted.read("number", &number, sizeof(number)) && number == 1234);
+    char key[FlashKV::MAX_KEY_LEN + 1];
+    assert(rebooted.key_at(0, key, sizeof(key)) && strcmp(key, "number") == 0);
+    assert(rebooted.key_at(1, key, sizeof(key)) && strcmp(key, "empty") == 0);
+    assert(!rebooted.key_at(2, key, sizeof(key)));
+
+    // Limits
+    std::string long_key(FlashKV::MAX_KEY_LEN + 1, 'k');
+    assert(!rebooted.put(long_key.c_str(), "x", 1));
+    assert(rebooted.put(long_key.substr(1).c_str(), "x", 1));
+    std::string big(FlashKV::MAX_VALUE_LEN + 1, 'v');
+    assert(!rebooted.put("big", big.data(), big.size()));
+    assert(rebooted.put("big", big.data(), FlashKV::MAX_VALUE_LEN));
+    assert(!rebooted.put("", "x", 1));
+    for (int i = rebooted.getKeyCount(); i < FlashKV::MAX_KEYS; i++) {
+        assert(rebooted.put(key_name(i).c_str(), "x", 1));
+    }
+    assert(!rebooted.put("one too many", "x", 1));
+    assert(rebooted.put("number", "y", 1));      // Existing keys still update
+
+    // A blank or foreign device is formatted on mount
+    memset(flash.memory, 0x00, sizeof(flash.memory));
+    FlashKV fresh(&flash, 0, RamFlash::SECTORS);
+    assert(fresh.mount() && fresh.getKeyCount() == 0);
+    printf("basic: ok\n");
+}
+
+// Enough writes to go round the sectors many times, checked against a model
+// and by remounting along the way
+static void test_wrap() {
+    const int KEYS = 12;
+    RamFlash flash;
+    FlashKV kv(&flash, 0, RamFlash::SECTORS);
+    assert(kv.format());
+    Model model;
+    for (uint32_t n = 0; n < 3000; n++) {
+        assert(step(kv, model, n, KEYS));
+        if (n % 250 == 0) {
+            FlashKV rebooted(&flash, 0, RamFlash::SECTORS);
+            assert(rebooted.mount() && matches(rebooted, model, KEYS));
+        }
+    }
+    assert(matches(kv, model, KEYS));
+    assert(kv.getEraseCount() > 10 * RamFlash::SECTORS);
+    printf("wrap: %lu erases, %lu programs, ok\n",
+           (unsigned long)kv.getEraseCount(), (unsigned long)kv.getProgramCount());
+}
+
+// A cut at every erase and program of the workload: the store mounts with
+// all acknowledged changes, the interrupted one either done or not, and
+// carries on over later boots
+static void test_power_cuts() {
+    const int KEYS = 8;
+    const uint32_t STEPS = 400;
+
+    RamFlash counting;
+    FlashKV uncut(&counting, 0, RamFlash::SECTORS);
+    assert(uncut.format());
+    Model model;
+    counting.operations = 0;
+    for (uint32_t n = 0; n < STEPS; n++) {
+        assert(step(uncut, model, n, KEYS));
+    }
+    long total = counting.operations;
+
+    for (long cut = 0; cut < total; cut++) {
+        RamFlash flash;
+        FlashKV kv(&flash, 0, RamFlash::SECTORS);
+        assert(kv.format());
+        Model before;
+        Model after;
+        flash.operations_left = cut;
+        try {
+            for (uint32_t n = 0; n < STEPS; n++) {
+                before = after;
+                assert(step(kv, after, n, KEYS));
+            }
+            assert(false);      // Every cut point lies within the workload
+        } catch (const PowerCut&) {
+        }
+        flash.operations_left = -1;
+
+        for (int boot = 0; boot < 2; boot++) {
+            FlashKV rebooted(&flash, 0, RamFlash::SECTORS);
+            assert(rebooted.mount());
+            if (matches(rebooted, after, KEYS)) {
+                before = after;
+            } else {
+                assert(matches(rebooted, before, KEYS));
+                after = before;
+            }
+            for (uint32_t n = 0; n < 50; n++) {
+                assert(step(rebooted, after, 1000 + n, KEYS));
+            }
+            before = after;
+        }
+    }
+    printf("power cuts: %ld cut points, ok\n", total);
+}
+
+// Many long-lived keys and one rewritten over and over, so every roll-over
+// copies most of a sector forward. A cut while that copy is under way
+// leaves a torn record in the new sector and no spare one, and the store
+// must still mount with every value intact.
+static void test_cut_during_collection() {
+    const int LONG_LIVED = 13;
+    const int REWRITTEN = LONG_LIVED;
+    const size_t VALUE_LENGTH = 200;
+    int trials = 0;
+    for (long cut = 0; cut < 400; cut++) {
+        RamFlash flash;
+        FlashKV kv(&flash, 0, RamFlash::SECTORS);
+        assert(kv.format());
+        for (int key = 0; key < LONG_LIVED; key++) {
+            assert(kv.put(key_name(key).c_str(), value_for(key, 0, VALUE_LENGTH).data(), VALUE_LENGTH));
+        }
+
+        flash.operations_left = cut;
+        uint32_t acknowledged = 0;
+        uint32_t version = 0;
+        try {
+            for (version = 1; version < 200; version++) {
+                std::string value = value_for(REWRITTEN, version, VALUE_LENGTH);
+                assert(kv.put(key_name(REWRITTEN).c_str(), value.data(), VALUE_LENGTH));
+                acknowledged = version;
+            }
+        } catch (const PowerCut&) {
+        }
+        flash.operations_left = -1;
+
+        for (int boot = 0; boot < 2; boot++) {
+            FlashKV rebooted(&flash, 0, RamFlash::SECTORS);
+            assert(rebooted.mount());
+            for (int key = 0; key < LONG_LIVED; key++) {
+                assert(holds(rebooted, key, value_for(key, 0, VALUE_LENGTH)));
+            }
+            if (acknowledged > 0) {
+                assert(holds(rebooted, REWRITTEN, value_for(REWRITTEN, acknowledged, VALUE_LENGTH)) ||
+                       holds(rebooted, REWRITTEN, value_for(REWRITTEN, acknowledged + 1, VALUE_LENGTH)));
+            }
+            // Still takes writes, across more roll-overs
+            for (uint32_t i = 0; i < 30; i++) {
+                std::string value = value_for(REWRITTEN, 1000 + i, VALUE_LENGTH);
+                assert(rebooted.put(key_name(REWRITTEN).c_str(), value.data(), VALUE_LENGTH));
+            }
+            acknowledged = 1000 + 29;
+        }
+        trials++;
+    }
+    printf("cut during collection: %d cut points, ok\n", trials);
+}
+
+int main() {
+    srand(5);
+    test_basic();
+    test_wrap();
+    test_power_cuts();
+    test_cut_during_collection();
+    printf("PASS\n");
+    return 0;
+}
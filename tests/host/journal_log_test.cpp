@@ -0,0 +1,124 @@
+// Journal with JOURNAL_HOST against a RAM device that loses power after a
+// set number of block writes, sometimes halfway through a block. After
+// every cut the journal must mount and read back every record it
+// acknowledged, in order, and nothing it did not accept.
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include "journal_log.h"
+
+struct PowerCut {};
+
+class RamDevice : public BlockDevice {
+public:
+    std::vector<uint8_t> data;
+    uint32_t blocks;
+    long writes_left = -1;          // Negative for no cut
+    long writes = 0;
+
+    explicit RamDevice(uint32_t blocks) : data(blocks * 512, 0xFF), blocks(blocks) {}
+
+    uint32_t block_count() const override { return blocks; }
+    bool read_block(uint32_t block_addr, uint8_t* buffer) override {
+        memcpy(buffer, &data[block_addr * 512], 512);
+        return true;
+    }
+    bool write_blocks(uint32_t block_addr, const uint8_t* buffer, uint32_t count) override {
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t* block = &data[(block_addr + i) * 512];
+            if (writes_left == 0) {
+                throw PowerCut();
+            }
+            if (writes_left > 0 && --writes_left == 0 && (writes & 1) != 0) {
+                memcpy(block, buffer + i * 512, 256);   // Torn write
+                throw PowerCut();
+            }
+            memcpy(block, buffer + i * 512, 512);
+            writes++;
+        }
+        return true;
+    }
+};
+
+// Record contents follow from the sequence number, so reads can be checked
+static size_t record_for(uint32_t sequence, uint8_t* buffer) {
+    size_t length = (sequence * 37) % 200 + (sequence % 5 == 0 ? 400 : 0);
+    if (length > JournalLog::MAX_RECORD_LEN) {
+        length = JournalLog::MAX_RECORD_LEN;
+    }
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = (uint8_t)(sequence * 7 + i);
+    }
+    return length;
+}
+
+struct ReadCheck {
+    uint32_t next;
+    uint32_t count;
+};
+
+static void check_record(uint32_t sequence, const uint8_t* data, size_t length, void* context) {
+    ReadCheck* check = (ReadCheck*)context;
+    uint8_t expected[512];
+    size_t expected_length = record_for(sequence, expected);
+    if (check->count > 0) {
+        assert(sequence == check->next);
+    }
+    assert(length == expected_length && memcmp(data, expected, length) == 0);
+    check->next = sequence + 1;
+    check->count++;
+}
+
+int main() {
+    uint8_t record[512];
+    uint32_t trials = 0;
+    uint32_t most_recovered = 0;
+    for (long cut = 1; cut < 1200; cut += 3) {
+        RamDevice device(2 + 100);
+        JournalLog* journal = new JournalLog();
+        assert(journal->format(&device));
+        uint32_t acknowledged = 1;
+        uint32_t time_ms = 0;
+
+        for (int boot = 0; boot < 3; boot++) {
+            device.writes_left = boot == 0 ? cut : cut * 7 % 300 + 1;
+            try {
+                for (int i = 0; i < 3000; i++) {
+                    size_t length = record_for(journal->getNextSequence(), record);
+                    assert(journal->append(record, length));
+                    journal_set_mock_time(time_ms += 3);
+                    journal->poll();
+                    if (journal->getCommittedSequence() > acknowledged) {
+                        acknowledged = journal->getCommittedSequence();
+                    }
+                }
+                journal->flush();
+                acknowledged = journal->getCommittedSequence();
+            } catch (const PowerCut&) {
+            }
+
+            device.writes_left = -1;
+            delete journal;
+            journal = new JournalLog();
+            assert(journal->mount(&device));
+            assert(journal->getRecoveredPages() <= JOURNAL_CHECKPOINT_PAGES + JOURNAL_BATCH_PAGES);
+            if (journal->getRecoveredPages() > most_recovered) {
+                most_recovered = journal->getRecoveredPages();
+            }
+
+            ReadCheck check = {0, 0};
+            journal->read_all(check_record, &check);
+            if (check.count == 0) {
+                assert(journal->getNextSequence() == acknowledged);
+            } else {
+                assert(check.next >= acknowledged && check.next == journal->getNextSequence());
+            }
+        }
+        delete journal;
+        trials++;
+    }
+    printf("%lu power cuts, at most %lu pages rolled forward\n", (unsigned long)trials, (unsigned long)most_recovered);
+    printf("PASS\n");
+    return 0;
+}
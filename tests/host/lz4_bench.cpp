@@ -0,0 +1,108 @@
+// Logger compression benchmark: the sample filter and lz4_compress() over
+// frames of noise, a sine and a slowly drifting DC level, as emit_frame()
+// runs them. Prints the LZ4 ratio, the throughput of filter plus compress
+// on this machine, and how much less the card has to write once frames that
+// do not save a sector are stored plain. Not part of ctest.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "data_logger.h"
+
+static const uint32_t FRAMES = 512;       // 2 MB of blocks per signal
+static const int PASSES = 5;
+
+typedef uint16_t (*signal_t)(uint32_t n);
+
+static uint16_t noise(uint32_t) {
+    return rand() & 0xFFF;
+}
+
+// 1 kHz at 100 kS/s, most of the ADC range
+static uint16_t sine(uint32_t n) {
+    return (uint16_t)lround(2048 + 1800 * sin(2 * M_PI * n / 100.0));
+}
+
+// A level wandering by a few LSB over thousands of samples, with one LSB of noise
+static uint16_t drift(uint32_t n) {
+    return (uint16_t)(1000 + lround(20 * sin(2 * M_PI * n / 50000.0)) + rand() % 2);
+}
+
+static void fill(std::vector<log_block_t>& blocks, signal_t signal) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < blocks.size(); i++) {
+        log_block_t* block = &blocks[i];
+        block->header.magic = LOG_BLOCK_MAGIC;
+        block->header.sequence = i;
+        block->header.timestamp_us = n * 10;
+        block->header.sample_count = LOG_SAMPLES_PER_BLOCK;
+        block->header.run = 1;
+        for (int s = 0; s < LOG_SAMPLES_PER_BLOCK; s++) {
+            block->samples[s] = signal(n++);
+        }
+    }
+}
+
+static void run(const char* name, signal_t signal) {
+    std::vector<log_block_t> original(FRAMES * LOG_FRAME_BLOCKS);
+    std::vector<log_block_t> blocks(original.size());
+    std::vector<uint8_t> output(LZ4_COMPRESS_BOUND(LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE));
+    static lz4_state_t state;
+    srand(1);
+    fill(original, signal);
+
+    uint64_t payload = 0;
+    uint64_t sectors_written = 0;
+    double best_seconds = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        blocks = original;
+        payload = 0;
+        sectors_written = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t f = 0; f < FRAMES; f++) {
+            log_block_t* frame = &blocks[f * LOG_FRAME_BLOCKS];
+            for (int b = 0; b < LOG_FRAME_BLOCKS; b++) {
+                log_filter_block(&frame[b]);
+            }
+            size_t length = lz4_compress((const uint8_t*)frame, LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE,
+                                         output.data(), output.size(), &state);
+            assert(length > 0);
+            payload += length;
+            // The same rule as emit_frame(): compressed only if it saves a sector
+            uint32_t sectors = (sizeof(log_frame_header_t) + length + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+            sectors_written += sectors < LOG_FRAME_BLOCKS ? sectors : LOG_FRAME_BLOCKS;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (pass == 0 || seconds < best_seconds) {
+            best_seconds = seconds;
+        }
+    }
+
+    // The last frame decodes back to its samples
+    log_block_t* last = &blocks[(FRAMES - 1) * LOG_FRAME_BLOCKS];
+    size_t length = lz4_compress((const uint8_t*)last, LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE,
+                                 output.data(), output.size(), &state);
+    assert(lz4_decompress(output.data(), length, (uint8_t*)last, LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE) ==
+           LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE);
+    for (int b = 0; b < LOG_FRAME_BLOCKS; b++) {
+        log_unfilter_block(&last[b]);
+    }
+    assert(memcmp(last, &original[(FRAMES - 1) * LOG_FRAME_BLOCKS], LOG_FRAME_BLOCKS * LOG_BLOCK_SIZE) == 0);
+
+    double raw = (double)original.size() * LOG_BLOCK_SIZE;
+    printf("  %-6s %6.2fx %9.1f MB/s %6.2fx\n", name, raw / payload, raw / best_seconds / 1e6,
+           (double)original.size() / sectors_written);
+}
+
+int main() {
+    printf("LZ4 over %lu frames of %d blocks, best of %d passes\n",
+           (unsigned long)FRAMES, LOG_FRAME_BLOCKS, PASSES);
+    printf("  %-6s %7s %14s %7s\n", "signal", "ratio", "filter+lz4", "write");
+    run("noise", noise);
+    run("sine", sine);
+    run("drift", drift);
+    return 0;
+}
@@ -0,0 +1,184 @@
+// Staging writer with OTA_HOST against a RAM FlashDevice: images arrive in
+// TCP-sized pieces, land in the staging bank and nowhere else, and every
+// kind of bad image is refused with its reason
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+#include "ota.h"
+
+class RamFlash : public FlashDevice {
+public:
+    std::vector<uint8_t> memory;
+    int erases = 0;
+    int programs = 0;
+    bool fail_program = false;
+
+    explicit RamFlash(size_t size) : memory(size, 0x5A) {}
+
+    const uint8_t* read_ptr(uint32_t offset) override { return &memory[offset]; }
+    bool erase_sector(uint32_t offset) override {
+        assert(offset % SECTOR_SIZE == 0);
+        memset(&memory[offset], 0xFF, SECTOR_SIZE);
+        erases++;
+        return true;
+    }
+    bool program_page(uint32_t offset, const uint8_t* data) override {
+        assert(offset % PAGE_SIZE == 0);
+        if (fail_program) {
+            return false;
+        }
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            memory[offset + i] &= data[i];
+        }
+        programs++;
+        return true;
+    }
+};
+
+static const uint32_t BASE = 1 << 20;
+static const uint32_t SIZE = (1 << 20) - 5 * FlashDevice::SECTOR_SIZE;
+
+static void put32(uint8_t* p, uint32_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+// The CRC-32/MPEG-2 the boot ROM checks boot2 with
+static uint32_t boot2_crc(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int b = 0; b < 8; b++) {
+            crc = crc & 0x80000000 ? crc << 1 ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Random contents with a valid boot2 checksum and a vector table pointing
+// into RAM and flash
+static std::vector<uint8_t> make_image(size_t length) {
+    std::vector<uint8_t> image(length);
+    for (size_t i = 0; i < length; i++) {
+        image[i] = (uint8_t)rand();
+    }
+    put32(&image[252], boot2_crc(image.data(), 252));
+    put32(&image[256], 0x20042000);
+    put32(&image[260], 0x100001F7);
+    return image;
+}
+
+static ota_header_t make_header(const std::vector<uint8_t>& image) {
+    ota_header_t header = {OTA_MAGIC, (uint32_t)image.size(), {}};
+    sha256_state_t sha;
+    sha256_init(&sha);
+    sha256_update(&sha, image.data(), image.size());
+    sha256_final(&sha, header.sha256);
+    return header;
+}
+
+static bool stream(OtaStagingWriter& writer, const std::vector<uint8_t>& image) {
+    for (size_t i = 0; i < image.size();) {
+        size_t piece = 1 + rand() % 1460;
+        if (piece > image.size() - i) {
+            piece = image.size() - i;
+        }
+        if (!writer.write(&image[i], piece)) {
+            return false;
+        }
+        i += piece;
+    }
+    return true;
+}
+
+static void check_digest(const char* text, size_t repeat, const char* expected) {
+    sha256_state_t sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    sha256_init(&sha);
+    for (size_t i = 0; i < repeat; i++) {
+        sha256_update(&sha, text, strlen(text));
+    }
+    sha256_final(&sha, digest);
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        snprintf(&hex[2 * i], 3, "%02x", digest[i]);
+    }
+    assert(strcmp(hex, expected) == 0);
+}
+
+static void test_sha256() {
+    check_digest("abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    check_digest("a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    printf("sha256: ok\n");
+}
+
+// Images from one page to the whole bank stage intact, without touching
+// the flash on either side
+static void test_stage() {
+    for (size_t length : {4096ul, 4097ul, 700001ul, (size_t)SIZE}) {
+        RamFlash flash(2 << 20);
+        OtaStagingWriter writer(&flash, BASE, SIZE);
+        std::vector<uint8_t> image = make_image(length);
+        ota_header_t header = make_header(image);
+        assert(writer.begin(&header));
+        assert(stream(writer, image));
+        assert(writer.finish() && writer.isStaged());
+        assert(memcmp(&flash.memory[BASE], image.data(), length) == 0);
+        assert(flash.memory[BASE - 1] == 0x5A && flash.memory[BASE + SIZE] == 0x5A);
+        assert(flash.erases == (int)((length + FlashDevice::SECTOR_SIZE - 1) / FlashDevice::SECTOR_SIZE));
+        printf("stage %lu bytes: %d erases, %d programs, ok\n", (unsigned long)length, flash.erases, flash.programs);
+    }
+}
+
+static void expect_error(OtaStagingWriter& writer, const char* reason) {
+    assert(writer.getError() != NULL && strcmp(writer.getError(), reason) == 0);
+    assert(!writer.isStaged());
+}
+
+static void test_refused() {
+    RamFlash flash(2 << 20);
+    OtaStagingWriter writer(&flash, BASE, SIZE);
+
+    std::vector<uint8_t> image = make_image(5000);
+    ota_header_t header = {OTA_MAGIC, 5000, {}};
+    assert(writer.begin(&header) && stream(writer, image) && !writer.finish());
+    expect_error(writer, "sha256 mismatch");
+
+    header = make_header(image);
+    assert(writer.begin(&header) && stream(writer, image));
+    assert(!writer.write(image.data(), 1));
+    expect_error(writer, "image longer than header");
+
+    image[10] ^= 1;
+    header = make_header(image);
+    assert(writer.begin(&header) && stream(writer, image) && !writer.finish());
+    expect_error(writer, "boot2 checksum");
+
+    std::vector<uint8_t> tiny = make_image(300);
+    header = make_header(tiny);
+    assert(!(writer.begin(&header) && stream(writer, tiny) && writer.finish()));
+    assert(!writer.isStaged());
+
+    header.image_length = SIZE + 1;
+    assert(!writer.begin(&header));
+    expect_error(writer, "image size");
+    header.magic = 0;
+    assert(!writer.begin(&header));
+    expect_error(writer, "bad header");
+
+    image = make_image(5000);
+    header = make_header(image);
+    flash.fail_program = true;
+    assert(writer.begin(&header) && !stream(writer, image));
+    expect_error(writer, "flash program");
+    printf("refused images: ok\n");
+}
+
+int main() {
+    test_sha256();
+    test_stage();
+    test_refused();
+    printf("PASS\n");
+    return 0;
+}
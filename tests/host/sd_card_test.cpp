@@ -0,0 +1,540 @@
+// SD driver against a model of a card on the SPI bus. The model answers
+// the commands the driver sends and records the address argument of each
+// data command, so the tests can check block and byte addressing, and the
+// ranges it erases.
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+#include "sd_card.h"
+#include "block_device.h"
+#include "sd_file.h"
+
+static uint64_t now_us;
+
+uint64_t time_us_64() { return ++now_us; }
+uint32_t time_us_32() { return (uint32_t)time_us_64(); }
+void sleep_us(uint64_t us) { now_us += us; }
+void sleep_ms(uint32_t ms) { now_us += ms * 1000ull; }
+uint get_core_num() { return 0; }
+int getchar_timeout_us(uint32_t) { return PICO_ERROR_TIMEOUT; }
+uint32_t save_and_disable_interrupts() { return 0; }
+void restore_interrupts(uint32_t) {}
+void gpio_init(uint) {}
+void gpio_set_function(uint, int) {}
+void gpio_set_dir(uint, bool) {}
+uint spi_init(spi_inst_t*, uint baudrate) { return baudrate; }
+uint spi_set_baudrate(spi_inst_t*, uint baudrate) { return baudrate; }
+
+spi_inst_t* spi0 = (spi_inst_t*)0;
+spi_inst_t* spi1 = (spi_inst_t*)1;
+
+struct CardModel {
+    uint8_t type;                       // SD_TYPE_SD1, SD_TYPE_SD2 or SD_TYPE_SDHC
+    bool selected = false;
+    bool present = true;                // A removed card never drives the bus
+    bool idle = true;
+    bool app = false;
+    int init_polls = 0;
+    uint8_t command[6];
+    int command_length = 0;
+    std::deque<uint8_t> out;            // Bytes the card sends next
+
+    std::map<uint32_t, std::vector<uint8_t>> blocks;    // Missing blocks read as zeros
+    std::vector<uint32_t> addresses;    // Argument of every data command
+
+    uint8_t au_size = 0;                // SD status AU_SIZE code, 0 when not given
+    uint16_t erase_size = 0;            // AUs the erase timeout is for
+    uint32_t erase_start = 0;
+    uint32_t erase_end = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> erases;  // First and last block of each CMD38
+
+    bool reading = false;               // CMD18 streams blocks until CMD12
+    uint32_t read_next = 0;
+    int writing = 0;                    // 1 after CMD24, 2 after CMD25
+    bool in_data = false;
+    uint32_t write_next = 0;
+    std::vector<uint8_t> data;
+
+    explicit CardModel(uint8_t type = SD_TYPE_SDHC) : type(type) {}
+
+    uint32_t block_of(uint32_t arg) {
+        addresses.push_back(arg);
+        if (type == SD_TYPE_SDHC) {
+            return arg;
+        }
+        assert(arg % 512 == 0);
+        return arg / 512;
+    }
+
+    void send_block(uint32_t block) {
+        out.push_back(0xFF);
+        out.push_back(0xFE);
+        auto it = blocks.find(block);
+        for (int i = 0; i < 512; i++) {
+            out.push_back(it == blocks.end() ? 0 : it->second[i]);
+        }
+        out.push_back(0);
+        out.push_back(0);
+    }
+
+    void send_register(const uint8_t* data, size_t length) {
+        out.push_back(0xFF);
+        out.push_back(0xFE);
+        out.insert(out.end(), data, data + length);
+        out.push_back(0);
+        out.push_back(0);
+    }
+
+    void execute() {
+        uint8_t cmd = command[0] & 0x3F;
+        uint32_t arg = (uint32_t)command[1] << 24 | command[2] << 16 | command[3] << 8 | command[4];
+        bool was_app = app;
+        app = false;
+        out.clear();
+        out.push_back(0xFF);            // One byte of NCR before every response
+
+        if (cmd == 12) {
+            reading = false;
+            out.push_back(0);
+            return;
+        }
+        uint8_t r1 = idle ? 1 : 0;
+        switch (cmd) {
+        case 0:
+            idle = true;
+            out.push_back(1);
+            break;
+        case 1:
+        case 41:
+            assert(cmd == 41 ? was_app : type == SD_TYPE_SD1);
+            if (++init_polls > 2) {
+                idle = false;
+            }
+            out.push_back(idle ? 1 : 0);
+            break;
+        case 8:
+            if (type == SD_TYPE_SD1) {
+                out.push_back(0x05);    // Illegal command
+            } else {
+                for (uint8_t b : {0x01, 0x00, 0x00, 0x01, 0xAA}) {
+                    out.push_back(b);
+                }
+            }
+            break;
+        case 55:
+            app = true;
+            out.push_back(r1);
+            break;
+        case 58:
+            for (uint8_t b : {r1, (uint8_t)(type == SD_TYPE_SDHC ? 0xC0 : 0x80), (uint8_t)0xFF, (uint8_t)0x80, (uint8_t)0x00}) {
+                out.push_back(b);
+            }
+            break;
+        case 16:
+            assert(type != SD_TYPE_SDHC && arg == 512);
+            out.push_back(r1);
+            break;
+        case 9: {
+            uint8_t csd[16] = {0};
+            if (type == SD_TYPE_SDHC) {
+                csd[0] = 0x40;          // CSD v2, C_SIZE 63: 32 MB
+                csd[9] = 0x3F;
+            } else {
+                csd[5] = 9;             // CSD v1, 512-byte blocks, 1 GB
+                csd[6] = 0x03;
+                csd[7] = 0xFF;
+                csd[8] = 0xC0;
+                csd[9] = 0x03;
+                csd[10] = 0x80;
+            }
+            out.push_back(0);
+            send_register(csd, sizeof(csd));
+            break;
+        }
+        case 23:
+            assert(was_app);            // ACMD23 pre-erase count before CMD25
+            out.push_back(r1);
+            break;
+        case 13: {
+            assert(was_app);
+            uint8_t status[64] = {0};
+            status[10] = au_size << 4;
+            status[11] = erase_size >> 8;
+            status[12] = erase_size & 0xFF;
+            status[13] = 8 << 2 | 1;    // 8 s per erase_size AUs, plus 1 s
+            out.push_back(0);
+            out.push_back(0);
+            send_register(status, sizeof(status));
+            break;
+        }
+        case 32:
+            out.push_back(0);
+            erase_start = block_of(arg);
+            break;
+        case 33:
+            out.push_back(0);
+            erase_end = block_of(arg);
+            break;
+        case 38:
+            assert(erase_start <= erase_end);
+            out.push_back(0);
+            erases.push_back(std::make_pair(erase_start, erase_end));
+            blocks.erase(blocks.lower_bound(erase_start), blocks.upper_bound(erase_end));
+            break;
+        case 17:
+            out.push_back(0);
+            send_block(block_of(arg));
+            break;
+        case 18:
+            out.push_back(0);
+            reading = true;
+            read_next = block_of(arg);
+            break;
+        case 24:
+        case 25:
+            out.push_back(0);
+            writing = cmd == 24 ? 1 : 2;
+            write_next = block_of(arg);
+            break;
+        default:
+            fprintf(stderr, "Unexpected CMD%u\n", cmd);
+            assert(false);
+        }
+    }
+
+    uint8_t transfer(uint8_t in) {
+        if (!selected || !present) {
+            return 0xFF;
+        }
+        if (in_data) {
+            data.push_back(in);
+            if (data.size() == 512 + 2) {
+                blocks[write_next++] = std::vector<uint8_t>(data.begin(), data.begin() + 512);
+                data.clear();
+                in_data = false;
+                out.push_back(0xE5);    // Data accepted, then ready
+                if (writing == 1) {
+                    writing = 0;
+                }
+            }
+            return 0xFF;
+        }
+
+        uint8_t result = 0xFF;
+        if (out.empty() && reading) {
+            send_block(read_next++);
+        }
+        if (!out.empty()) {
+            result = out.front();
+            out.pop_front();
+        }
+        if (command_length == 0 && writing && out.empty()) {
+            if ((writing == 1 && in == 0xFE) || (writing == 2 && in == 0xFC)) {
+                in_data = true;
+                return result;
+            }
+            if (writing == 2 && in == 0xFD) {
+                writing = 0;
+                return result;
+            }
+        }
+        if (command_length > 0 || (in & 0xC0) == 0x40) {
+            command[command_length++] = in;
+            if (command_length == 6) {
+                command_length = 0;
+                execute();
+            }
+        }
+        return result;
+    }
+};
+
+// The card on spi1 with CS on GPIO14, the one on spi0 with CS on GPIO17
+static CardModel cards[2];
+
+void gpio_put(uint gpio, bool value) {
+    if (gpio == 14) {
+        cards[1].selected = !value;
+    } else if (gpio == 17) {
+        cards[0].selected = !value;
+    }
+}
+
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len) {
+    CardModel& card = cards[spi == spi1];
+    for (size_t i = 0; i < len; i++) {
+        uint8_t in = card.transfer(src != NULL ? src[i] : 0xFF);
+        if (dst != NULL) {
+            dst[i] = in;
+        }
+    }
+    return (int)len;
+}
+
+static void fill(uint8_t* buffer, size_t length, uint8_t seed) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = (uint8_t)(i * 7 + i / 512 + seed);
+    }
+}
+
+// Every data command carries the block number on SDHC and the byte offset
+// on SD v1 and standard capacity v2 cards
+static void test_addressing(uint8_t type) {
+    CardModel& card = cards[1];
+    card = CardModel(type);
+    SDCard sd(spi1, 11, 12, 13, 14);
+    assert(sd.init(false));
+    assert(sd.getType() == type);
+    assert(sd.getAddressing() == (type == SD_TYPE_SDHC ? SD_ADDRESS_BLOCK : SD_ADDRESS_BYTE));
+
+    static uint8_t buffer[8 * 512];
+    static uint8_t readback[8 * 512];
+    fill(buffer, sizeof(buffer), type);
+    card.addresses.clear();
+    assert(sd.write_block(1000, buffer));
+    assert(sd.write_blocks(2000, buffer, 8));
+    assert(sd.read_block(1000, readback) && memcmp(readback, buffer, 512) == 0);
+    assert(sd.read_blocks(2000, readback, 8) && memcmp(readback, buffer, sizeof(buffer)) == 0);
+    assert(sd.read_blocks(2003, readback, 2) && memcmp(readback, buffer + 3 * 512, 2 * 512) == 0);
+    assert(card.blocks.count(2007) == 1 && card.blocks.count(2008) == 0);
+
+    uint32_t scale = type == SD_TYPE_SDHC ? 1 : 512;
+    uint32_t expected[] = {1000 * scale, 2000 * scale, 1000 * scale, 2000 * scale, 2003 * scale};
+    assert(card.addresses.size() == 5);
+    for (int i = 0; i < 5; i++) {
+        assert(card.addresses[i] == expected[i]);
+    }
+
+    // A deferred write leaves the card programming until the next command
+    assert(sd.write_block(3000, buffer, false) && sd.isProgramming());
+    assert(sd.read_block(3000, readback) && !sd.isProgramming());
+    assert(memcmp(readback, buffer, 512) == 0);
+    printf("addressing, card type %u: ok\n", type);
+}
+
+// A run striped over a block card on spi1 and a byte card on spi0: chunk k
+// of 8 blocks goes to card k % 2, at block (k / 2) * 8 of its region
+static void test_stripe() {
+    cards[1] = CardModel(SD_TYPE_SDHC);
+    cards[0] = CardModel(SD_TYPE_SD2);
+    SDCard first(spi1, 11, 12, 13, 14);
+    SDCard second(spi0, 19, 16, 18, 17);
+    assert(first.init(false) && second.init(false));
+
+    SDBlockRegion first_region(&first);
+    SDBlockRegion second_region(&second);
+    first_region.setRegion(100, 1000);
+    second_region.setRegion(300, 990);
+    BlockDevice* devices[2] = {&first_region, &second_region};
+    StripedBlockDevice stripe;
+    assert(stripe.setDevices(devices, 2, 8));
+    assert(stripe.block_count() == 990 / 8 * 8 * 2);
+
+    static uint8_t buffer[40 * 512];
+    static uint8_t readback[40 * 512];
+    fill(buffer, sizeof(buffer), 3);
+    assert(stripe.write_blocks(5, buffer, 40));
+    assert(!first.isProgramming() && !second.isProgramming());
+    for (uint32_t block = 5; block < 45; block++) {
+        uint32_t chunk = block / 8;
+        CardModel& card = cards[chunk % 2 == 0 ? 1 : 0];
+        uint32_t card_block = (chunk % 2 == 0 ? 100 : 300) + chunk / 2 * 8 + block % 8;
+        assert(card.blocks.count(card_block) == 1);
+        assert(memcmp(card.blocks[card_block].data(), buffer + (block - 5) * 512, 512) == 0);
+    }
+    assert(stripe.read_blocks(5, readback, 40) && memcmp(readback, buffer, sizeof(buffer)) == 0);
+    assert(stripe.read_block(17, readback) && memcmp(readback, buffer + 12 * 512, 512) == 0);
+    assert(!stripe.write_blocks(stripe.block_count() - 1, buffer, 2));
+
+    // Deferred writes leave both cards programming at once until sync()
+    assert(stripe.write_blocks_deferred(0, buffer, 16));
+    assert(first.isProgramming() && second.isProgramming());
+    assert(stripe.sync() && !first.isProgramming() && !second.isProgramming());
+    printf("stripe: ok\n");
+}
+
+// discard() erases only the whole AUs inside a range, in batches of
+// erase_size AUs, and erase() exactly the blocks asked for
+static void test_discard(uint8_t type) {
+    CardModel& card = cards[1];
+    card = CardModel(type);
+    card.au_size = 1;                   // 16 KB, 32 blocks
+    card.erase_size = 4;
+    SDCard sd(spi1, 11, 12, 13, 14);
+    assert(sd.init(false) && sd.getAuBlocks() == 32);
+
+    std::vector<uint8_t> block(512, 0x5A);
+    for (uint32_t i = 0; i < 400; i++) {
+        card.blocks[i] = block;
+    }
+    card.addresses.clear();
+    assert(sd.discard(10, 320) == 288);
+    assert(card.erases.size() == 3);
+    assert(card.erases[0] == std::make_pair(32u, 159u));
+    assert(card.erases[1] == std::make_pair(160u, 287u));
+    assert(card.erases[2] == std::make_pair(288u, 319u));
+    uint32_t scale = type == SD_TYPE_SDHC ? 1 : 512;
+    assert(card.addresses[0] == 32 * scale && card.addresses[1] == 159 * scale);
+    assert(card.blocks.count(31) == 1 && card.blocks.count(32) == 0);
+    assert(card.blocks.count(319) == 0 && card.blocks.count(320) == 1);
+
+    // No whole AU inside
+    assert(sd.discard(40, 20) == 0 && card.erases.size() == 3);
+    assert(sd.erase(5, 3) && card.erases.back() == std::make_pair(5u, 7u));
+    printf("discard, card type %u: ok\n", type);
+}
+
+// A 64 MB AU times 32768 AUs is 2^32 blocks, the batch must not wrap to 0
+static void test_discard_large_batch() {
+    CardModel& card = cards[1];
+    card = CardModel(SD_TYPE_SDHC);
+    card.au_size = 0xF;
+    card.erase_size = 0x8000;
+    SDCard sd(spi1, 11, 12, 13, 14);
+    assert(sd.init(false) && sd.getAuBlocks() == 131072);
+    assert(sd.discard(1, 3 * 131072) == 2 * 131072);
+    assert(card.erases.size() == 1);
+    assert(card.erases[0] == std::make_pair(131072u, 3 * 131072u - 1));
+    printf("discard, large batch: ok\n");
+}
+
+static void put32(std::vector<uint8_t>& sector, uint32_t offset, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        sector[offset + i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static uint32_t get32(const std::vector<uint8_t>& sector, uint32_t offset) {
+    return sector[offset] | sector[offset + 1] << 8 | sector[offset + 2] << 16 | (uint32_t)sector[offset + 3] << 24;
+}
+
+// Removing a file frees its chain in both FATs and discards the whole AUs
+// its clusters covered, leaving other files alone
+static void test_remove() {
+    CardModel& card = cards[1];
+    card = CardModel(SD_TYPE_SDHC);
+    card.au_size = 1;                   // 32 blocks
+    card.erase_size = 4;
+    const uint32_t sectors_per_cluster = 8;
+    const uint32_t fat = 32;
+    const uint32_t fat_size = 8;
+    const uint32_t data = fat + 2 * fat_size;
+
+    std::vector<uint8_t> boot(512, 0);
+    boot[11] = 0x00;                    // 512 bytes per sector
+    boot[12] = 0x02;
+    boot[13] = sectors_per_cluster;
+    boot[14] = fat;                     // Reserved sectors
+    boot[16] = 2;                       // FATs
+    put32(boot, 32, 8192);              // Total sectors
+    put32(boot, 36, fat_size);
+    put32(boot, 44, 2);                 // Root cluster
+    memcpy(&boot[82], "FAT32   ", 8);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+    card.blocks[0] = boot;
+
+    // LOG.BIN takes clusters 4 to 20 and 100 to 140, the second run
+    // crossing into the next FAT sector. KEEP.TXT has cluster 3.
+    std::vector<uint32_t> chain;
+    for (uint32_t c = 4; c <= 20; c++) {
+        chain.push_back(c);
+    }
+    for (uint32_t c = 100; c <= 140; c++) {
+        chain.push_back(c);
+    }
+    std::vector<uint8_t> fat_sectors[2] = {std::vector<uint8_t>(512, 0), std::vector<uint8_t>(512, 0)};
+    put32(fat_sectors[0], 0, 0x0FFFFFF8);
+    put32(fat_sectors[0], 4, 0x0FFFFFFF);
+    put32(fat_sectors[0], 8, 0x0FFFFFFF);
+    put32(fat_sectors[0], 12, 0x0FFFFFFF);
+    for (size_t i = 0; i < chain.size(); i++) {
+        uint32_t next = i + 1 < chain.size() ? chain[i + 1] : 0x0FFFFFFF;
+        put32(fat_sectors[chain[i] / 128], chain[i] % 128 * 4, next);
+    }
+    for (uint32_t copy = 0; copy < 2; copy++) {
+        card.blocks[fat + copy * fat_size] = fat_sectors[0];
+        card.blocks[fat + copy * fat_size + 1] = fat_sectors[1];
+    }
+    std::vector<uint8_t> directory(512, 0);
+    memcpy(&directory[0], "KEEP    TXT", 11);
+    directory[11] = 0x20;
+    directory[26] = 3;
+    memcpy(&directory[32], "LOG     BIN", 11);
+    directory[32 + 11] = 0x20;
+    directory[32 + 26] = 4;
+    put32(directory, 32 + 28, chain.size() * sectors_per_cluster * 512);
+    card.blocks[data] = directory;
+
+    SDCard sd(spi1, 11, 12, 13, 14);
+    assert(sd.init(false) && sd.parse_boot_sector(false));
+    SDFile file(&sd);
+    assert(!file.remove("nope.bin"));
+    card.erases.clear();
+    assert(file.remove("log.bin"));
+    assert(!file.open_file("log.bin"));
+    assert(file.open_file("keep.txt"));
+    file.close();
+    assert(card.blocks[data][32] == 0xE5);
+    for (uint32_t copy = 0; copy < 2; copy++) {
+        for (uint32_t c : chain) {
+            assert(get32(card.blocks[fat + copy * fat_size + c / 128], c % 128 * 4) == 0);
+        }
+        assert(get32(card.blocks[fat + copy * fat_size], 12) == 0x0FFFFFFF);
+    }
+
+    // Clusters 4 to 20 are blocks 64 to 199, whole AUs 64 to 191. Clusters
+    // 100 to 140 are blocks 832 to 1167, whole AUs 832 to 1151, in batches
+    // of 128 blocks.
+    assert(card.erases.size() == 4);
+    assert(card.erases[0] == std::make_pair(64u, 191u));
+    assert(card.erases[1].first == 832 && card.erases[3].second == 1151);
+
+    // Preallocating discards the run it takes
+    card.erases.clear();
+    assert(file.preallocate("new.bin", 20 * sectors_per_cluster * 512));
+    assert(!card.erases.empty());
+    printf("remove: ok\n");
+}
+
+// A card without a filesystem can be forgotten, and a failed init() leaves
+// nothing of the card it found before
+static void test_reinit() {
+    CardModel& card = cards[0];
+    card = CardModel(SD_TYPE_SD1);
+    SDCard sd(spi0, 19, 16, 18, 17);
+    assert(sd.init(false) && sd.isInitialized() && sd.getAddressing() == SD_ADDRESS_BYTE);
+    assert(!sd.parse_boot_sector(false));      // Blank card
+    sd.deinit();
+    assert(!sd.isInitialized() && sd.getType() == SD_TYPE_UNKNOWN && sd.getSize() == 0);
+
+    card = CardModel(SD_TYPE_SDHC);
+    static uint8_t buffer[512];
+    assert(sd.init(false) && sd.write_block(7, buffer, false) && sd.isProgramming());
+    card.present = false;
+    assert(!sd.init(false));
+    assert(!sd.isInitialized() && !sd.isProgramming() && sd.getType() == SD_TYPE_UNKNOWN);
+    assert(sd.getAddressing() == SD_ADDRESS_BLOCK && sd.getAuBlocks() == SD_DEFAULT_AU_BLOCKS);
+
+    card = CardModel(SD_TYPE_SD2);
+    assert(sd.init(false) && sd.getType() == SD_TYPE_SD2 && sd.getAddressing() == SD_ADDRESS_BYTE);
+    printf("reinit: ok\n");
+}
+
+int main() {
+    test_addressing(SD_TYPE_SD1);
+    test_addressing(SD_TYPE_SD2);
+    test_addressing(SD_TYPE_SDHC);
+    test_stripe();
+    test_discard(SD_TYPE_SD1);
+    test_discard(SD_TYPE_SDHC);
+    test_discard_large_batch();
+    test_remove();
+    test_reinit();
+    printf("PASS\n");
+    return 0;
+}
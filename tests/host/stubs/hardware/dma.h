@@ -0,0 +1,6 @@
+#ifndef HOST_STUB_HARDWARE_DMA_H
+#define HOST_STUB_HARDWARE_DMA_H
+
+// Included by sd_card.cpp, which does not use DMA yet
+
+#endif // HOST_STUB_HARDWARE_DMA_H
@@ -0,0 +1,15 @@
+#ifndef HOST_STUB_HARDWARE_GPIO_H
+#define HOST_STUB_HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+#define GPIO_FUNC_SPI 1
+#define GPIO_IN 0
+#define GPIO_OUT 1
+
+void gpio_init(uint gpio);
+void gpio_set_function(uint gpio, int function);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+
+#endif // HOST_STUB_HARDWARE_GPIO_H
@@ -0,0 +1,14 @@
+#ifndef HOST_STUB_HARDWARE_SPI_H
+#define HOST_STUB_HARDWARE_SPI_H
+
+#include "pico/stdlib.h"
+
+typedef struct spi_inst spi_inst_t;
+extern spi_inst_t* spi0;
+extern spi_inst_t* spi1;
+
+uint spi_init(spi_inst_t* spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t* spi, uint baudrate);
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len);
+
+#endif // HOST_STUB_HARDWARE_SPI_H
@@ -0,0 +1,9 @@
+#ifndef HOST_STUB_HARDWARE_SYNC_H
+#define HOST_STUB_HARDWARE_SYNC_H
+
+#include <stdint.h>
+
+uint32_t save_and_disable_interrupts();
+void restore_interrupts(uint32_t status);
+
+#endif // HOST_STUB_HARDWARE_SYNC_H
@@ -0,0 +1,22 @@
+#ifndef HOST_STUB_PICO_STDLIB_H
+#define HOST_STUB_PICO_STDLIB_H
+
+// The parts of the SDK the host builds of the SD driver use. The test
+// defines the functions, see sd_card_test.cpp.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+#define PICO_ERROR_TIMEOUT (-1)
+
+uint64_t time_us_64();
+uint32_t time_us_32();
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+uint get_core_num();
+int getchar_timeout_us(uint32_t timeout_us);
+
+#endif // HOST_STUB_PICO_STDLIB_H
@@ -0,0 +1,144 @@
+// Trace recorder with TRACE_HOST and TRACE_ENABLED: events recorded on both
+// mock cores, past the end of the rings, come out of trace_dump() as one
+// Chrome trace in time order
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+// Everything trace_dump() prints
+static std::string dump() {
+    fflush(stdout);
+    FILE* file = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(file), STDOUT_FILENO);
+    trace_dump();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    std::string text;
+    char buffer[4096];
+    size_t length;
+    rewind(file);
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, length);
+    }
+    fclose(file);
+    return text;
+}
+
+typedef struct {
+    std::string name;
+    char phase;
+    unsigned long long ts;
+    int tid;
+} dumped_event_t;
+
+// One event per line between the header and the footer
+static std::vector<dumped_event_t> parse(const std::string& text) {
+    const char* header = "{\"traceEvents\":[\n";
+    const char* footer = "\n],\"displayTimeUnit\":\"ms\"}\n";
+    assert(text.compare(0, strlen(header), header) == 0);
+    assert(text.size() >= strlen(header) + strlen(footer));
+    assert(text.compare(text.size() - strlen(footer), strlen(footer), footer) == 0);
+
+    std::vector<dumped_event_t> events;
+    size_t position = strlen(header);
+    size_t last = text.size() - strlen(footer);
+    while (position < last) {
+        size_t end = text.find('\n', position);
+        if (end == std::string::npos || end > last) {
+            end = last;
+        }
+        std::string line = text.substr(position, end - position);
+        char name[64];
+        dumped_event_t event;
+        assert(sscanf(line.c_str(), "{\"name\":\"%63[^\"]\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":0,\"tid\":%d",
+                      name, &event.phase, &event.ts, &event.tid) == 4);
+        event.name = name;
+        assert(line.back() == '}' || line.substr(line.size() - 2) == "},");
+        events.push_back(event);
+        position = end + 1;
+    }
+    return events;
+}
+
+// Both cores record at their own pace, three times what their rings hold,
+// and the dump keeps the newest of each in one timeline
+static void test_merge() {
+    trace_clear();
+    trace_set_recording(true);
+    const uint32_t PER_CORE = 3 * TRACE_BUFFER_EVENTS;
+    const uint64_t START = (1ull << 32) - 1000;     // Crosses into time_hi
+    uint32_t recorded[2] = {0, 0};
+    while (recorded[0] < PER_CORE || recorded[1] < PER_CORE) {
+        int core = rand() % 2;
+        if (recorded[core] == PER_CORE) {
+            core = !core;
+        }
+        // Core 0 ticks every 3 us, core 1 every 5 us
+        trace_set_mock_core(core);
+        trace_set_mock_time(START + recorded[core] * (core == 0 ? 3 : 5));
+        TRACE_COUNTER(core == 0 ? "core0" : "core1", recorded[core]);
+        recorded[core]++;
+    }
+
+    std::vector<dumped_event_t> events = parse(dump());
+    assert(events.size() == 2 * TRACE_BUFFER_EVENTS);
+    uint32_t kept[2] = {0, 0};
+    for (size_t i = 0; i < events.size(); i++) {
+        assert(i == 0 || events[i].ts >= events[i - 1].ts);
+        int core = events[i].tid;
+        assert(core == 0 || core == 1);
+        assert(events[i].phase == TRACE_PHASE_COUNTER && events[i].name == (core == 0 ? "core0" : "core1"));
+        // Only the newest survive, oldest first
+        uint32_t n = PER_CORE - TRACE_BUFFER_EVENTS + kept[core];
+        assert(events[i].ts == START + n * (core == 0 ? 3 : 5));
+        kept[core]++;
+    }
+    assert(kept[0] == TRACE_BUFFER_EVENTS && kept[1] == TRACE_BUFFER_EVENTS);
+    printf("merge: %lu events, ok\n", (unsigned long)events.size());
+}
+
+// Scopes, instants and counters, and pausing
+static void test_events() {
+    trace_clear();
+    trace_set_mock_core(0);
+    trace_set_mock_time(10);
+    {
+        TRACE_SCOPE("outer");
+        trace_set_mock_time(20);
+        TRACE_INSTANT("mark", 7);
+        trace_set_mock_time(30);
+    }
+    trace_set_recording(false);
+    assert(!trace_is_recording());
+    TRACE_INSTANT("lost", 0);
+    trace_set_recording(true);
+
+    std::string text = dump();
+    std::vector<dumped_event_t> events = parse(text);
+    assert(events.size() == 3);
+    assert(events[0].name == "outer" && events[0].phase == 'B' && events[0].ts == 10);
+    assert(events[1].name == "mark" && events[1].phase == 'i' && events[1].ts == 20);
+    assert(events[2].name == "outer" && events[2].phase == 'E' && events[2].ts == 30);
+    assert(text.find("\"s\":\"t\",\"args\":{\"arg\":7}") != std::string::npos);
+    assert(trace_is_recording());       // Dumping pauses only while it prints
+
+    trace_clear();
+    assert(parse(dump()).empty());
+    printf("events: ok\n");
+}
+
+int main() {
+    srand(7);
+    test_merge();
+    test_events();
+    printf("PASS\n");
+    return 0;
+}
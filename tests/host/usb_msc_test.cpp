@@ -0,0 +1,136 @@
+// USB mass storage glue with MSC_HOST, called the way TinyUSB splits a
+// READ10 or WRITE10 into 4 KB chunks, with the main loop's poll() between
+// them, against a RAM BlockDevice
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include "usb_msc.h"
+
+class RamDisk : public BlockDevice {
+public:
+    std::vector<uint8_t> data;
+    uint32_t blocks;
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    uint32_t largest_read = 0;
+    bool fail_writes = false;
+
+    explicit RamDisk(uint32_t blocks) : data(blocks * 512), blocks(blocks) {
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = (uint8_t)(i * 7 + i / 512);
+        }
+    }
+
+    uint32_t block_count() const override { return blocks; }
+    bool read_block(uint32_t block_addr, uint8_t* buffer) override {
+        return read_blocks(block_addr, buffer, 1);
+    }
+    bool read_blocks(uint32_t block_addr, uint8_t* buffer, uint32_t count) override {
+        assert(block_addr + count <= blocks);
+        memcpy(buffer, &data[block_addr * 512], count * 512);
+        reads++;
+        largest_read = std::max(largest_read, count);
+        return true;
+    }
+    bool write_blocks(uint32_t block_addr, const uint8_t* buffer, uint32_t count) override {
+        if (fail_writes) {
+            return false;
+        }
+        assert(block_addr + count <= blocks);
+        memcpy(&data[block_addr * 512], buffer, count * 512);
+        writes++;
+        return true;
+    }
+};
+
+static const uint32_t CHUNK = MSC_CHUNK_BLOCKS * 512;
+
+static void read10(uint32_t lba, uint32_t blocks, uint8_t* out, bool poll = true) {
+    for (uint32_t offset = 0; offset < blocks * 512; offset += CHUNK) {
+        uint32_t length = std::min(CHUNK, blocks * 512 - offset);
+        assert(usb_msc.read(lba, offset, out + offset, length) == (int32_t)length);
+        if (poll) {
+            usb_msc.poll();
+        }
+    }
+}
+
+static void write10(uint32_t lba, uint32_t blocks, const uint8_t* in) {
+    for (uint32_t offset = 0; offset < blocks * 512; offset += CHUNK) {
+        uint32_t length = std::min(CHUNK, blocks * 512 - offset);
+        assert(usb_msc.write(lba, offset, in + offset, length) == (int32_t)length);
+        usb_msc.poll();
+    }
+    assert(usb_msc.write_complete());
+}
+
+int main() {
+    static uint8_t buffer[65536];
+    static uint8_t pattern[65536];
+    RamDisk disk(1000);
+    assert(usb_msc.read(0, 0, buffer, 512) == -1);     // Not exported yet
+    assert(usb_msc.export_device(&disk));
+
+    // A sequential 64 KB read misses once, read-ahead serves the rest in
+    // chunk-sized device reads, and carries over into the next command
+    read10(100, 128, buffer);
+    assert(memcmp(buffer, &disk.data[100 * 512], sizeof(buffer)) == 0);
+    assert(usb_msc.getReadMisses() == 1 && usb_msc.getReadHits() == 15);
+    assert(disk.largest_read == MSC_CHUNK_BLOCKS);
+    read10(228, 8, buffer);
+    assert(usb_msc.getReadHits() == 16);
+
+    // Still correct when the main loop never gets to prefetch
+    read10(300, 32, buffer, false);
+    assert(memcmp(buffer, &disk.data[300 * 512], 32 * 512) == 0);
+
+    // Writes go out one device write per chunk and read back
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 13 + 5);
+    }
+    uint32_t writes = disk.writes;
+    write10(500, 128, pattern);
+    assert(memcmp(&disk.data[500 * 512], pattern, sizeof(pattern)) == 0);
+    assert(disk.writes - writes == 128 / MSC_CHUNK_BLOCKS);
+    read10(500, 128, buffer);
+    assert(memcmp(buffer, pattern, sizeof(pattern)) == 0);
+
+    // A write over prefetched blocks, read back before it reaches the device
+    read10(600, 8, buffer);
+    usb_msc.poll();
+    memset(pattern, 0xAB, CHUNK);
+    assert(usb_msc.write(608, 0, pattern, CHUNK) == (int32_t)CHUNK);
+    assert(usb_msc.read(608, 0, buffer, CHUNK) == (int32_t)CHUNK);
+    assert(memcmp(buffer, pattern, CHUNK) == 0);
+
+    // The end of the device
+    read10(990, 10, buffer);
+    assert(memcmp(buffer, &disk.data[990 * 512], 10 * 512) == 0);
+    assert(usb_msc.read(995, 0, buffer, CHUNK) == -1);
+    assert(usb_msc.write(1000, 0, pattern, 512) == -1);
+
+    // A deferred write that fails is reported on the next command, a
+    // failure at the end of a command by write_complete()
+    disk.fail_writes = true;
+    assert(usb_msc.write(10, 0, pattern, CHUNK) == (int32_t)CHUNK);
+    usb_msc.poll();
+    disk.fail_writes = false;
+    assert(usb_msc.read(0, 0, buffer, 512) == -1);
+    assert(usb_msc.read(0, 0, buffer, 512) == 512);
+    disk.fail_writes = true;
+    assert(usb_msc.write(10, 0, pattern, CHUNK) == (int32_t)CHUNK);
+    assert(!usb_msc.write_complete());
+    disk.fail_writes = false;
+    assert(usb_msc.write(10, 0, pattern, 512) == -1);
+
+    // Ejecting writes out what is buffered
+    memset(pattern, 0x5A, CHUNK);
+    assert(usb_msc.write(20, 0, pattern, CHUNK) == (int32_t)CHUNK);
+    usb_msc.eject();
+    assert(memcmp(&disk.data[20 * 512], pattern, CHUNK) == 0);
+    assert(!usb_msc.isExported());
+    printf("PASS\n");
+    return 0;
+}
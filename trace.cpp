@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#include "memory.h"
+
+#if TRACE_ENABLED
+
+#ifdef TRACE_HOST
+// Host build: time and core come from the caller
+static uint64_t mock_time_us;
+static int mock_core;
+
+void trace_set_mock_time(uint64_t time_us) { mock_time_us = time_us; }
+void trace_set_mock_core(int core) { mock_core = core; }
+
+static inline uint64_t trace_time_us() { return mock_time_us; }
+static inline int trace_core() { return mock_core; }
+static inline uint32_t trace_lock() { return 0; }
+static inline void trace_unlock(uint32_t) {}
+#else
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+static inline uint64_t trace_time_us() { return time_us_64(); }
+static inline int trace_core() { return get_core_num(); }
+// Only this core writes its ring, masking interrupts keeps handlers from
+// claiming the same slot. Held for a handful of instructions.
+static inline uint32_t trace_lock() { return save_and_disable_interrupts(); }
+static inline void trace_unlock(uint32_t state) { restore_interrupts(state); }
+#endif
+
+static_assert((TRACE_BUFFER_EVENTS & (TRACE_BUFFER_EVENTS - 1)) == 0, "trace buffer size must be a power of two");
+
+// One ring per core, written only by that core
+typedef struct {
+    trace_event_t events[TRACE_BUFFER_EVENTS];
+    volatile uint32_t head;     // Total events recorded, wraps the ring
+} trace_buffer_t;
+
+static trace_buffer_t trace_buffers[2];
+static MemoryRegion memory_trace("trace", sizeof(trace_buffers));
+static volatile bool trace_recording = true;
+
+void trace_record(const char* name, uint8_t phase, uint32_t arg) {
+    if (!trace_recording) {
+        return;
+    }
+
+    uint64_t now = trace_time_us();
+    trace_buffer_t* buffer = &trace_buffers[trace_core()];
+
+    uint32_t state = trace_lock();
+    trace_event_t* event = &buffer->events[buffer->head & (TRACE_BUFFER_EVENTS - 1)];
+    event->time_lo = (uint32_t)now;
+    event->time_hi = (uint16_t)(now >> 32);
+    event->phase = phase;
+    event->name = name;
+    event->arg = arg;
+    buffer->head = buffer->head + 1;
+    trace_unlock(state);
+}
+
+void trace_set_recording(bool recording) {
+    trace_recording = recording;
+}
+
+bool trace_is_recording() {
+    return trace_recording;
+}
+
+void trace_clear() {
+    bool was_recording = trace_recording;
+    trace_recording = false;
+    trace_buffers[0].head = 0;
+    trace_buffers[1].head = 0;
+    trace_recording = was_recording;
+}
+
+static uint64_t event_time(const trace_event_t* event) {
+    return ((uint64_t)event->time_hi << 32) | event->time_lo;
+}
+
+// Print both rings as one Chrome trace, merged in time order
+void trace_dump() {
+    bool was_recording = trace_recording;
+    trace_recording = false;
+
+    uint32_t next[2];
+    uint32_t end[2];
+    for (int core = 0; core < 2; core++) {
+        end[core] = trace_buffers[core].head;
+        next[core] = end[core] > TRACE_BUFFER_EVENTS ? end[core] - TRACE_BUFFER_EVENTS : 0;
+    }
+
+    printf("{\"traceEvents\":[\n");
+    bool first = true;
+    for (;;) {
+        int core = -1;
+        for (int c = 0; c < 2; c++) {
+            if (next[c] < end[c] &&
+                (core < 0 || event_time(&trace_buffers[c].events[next[c] & (TRACE_BUFFER_EVENTS - 1)]) <
+                             event_time(&trace_buffers[core].events[next[core] & (TRACE_BUFFER_EVENTS - 1)]))) {
+                core = c;
+            }
+        }
+        if (core < 0) {
+            break;
+        }
+
+        const trace_event_t* event = &trace_buffers[core].events[next[core] & (TRACE_BUFFER_EVENTS - 1)];
+        next[core]++;
+
+        printf("%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":0,\"tid\":%d",
+               first ? "" : ",\n", event->name, event->phase,
+               (unsigned long long)event_time(event), core);
+        if (event->phase == TRACE_PHASE_COUNTER) {
+            printf(",\"args\":{\"value\":%lu}}", (unsigned long)event->arg);
+        } else if (event->phase == TRACE_PHASE_INSTANT) {
+            printf(",\"s\":\"t\",\"args\":{\"arg\":%lu}}", (unsigned long)event->arg);
+        } else {
+            printf("}");
+        }
+        first = false;
+    }
+    printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    trace_recording = was_recording;
+}
+
+void trace_print_status() {
+    printf("Tracing: %s\n", trace_recording ? "Recording" : "Paused");
+    for (int core = 0; core < 2; core++) {
+        uint32_t head = trace_buffers[core].head;
+        printf("  Core %d: %lu events recorded, %lu buffered\n", core, (unsigned long)head,
+               (unsigned long)(head < TRACE_BUFFER_EVENTS ? head : TRACE_BUFFER_EVENTS));
+    }
+}
+
+#else
+
+void trace_print_status() {
+    printf("Tracing: Disabled at compile time (cmake -DENABLE_TRACE=ON)\n");
+}
+
+#endif // TRACE_ENABLED
@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lightweight event tracing.
+//
+// Trace points are macros that compile to nothing, and the ring buffers
+// are left out, unless TRACE_ENABLED is set (cmake -DENABLE_TRACE=ON).
+// When enabled each event is a 16-byte record with a timestamp from the
+// 64-bit microsecond timer, written into a ring buffer owned by the core
+// that recorded it, so the two cores never contend. 'trace dump' prints the buffers as Chrome trace JSON, which
+// chrome://tracing and Perfetto load directly.
+//
+// Names must be string literals, only the pointer is stored.
+//
+// Building with TRACE_HOST replaces the hardware timer with a mock clock
+// (trace_set_mock_time) so the recorder and dump can run on a PC.
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+#ifndef TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS 256     // Per core, must be a power of two
+#endif
+
+// Chrome trace event phases
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END 'E'
+#define TRACE_PHASE_INSTANT 'i'
+#define TRACE_PHASE_COUNTER 'C'
+
+typedef struct {
+    uint32_t time_lo;       // Microseconds since boot, 48 bits in total
+    uint16_t time_hi;
+    uint8_t phase;
+    uint8_t reserved;
+    const char* name;
+    uint32_t arg;
+} trace_event_t;
+
+void trace_print_status();
+
+#if TRACE_ENABLED
+
+void trace_record(const char* name, uint8_t phase, uint32_t arg);
+void trace_set_recording(bool recording);
+bool trace_is_recording();
+void trace_clear();
+void trace_dump();
+
+#ifdef TRACE_HOST
+void trace_set_mock_time(uint64_t time_us);
+void trace_set_mock_core(int core);
+#endif
+
+// Records a begin event now and the matching end event when it goes out of scope
+class TraceScope {
+private:
+    const char* name;
+
+public:
+    explicit TraceScope(const char* name) : name(name) {
+        trace_record(name, TRACE_PHASE_BEGIN, 0);
+    }
+    ~TraceScope() {
+        trace_record(name, TRACE_PHASE_END, 0);
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_BEGIN(name) trace_record((name), TRACE_PHASE_BEGIN, 0)
+#define TRACE_END(name) trace_record((name), TRACE_PHASE_END, 0)
+#define TRACE_INSTANT(name, arg) trace_record((name), TRACE_PHASE_INSTANT, (uint32_t)(arg))
+#define TRACE_COUNTER(name, value) trace_record((name), TRACE_PHASE_COUNTER, (uint32_t)(value))
+
+#else
+
+// Compiled out: no buffers are reserved and nothing is recorded
+inline void trace_record(const char*, uint8_t, uint32_t) {}
+inline void trace_set_recording(bool) {}
+inline bool trace_is_recording() { return false; }
+inline void trace_clear() {}
+inline void trace_dump() {}
+
+#ifdef TRACE_HOST
+inline void trace_set_mock_time(uint64_t) {}
+inline void trace_set_mock_core(int) {}
+#endif
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_INSTANT(name, arg) do {} while (0)
+#define TRACE_COUNTER(name, value) do {} while (0)
+
+#endif // TRACE_ENABLED
+
+#endif // TRACE_H
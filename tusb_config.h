@@ -0,0 +1,22 @@
+#ifndef TUSB_CONFIG_H
+#define TUSB_CONFIG_H
+
+// TinyUSB configuration for the composite device described in usb_device.cpp
+
+#define CFG_TUSB_RHPORT0_MODE (OPT_MODE_DEVICE)
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 1
+#define CFG_TUD_MSC 1
+#define CFG_TUD_HID 0
+#define CFG_TUD_MIDI 0
+#define CFG_TUD_VENDOR 0
+
+// Same console buffering as the SDK's USB stdio
+#define CFG_TUD_CDC_RX_BUFSIZE 256
+#define CFG_TUD_CDC_TX_BUFSIZE 256
+
+// READ10/WRITE10 data arrives in chunks of this size, see usb_msc.h
+#define CFG_TUD_MSC_EP_BUFSIZE 4096
+
+#endif // TUSB_CONFIG_H
@@ -0,0 +1,233 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/unique_id.h"
+#include "pico/bootrom.h"
+#include "hardware/watchdog.h"
+#include "hardware/irq.h"
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+#include "usb_device.h"
+#include "usb_msc.h"
+#include "power.h"
+
+#define USB_VID 0x2E8A          // Raspberry Pi
+#define USB_PID 0x000A          // Pico SDK USB stdio, so existing host setups keep working
+#define USB_BCD 0x0101          // Differs from the SDK's CDC-only device so hosts do not reuse cached descriptors
+
+// Vendor interface picotool sends reboot requests to, as in the SDK's USB stdio
+#define RESET_INTERFACE_SUBCLASS 0x00
+#define RESET_INTERFACE_PROTOCOL 0x01
+#define RESET_REQUEST_BOOTSEL 0x01
+#define RESET_REQUEST_FLASH 0x02
+#define RESET_DESC_LEN 9
+
+enum {
+    ITF_NUM_CDC = 0,
+    ITF_NUM_CDC_DATA,
+    ITF_NUM_MSC,
+    ITF_NUM_RESET,
+    ITF_NUM_TOTAL
+};
+
+enum {
+    STRID_LANGID = 0,
+    STRID_MANUFACTURER,
+    STRID_PRODUCT,
+    STRID_SERIAL,
+    STRID_CDC,
+    STRID_MSC,
+    STRID_RESET
+};
+
+#define EPNUM_CDC_NOTIF 0x81
+#define EPNUM_CDC_OUT 0x02
+#define EPNUM_CDC_IN 0x82
+#define EPNUM_MSC_OUT 0x03
+#define EPNUM_MSC_IN 0x83
+
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN + RESET_DESC_LEN)
+
+static const tusb_desc_device_t device_descriptor = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+    // Interface association, the CDC pair is grouped by an IAD
+    .bDeviceClass = TUSB_CLASS_MISC,
+    .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor = USB_VID,
+    .idProduct = USB_PID,
+    .bcdDevice = USB_BCD,
+    .iManufacturer = STRID_MANUFACTURER,
+    .iProduct = STRID_PRODUCT,
+    .iSerialNumber = STRID_SERIAL,
+    .bNumConfigurations = 1
+};
+
+static const uint8_t config_descriptor[] = {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 250),
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRID_CDC, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+    TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, STRID_MSC, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64),
+    // No endpoints, requests arrive on the control pipe
+    RESET_DESC_LEN, TUSB_DESC_INTERFACE, ITF_NUM_RESET, 0, 0, TUSB_CLASS_VENDOR_SPECIFIC,
+    RESET_INTERFACE_SUBCLASS, RESET_INTERFACE_PROTOCOL, STRID_RESET,
+};
+
+static_assert(sizeof(config_descriptor) == CONFIG_TOTAL_LEN, "configuration descriptor length mismatch");
+
+static const char* const strings[] = {
+    NULL,               // Language, handled separately
+    "Raspberry Pi",
+    "Pico W Base",
+    NULL,               // Serial, the flash unique ID
+    "Pico W Console",
+    "Pico W SD Card",
+    "Reset",
+};
+
+static uint8_t task_irq;         // Spare interrupt tud_task() runs in
+static volatile bool in_task;
+static uint8_t reset_itf_num;
+
+// TinyUSB descriptor callbacks
+const uint8_t* tud_descriptor_device_cb() {
+    return (const uint8_t*)&device_descriptor;
+}
+
+const uint8_t* tud_descriptor_configuration_cb(uint8_t index) {
+    (void)index;
+    return config_descriptor;
+}
+
+const uint16_t* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+    (void)langid;
+    static uint16_t descriptor[32];
+    char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+
+    uint8_t length;
+    if (index == STRID_LANGID) {
+        descriptor[1] = 0x0409;  // English (US)
+        length = 1;
+    } else {
+        if (index >= sizeof(strings) / sizeof(strings[0])) {
+            return NULL;
+        }
+        const char* text = strings[index];
+        if (index == STRID_SERIAL) {
+            pico_get_unique_board_id_string(serial, sizeof(serial));
+            text = serial;
+        }
+        length = (uint8_t)strlen(text);
+        if (length > 31) {
+            length = 31;
+        }
+        for (uint8_t i = 0; i < length; i++) {
+            descriptor[1 + i] = text[i];
+        }
+    }
+
+    // Header: total length in bytes and descriptor type
+    descriptor[0] = (uint16_t)((TUSB_DESC_STRING << 8) | (2 * length + 2));
+    return descriptor;
+}
+
+// Reset interface driver, answers picotool's reboot requests
+static void resetd_init() {
+}
+
+static void resetd_reset(uint8_t rhport) {
+    (void)rhport;
+    reset_itf_num = 0;
+}
+
+static uint16_t resetd_open(uint8_t rhport, const tusb_desc_interface_t* itf_desc, uint16_t max_len) {
+    (void)rhport;
+    TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC &&
+              itf_desc->bInterfaceSubClass == RESET_INTERFACE_SUBCLASS &&
+              itf_desc->bInterfaceProtocol == RESET_INTERFACE_PROTOCOL, 0);
+    TU_VERIFY(max_len >= sizeof(tusb_desc_interface_t), 0);
+    reset_itf_num = itf_desc->bInterfaceNumber;
+    return sizeof(tusb_desc_interface_t);
+}
+
+static bool resetd_control_xfer_cb(uint8_t rhport, uint8_t stage, const tusb_control_request_t* request) {
+    (void)rhport;
+    if (stage != CONTROL_STAGE_SETUP) {
+        return true;
+    }
+    if (request->wIndex != reset_itf_num) {
+        return false;
+    }
+
+    if (request->bRequest == RESET_REQUEST_BOOTSEL) {
+        // wValue: activity LED GPIO in the top bits when bit 8 is set, interfaces to disable in the low bits
+        uint32_t gpio_mask = (request->wValue & 0x100) ? 1u << (request->wValue >> 9) : 0;
+        reset_usb_boot(gpio_mask, request->wValue & 0x7F);
+    } else if (request->bRequest == RESET_REQUEST_FLASH) {
+        watchdog_reboot(0, 0, 100);
+        return true;
+    }
+    return false;
+}
+
+static bool resetd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes) {
+    (void)rhport;
+    (void)ep_addr;
+    (void)result;
+    (void)xferred_bytes;
+    return true;
+}
+
+static const usbd_class_driver_t reset_driver = {
+#if CFG_TUSB_DEBUG >= 2
+    .name = "RESET",
+#endif
+    .init = resetd_init,
+    .reset = resetd_reset,
+    .open = resetd_open,
+    .control_xfer_cb = resetd_control_xfer_cb,
+    .xfer_cb = resetd_xfer_cb
+};
+
+const usbd_class_driver_t* usbd_app_driver_get_cb(uint8_t* driver_count) {
+    *driver_count = 1;
+    return &reset_driver;
+}
+
+// Runs after TinyUSB's own handler has queued the event
+static void usb_irq_handler() {
+    power.note_event();
+    irq_set_pending(task_irq);
+}
+
+static void task_irq_handler() {
+    if (!usb_msc.isExported()) {
+        usb_device_task();
+    }
+}
+
+// Public interface
+void usb_device_init() {
+    tusb_init();
+
+    // Lowest priority, so the timer, DMA and SPI interrupts can preempt a long tud_task()
+    task_irq = (uint8_t)user_irq_claim_unused(true);
+    irq_set_exclusive_handler(task_irq, task_irq_handler);
+    irq_set_priority(task_irq, PICO_LOWEST_IRQ_PRIORITY);
+    irq_set_enabled(task_irq, true);
+    irq_add_shared_handler(USBCTRL_IRQ, usb_irq_handler, PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY);
+}
+
+// Runs on core 0 from the main loop and the task interrupt. The interrupt
+// cannot preempt a main loop call that already holds the flag, and a main
+// loop call cannot start while the interrupt's call is running. An event
+// the interrupt skips wakes the main loop, which services it next pass.
+void usb_device_task() {
+    if (in_task) {
+        return;
+    }
+    in_task = true;
+    tud_task();
+    in_task = false;
+}
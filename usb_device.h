@@ -0,0 +1,17 @@
+#ifndef USB_DEVICE_H
+#define USB_DEVICE_H
+
+// USB composite device: CDC for the console, MSC for the SD card (see
+// usb_msc.h), and the vendor reset interface picotool uses to reboot the
+// board.
+//
+// usb_device_task() services TinyUSB. Each USB interrupt pends a spare low
+// priority interrupt that calls it, so enumeration and the console keep
+// going through boot and long commands without a polling tick, except while
+// the card is exported: SCSI callbacks then access the SD card, and like
+// every other SD user they must only run from the main loop.
+
+void usb_device_init();
+void usb_device_task();
+
+#endif // USB_DEVICE_H
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include "usb_msc.h"
+#include "memory.h"
+
+#ifndef MSC_HOST
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "sd_card.h"
+
+static_assert(CFG_TUD_MSC_EP_BUFSIZE == MSC_CHUNK_BLOCKS * BlockDevice::BLOCK_SIZE,
+              "the read-ahead buffer must hold exactly one TinyUSB chunk");
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#endif
+
+// Global instance
+UsbMassStorage usb_msc;
+static MemoryRegion memory_msc("usb_msc", sizeof(UsbMassStorage));
+
+// Constructor
+UsbMassStorage::UsbMassStorage() {
+    device = NULL;
+    exported = false;
+    state = BUFFER_EMPTY;
+    buffer_block = 0;
+    buffer_count = 0;
+    deferred_error = false;
+    last_command_us = 0;
+    blocks_read = 0;
+    blocks_written = 0;
+    read_hits = 0;
+    read_misses = 0;
+    errors = 0;
+}
+
+// Public interface
+bool UsbMassStorage::export_device(BlockDevice* device) {
+    if (exported || device == NULL || device->block_count() == 0) {
+        return false;
+    }
+    this->device = device;
+    state = BUFFER_EMPTY;
+    deferred_error = false;
+    blocks_read = 0;
+    blocks_written = 0;
+    read_hits = 0;
+    read_misses = 0;
+    errors = 0;
+    exported = true;
+    return true;
+}
+
+// Write out anything pending, then report the medium as removed
+void UsbMassStorage::eject() {
+    if (!exported) {
+        return;
+    }
+    if (!flush()) {
+        printf("USB mass storage: pending write failed on eject\n");
+    }
+    state = BUFFER_EMPTY;
+    exported = false;
+}
+
+int32_t UsbMassStorage::read(uint32_t lba, uint32_t offset, uint8_t* data, uint32_t length) {
+    if (!exported) {
+        return -1;
+    }
+    touch();
+    if (deferred_error) {
+        deferred_error = false;
+        return -1;
+    }
+
+    uint32_t block = lba + offset / BlockDevice::BLOCK_SIZE;
+    uint32_t count = length / BlockDevice::BLOCK_SIZE;
+    if (count == 0 || block >= device->block_count() || count > device->block_count() - block) {
+        errors++;
+        return -1;
+    }
+
+    // Reads must see every earlier write
+    if (!flush()) {
+        return -1;
+    }
+
+    if (state == BUFFER_READ && buffer_block == block && buffer_count >= count) {
+        memcpy(data, buffer, length);
+        read_hits++;
+    } else {
+        // Also the case when the main loop has not got round to the read-ahead yet
+        if (!device->read_blocks(block, data, count)) {
+            errors++;
+            state = BUFFER_EMPTY;
+            return -1;
+        }
+        read_misses++;
+    }
+    blocks_read += count;
+
+    schedule_prefetch(block + count);
+    return (int32_t)length;
+}
+
+int32_t UsbMassStorage::write(uint32_t lba, uint32_t offset, const uint8_t* data, uint32_t length) {
+    if (!exported) {
+        return -1;
+    }
+    touch();
+    if (deferred_error) {
+        deferred_error = false;
+        return -1;
+    }
+
+    uint32_t block = lba + offset / BlockDevice::BLOCK_SIZE;
+    uint32_t count = length / BlockDevice::BLOCK_SIZE;
+    if (count == 0 || block >= device->block_count() || count > device->block_count() - block) {
+        errors++;
+        return -1;
+    }
+
+    // The previous chunk goes out now if the main loop has not written it yet
+    if (!flush()) {
+        return -1;
+    }
+
+    if (count > MSC_CHUNK_BLOCKS) {
+        if (!device->write_blocks(block, data, count)) {
+            errors++;
+            return -1;
+        }
+        blocks_written += count;
+        return (int32_t)length;
+    }
+
+    // Accept the chunk so USB can receive the next one while this is written
+    memcpy(buffer, data, length);
+    state = BUFFER_WRITE;
+    buffer_block = block;
+    buffer_count = count;
+    return (int32_t)length;
+}
+
+// End of a WRITE10, a failure can only be reported on the next command
+bool UsbMassStorage::write_complete() {
+    if (!flush()) {
+        deferred_error = true;
+        return false;
+    }
+    return true;
+}
+
+// SYNCHRONIZE CACHE, a failure is reported on this command
+bool UsbMassStorage::sync() {
+    return flush();
+}
+
+void UsbMassStorage::poll() {
+    if (!exported) {
+        return;
+    }
+    if (state == BUFFER_WRITE) {
+        if (!flush()) {
+            deferred_error = true;
+        }
+    } else if (state == BUFFER_PREFETCH) {
+        fill();
+    }
+}
+
+bool UsbMassStorage::flush() {
+    if (state != BUFFER_WRITE) {
+        return true;
+    }
+    state = BUFFER_EMPTY;
+    if (!device->write_blocks(buffer_block, buffer, buffer_count)) {
+        errors++;
+        return false;
+    }
+    blocks_written += buffer_count;
+    return true;
+}
+
+// Read-ahead failures are not reported, the host's own read of those blocks will be
+bool UsbMassStorage::fill() {
+    if (state != BUFFER_PREFETCH) {
+        return true;
+    }
+    bool success = device->read_blocks(buffer_block, buffer, buffer_count);
+    state = success ? BUFFER_READ : BUFFER_EMPTY;
+    return success;
+}
+
+void UsbMassStorage::schedule_prefetch(uint32_t block) {
+    if (block >= device->block_count()) {
+        state = BUFFER_EMPTY;
+        return;
+    }
+    state = BUFFER_PREFETCH;
+    buffer_block = block;
+    buffer_count = device->block_count() - block;
+    if (buffer_count > MSC_CHUNK_BLOCKS) {
+        buffer_count = MSC_CHUNK_BLOCKS;
+    }
+}
+
+void UsbMassStorage::touch() {
+#ifndef MSC_HOST
+    last_command_us = time_us_32();
+#endif
+}
+
+bool UsbMassStorage::isBusy() const {
+    if (!exported) {
+        return false;
+    }
+    if (state == BUFFER_PREFETCH || state == BUFFER_WRITE) {
+        return true;
+    }
+#ifdef MSC_HOST
+    return false;
+#else
+    return time_us_32() - last_command_us < MSC_BUSY_US;
+#endif
+}
+
+void UsbMassStorage::print_status() {
+    printf("USB mass storage: %s\n", exported ? "SD card exported" : "not exported");
+    if (exported) {
+        printf("  Capacity: %lu blocks (%lu MB)\n", (unsigned long)device->block_count(),
+               (unsigned long)(device->block_count() / 2048));
+    }
+    if (blocks_read == 0 && blocks_written == 0 && errors == 0) {
+        return;
+    }
+    printf("  Read: %lu blocks, read-ahead %lu hits, %lu misses\n", (unsigned long)blocks_read,
+           (unsigned long)read_hits, (unsigned long)read_misses);
+    printf("  Written: %lu blocks, %lu errors\n", (unsigned long)blocks_written, (unsigned long)errors);
+}
+
+#ifndef MSC_HOST
+// TinyUSB MSC callbacks, one LUN. While the card is exported they only run
+// from the main loop, see usb_device.h.
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
+    (void)lun;
+    memcpy(vendor_id, "PicoW   ", 8);
+    memcpy(product_id, "SD Card         ", 16);
+    memcpy(product_rev, "1.0 ", 4);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun) {
+    if (!usb_msc.isExported()) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);  // Medium not present
+        return false;
+    }
+    return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size) {
+    (void)lun;
+    *block_count = usb_msc.getBlockCount();
+    *block_size = BlockDevice::BLOCK_SIZE;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
+    (void)lun;
+    (void)power_condition;
+    if (load_eject && !start && usb_msc.isExported()) {
+        usb_msc.eject();
+        sd_card.parse_boot_sector();  // The host may have changed the file system
+        printf("SD card ejected by the USB host\n");
+    }
+    return true;
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
+    int32_t result = usb_msc.read(lba, offset, (uint8_t*)buffer, bufsize);
+    if (result < 0) {
+        if (usb_msc.isExported()) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);  // Unrecovered read error
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+        }
+    }
+    return result;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
+    int32_t result = usb_msc.write(lba, offset, buffer, bufsize);
+    if (result < 0) {
+        if (usb_msc.isExported()) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // Write error
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+        }
+    }
+    return result;
+}
+
+void tud_msc_write10_complete_cb(uint8_t lun) {
+    (void)lun;
+    usb_msc.write_complete();
+}
+
+// Commands TinyUSB does not handle itself
+int32_t tud_msc_scsi_cb(uint8_t lun, const uint8_t scsi_cmd[16], void* buffer, uint16_t bufsize) {
+    (void)buffer;
+    (void)bufsize;
+    switch (scsi_cmd[0]) {
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+        return 0;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+        if (!usb_msc.sync()) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+            return -1;
+        }
+        return 0;
+    default:
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);  // Invalid command
+        return -1;
+    }
+}
+#endif
@@ -0,0 +1,84 @@
+#ifndef USB_MSC_H
+#define USB_MSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_device.h"
+
+// USB mass storage: SCSI READ10/WRITE10 ranges mapped to multi-block
+// transfers on a BlockDevice, normally the whole SD card
+//
+// TinyUSB hands each command over in chunks of CFG_TUD_MSC_EP_BUFSIZE. A read
+// chunk comes from the read-ahead buffer when it holds it, then the main loop
+// refills the buffer with the following chunk while USB is still sending
+// this one. A write chunk is copied into the same buffer and written out by
+// the main loop while USB receives the next one, or at the latest when the
+// next chunk or the end of the command arrives. Either way SPI and USB run
+// at the same time instead of taking turns.
+//
+// A deferred write that fails is reported on the next command, since its
+// chunk was already accepted. Building with MSC_HOST leaves out TinyUSB so
+// the glue can be driven against a RAM BlockDevice on a PC.
+
+#define MSC_CHUNK_BLOCKS 8          // CFG_TUD_MSC_EP_BUFSIZE / 512
+#define MSC_BUSY_US 100000          // Main loop stays awake this long after a command
+
+class UsbMassStorage {
+private:
+    enum BufferState {
+        BUFFER_EMPTY,
+        BUFFER_PREFETCH,            // Holds nothing yet, the main loop should read buffer_block
+        BUFFER_READ,                // Holds buffer_count blocks from buffer_block
+        BUFFER_WRITE                // Holds buffer_count blocks still to be written to buffer_block
+    };
+
+    BlockDevice* device;
+    bool exported;
+    uint8_t buffer[MSC_CHUNK_BLOCKS * BlockDevice::BLOCK_SIZE];
+    BufferState state;
+    uint32_t buffer_block;
+    uint32_t buffer_count;
+    bool deferred_error;
+    uint32_t last_command_us;
+
+    // Statistics
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    uint32_t read_hits;
+    uint32_t read_misses;
+    uint32_t errors;
+
+    bool flush();
+    bool fill();
+    void schedule_prefetch(uint32_t block);
+    void touch();
+
+public:
+    // Constructor
+    UsbMassStorage();
+
+    // Public interface
+    bool export_device(BlockDevice* device);
+    void eject();
+    int32_t read(uint32_t lba, uint32_t offset, uint8_t* data, uint32_t length);
+    int32_t write(uint32_t lba, uint32_t offset, const uint8_t* data, uint32_t length);
+    bool write_complete();
+    bool sync();
+    void poll();                // Main loop, read-ahead and deferred writes
+    void print_status();
+
+    // Getter methods
+    bool isExported() const { return exported; }
+    bool isBusy() const;
+    uint32_t getBlockCount() const { return exported ? device->block_count() : 0; }
+    uint32_t getBlocksRead() const { return blocks_read; }
+    uint32_t getBlocksWritten() const { return blocks_written; }
+    uint32_t getReadHits() const { return read_hits; }
+    uint32_t getReadMisses() const { return read_misses; }
+    uint32_t getErrors() const { return errors; }
+};
+
+// Global instance
+extern UsbMassStorage usb_msc;
+
+#endif // USB_MSC_H
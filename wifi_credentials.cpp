@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "flash_device.h"
+#include "flash_kv.h"
+#include "wifi_credentials.h"
+
+// Key/value layout: "wifi:<ssid>" holds the password, "lease:<ssid>" the cached lease
+#define KEY_NETWORK_PREFIX "wifi:"
+#define KEY_LEASE_PREFIX "lease:"
+#define KEY_BUFFER_LEN (FlashKV::MAX_KEY_LEN + 1)
+
+static_assert(sizeof(KEY_LEASE_PREFIX) - 1 + MAX_SSID_LEN <= FlashKV::MAX_KEY_LEN, "SSID key too long");
+
+// Layout written by older firmware: one page per network in the last flash sector
+#define LEGACY_CREDENTIALS_MAGIC 0x57494649  // "WIFI" in hex
+#define LEGACY_SLOT_SIZE 256
+
+typedef struct {
+    uint32_t magic;
+    char ssid[MAX_SSID_LEN];
+    char password[MAX_PASSWORD_LEN];
+    uint32_t checksum;
+} legacy_credentials_t;
+
+static void make_key(char* key, const char* prefix, const char* ssid) {
+    snprintf(key, KEY_BUFFER_LEN, "%s%.*s", prefix, MAX_SSID_LEN - 1, ssid);
+}
+
+static bool has_prefix(const char* key, const char* prefix) {
+    return strncmp(key, prefix, strlen(prefix)) == 0;
+}
+
+static bool legacy_credentials_valid(const legacy_credentials_t* creds) {
+    if (creds->magic != LEGACY_CREDENTIALS_MAGIC) {
+        return false;
+    }
+    uint32_t checksum = 0;
+    const uint8_t* data = (const uint8_t*)creds;
+    for (size_t i = 0; i < offsetof(legacy_credentials_t, checksum); i++) {
+        checksum += data[i];
+    }
+    return creds->checksum == checksum;
+}
+
+// Copy networks out of the old fixed-slot sector, then erase it
+static void migrate_legacy_credentials() {
+    const uint8_t* sector = pico_flash.read_ptr(FLASH_LEGACY_CREDENTIALS_OFFSET);
+    bool erased = true;
+    for (uint32_t i = 0; i < FlashDevice::SECTOR_SIZE && erased; i++) {
+        erased = sector[i] == 0xFF;
+    }
+    if (erased) {
+        return;
+    }
+
+    for (int slot = 0; slot * LEGACY_SLOT_SIZE < (int)FlashDevice::SECTOR_SIZE; slot++) {
+        const legacy_credentials_t* creds = (const legacy_credentials_t*)(sector + slot * LEGACY_SLOT_SIZE);
+        if (!legacy_credentials_valid(creds)) {
+            continue;
+        }
+        char ssid[MAX_SSID_LEN];
+        char password[MAX_PASSWORD_LEN];
+        strncpy(ssid, creds->ssid, MAX_SSID_LEN - 1);
+        ssid[MAX_SSID_LEN - 1] = '\0';
+        strncpy(password, creds->password, MAX_PASSWORD_LEN - 1);
+        password[MAX_PASSWORD_LEN - 1] = '\0';
+        if (!save_wifi_credentials(ssid, password)) {
+            return;  // Keep the old sector, try again next boot
+        }
+        printf("Migrated saved network: %s\n", ssid);
+    }
+
+    pico_flash.erase_sector(FLASH_LEGACY_CREDENTIALS_OFFSET);
+}
+
+bool wifi_credentials_init() {
+    if (!flash_kv.isMounted() && !flash_kv.mount()) {
+        return false;
+    }
+    migrate_legacy_credentials();
+    return true;
+}
+
+// Add a network, or update the password of a saved one
+bool save_wifi_credentials(const char* ssid, const char* password) {
+    char key[KEY_BUFFER_LEN];
+    make_key(key, KEY_NETWORK_PREFIX, ssid);
+
+    size_t length;
+    if (flash_kv.get(key, &length) == NULL && count_wifi_credentials() >= WIFI_MAX_NETWORKS) {
+        return false;
+    }
+    size_t password_len = strnlen(password, MAX_PASSWORD_LEN - 1);
+    return flash_kv.put(key, password, password_len);
+}
+
+bool load_wifi_credentials(int index, char* ssid, char* password) {
+    char key[KEY_BUFFER_LEN];
+    for (int i = 0; flash_kv.key_at(i, key, sizeof(key)); i++) {
+        if (!has_prefix(key, KEY_NETWORK_PREFIX) || index-- > 0) {
+            continue;
+        }
+        strncpy(ssid, key + strlen(KEY_NETWORK_PREFIX), MAX_SSID_LEN - 1);
+        ssid[MAX_SSID_LEN - 1] = '\0';
+        return find_wifi_credentials(ssid, password);
+    }
+    return false;
+}
+
+// Look up the password for a saved network
+bool find_wifi_credentials(const char* ssid, char* password) {
+    char key[KEY_BUFFER_LEN];
+    make_key(key, KEY_NETWORK_PREFIX, ssid);
+
+    size_t length;
+    const void* value = flash_kv.get(key, &length);
+    if (value == NULL || length >= MAX_PASSWORD_LEN) {
+        return false;
+    }
+    memcpy(password, value, length);
+    password[length] = '\0';
+    return true;
+}
+
+bool forget_wifi_credentials(const char* ssid) {
+    char key[KEY_BUFFER_LEN];
+    make_key(key, KEY_LEASE_PREFIX, ssid);
+    flash_kv.remove(key);
+    make_key(key, KEY_NETWORK_PREFIX, ssid);
+    return flash_kv.remove(key);
+}
+
+bool clear_wifi_credentials() {
+    // Removing shifts the remaining keys down, so only advance past other keys
+    char key[KEY_BUFFER_LEN];
+    int i = 0;
+    while (flash_kv.key_at(i, key, sizeof(key))) {
+        if (has_prefix(key, KEY_NETWORK_PREFIX) || has_prefix(key, KEY_LEASE_PREFIX)) {
+            if (!flash_kv.remove(key)) {
+                return false;
+            }
+        } else {
+            i++;
+        }
+    }
+    return true;
+}
+
+int count_wifi_credentials() {
+    char key[KEY_BUFFER_LEN];
+    int count = 0;
+    for (int i = 0; flash_kv.key_at(i, key, sizeof(key)); i++) {
+        if (has_prefix(key, KEY_NETWORK_PREFIX)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool load_wifi_lease(const char* ssid, wifi_lease_t* lease) {
+    char key[KEY_BUFFER_LEN];
+    make_key(key, KEY_LEASE_PREFIX, ssid);
+    return flash_kv.read(key, lease, sizeof(wifi_lease_t));
+}
+
+// Lease of the network we connected to last, used for the boot fast path
+bool load_latest_wifi_lease(char* ssid, wifi_lease_t* lease) {
+    char key[KEY_BUFFER_LEN];
+    char password[MAX_PASSWORD_LEN];
+    bool found = false;
+
+    for (int i = 0; flash_kv.key_at(i, key, sizeof(key)); i++) {
+        wifi_lease_t candidate;
+        const char* candidate_ssid = key + strlen(KEY_LEASE_PREFIX);
+        if (!has_prefix(key, KEY_LEASE_PREFIX) || !flash_kv.read(key, &candidate, sizeof(candidate)) ||
+            !find_wifi_credentials(candidate_ssid, password)) {
+            continue;
+        }
+        if (!found || candidate.sequence > lease->sequence) {
+            strncpy(ssid, candidate_ssid, MAX_SSID_LEN - 1);
+            ssid[MAX_SSID_LEN - 1] = '\0';
+            memcpy(lease, &candidate, sizeof(wifi_lease_t));
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Store the lease for a saved network, the store skips the write when nothing changed
+bool save_wifi_lease(const char* ssid, wifi_lease_t* lease) {
+    char password[MAX_PASSWORD_LEN];
+    if (!find_wifi_credentials(ssid, password)) {
+        return false;  // Only cache leases for saved networks
+    }
+
+    // Take a new sequence number unless this network is already the latest
+    char latest_ssid[MAX_SSID_LEN];
+    wifi_lease_t latest;
+    lease->sequence = 1;
+    if (load_latest_wifi_lease(latest_ssid, &latest)) {
+        lease->sequence = strcmp(latest_ssid, ssid) == 0 ? latest.sequence : latest.sequence + 1;
+    }
+
+    char key[KEY_BUFFER_LEN];
+    make_key(key, KEY_LEASE_PREFIX, ssid);
+    return flash_kv.put(key, lease, sizeof(wifi_lease_t));
+}
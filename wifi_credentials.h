@@ -0,0 +1,38 @@
+#ifndef WIFI_CREDENTIALS_H
+#define WIFI_CREDENTIALS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_SSID_LEN 32
+#define MAX_PASSWORD_LEN 64
+#define WIFI_MAX_NETWORKS 8
+
+// Last successful association, used for a targeted join and DHCP INIT-REBOOT
+typedef struct {
+    uint8_t bssid[6];
+    uint16_t channel;
+    uint32_t ip_addr;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint32_t sequence;      // Highest value marks the most recently used network
+} wifi_lease_t;
+
+// Mount the settings store and import credentials saved by older firmware
+bool wifi_credentials_init();
+
+// Saved networks, kept in the flash key/value store
+bool save_wifi_credentials(const char* ssid, const char* password);
+bool load_wifi_credentials(int index, char* ssid, char* password);
+bool find_wifi_credentials(const char* ssid, char* password);
+bool forget_wifi_credentials(const char* ssid);
+bool clear_wifi_credentials();
+int count_wifi_credentials();
+
+// Lease cache, one per saved network
+bool load_wifi_lease(const char* ssid, wifi_lease_t* lease);
+bool save_wifi_lease(const char* ssid, wifi_lease_t* lease);
+bool load_latest_wifi_lease(char* ssid, wifi_lease_t* lease);
+
+#endif // WIFI_CREDENTIALS_H
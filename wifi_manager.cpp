@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "pico/rand.h"
+#include "cyw43.h"
+#include "lwip/netif.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/dhcp.h"
+#include "lwip/prot/dhcp.h"
+#include "wifi_manager.h"
+#include "wifi_scan.h"
+#include "trace.h"
+#include "event_log.h"
+
+// Not every cyw43-driver release exports this one (WLC_GET_CHANNEL)
+#ifndef CYW43_IOCTL_GET_CHANNEL
+#define CYW43_IOCTL_GET_CHANNEL (0x3a)
+#endif
+
+// Global instance
+WiFiManager wifi_manager;
+
+// Constructor
+WiFiManager::WiFiManager() {
+    ssid[0] = '\0';
+    password[0] = '\0';
+    sta_enabled = false;
+    auto_select = false;
+    candidate = 0;
+    state = WIFI_STATE_IDLE;
+    deadline = get_absolute_time();
+    attempts = 0;
+    history_count = 0;
+}
+
+const char* WiFiManager::state_name(wifi_state_t state) {
+    switch (state) {
+        case WIFI_STATE_IDLE: return "Idle";
+        case WIFI_STATE_FAST_JOIN: return "Fast join";
+        case WIFI_STATE_SCANNING: return "Scanning";
+        case WIFI_STATE_JOINING: return "Joining";
+        case WIFI_STATE_CONNECTED: return "Connected";
+        case WIFI_STATE_BACKOFF: return "Backoff";
+        default: return "Unknown";
+    }
+}
+
+void WiFiManager::set_state(wifi_state_t new_state, int link_status) {
+    state = new_state;
+
+    wifi_transition_t* entry = &history[history_count % HISTORY_SIZE];
+    entry->time_us = time_us_64();
+    entry->state = new_state;
+    entry->link_status = (int8_t)link_status;
+    history_count++;
+}
+
+uint64_t WiFiManager::getStateTime() const {
+    if (history_count == 0) {
+        return 0;
+    }
+    return time_us_64() - history[(history_count - 1) % HISTORY_SIZE].time_us;
+}
+
+// Exponential backoff with equal jitter: half fixed, half random
+uint32_t WiFiManager::backoff_delay_ms() const {
+    uint32_t delay = BACKOFF_MAX_MS;
+    if (attempts < 16) {
+        delay = BACKOFF_BASE_MS << (attempts - 1);
+        if (delay > BACKOFF_MAX_MS) {
+            delay = BACKOFF_MAX_MS;
+        }
+    }
+    return delay / 2 + get_rand_32() % (delay / 2 + 1);
+}
+
+// Seed lwIP's DHCP client with the cached address so the link-up sends a
+// DHCPREQUEST (INIT-REBOOT) instead of a DISCOVER/OFFER round trip.
+// A NAK from the server makes lwIP fall back to discovery on its own.
+static void prime_dhcp(const wifi_lease_t* lease) {
+    struct netif* netif = &cyw43_state.netif[CYW43_ITF_STA];
+    struct dhcp* dhcp = netif_dhcp_data(netif);
+    if (dhcp == NULL) {
+        return;
+    }
+    ip4_addr_set_u32(&dhcp->offered_ip_addr, lease->ip_addr);
+    ip4_addr_set_u32(&dhcp->offered_sn_mask, lease->netmask);
+    ip4_addr_set_u32(&dhcp->offered_gw_addr, lease->gateway);
+    dhcp->state = DHCP_STATE_REBOOTING;
+}
+
+// Remember the AP and address we ended up with for the next boot
+static void cache_lease(const char* ssid) {
+    wifi_lease_t lease;
+    memset(&lease, 0, sizeof(lease));
+
+    if (cyw43_wifi_get_bssid(&cyw43_state, lease.bssid) != 0) {
+        return;
+    }
+
+    // channel_info_t: hw_channel, target_channel, scan_channel
+    uint32_t channel_info[3] = {0};
+    if (cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel_info),
+                    (uint8_t*)channel_info, CYW43_ITF_STA) == 0) {
+        lease.channel = (uint16_t)channel_info[0];
+    }
+
+    struct netif* netif = &cyw43_state.netif[CYW43_ITF_STA];
+    lease.ip_addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+    lease.netmask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+    lease.gateway = ip4_addr_get_u32(netif_ip4_gw(netif));
+
+    save_wifi_lease(ssid, &lease);
+}
+
+// Targeted join against a known AP, priming DHCP if we hold a lease for this network
+bool WiFiManager::join_bssid(const uint8_t* bssid, uint32_t channel, wifi_state_t join_state, uint32_t timeout_ms) {
+    wifi_lease_t lease;
+    if (load_wifi_lease(ssid, &lease)) {
+        prime_dhcp(&lease);
+    }
+
+    // cyw43_arch_wifi_connect_bssid_async() has no channel argument, so join directly
+    int err = cyw43_wifi_join(&cyw43_state, strlen(ssid), (const uint8_t*)ssid,
+                              strlen(password), (const uint8_t*)password,
+                              CYW43_AUTH_WPA3_WPA2_AES_PSK, bssid,
+                              channel ? channel : CYW43_CHANNEL_NONE);
+    if (err != 0) {
+        return false;
+    }
+    deadline = make_timeout_time_ms(timeout_ms);
+    set_state(join_state, CYW43_LINK_JOIN);
+    return true;
+}
+
+void WiFiManager::start_fast_join() {
+    wifi_lease_t lease;
+    if (load_wifi_lease(ssid, &lease)) {
+        printf("WiFi: fast join '%s' at %02x:%02x:%02x:%02x:%02x:%02x on channel %d\n", ssid,
+               lease.bssid[0], lease.bssid[1], lease.bssid[2], lease.bssid[3], lease.bssid[4], lease.bssid[5],
+               lease.channel);
+        if (join_bssid(lease.bssid, lease.channel, WIFI_STATE_FAST_JOIN, FAST_JOIN_TIMEOUT_MS)) {
+            return;
+        }
+    }
+    retry();
+}
+
+void WiFiManager::start_join() {
+    attempts++;
+    printf("WiFi: joining '%s' (attempt %lu)\n", ssid, (unsigned long)attempts);
+
+    int err = cyw43_arch_wifi_connect_async(ssid, password, CYW43_AUTH_WPA3_WPA2_AES_PSK);
+    deadline = make_timeout_time_ms(JOIN_TIMEOUT_MS);
+    set_state(WIFI_STATE_JOINING, CYW43_LINK_JOIN);
+    if (err != 0) {
+        join_failed(err);
+    }
+}
+
+// One scan finds every saved network in range, strongest first
+void WiFiManager::start_scan() {
+    attempts++;
+    printf("WiFi: scanning for saved networks (attempt %lu)\n", (unsigned long)attempts);
+
+    set_state(WIFI_STATE_SCANNING, cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA));
+    int err = wifi_scan.start();
+    if (err != 0) {
+        join_failed(err);
+    }
+}
+
+// Join the strongest saved network at or after the given scan result
+bool WiFiManager::try_candidates(int first) {
+    for (int i = first; i < wifi_scan.getCount(); i++) {
+        const wifi_scan_entry_t* entry = wifi_scan.getEntry(i);
+        if (entry->ssid[0] == '\0' || !find_wifi_credentials(entry->ssid, password)) {
+            continue;
+        }
+
+        candidate = i;
+        strncpy(ssid, entry->ssid, MAX_SSID_LEN - 1);
+        ssid[MAX_SSID_LEN - 1] = '\0';
+        printf("WiFi: joining '%s' (rssi %d, channel %d)\n", ssid, entry->rssi, entry->channel);
+        if (join_bssid(entry->bssid, entry->channel, WIFI_STATE_JOINING, JOIN_TIMEOUT_MS)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Next full attempt, without waiting
+void WiFiManager::retry() {
+    if (auto_select) {
+        start_scan();
+    } else {
+        start_join();
+    }
+}
+
+void WiFiManager::join_failed(int link_status) {
+    cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    event_log.record(EVENT_WIFI_JOIN_FAILED, (uint32_t)link_status);
+
+    if (state == WIFI_STATE_FAST_JOIN) {
+        // Cached AP is gone or moved, go straight to a full scan
+        printf("WiFi: fast join failed (%d)\n", link_status);
+        retry();
+        return;
+    }
+
+    if (auto_select && state == WIFI_STATE_JOINING) {
+        // Fall through to the next strongest saved network from the same scan
+        printf("WiFi: join '%s' failed (%d)\n", ssid, link_status);
+        if (try_candidates(candidate + 1)) {
+            return;
+        }
+    } else if (auto_select && state == WIFI_STATE_SCANNING && link_status == 0) {
+        printf("WiFi: no saved network in range\n");
+    } else if (link_status == CYW43_LINK_BADAUTH) {
+        // Retrying won't fix a wrong password
+        printf("WiFi: authentication failed for '%s'\n", ssid);
+        set_state(WIFI_STATE_IDLE, link_status);
+        return;
+    }
+
+    uint32_t delay = backoff_delay_ms();
+    printf("WiFi: join failed (%d), retrying in %lu ms\n", link_status, (unsigned long)delay);
+    deadline = make_timeout_time_ms(delay);
+    set_state(WIFI_STATE_BACKOFF, link_status);
+}
+
+void WiFiManager::on_connected() {
+    event_log.record(EVENT_WIFI_CONNECTED, attempts);
+    attempts = 0;
+    set_state(WIFI_STATE_CONNECTED, CYW43_LINK_UP);
+    printf("WiFi: connected to '%s', IP Address: %s\n", ssid,
+           ip4addr_ntoa(netif_ip4_addr(&cyw43_state.netif[CYW43_ITF_STA])));
+    cache_lease(ssid);
+}
+
+// Start connecting to a network, returns immediately
+void WiFiManager::connect(const char* new_ssid, const char* new_password) {
+    if (!sta_enabled) {
+        cyw43_arch_enable_sta_mode();
+        sta_enabled = true;
+    }
+    if (state != WIFI_STATE_IDLE) {
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    }
+
+    strncpy(ssid, new_ssid, MAX_SSID_LEN - 1);
+    ssid[MAX_SSID_LEN - 1] = '\0';
+    strncpy(password, new_password, MAX_PASSWORD_LEN - 1);
+    password[MAX_PASSWORD_LEN - 1] = '\0';
+    auto_select = false;
+    attempts = 0;
+
+    start_fast_join();
+}
+
+// Connect to the best saved network: the last one used if its AP answers,
+// otherwise the strongest saved network found by a single scan
+void WiFiManager::connect_auto() {
+    if (!sta_enabled) {
+        cyw43_arch_enable_sta_mode();
+        sta_enabled = true;
+    }
+    if (state != WIFI_STATE_IDLE) {
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    }
+
+    auto_select = true;
+    attempts = 0;
+
+    wifi_lease_t lease;
+    if (load_latest_wifi_lease(ssid, &lease) && find_wifi_credentials(ssid, password)) {
+        start_fast_join();
+    } else {
+        start_scan();
+    }
+}
+
+void WiFiManager::disconnect() {
+    if (state != WIFI_STATE_IDLE) {
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        set_state(WIFI_STATE_IDLE, cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA));
+    }
+}
+
+// Drive the driver and the state machine, call from the main loop
+void WiFiManager::poll() {
+    // Driver events and lwIP callbacks all run from here
+    TRACE_BEGIN("cyw43_poll");
+    cyw43_arch_poll();
+    TRACE_END("cyw43_poll");
+
+    switch (state) {
+        case WIFI_STATE_IDLE:
+            break;
+
+        case WIFI_STATE_SCANNING:
+            wifi_scan.poll();
+            if (!wifi_scan.isActive() && !try_candidates(0)) {
+                join_failed(0);
+            }
+            break;
+
+        case WIFI_STATE_FAST_JOIN:
+        case WIFI_STATE_JOINING: {
+            int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+            if (status == CYW43_LINK_UP) {
+                on_connected();
+            } else if (status < 0) {
+                join_failed(status);
+            } else if (time_reached(deadline)) {
+                join_failed(PICO_ERROR_TIMEOUT);
+            }
+            break;
+        }
+
+        case WIFI_STATE_CONNECTED: {
+            int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+            if (status != CYW43_LINK_UP) {
+                printf("WiFi: link lost (%d), reconnecting\n", status);
+                event_log.record(EVENT_WIFI_LINK_LOST, (uint32_t)status);
+                cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+                start_fast_join();
+            }
+            break;
+        }
+
+        case WIFI_STATE_BACKOFF:
+            if (time_reached(deadline)) {
+                retry();
+            }
+            break;
+    }
+}
+
+absolute_time_t WiFiManager::getWakeTime() const {
+    // Scans, joins and link changes finish with an event from the radio
+    switch (state) {
+        case WIFI_STATE_FAST_JOIN:
+        case WIFI_STATE_JOINING:
+        case WIFI_STATE_BACKOFF:
+            return deadline;
+        default:
+            return at_the_end_of_time;
+    }
+}
+
+void WiFiManager::print_history() const {
+    uint32_t count = history_count < HISTORY_SIZE ? history_count : HISTORY_SIZE;
+    printf("WiFi state transitions (%lu total):\n", (unsigned long)history_count);
+    for (uint32_t i = history_count - count; i < history_count; i++) {
+        const wifi_transition_t* entry = &history[i % HISTORY_SIZE];
+        printf("  [%6lu.%03lu] %-10s link: %d\n",
+               (unsigned long)(entry->time_us / 1000000),
+               (unsigned long)((entry->time_us / 1000) % 1000),
+               state_name((wifi_state_t)entry->state), entry->link_status);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef WIFI_MANAGER_H
+#define WIFI_MANAGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "wifi_credentials.h"
+
+// Connection state machine states
+typedef enum {
+    WIFI_STATE_IDLE = 0,    // No network requested
+    WIFI_STATE_FAST_JOIN,   // Targeted join against the cached AP
+    WIFI_STATE_SCANNING,    // Looking for the strongest saved network
+    WIFI_STATE_JOINING,     // Joining the selected network
+    WIFI_STATE_CONNECTED,   // Link up with an address
+    WIFI_STATE_BACKOFF,     // Waiting before the next attempt
+} wifi_state_t;
+
+// One entry in the state transition history
+typedef struct {
+    uint64_t time_us;       // Time since boot
+    uint8_t state;          // New state
+    int8_t link_status;     // cyw43_tcpip_link_status() at the transition
+} wifi_transition_t;
+
+class WiFiManager {
+private:
+    // Timeouts and backoff configuration
+    static const uint32_t FAST_JOIN_TIMEOUT_MS = 5000;
+    static const uint32_t JOIN_TIMEOUT_MS = 30000;
+    static const uint32_t BACKOFF_BASE_MS = 1000;
+    static const uint32_t BACKOFF_MAX_MS = 60000;
+    static const int HISTORY_SIZE = 16;
+
+    // Target network
+    char ssid[MAX_SSID_LEN];
+    char password[MAX_PASSWORD_LEN];
+    bool sta_enabled;
+    bool auto_select;       // Pick the best saved network instead of a fixed SSID
+    int candidate;          // Scan result currently being tried
+
+    // State machine
+    wifi_state_t state;
+    absolute_time_t deadline;
+    uint32_t attempts;
+
+    // Transition history (ring buffer)
+    wifi_transition_t history[HISTORY_SIZE];
+    uint32_t history_count;
+
+    void set_state(wifi_state_t new_state, int link_status);
+    bool join_bssid(const uint8_t* bssid, uint32_t channel, wifi_state_t join_state, uint32_t timeout_ms);
+    void start_fast_join();
+    void start_join();
+    void start_scan();
+    bool try_candidates(int first);
+    void retry();
+    void join_failed(int link_status);
+    void on_connected();
+    uint32_t backoff_delay_ms() const;
+
+public:
+    // Constructor
+    WiFiManager();
+
+    // Public interface
+    void connect(const char* ssid, const char* password);
+    void connect_auto();
+    void disconnect();
+    void poll();
+    void print_history() const;
+
+    // Getter methods
+    wifi_state_t getState() const { return state; }
+    const char* getSsid() const { return ssid; }
+    uint32_t getAttempts() const { return attempts; }
+    uint64_t getStateTime() const;
+    absolute_time_t getWakeTime() const;    // When poll() next has work without a driver event
+
+    static const char* state_name(wifi_state_t state);
+};
+
+// Global instance
+extern WiFiManager wifi_manager;
+
+#endif // WIFI_MANAGER_H
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "cyw43.h"
+#include "wifi_scan.h"
+#include "memory.h"
+
+// Global instance
+WiFiScan wifi_scan;
+static MemoryRegion memory_scan("wifi_scan", sizeof(WiFiScan));
+
+// Constructor
+WiFiScan::WiFiScan() {
+    memset(entries, 0, sizeof(entries));
+    count = 0;
+    dropped = 0;
+    scanning = false;
+    deadline = get_absolute_time();
+}
+
+const char* WiFiScan::auth_name(uint32_t auth_mode) {
+    switch (auth_mode) {
+        case CYW43_AUTH_OPEN: return "Open";
+        case CYW43_AUTH_WPA_TKIP_PSK: return "WPA";
+        case CYW43_AUTH_WPA2_AES_PSK: return "WPA2";
+        case CYW43_AUTH_WPA2_MIXED_PSK: return "WPA2 Mixed";
+        case CYW43_AUTH_WPA3_SAE_AES_PSK: return "WPA3";
+        case CYW43_AUTH_WPA3_WPA2_AES_PSK: return "WPA2/WPA3";
+        default: return "Unknown";
+    }
+}
+
+static uint32_t bssid_hash(const uint8_t* bssid) {
+    // FNV-1a over the six address bytes
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        hash = (hash ^ bssid[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Called from the driver for every beacon/probe response, must not allocate
+void WiFiScan::insert(const cyw43_ev_scan_result_t* result) {
+    uint32_t index = bssid_hash(result->bssid) & (CAPACITY - 1);
+
+    for (int probe = 0; probe < CAPACITY; probe++) {
+        wifi_scan_entry_t* entry = &entries[index];
+
+        if (!entry->used) {
+            memcpy(entry->bssid, result->bssid, 6);
+            uint8_t len = result->ssid_len < MAX_SSID_LEN ? result->ssid_len : MAX_SSID_LEN;
+            memcpy(entry->ssid, result->ssid, len);
+            entry->ssid[len] = '\0';
+            entry->rssi = result->rssi;
+            entry->channel = result->channel;
+            entry->auth_mode = result->auth_mode;
+            entry->used = 1;
+            count++;
+            return;
+        }
+
+        if (memcmp(entry->bssid, result->bssid, 6) == 0) {
+            // Same AP heard again, keep the strongest reading
+            if (result->rssi > entry->rssi) {
+                entry->rssi = result->rssi;
+                entry->channel = result->channel;
+            }
+            return;
+        }
+
+        index = (index + 1) & (CAPACITY - 1);  // Linear probing
+    }
+
+    dropped++;
+}
+
+int WiFiScan::scan_callback(void* env, const cyw43_ev_scan_result_t* result) {
+    WiFiScan* scan = (WiFiScan*)env;
+    // A scan that outlived the deadline keeps reporting, but the table was
+    // already compacted and handed to readers
+    if (result && scan->scanning) {
+        scan->insert(result);
+    }
+    return 0;
+}
+
+// Start a scan, results become available once poll() returns true
+int WiFiScan::start() {
+    if (scanning) {
+        return 0;
+    }
+    // The last scan ran past its deadline and the driver is still on it
+    if (cyw43_wifi_scan_active(&cyw43_state)) {
+        return -CYW43_EPERM;
+    }
+
+    memset(entries, 0, sizeof(entries));
+    count = 0;
+    dropped = 0;
+
+    cyw43_wifi_scan_options_t scan_options = {0};
+    int err = cyw43_wifi_scan(&cyw43_state, &scan_options, this, scan_callback);
+    if (err != 0) {
+        return err;
+    }
+
+    scanning = true;
+    deadline = make_timeout_time_ms(SCAN_TIMEOUT_MS);
+    return 0;
+}
+
+// Compact the table and sort by RSSI, strongest first
+void WiFiScan::finish() {
+    int n = 0;
+    for (int i = 0; i < CAPACITY; i++) {
+        if (entries[i].used) {
+            if (i != n) {
+                entries[n] = entries[i];
+            }
+            n++;
+        }
+    }
+    memset(&entries[n], 0, (CAPACITY - n) * sizeof(wifi_scan_entry_t));
+
+    // Insertion sort, the table is small and mostly arrives strongest first
+    for (int i = 1; i < n; i++) {
+        wifi_scan_entry_t entry = entries[i];
+        int j = i - 1;
+        while (j >= 0 && entries[j].rssi < entry.rssi) {
+            entries[j + 1] = entries[j];
+            j--;
+        }
+        entries[j + 1] = entry;
+    }
+
+    scanning = false;
+}
+
+// Returns true once when the scan has completed. The driver cannot abort a
+// scan, so at the deadline the results are frozen as they are and start()
+// refuses a new scan until the driver's has ended.
+bool WiFiScan::poll() {
+    if (!scanning) {
+        return false;
+    }
+    if (cyw43_wifi_scan_active(&cyw43_state) && !time_reached(deadline)) {
+        return false;
+    }
+    finish();
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef WIFI_SCAN_H
+#define WIFI_SCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "cyw43.h"
+#include "wifi_credentials.h"
+
+// One access point seen during a scan
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t used;
+    uint8_t auth_mode;
+    int16_t rssi;       // Best RSSI seen for this BSSID
+    uint16_t channel;
+    char ssid[MAX_SSID_LEN + 1];
+} wifi_scan_entry_t;
+
+class WiFiScan {
+private:
+    // Open-addressed table keyed by BSSID, must be a power of two
+    static const int CAPACITY = 64;
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "scan table capacity must be a power of two");
+    static const uint32_t SCAN_TIMEOUT_MS = 10000;
+
+    wifi_scan_entry_t entries[CAPACITY];
+    int count;
+    uint32_t dropped;       // Results lost because the table was full
+    bool scanning;
+    absolute_time_t deadline;
+
+    static int scan_callback(void* env, const cyw43_ev_scan_result_t* result);
+    void insert(const cyw43_ev_scan_result_t* result);
+    void finish();
+
+public:
+    // Constructor
+    WiFiScan();
+
+    // Public interface
+    int start();
+    bool poll();
+
+    // Getter methods
+    bool isActive() const { return scanning; }
+    int getCount() const { return count; }
+    uint32_t getDropped() const { return dropped; }
+    const wifi_scan_entry_t* getEntry(int index) const { return &entries[index]; }
+
+    static const char* auth_name(uint32_t auth_mode);
+};
+
+// Global instance
+extern WiFiScan wifi_scan;
+
+#endif // WIFI_SCAN_H